@@ -0,0 +1,382 @@
+//
+// Offline chemistry matching for chem ID logs.
+//
+
+#include "ChemIDMatcher.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <thread>
+
+namespace ChemIDMatcher
+{
+	namespace
+	{
+		// A discharge covering less of the OCV table than this can't tell chemistries apart
+		constexpr float MIN_DOD_SPAN = 0.2f;
+
+		// Range allowed for the fitted resistance multiplier, since real packs add wiring and contact resistance
+		constexpr float MIN_RESISTANCE_SCALE = 0.25f;
+		constexpr float MAX_RESISTANCE_SCALE = 8.0f;
+
+		// Resample an evenly spaced table to GRID_POINTS evenly spaced points
+		void resample(std::vector<float> const & table, float * out)
+		{
+			if(table.size() == 1)
+			{
+				std::fill(out, out + GRID_POINTS, table[0]);
+				return;
+			}
+
+			for(size_t point = 0; point < GRID_POINTS; point++)
+			{
+				float const position = static_cast<float>(point) * (table.size() - 1) / (GRID_POINTS - 1);
+				size_t const low = std::min(static_cast<size_t>(position), table.size() - 2);
+				float const fraction = position - low;
+				out[point] = table[low] + fraction * (table[low + 1] - table[low]);
+			}
+		}
+
+		/**
+		 * Find the DOD at which a chemistry's OCV equals the given voltage.  OCV falls with DOD,
+		 * so this is a binary search.  Voltages outside the table clamp to DOD 0 or 1.
+		 */
+		float dodAtOCV(float const * ocv, float voltage_mV)
+		{
+			if(voltage_mV >= ocv[0])
+			{
+				return 0;
+			}
+			if(voltage_mV <= ocv[GRID_POINTS - 1])
+			{
+				return 1;
+			}
+
+			size_t low = 0;
+			size_t high = GRID_POINTS - 1;
+			while(high - low > 1)
+			{
+				size_t const middle = (low + high) / 2;
+				if(ocv[middle] > voltage_mV)
+				{
+					low = middle;
+				}
+				else
+				{
+					high = middle;
+				}
+			}
+
+			float const fraction = (ocv[low] - voltage_mV) / (ocv[low] - ocv[high]);
+			return (low + fraction) / (GRID_POINTS - 1);
+		}
+
+		bool scoreBefore(Score const & a, Score const & b)
+		{
+			return a.maxError_mV < b.maxError_mV || (a.maxError_mV == b.maxError_mV && a.rmsError_mV < b.rmsError_mV);
+		}
+
+		void scoreRange(Database const & database, Measurement const & measurement, size_t begin, size_t end,
+			size_t count, std::vector<Score> & best)
+		{
+			// Keep the count best as a max-heap on error, so the worst kept score is always at the front
+			for(size_t index = begin; index < end; index++)
+			{
+				Score const candidate = score(database, index, measurement);
+				if(best.size() < count)
+				{
+					best.push_back(candidate);
+					std::push_heap(best.begin(), best.end(), scoreBefore);
+				}
+				else if(scoreBefore(candidate, best.front()))
+				{
+					std::pop_heap(best.begin(), best.end(), scoreBefore);
+					best.back() = candidate;
+					std::push_heap(best.begin(), best.end(), scoreBefore);
+				}
+			}
+		}
+	}
+
+	void Database::add(uint16_t id, std::string description, std::vector<float> const & ocv_mV, std::vector<float> const & resistance_mOhm)
+	{
+		ids.push_back(id);
+		descriptions.push_back(std::move(description));
+
+		ocv.resize(ocv.size() + GRID_POINTS);
+		resample(ocv_mV, ocv.data() + ocv.size() - GRID_POINTS);
+		resistance.resize(resistance.size() + GRID_POINTS);
+		resample(resistance_mOhm, resistance.data() + resistance.size() - GRID_POINTS);
+	}
+
+	bool Database::load(char const * path)
+	{
+		std::ifstream file(path);
+		if(!file)
+		{
+			perror(path);
+			return false;
+		}
+
+		// Record being assembled
+		bool inRecord = false;
+		uint16_t id = 0;
+		std::string description;
+		std::vector<float> recordOCV;
+		std::vector<float> recordResistance;
+		size_t recordLine = 0;
+
+		auto finishRecord = [&]() -> bool
+		{
+			if(!inRecord)
+			{
+				return true;
+			}
+			inRecord = false;
+			if(recordOCV.size() < 2 || recordResistance.empty())
+			{
+				fprintf(stderr, "%s:%zu: chemistry %04x needs an ocv line with at least 2 points and a res line\n", path, recordLine, id);
+				return false;
+			}
+			if(!std::is_sorted(recordOCV.rbegin(), recordOCV.rend()))
+			{
+				fprintf(stderr, "%s:%zu: OCV of chemistry %04x must fall from DOD 0 to DOD 1\n", path, recordLine, id);
+				return false;
+			}
+			add(id, description, recordOCV, recordResistance);
+			return true;
+		};
+
+		std::string line;
+		size_t lineNumber = 0;
+		while(std::getline(file, line))
+		{
+			++lineNumber;
+			std::istringstream fields(line);
+			std::string keyword;
+			if(!(fields >> keyword) || keyword[0] == '#')
+			{
+				continue;
+			}
+
+			if(keyword == "chem")
+			{
+				if(!finishRecord())
+				{
+					return false;
+				}
+
+				std::string idText;
+				fields >> idText;
+				char * idEnd;
+				unsigned long const parsedID = strtoul(idText.c_str(), &idEnd, 16);
+				if(idText.empty() || *idEnd != '\0' || parsedID > UINT16_MAX)
+				{
+					fprintf(stderr, "%s:%zu: bad chemistry ID \"%s\"\n", path, lineNumber, idText.c_str());
+					return false;
+				}
+
+				inRecord = true;
+				id = static_cast<uint16_t>(parsedID);
+				std::getline(fields >> std::ws, description);
+				recordOCV.clear();
+				recordResistance.clear();
+				recordLine = lineNumber;
+			}
+			else if((keyword == "ocv" || keyword == "res") && inRecord)
+			{
+				std::vector<float> & values = keyword == "ocv" ? recordOCV : recordResistance;
+				float value;
+				while(fields >> value)
+				{
+					values.push_back(value);
+				}
+				if(!fields.eof())
+				{
+					fprintf(stderr, "%s:%zu: bad number in %s line\n", path, lineNumber, keyword.c_str());
+					return false;
+				}
+			}
+			else
+			{
+				fprintf(stderr, "%s:%zu: unexpected \"%s\"\n", path, lineNumber, keyword.c_str());
+				return false;
+			}
+		}
+
+		return finishRecord();
+	}
+
+	bool extractMeasurement(ChemIDTrace const & trace, uint8_t cellCount, Measurement & measurement, std::string & error)
+	{
+		auto eventIndex = [&](ChemIDLog::Event event)
+		{
+			return trace.recordedEventIndices[static_cast<size_t>(event)];
+		};
+
+		int64_t const dischargeStart = eventIndex(ChemIDLog::Event::RELAX_CHARGED_DONE);
+		int64_t const dischargeEnd = eventIndex(ChemIDLog::Event::DISCHARGE_DONE);
+		int64_t const done = eventIndex(ChemIDLog::Event::DONE);
+		if(dischargeStart < 1 || dischargeEnd <= dischargeStart || done <= dischargeEnd)
+		{
+			error = "log does not contain a complete charge, relax, discharge and relax cycle";
+			return false;
+		}
+
+		// The last sample of each relaxation holds the settled OCV
+		measurement.fullOCV_mV = static_cast<float>(trace.samples[dischargeStart - 1].voltage_mV) / cellCount;
+		measurement.emptyOCV_mV = static_cast<float>(trace.samples[done].voltage_mV) / cellCount;
+
+		// Loaded part of the discharge, with the charge passed up to each sample.  The load may be connected
+		// a little after DISCHARGE starts, so samples without current are left out.
+		std::vector<double> passedCharge;
+		std::vector<float> voltages;
+		std::vector<float> currents;
+		double charge_mAh = 0;
+		ChemIDLog::Sample const * previous = nullptr;
+		for(int64_t sampleIndex = dischargeStart; sampleIndex <= dischargeEnd; sampleIndex++)
+		{
+			ChemIDLog::Sample const & sample = trace.samples[sampleIndex];
+			if(sample.current_mA >= 0)
+			{
+				previous = nullptr;
+				continue;
+			}
+
+			if(previous != nullptr)
+			{
+				double const dt_h = (static_cast<double>(sample.elapsed_s) - previous->elapsed_s) / 3600.0;
+				charge_mAh -= (sample.current_mA + previous->current_mA) / 2.0 * dt_h;
+			}
+			passedCharge.push_back(charge_mAh);
+			voltages.push_back(static_cast<float>(sample.voltage_mV) / cellCount);
+			currents.push_back(-static_cast<float>(sample.current_mA));
+			previous = &sample;
+		}
+
+		if(passedCharge.size() < 2 || charge_mAh <= 0)
+		{
+			error = "no loaded samples in the discharge";
+			return false;
+		}
+		measurement.passedCharge_mAh = static_cast<float>(charge_mAh);
+
+		size_t source = 0;
+		for(size_t point = 0; point < CURVE_POINTS; point++)
+		{
+			double const target = charge_mAh * point / (CURVE_POINTS - 1);
+			while(source + 2 < passedCharge.size() && passedCharge[source + 1] < target)
+			{
+				++source;
+			}
+
+			double const span = passedCharge[source + 1] - passedCharge[source];
+			float const fraction = span > 0 ? static_cast<float>(std::clamp((target - passedCharge[source]) / span, 0.0, 1.0)) : 0;
+			measurement.voltage_mV[point] = voltages[source] + fraction * (voltages[source + 1] - voltages[source]);
+			measurement.current_mA[point] = currents[source] + fraction * (currents[source + 1] - currents[source]);
+		}
+		return true;
+	}
+
+	Score score(Database const & database, size_t index, Measurement const & measurement)
+	{
+		float const * const ocv = database.getOCV(index);
+		float const * const resistance = database.getResistance(index);
+
+		Score result;
+		result.index = index;
+		result.startDOD = dodAtOCV(ocv, measurement.fullOCV_mV);
+		result.endDOD = dodAtOCV(ocv, measurement.emptyOCV_mV);
+		result.resistanceScale = 0;
+		result.qmax_mAh = 0;
+
+		float const span = result.endDOD - result.startDOD;
+		if(span < MIN_DOD_SPAN)
+		{
+			result.maxError_mV = std::numeric_limits<float>::infinity();
+			result.rmsError_mV = std::numeric_limits<float>::infinity();
+			return result;
+		}
+		result.qmax_mAh = measurement.passedCharge_mAh / span;
+
+		// Pass 1: OCV minus the measured voltage, and the drop predicted by the resistance profile, at each point.
+		// No branches or calls in the loop, so it vectorizes across points.
+		float ocvExcess[CURVE_POINTS];
+		float predictedDrop[CURVE_POINTS];
+		float const gridScale = (GRID_POINTS - 1) * span / (CURVE_POINTS - 1);
+		float const gridOffset = (GRID_POINTS - 1) * result.startDOD;
+		float sumExcessDrop = 0;
+		float sumDropSquared = 0;
+#pragma omp simd reduction(+:sumExcessDrop, sumDropSquared)
+		for(int32_t point = 0; point < static_cast<int32_t>(CURVE_POINTS); point++)
+		{
+			// 32-bit indices, since SSE/AVX only convert floats to 32-bit integers
+			float const position = gridOffset + gridScale * static_cast<float>(point);
+			int32_t const low = std::min(static_cast<int32_t>(position), static_cast<int32_t>(GRID_POINTS - 2));
+			float const fraction = position - static_cast<float>(low);
+
+			float const pointOCV = ocv[low] + fraction * (ocv[low + 1] - ocv[low]);
+			float const pointResistance = resistance[low] + fraction * (resistance[low + 1] - resistance[low]);
+
+			ocvExcess[point] = pointOCV - measurement.voltage_mV[point];
+			predictedDrop[point] = measurement.current_mA[point] * pointResistance * 1e-3f;
+			sumExcessDrop += ocvExcess[point] * predictedDrop[point];
+			sumDropSquared += predictedDrop[point] * predictedDrop[point];
+		}
+
+		// Least squares fit of one multiplier on the resistance profile
+		float const scale = sumDropSquared > 0 ? sumExcessDrop / sumDropSquared : 1;
+		result.resistanceScale = std::clamp(scale, MIN_RESISTANCE_SCALE, MAX_RESISTANCE_SCALE);
+
+		// Pass 2: residuals of the fitted model
+		float const fittedScale = result.resistanceScale;
+		float maxError = 0;
+		float sumErrorSquared = 0;
+#pragma omp simd reduction(max:maxError) reduction(+:sumErrorSquared)
+		for(size_t point = 0; point < CURVE_POINTS; point++)
+		{
+			float const pointError = ocvExcess[point] - fittedScale * predictedDrop[point];
+			maxError = std::max(maxError, std::fabs(pointError));
+			sumErrorSquared += pointError * pointError;
+		}
+
+		result.maxError_mV = maxError;
+		result.rmsError_mV = std::sqrt(sumErrorSquared / CURVE_POINTS);
+		return result;
+	}
+
+	std::vector<Score> findBest(Database const & database, Measurement const & measurement, size_t count, unsigned int threadCount)
+	{
+		threadCount = std::max(1u, std::min<unsigned int>(threadCount, database.size()));
+
+		// Each thread keeps its own best list over a contiguous chunk, then the lists are merged
+		std::vector<std::vector<Score>> results(threadCount);
+		std::vector<std::thread> threads;
+		size_t const chunkSize = (database.size() + threadCount - 1) / threadCount;
+		for(unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+		{
+			size_t const begin = std::min(database.size(), threadIndex * chunkSize);
+			size_t const end = std::min(database.size(), begin + chunkSize);
+			threads.emplace_back(scoreRange, std::cref(database), std::cref(measurement), begin, end, count, std::ref(results[threadIndex]));
+		}
+
+		std::vector<Score> best;
+		for(unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+		{
+			threads[threadIndex].join();
+			best.insert(best.end(), results[threadIndex].begin(), results[threadIndex].end());
+		}
+
+		std::sort(best.begin(), best.end(), scoreBefore);
+		if(best.size() > count)
+		{
+			best.resize(count);
+		}
+		return best;
+	}
+}
@@ -0,0 +1,99 @@
+//
+// Offline chemistry matching for chem ID logs.
+// Scores a measured discharge against a database of OCV tables and resistance profiles, the same way
+// TI's GPCCHEM tool does: each chemistry's OCV(DOD) curve, minus the current times its resistance profile,
+// should reproduce the loaded voltage at every point of a C/10 discharge between two relaxed OCV readings.
+//
+// Database file format (text, one record per chemistry, '#' starts a comment line):
+//   chem <ID in hex> <description...>
+//   ocv <mV> <mV> ...    per-cell OCV, evenly spaced from DOD 0 (full) to DOD 1 (empty), at least 2 points
+//   res <mOhm> ...       per-cell resistance, evenly spaced the same way, at least 1 point
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_CHEMIDMATCHER_H
+#define BQ34Z100G1_UTILS_HOST_CHEMIDMATCHER_H
+
+#include "ChemIDTrace.h"
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace ChemIDMatcher
+{
+	// Every chemistry's tables are resampled to this many evenly spaced DOD points on load
+	constexpr size_t GRID_POINTS = 128;
+
+	// The measured discharge is resampled to this many evenly spaced points of passed charge
+	constexpr size_t CURVE_POINTS = 256;
+
+	/**
+	 * Chemistry tables, stored back to back so that scoring streams through memory.
+	 */
+	class Database
+	{
+	public:
+		/**
+		 * Add the chemistries in a database file.  Problems are reported on stderr.
+		 * @return false if the file could not be read or has a malformed record
+		 */
+		bool load(char const * path);
+
+		// Add one chemistry.  Tables are evenly spaced from DOD 0 to 1 and may have any length.
+		void add(uint16_t id, std::string description, std::vector<float> const & ocv_mV, std::vector<float> const & resistance_mOhm);
+
+		size_t size() const { return ids.size(); }
+		uint16_t getID(size_t index) const { return ids[index]; }
+		std::string const & getDescription(size_t index) const { return descriptions[index]; }
+
+		// GRID_POINTS values each
+		float const * getOCV(size_t index) const { return ocv.data() + index * GRID_POINTS; }
+		float const * getResistance(size_t index) const { return resistance.data() + index * GRID_POINTS; }
+
+	private:
+		std::vector<uint16_t> ids;
+		std::vector<std::string> descriptions;
+		std::vector<float> ocv; // mV per cell
+		std::vector<float> resistance; // mOhm per cell
+	};
+
+	// What scoring needs from a log, all per cell
+	struct Measurement
+	{
+		float fullOCV_mV; // relaxed, at the end of RELAX_CHARGED
+		float emptyOCV_mV; // relaxed, at the end of RELAX_DISCHARGED
+		float passedCharge_mAh; // charge drawn while the load was connected
+
+		// Loaded voltage and discharge current at evenly spaced fractions of passedCharge_mAh
+		float voltage_mV[CURVE_POINTS];
+		float current_mA[CURVE_POINTS];
+	};
+
+	/**
+	 * Pull the relaxed OCV readings and the loaded discharge curve out of a complete chem ID run.
+	 * @return false, with error set, if the log doesn't cover a full charge, relax, discharge and relax cycle.
+	 */
+	bool extractMeasurement(ChemIDTrace const & trace, uint8_t cellCount, Measurement & measurement, std::string & error);
+
+	struct Score
+	{
+		size_t index; // in the database
+		float maxError_mV; // largest difference between modelled and measured voltage
+		float rmsError_mV;
+		float resistanceScale; // best fit multiplier on the chemistry's resistance profile
+		float startDOD; // where the relaxed OCV readings put the start and end of the discharge
+		float endDOD;
+		float qmax_mAh; // capacity implied by the passed charge and the DOD range
+	};
+
+	// Score one chemistry.  Chemistries whose OCV table can't explain the relaxed readings get an infinite error.
+	Score score(Database const & database, size_t index, Measurement const & measurement);
+
+	/**
+	 * Score every chemistry, split across threadCount threads.
+	 * @return the best count scores, lowest maximum error first
+	 */
+	std::vector<Score> findBest(Database const & database, Measurement const & measurement, size_t count, unsigned int threadCount);
+}
+
+#endif //BQ34Z100G1_UTILS_HOST_CHEMIDMATCHER_H
@@ -0,0 +1,171 @@
+//
+// Loads recorded chem ID logs, CSV or binary, for the host analysis tools.
+//
+
+#include "ChemIDTrace.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+
+ChemIDTrace::ChemIDTrace()
+{
+	std::fill(std::begin(recordedEventTimes), std::end(recordedEventTimes), -1);
+	std::fill(std::begin(recordedEventIndices), std::end(recordedEventIndices), -1);
+}
+
+void ChemIDTrace::add(ChemIDLog::Sample const & sample, ChemIDLog::Event event)
+{
+	size_t const eventIndex = static_cast<size_t>(event);
+	if(event != ChemIDLog::Event::NONE && eventIndex < ChemIDTrace::EVENT_COUNT && recordedEventTimes[eventIndex] < 0)
+	{
+		recordedEventTimes[eventIndex] = sample.elapsed_s;
+		recordedEventIndices[eventIndex] = static_cast<int64_t>(samples.size());
+	}
+	samples.push_back(sample);
+}
+
+namespace
+{
+	class TraceListener : public ChemIDLog::Listener
+	{
+	public:
+		ChemIDTrace & trace;
+		uint8_t const channel;
+		size_t badFrames = 0;
+
+		TraceListener(ChemIDTrace & trace, uint8_t channel):
+		trace(trace),
+		channel(channel)
+		{}
+
+		void onStart(uint8_t sampleChannel, uint8_t formatVersion) override
+		{
+			(void)sampleChannel;
+			(void)formatVersion;
+		}
+
+		void onSample(uint8_t sampleChannel, ChemIDLog::Sample const & sample, ChemIDLog::Event event) override
+		{
+			if(sampleChannel == channel)
+			{
+				trace.add(sample, event);
+			}
+		}
+
+		void onBadFrame() override
+		{
+			++badFrames;
+		}
+	};
+
+	ChemIDLog::Event eventFromComment(char const * comment)
+	{
+		for(size_t eventIndex = 1; eventIndex < ChemIDTrace::EVENT_COUNT; eventIndex++)
+		{
+			// relax evidence may follow the comment
+			auto const event = static_cast<ChemIDLog::Event>(eventIndex);
+			char const * eventText = ChemIDLog::eventComment(event);
+			if(strncmp(comment, eventText, strlen(eventText)) == 0)
+			{
+				return event;
+			}
+		}
+		return ChemIDLog::Event::NONE;
+	}
+
+	bool loadCSV(FILE * file, ChemIDTrace & trace, uint8_t channel)
+	{
+		char line[512];
+		while(fgets(line, sizeof(line), file) != nullptr)
+		{
+			char * cursor = line;
+
+			// rows from multi-pack runs start with a "ch<n>, " tag
+			unsigned int lineChannel = 0;
+			int tagLength = 0;
+			if(sscanf(line, "ch%u, %n", &lineChannel, &tagLength) == 1 && tagLength > 0)
+			{
+				cursor += tagLength;
+			}
+			if(lineChannel != channel)
+			{
+				continue;
+			}
+
+			// skip the header and anything else that doesn't start with a number
+			char * end;
+			double values[5];
+			bool valid = true;
+			for(double & value : values)
+			{
+				value = strtod(cursor, &end);
+				if(end == cursor || (*end != ',' && *end != '\0' && *end != '\n'))
+				{
+					valid = false;
+					break;
+				}
+				cursor = *end == ',' ? end + 1 : end;
+			}
+			if(!valid)
+			{
+				continue;
+			}
+
+			// rest of the line is the comment
+			while(*cursor == ' ')
+			{
+				++cursor;
+			}
+			cursor[strcspn(cursor, "\r\n")] = '\0';
+
+			ChemIDLog::Sample sample;
+			sample.elapsed_s = static_cast<uint32_t>(values[0]);
+			sample.voltage_mV = static_cast<uint16_t>(values[1]);
+			sample.current_mA = static_cast<int16_t>(values[2]);
+			sample.temperature_dK = static_cast<uint16_t>((values[3] + 273.15) * 10 + 0.5);
+			sample.soc_percent = static_cast<uint8_t>(values[4]);
+			trace.add(sample, eventFromComment(cursor));
+		}
+		return true;
+	}
+}
+
+bool loadChemIDTrace(char const * path, ChemIDTrace & trace, uint8_t channel)
+{
+	FILE * file = fopen(path, "rb");
+	if(file == nullptr)
+	{
+		perror(path);
+		return false;
+	}
+
+	int const firstByte = fgetc(file);
+	ungetc(firstByte, file);
+
+	bool result = true;
+	if(firstByte == ChemIDLog::SYNC)
+	{
+		TraceListener listener(trace, channel);
+		ChemIDLog::Decoder decoder(listener);
+		uint8_t buffer[4096];
+		size_t bytesRead;
+		while((bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			decoder.feed(buffer, bytesRead);
+		}
+		if(listener.badFrames > 0)
+		{
+			fprintf(stderr, "%s: skipped %zu bad frames\n", path, listener.badFrames);
+		}
+	}
+	else
+	{
+		result = loadCSV(file, trace, channel);
+	}
+
+	fclose(file);
+	return result;
+}
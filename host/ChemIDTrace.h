@@ -0,0 +1,39 @@
+//
+// Loads recorded chem ID logs, CSV or binary, for the host analysis tools.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_CHEMIDTRACE_H
+#define BQ34Z100G1_UTILS_HOST_CHEMIDTRACE_H
+
+#include "ChemIDLog.h"
+
+#include <cstdint>
+#include <vector>
+
+// One pack's samples from a chem ID log, with the state changes recorded in it
+struct ChemIDTrace
+{
+	// Index of each event in the per-trace tables.  Only the state changes (up to DONE) are tracked.
+	static constexpr size_t EVENT_COUNT = static_cast<size_t>(ChemIDLog::Event::DONE) + 1;
+
+	std::vector<ChemIDLog::Sample> samples;
+
+	// Time each event was recorded at, or -1 if it wasn't
+	int64_t recordedEventTimes[EVENT_COUNT];
+
+	// Index in samples of the sample each event was attached to, or -1
+	int64_t recordedEventIndices[EVENT_COUNT];
+
+	ChemIDTrace();
+
+	void add(ChemIDLog::Sample const & sample, ChemIDLog::Event event);
+};
+
+/**
+ * Load one channel of a log as printed by chem-id-measurer (CSV, with or without channel tags)
+ * or captured in binary (chemid-binary-log = true).  Problems are reported on stderr.
+ * @return false if the file could not be read
+ */
+bool loadChemIDTrace(char const * path, ChemIDTrace & trace, uint8_t channel = 0);
+
+#endif //BQ34Z100G1_UTILS_HOST_CHEMIDTRACE_H
@@ -0,0 +1,270 @@
+//
+// Linux client for soc-test's machine protocol.
+//
+
+#include "SocTestClient.h"
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace
+{
+	// Collects one outgoing frame so it can go out in a single write
+	class FrameBuffer : public ByteSink
+	{
+	public:
+		uint8_t data[MachineProtocol::MAX_FRAME_SIZE];
+		size_t length = 0;
+
+		void write(uint8_t const * bytes, size_t count) override
+		{
+			memcpy(data, bytes, count);
+			length = count;
+		}
+	};
+}
+
+SocTestClient::~SocTestClient()
+{
+	if(writeFd >= 0 && writeFd != readFd)
+	{
+		close(writeFd);
+	}
+	if(readFd >= 0)
+	{
+		close(readFd);
+	}
+
+	// The simulator sees the end of its input and exits
+	if(child > 0)
+	{
+		waitpid(child, nullptr, 0);
+	}
+}
+
+bool SocTestClient::openSerial(char const * device)
+{
+	int const fd = open(device, O_RDWR | O_NOCTTY);
+	if(fd < 0)
+	{
+		fprintf(stderr, "Can't open %s: %s\n", device, strerror(errno));
+		return false;
+	}
+
+	termios settings;
+	if(tcgetattr(fd, &settings) != 0)
+	{
+		fprintf(stderr, "%s is not a serial port: %s\n", device, strerror(errno));
+		close(fd);
+		return false;
+	}
+	cfmakeraw(&settings);
+	cfsetispeed(&settings, B115200);
+	cfsetospeed(&settings, B115200);
+	settings.c_cflag |= CLOCAL | CREAD;
+	settings.c_cc[VMIN] = 0;
+	settings.c_cc[VTIME] = 0;
+	tcsetattr(fd, TCSANOW, &settings);
+	tcflush(fd, TCIOFLUSH);
+
+	readFd = fd;
+	writeFd = fd;
+	return true;
+}
+
+bool SocTestClient::startSimulator(char const * path)
+{
+	int toChild[2];
+	int fromChild[2];
+	if(pipe(toChild) != 0 || pipe(fromChild) != 0)
+	{
+		fprintf(stderr, "Can't create pipes: %s\n", strerror(errno));
+		return false;
+	}
+
+	child = fork();
+	if(child < 0)
+	{
+		fprintf(stderr, "Can't start %s: %s\n", path, strerror(errno));
+		return false;
+	}
+	if(child == 0)
+	{
+		dup2(toChild[0], STDIN_FILENO);
+		dup2(fromChild[1], STDOUT_FILENO);
+		close(toChild[0]);
+		close(toChild[1]);
+		close(fromChild[0]);
+		close(fromChild[1]);
+		execl(path, path, static_cast<char *>(nullptr));
+		fprintf(stderr, "Can't run %s: %s\n", path, strerror(errno));
+		_exit(127);
+	}
+
+	close(toChild[0]);
+	close(fromChild[1]);
+	writeFd = toChild[1];
+	readFd = fromChild[0];
+	return true;
+}
+
+bool SocTestClient::enterMachineMode(std::chrono::milliseconds timeout)
+{
+	// Menu selection.  If machine mode is already running, this is just text that the parser there skips.
+	char const selection[] = "\r\n26\r\n";
+	if(!writeAll(reinterpret_cast<uint8_t const *>(selection), sizeof(selection) - 1))
+	{
+		return false;
+	}
+
+	auto const deadline = std::chrono::steady_clock::now() + timeout;
+	MachineProtocol::Frame frame;
+	while(readFrame(frame, std::min(deadline, std::chrono::steady_clock::now() + std::chrono::seconds(1))))
+	{
+		if(frame.code == MachineProtocol::READY)
+		{
+			return true;
+		}
+	}
+
+	// No READY, so maybe machine mode was running all along
+	uint8_t const pingID = send(MachineProtocol::Command::PING);
+	Response response;
+	while(std::chrono::steady_clock::now() < deadline
+		&& receive(response, std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now())))
+	{
+		if(response.requestID == pingID)
+		{
+			return response.status == MachineProtocol::Status::OK;
+		}
+	}
+	return false;
+}
+
+uint8_t SocTestClient::send(MachineProtocol::Command command, uint8_t const * arguments, size_t length)
+{
+	uint8_t const requestID = nextRequestID;
+
+	// 0 is left for unsolicited frames
+	nextRequestID = nextRequestID == 0xFF ? 1 : nextRequestID + 1;
+
+	FrameBuffer frame;
+	MachineProtocol::sendFrame(frame, static_cast<uint8_t>(command), requestID, arguments, length);
+	if(writeAll(frame.data, frame.length))
+	{
+		++outstanding;
+	}
+	return requestID;
+}
+
+bool SocTestClient::receive(Response & response, std::chrono::milliseconds timeout)
+{
+	auto deadline = std::chrono::steady_clock::now() + timeout;
+	MachineProtocol::Frame frame;
+	while(readFrame(frame, deadline))
+	{
+		if(frame.code & MachineProtocol::RESPONSE_FLAG)
+		{
+			if(frame.length < 1)
+			{
+				continue;
+			}
+			response.requestID = frame.requestID;
+			response.command = static_cast<MachineProtocol::Command>(frame.code & ~MachineProtocol::RESPONSE_FLAG);
+			response.status = static_cast<MachineProtocol::Status>(frame.payload[0]);
+			response.resultLength = frame.length - 1;
+			memcpy(response.result, frame.payload + 1, response.resultLength);
+			if(outstanding > 0)
+			{
+				--outstanding;
+			}
+			return true;
+		}
+
+		if(frame.code != MachineProtocol::READY && (frame.code & MachineProtocol::PROGRESS_FLAG))
+		{
+			deadline = std::chrono::steady_clock::now() + timeout;
+			MachineProtocol::PayloadReader reader(frame.payload, frame.length);
+			MachineProtocol::Progress progress;
+			decode(reader, progress);
+			if(reader.complete() && progressHandler)
+			{
+				progressHandler(frame.requestID, static_cast<MachineProtocol::Command>(frame.code & ~MachineProtocol::PROGRESS_FLAG), progress);
+			}
+		}
+	}
+	return false;
+}
+
+bool SocTestClient::readFrame(MachineProtocol::Frame & frame, std::chrono::steady_clock::time_point deadline)
+{
+	while(true)
+	{
+		while(receivedPosition < received.size())
+		{
+			if(parser.feed(received[receivedPosition++]))
+			{
+				frame = parser.getFrame();
+				return true;
+			}
+		}
+		received.clear();
+		receivedPosition = 0;
+
+		auto const now = std::chrono::steady_clock::now();
+		if(now >= deadline)
+		{
+			return false;
+		}
+
+		pollfd pollFd{readFd, POLLIN, 0};
+		int const waitMs = static_cast<int>(std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now).count()) + 1;
+		int const ready = poll(&pollFd, 1, waitMs);
+		if(ready < 0 && errno != EINTR)
+		{
+			return false;
+		}
+		if(ready <= 0)
+		{
+			continue;
+		}
+
+		uint8_t buffer[4096];
+		ssize_t const bytesRead = read(readFd, buffer, sizeof(buffer));
+		if(bytesRead == 0 || (bytesRead < 0 && errno != EINTR && errno != EAGAIN))
+		{
+			// closed, e.g. the simulator exited
+			return false;
+		}
+		if(bytesRead > 0)
+		{
+			received.assign(buffer, buffer + bytesRead);
+		}
+	}
+}
+
+bool SocTestClient::writeAll(uint8_t const * data, size_t length)
+{
+	while(length > 0)
+	{
+		ssize_t const written = write(writeFd, data, length);
+		if(written < 0)
+		{
+			if(errno == EINTR)
+			{
+				continue;
+			}
+			fprintf(stderr, "Error writing to the target: %s\n", strerror(errno));
+			return false;
+		}
+		data += written;
+		length -= written;
+	}
+	return true;
+}
@@ -0,0 +1,97 @@
+//
+// Linux client for soc-test's machine protocol (see MachineProtocol.h), over a serial port or a
+// host build of soc-test started as a child process.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_SOCTESTCLIENT_H
+#define BQ34Z100G1_UTILS_HOST_SOCTESTCLIENT_H
+
+#include "MachineProtocol.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <sys/types.h>
+#include <vector>
+
+class SocTestClient
+{
+public:
+	struct Response
+	{
+		uint8_t requestID;
+		MachineProtocol::Command command;
+		MachineProtocol::Status status;
+		uint8_t result[MachineProtocol::MAX_PAYLOAD_SIZE];
+		size_t resultLength;
+
+		// Reader over the result, for decode()
+		MachineProtocol::PayloadReader reader() const { return MachineProtocol::PayloadReader(result, resultLength); }
+	};
+
+	using ProgressHandler = std::function<void(uint8_t requestID, MachineProtocol::Command command,
+		MachineProtocol::Progress const & progress)>;
+
+	SocTestClient() = default;
+	SocTestClient(SocTestClient const &) = delete;
+	SocTestClient & operator=(SocTestClient const &) = delete;
+
+	// Closes the connection, and waits for the simulator to exit if one was started
+	~SocTestClient();
+
+	/**
+	 * Open a serial port connected to the board, at the 115200 baud that soc-test uses.
+	 * Problems are reported on stderr.
+	 */
+	bool openSerial(char const * device);
+
+	/**
+	 * Start a host build of soc-test with its console connected to this client.
+	 */
+	bool startSimulator(char const * path);
+
+	/**
+	 * Select machine mode from the soc-test menu and wait until it is ready.
+	 * Also works if the target is already in machine mode.
+	 */
+	bool enterMachineMode(std::chrono::milliseconds timeout);
+
+	/**
+	 * Send a request without waiting for its response, so that several can be in flight.
+	 * @return its request ID
+	 */
+	uint8_t send(MachineProtocol::Command command, uint8_t const * arguments = nullptr, size_t length = 0);
+
+	/**
+	 * Wait for the next response.  Progress frames that arrive meanwhile go to the progress handler
+	 * and restart the timeout, so long-running commands only time out if the target goes quiet.
+	 * @return false on timeout or if the connection was closed
+	 */
+	bool receive(Response & response, std::chrono::milliseconds timeout);
+
+	void setProgressHandler(ProgressHandler handler) { progressHandler = std::move(handler); }
+
+	// Requests sent whose responses haven't been received yet
+	size_t getOutstandingCount() const { return outstanding; }
+
+private:
+	int readFd = -1;
+	int writeFd = -1;
+	pid_t child = -1;
+
+	MachineProtocol::Parser parser;
+	std::vector<uint8_t> received;
+	size_t receivedPosition = 0;
+
+	uint8_t nextRequestID = 1;
+	size_t outstanding = 0;
+	ProgressHandler progressHandler;
+
+	// Wait for the next frame until the deadline
+	bool readFrame(MachineProtocol::Frame & frame, std::chrono::steady_clock::time_point deadline);
+
+	bool writeAll(uint8_t const * data, size_t length);
+};
+
+#endif //BQ34Z100G1_UTILS_HOST_SOCTESTCLIENT_H
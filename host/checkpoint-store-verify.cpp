@@ -0,0 +1,306 @@
+//
+// Checks CheckpointStore against resets on the block devices it runs on: the simulated on-chip flash, and a
+// HeapBlockDevice, whose erase leaves the old contents in place.  A few keys are set and removed at random,
+// and now and then the store is reset (re-initialized on the same device), either cleanly or with a program
+// cut off partway, as a power loss would.  Cuts land on every program of a run, including the ones that move
+// the keys into the other erase unit.  After every reset, each key must read back as its last stored value, or
+// for the key being written when the power went, as either its old or its new value.  The store must also take
+// new writes from there on, and wear both erase units alike.
+//
+// Usage: checkpoint-store-verify [--operations <n>]
+//   --operations <n>  sets and removes on each device (default 20000)
+// Exits with 1 if any check fails.
+//
+
+#include "CheckpointStore.h"
+#include "FlashIAPBlockDevice.h"
+#include "blockdevice/HeapBlockDevice.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+namespace
+{
+	uint32_t failures = 0;
+
+	void check(bool condition, char const * device, char const * what, uint32_t value)
+	{
+		if(!condition && failures++ < 20)
+		{
+			printf("  FAILED on %s: %s (%" PRIu32 ")\n", device, what, value);
+		}
+	}
+
+	// Repeatable pseudo random numbers, so a failure can be run again
+	class Random
+	{
+	public:
+		uint32_t next(uint32_t limit)
+		{
+			state = state * 6364136223846793005ULL + 1442695040888963407ULL;
+			return static_cast<uint32_t>(state >> 33) % limit;
+		}
+
+	private:
+		uint64_t state = 1;
+	};
+
+	/**
+	 * Passes everything on to another device, counting erases per erase unit, and can cut a program off after
+	 * part of it has been written, as a reset would.
+	 */
+	class TestDevice : public BlockDevice
+	{
+	public:
+		explicit TestDevice(BlockDevice & target):
+		target(target)
+		{}
+
+		// Erases of each erase unit, by address
+		std::map<bd_addr_t, uint32_t> eraseCounts;
+
+		// Count of programs to let through before cutting one off, or -1 for none
+		int programsBeforeTear = -1;
+
+		// Bytes of the cut off program that make it to the device, rounded down to the program size
+		bd_size_t tearLength = 0;
+
+		bool torn = false;
+
+		int init() override { return target.init(); }
+		int deinit() override { return target.deinit(); }
+		int read(void * buffer, bd_addr_t addr, bd_size_t size) override { return target.read(buffer, addr, size); }
+
+		int program(void const * buffer, bd_addr_t addr, bd_size_t size) override
+		{
+			if(torn)
+			{
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			if(programsBeforeTear >= 0 && programsBeforeTear-- == 0)
+			{
+				// The device is gone until the next "reset"
+				torn = true;
+				bd_size_t const length = std::min(tearLength, size) / target.get_program_size() * target.get_program_size();
+				if(length > 0)
+				{
+					target.program(buffer, addr, length);
+				}
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			return target.program(buffer, addr, size);
+		}
+
+		int erase(bd_addr_t addr, bd_size_t size) override
+		{
+			if(torn)
+			{
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			for(bd_size_t offset = 0; offset < size; offset += target.get_erase_size(addr + offset))
+			{
+				++eraseCounts[addr + offset];
+			}
+			return target.erase(addr, size);
+		}
+
+		bd_size_t get_read_size() const override { return target.get_read_size(); }
+		bd_size_t get_program_size() const override { return target.get_program_size(); }
+		bd_size_t get_erase_size() const override { return target.get_erase_size(); }
+		bd_size_t get_erase_size(bd_addr_t addr) const override { return target.get_erase_size(addr); }
+		int get_erase_value() const override { return target.get_erase_value(); }
+		bd_size_t size() const override { return target.size(); }
+		char const * get_type() const override { return target.get_type(); }
+
+	private:
+		BlockDevice & target;
+	};
+
+	constexpr size_t KEY_COUNT = 5;
+
+	// Values are made from a version number, so a value read back can be told apart from any other
+	std::vector<uint8_t> makeValue(size_t key, uint32_t version)
+	{
+		std::vector<uint8_t> value(1 + (version * 7 + key) % CheckpointStore::MAX_DATA_SIZE);
+		for(size_t i = 0; i < value.size(); i++)
+		{
+			value[i] = static_cast<uint8_t>(version * 13 + key * 29 + i);
+		}
+		return value;
+	}
+
+	std::string keyName(size_t key)
+	{
+		return "key" + std::to_string(key);
+	}
+
+	// What a key should hold: a value, or nothing
+	struct Expected
+	{
+		bool present = false;
+		std::vector<uint8_t> value;
+	};
+
+	bool holds(CheckpointStore & store, size_t key, Expected const & expected)
+	{
+		uint8_t buffer[CheckpointStore::MAX_DATA_SIZE];
+		size_t size = 0;
+		int const result = store.get(keyName(key).c_str(), buffer, sizeof(buffer), &size);
+		if(!expected.present)
+		{
+			return result == CheckpointStore::ERROR_NOT_FOUND;
+		}
+		return result == CheckpointStore::OK && size == expected.value.size()
+			&& memcmp(buffer, expected.value.data(), size) == 0;
+	}
+
+	void verifyDevice(char const * name, BlockDevice & target, uint32_t operations)
+	{
+		TestDevice device(target);
+		uint32_t const failuresBefore = failures;
+
+		auto store = std::make_unique<CheckpointStore>(device);
+		check(store->init() == CheckpointStore::OK, name, "init", 0);
+		check(store->reset() == CheckpointStore::OK, name, "reset", 0);
+		device.eraseCounts.clear();
+
+		Random random;
+		Expected expected[KEY_COUNT];
+		uint32_t version = 0;
+		uint32_t resets = 0;
+		uint32_t tears = 0;
+		uint32_t tearsWhileSwitching = 0;
+		for(uint32_t operation = 0; operation < operations; operation++)
+		{
+			// Cut off one of the next few programs now and then, which often falls on a switch of erase units
+			bool const tear = random.next(7) == 0;
+			if(tear)
+			{
+				device.programsBeforeTear = static_cast<int>(random.next(3));
+				device.tearLength = random.next(65);
+			}
+			uint32_t const erasesBefore = store->getEraseCount();
+
+			size_t const key = random.next(KEY_COUNT);
+			Expected const before = expected[key];
+			Expected after;
+			int result;
+			uint32_t const choice = random.next(10);
+			if(choice == 0 && before.present)
+			{
+				result = store->remove(keyName(key).c_str());
+			}
+			else
+			{
+				// Sometimes the value that is already stored, which must not be written again
+				after.present = true;
+				after.value = choice == 1 && before.present ? before.value : makeValue(key, ++version);
+				result = store->set(keyName(key).c_str(), after.value.data(), after.value.size());
+			}
+
+			if(!device.torn)
+			{
+				check(result == CheckpointStore::OK, name, "set or remove", static_cast<uint32_t>(-result));
+				expected[key] = after;
+				device.programsBeforeTear = -1;
+			}
+			else
+			{
+				check(result == CheckpointStore::ERROR_DEVICE, name, "result of a cut off write", static_cast<uint32_t>(-result));
+				++tears;
+				if(store->getEraseCount() != erasesBefore)
+				{
+					++tearsWhileSwitching;
+				}
+			}
+
+			// A reset after every cut off write, and some clean ones as well
+			if(device.torn || random.next(50) == 0)
+			{
+				bool const interrupted = device.torn;
+				device.torn = false;
+				device.programsBeforeTear = -1;
+
+				// Carry on with a new store on the same device, as the firmware would after a reset
+				store = std::make_unique<CheckpointStore>(device);
+				check(store->init() == CheckpointStore::OK, name, "init after a reset", operation);
+				++resets;
+				for(size_t other = 0; other < KEY_COUNT; other++)
+				{
+					if(other == key && interrupted)
+					{
+						// The cut may have come after the record's CRC, and then the new value counts
+						bool const old = holds(*store, key, before);
+						bool const updated = holds(*store, key, after);
+						check(old || updated, name, "key being written when the power went", operation);
+						expected[key] = updated && !old ? after : before;
+					}
+					else
+					{
+						check(holds(*store, other, expected[other]), name, "key after a reset", operation);
+					}
+				}
+			}
+		}
+
+		// Every key as last written
+		for(size_t key = 0; key < KEY_COUNT; key++)
+		{
+			check(holds(*store, key, expected[key]), name, "key at the end", static_cast<uint32_t>(key));
+		}
+
+		// The two erase units are erased in turn, so they can only differ by the switch in progress, and by a
+		// unit erased again after a cut off switch
+		uint32_t minErases = UINT32_MAX;
+		uint32_t maxErases = 0;
+		for(auto const & unit : device.eraseCounts)
+		{
+			minErases = std::min(minErases, unit.second);
+			maxErases = std::max(maxErases, unit.second);
+		}
+		check(device.eraseCounts.size() == 2, name, "erase units used", static_cast<uint32_t>(device.eraseCounts.size()));
+		check(maxErases - minErases <= 1 + tearsWhileSwitching, name, "spread of erases per unit", maxErases - minErases);
+
+		printf("%s: %" PRIu32 " writes, %" PRIu32 " resets (%" PRIu32 " cut off while writing, %" PRIu32
+			" of them while switching units), %" PRIu32 " to %" PRIu32 " erases per unit: %s\n", name, operations,
+			resets, tears, tearsWhileSwitching, minErases, maxErases, failures == failuresBefore ? "passed" : "FAILED");
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	uint32_t operations = 20000;
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		if(strcmp(argv[argIndex], "--operations") == 0 && argIndex + 1 < argc)
+		{
+			operations = static_cast<uint32_t>(std::max(1, atoi(argv[++argIndex])));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--operations <n>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// The simulated flash must start erased, not from a checkpoint file
+	unsetenv("BQ34_SIM_FLASH_FILE");
+
+	// As chem-id-measurer uses it: 2 kiB pages that refuse to be programmed twice without an erase
+	FlashIAPBlockDevice flash(0x08070000, 8 * 2048);
+	verifyDevice("FlashIAPBlockDevice", flash, operations);
+
+	// Erasing changes nothing here, so records from before an erase are still there to be found
+	HeapBlockDevice heap(16 * 1024, 1, 1, 2048);
+	verifyDevice("HeapBlockDevice, 2 kiB pages", heap, operations);
+
+	printf("\n%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,239 @@
+//
+// Converts a binary chem ID log (captured from chem-id-measurer built with chemid-binary-log = true)
+// into the CSV format that TI's GPCCHEM tool expects.
+//
+// Usage: chemid-log-decode [--channel <n> | --split <prefix>] [--notes] [input file] [output file]
+// Input and output default to stdin and stdout, so this also works in a pipe from a serial port.
+// A log from several packs holds one run per channel.  Only one channel (0 unless --channel is given)
+// goes to the output, or with --split, every channel is written to <prefix>-ch<n>.csv.
+// With --notes, each row where a phase ends is followed by a "# " line with the phase statistics and relax
+// evidence, as chem-id-measurer built with chemid-csv-notes prints them.  GPCCHEM doesn't take those lines.
+//
+
+#include "ChemIDLog.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <utility>
+
+class CSVWriter : public ChemIDLog::Listener
+{
+	// Output file per channel, nullptr for channels that aren't being written
+	FILE * outputs[ChemIDLog::MAX_CHANNELS] = {};
+
+	// Evidence waiting for the sample its event is attached to
+	RelaxDetector::Evidence pendingEvidence[ChemIDLog::MAX_CHANNELS];
+	bool hasPendingEvidence[ChemIDLog::MAX_CHANNELS] = {};
+
+	// Likewise for phase summaries
+	PhaseStatistics::Summary pendingSummary[ChemIDLog::MAX_CHANNELS];
+	bool hasPendingSummary[ChemIDLog::MAX_CHANNELS] = {};
+
+	// Prefix for --split output files, or empty if not splitting
+	std::string splitPrefix;
+
+	// Whether to follow rows with formatCSVNote() lines
+	bool notes = false;
+
+public:
+	size_t samples = 0;
+	size_t skippedSamples = 0;
+	size_t badFrames = 0;
+
+	// Write a single channel to output
+	CSVWriter(FILE * output, uint8_t channel)
+	{
+		outputs[channel] = output;
+	}
+
+	// Write every channel to its own file
+	explicit CSVWriter(std::string splitPrefix):
+	splitPrefix(std::move(splitPrefix))
+	{}
+
+	~CSVWriter()
+	{
+		if(!splitPrefix.empty())
+		{
+			for(FILE * output : outputs)
+			{
+				if(output != nullptr)
+				{
+					fclose(output);
+				}
+			}
+		}
+	}
+
+	void writeNotes(bool enable)
+	{
+		notes = enable;
+	}
+
+	void onStart(uint8_t channel, uint8_t formatVersion) override
+	{
+		if(formatVersion > ChemIDLog::FORMAT_VERSION)
+		{
+			fprintf(stderr, "Warning: log has format version %" PRIu8 ", this decoder expects %" PRIu8 " or older\n",
+				formatVersion, ChemIDLog::FORMAT_VERSION);
+		}
+
+		if(!splitPrefix.empty() && outputs[channel] == nullptr)
+		{
+			std::string const path = splitPrefix + "-ch" + std::to_string(channel) + ".csv";
+			outputs[channel] = fopen(path.c_str(), "w");
+			if(outputs[channel] == nullptr)
+			{
+				perror(path.c_str());
+				return;
+			}
+			fprintf(stderr, "Writing channel %" PRIu8 " to %s\n", channel, path.c_str());
+		}
+
+		if(outputs[channel] != nullptr)
+		{
+			fputs(ChemIDLog::CSV_HEADER, outputs[channel]);
+		}
+	}
+
+	void onSample(uint8_t channel, ChemIDLog::Sample const & sample, ChemIDLog::Event event) override
+	{
+		if(outputs[channel] == nullptr)
+		{
+			hasPendingEvidence[channel] = false;
+			hasPendingSummary[channel] = false;
+			++skippedSamples;
+			return;
+		}
+
+		char row[ChemIDLog::CSV_ROW_SIZE];
+		bool const withEvidence = event != ChemIDLog::Event::NONE && hasPendingEvidence[channel];
+		bool const withSummary = event != ChemIDLog::Event::NONE && hasPendingSummary[channel];
+		ChemIDLog::formatCSVRow(row, sizeof(row), sample, event);
+		fputs(row, outputs[channel]);
+		if(notes && ChemIDLog::formatCSVNote(row, sizeof(row), withEvidence ? &pendingEvidence[channel] : nullptr,
+			withSummary ? &pendingSummary[channel] : nullptr) > 0)
+		{
+			fputs(row, outputs[channel]);
+		}
+		hasPendingEvidence[channel] = false;
+		hasPendingSummary[channel] = false;
+		++samples;
+	}
+
+	void onRelaxEvidence(uint8_t channel, RelaxDetector::Evidence const & evidence) override
+	{
+		pendingEvidence[channel] = evidence;
+		hasPendingEvidence[channel] = true;
+	}
+
+	void onPhaseSummary(uint8_t channel, PhaseStatistics::Summary const & summary) override
+	{
+		pendingSummary[channel] = summary;
+		hasPendingSummary[channel] = true;
+	}
+
+	void onBadFrame() override
+	{
+		++badFrames;
+	}
+};
+
+int main(int argc, char ** argv)
+{
+	FILE * input = stdin;
+	FILE * output = stdout;
+	int channel = 0;
+	char const * splitPrefix = nullptr;
+	bool notes = false;
+
+	int argIndex = 1;
+	for(; argIndex < argc && argv[argIndex][0] == '-' && argv[argIndex][1] != '\0'; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--channel") == 0 && hasValue)
+		{
+			channel = atoi(argv[++argIndex]);
+			if(channel < 0 || channel >= ChemIDLog::MAX_CHANNELS)
+			{
+				fprintf(stderr, "Channel must be between 0 and %d\n", ChemIDLog::MAX_CHANNELS - 1);
+				return 1;
+			}
+		}
+		else if(strcmp(arg, "--split") == 0 && hasValue)
+		{
+			splitPrefix = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--notes") == 0)
+		{
+			notes = true;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--channel <n> | --split <prefix>] [--notes] [input file] [output file]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	if(argIndex < argc)
+	{
+		input = fopen(argv[argIndex], "rb");
+		if(input == nullptr)
+		{
+			perror(argv[argIndex]);
+			return 1;
+		}
+	}
+	if(argIndex + 1 < argc && splitPrefix == nullptr)
+	{
+		output = fopen(argv[argIndex + 1], "w");
+		if(output == nullptr)
+		{
+			perror(argv[argIndex + 1]);
+			return 1;
+		}
+	}
+
+	size_t samples;
+	size_t skippedSamples;
+	size_t badFrames;
+	size_t totalBytes = 0;
+	{
+		CSVWriter writer = splitPrefix != nullptr ? CSVWriter(splitPrefix) : CSVWriter(output, static_cast<uint8_t>(channel));
+		writer.writeNotes(notes);
+		ChemIDLog::Decoder decoder(writer);
+
+		uint8_t buffer[4096];
+		size_t bytesRead;
+		while((bytesRead = fread(buffer, 1, sizeof(buffer), input)) > 0)
+		{
+			decoder.feed(buffer, bytesRead);
+			totalBytes += bytesRead;
+		}
+
+		samples = writer.samples;
+		skippedSamples = writer.skippedSamples;
+		badFrames = writer.badFrames;
+	}
+
+	fprintf(stderr, "Decoded %zu samples from %zu bytes (%zu bad frames)\n", samples, totalBytes, badFrames);
+	if(skippedSamples > 0)
+	{
+		fprintf(stderr, "Skipped %zu samples from other channels; use --channel or --split to decode them\n", skippedSamples);
+	}
+
+	if(output != stdout)
+	{
+		fclose(output);
+	}
+	if(input != stdin)
+	{
+		fclose(input);
+	}
+
+	return badFrames > 0 ? 2 : 0;
+}
@@ -0,0 +1,131 @@
+//
+// Finds the chemistry IDs that best match a recorded chem ID run, using a local chemistry database
+// instead of sending the CSV through TI's GPCCHEM tool.  The chosen ID can then be programmed into
+// the gauge and checked with getChemID().
+//
+// Usage: chemid-match --db <database file> [options] log.csv|log.bin
+// The database format is described in ChemIDMatcher.h.
+//
+// Options:
+//   --top <n>          candidates to list (5)
+//   --cells <n>        cells in series in the pack (CELLCOUNT)
+//   --channel <n>      pack to match from multi-pack logs (0)
+//   --threads <n>      worker threads (default: number of cores)
+//
+
+#include "ChemIDMatcher.h"
+#include "ChemIDTrace.h"
+
+#include <BQ34Z100.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <thread>
+
+int main(int argc, char ** argv)
+{
+	char const * databasePath = nullptr;
+	char const * logPath = nullptr;
+	size_t topCount = 5;
+	int cellCount = CELLCOUNT;
+	uint8_t channel = 0;
+	unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--db") == 0 && hasValue)
+		{
+			databasePath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--top") == 0 && hasValue)
+		{
+			topCount = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--cells") == 0 && hasValue)
+		{
+			cellCount = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--channel") == 0 && hasValue)
+		{
+			channel = static_cast<uint8_t>(atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--threads") == 0 && hasValue)
+		{
+			threadCount = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(arg[0] != '-' && logPath == nullptr)
+		{
+			logPath = arg;
+		}
+		else
+		{
+			logPath = nullptr;
+			break;
+		}
+	}
+
+	if(databasePath == nullptr || logPath == nullptr)
+	{
+		fprintf(stderr, "Usage: %s --db <database file> [--top <n>] [--cells <n>] [--channel <n>] [--threads <n>] log\n", argv[0]);
+		return 1;
+	}
+
+	ChemIDMatcher::Database database;
+	if(!database.load(databasePath))
+	{
+		return 1;
+	}
+	if(database.size() == 0)
+	{
+		fprintf(stderr, "%s: no chemistries\n", databasePath);
+		return 1;
+	}
+
+	ChemIDTrace trace;
+	if(!loadChemIDTrace(logPath, trace, channel))
+	{
+		return 1;
+	}
+
+	ChemIDMatcher::Measurement measurement;
+	std::string error;
+	if(!ChemIDMatcher::extractMeasurement(trace, static_cast<uint8_t>(cellCount), measurement, error))
+	{
+		fprintf(stderr, "%s: %s\n", logPath, error.c_str());
+		return 1;
+	}
+
+	printf("%s: relaxed OCV %.0f mV -> %.0f mV per cell, %.0f mAh discharged at %.0f-%.0f mA\n", logPath,
+		measurement.fullOCV_mV, measurement.emptyOCV_mV, measurement.passedCharge_mAh,
+		*std::min_element(std::begin(measurement.current_mA), std::end(measurement.current_mA)),
+		*std::max_element(std::begin(measurement.current_mA), std::end(measurement.current_mA)));
+
+	auto const startTime = std::chrono::steady_clock::now();
+	std::vector<ChemIDMatcher::Score> const best = ChemIDMatcher::findBest(database, measurement, topCount, threadCount);
+	double const elapsed_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - startTime).count();
+	printf("Scored %zu chemistries in %.2f ms on %u threads\n\n", database.size(), elapsed_ms, threadCount);
+
+	printf("%4s  %-7s  %14s  %14s  %-13s  %10s  %7s  %s\n", "Rank", "Chem ID", "Max error (mV)", "RMS error (mV)",
+		"DOD range", "Qmax (mAh)", "R scale", "Description");
+	for(size_t rank = 0; rank < best.size(); rank++)
+	{
+		ChemIDMatcher::Score const & score = best[rank];
+		if(std::isinf(score.maxError_mV))
+		{
+			printf("%4zu  %04" PRIx16 "     %14s  %14s  %.2f -> %.2f   %10s  %7s  %s\n", rank + 1, database.getID(score.index),
+				"no fit", "-", score.startDOD, score.endDOD, "-", "-", database.getDescription(score.index).c_str());
+			continue;
+		}
+		printf("%4zu  %04" PRIx16 "     %14.1f  %14.1f  %.2f -> %.2f   %10.0f  %7.2f  %s\n", rank + 1, database.getID(score.index),
+			score.maxError_mV, score.rmsError_mV, score.startDOD, score.endDOD, score.qmax_mAh, score.resistanceScale,
+			database.getDescription(score.index).c_str());
+	}
+	return 0;
+}
@@ -0,0 +1,171 @@
+//
+// Replays recorded chem ID logs through ChemIDStateMachine at full host speed and reports where each
+// transition fires, next to where it fired in the recording.  Use it to check threshold changes against
+// real data without re-running packs.
+//
+// Usage: chemid-replay [options] log1.csv [log2.bin ...]
+// Logs can be CSV as printed by chem-id-measurer or binary captures (chemid-binary-log = true).
+//
+// Options (defaults come from the driver's pack configuration):
+//   --channel <n>                   pack to replay from multi-pack logs (0)
+//   --charge-cutoff-ma <mA>         CHARGE ends once current drops below this (DESIGNCAP/10)
+//   --discharge-cutoff-mv <mV>      DISCHARGE ends once voltage drops below this (ZEROCHARGEVOLT * CELLCOUNT)
+//   --relax-charged-s <seconds>     length of RELAX_CHARGED (7200)
+//   --relax-discharged-s <seconds>  length of RELAX_DISCHARGED (18000)
+//   --relax-early-exit              end relax phases once the voltage has settled, as with relax-early-exit = true
+//   --relax-slope-uvps <uV/s>       per-cell dV/dt limit for --relax-early-exit (2)
+// Logs don't record the gauge flags, so OCVTAKEN is not checked when replaying.
+//
+
+#include "ChemIDLog.h"
+#include "ChemIDStateMachine.h"
+#include "ChemIDTrace.h"
+
+#include <BQ34Z100.h>
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <vector>
+
+namespace
+{
+	void replay(char const * path, ChemIDTrace const & trace, ChemIDStateMachine::Thresholds const & thresholds)
+	{
+		ChemIDStateMachine stateMachine(thresholds);
+
+		printf("%s: %zu samples\n", path, trace.samples.size());
+		printf("  %-28s %12s %12s %10s\n", "Transition", "Replay (s)", "Recorded (s)", "Delta (s)");
+
+		bool replayedEvents[ChemIDTrace::EVENT_COUNT] = {};
+		for(ChemIDLog::Sample const & sample : trace.samples)
+		{
+			// The log holds the sign-corrected current, but the state machine only looks at the current
+			// during CHARGE, where it was logged unchanged.
+			ChemIDStateMachine::State const stateBefore = stateMachine.getState();
+			ChemIDStateMachine::Output const output = stateMachine.update(
+				{std::chrono::seconds(sample.elapsed_s), sample.voltage_mV, sample.current_mA});
+
+			if(output.event == ChemIDLog::Event::NONE)
+			{
+				continue;
+			}
+
+			size_t const eventIndex = static_cast<size_t>(output.event);
+			replayedEvents[eventIndex] = true;
+
+			char transition[64];
+			snprintf(transition, sizeof(transition), "%s->%s", ChemIDStateMachine::stateName(stateBefore),
+				ChemIDStateMachine::stateName(stateMachine.getState()));
+
+			int64_t const recorded = trace.recordedEventTimes[eventIndex];
+			if(recorded >= 0)
+			{
+				printf("  %-28s %12" PRIu32 " %12" PRIi64 " %+10" PRIi64 "\n", transition, sample.elapsed_s, recorded,
+					static_cast<int64_t>(sample.elapsed_s) - recorded);
+			}
+			else
+			{
+				printf("  %-28s %12" PRIu32 " %12s %10s\n", transition, sample.elapsed_s, "-", "-");
+			}
+
+			if(output.hasRelaxEvidence)
+			{
+				char evidence[128];
+				RelaxDetector::formatEvidence(evidence, sizeof(evidence), output.relaxEvidence);
+				printf("    %s\n", evidence);
+			}
+		}
+
+		for(size_t eventIndex = 1; eventIndex < ChemIDTrace::EVENT_COUNT; eventIndex++)
+		{
+			if(!replayedEvents[eventIndex] && trace.recordedEventTimes[eventIndex] >= 0)
+			{
+				printf("  recorded \"%s\" at %" PRIi64 " s never fired in replay\n",
+					ChemIDLog::eventComment(static_cast<ChemIDLog::Event>(eventIndex)), trace.recordedEventTimes[eventIndex]);
+			}
+		}
+		printf("  replay ended in state %s\n\n", ChemIDStateMachine::stateName(stateMachine.getState()));
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	ChemIDStateMachine::Thresholds thresholds{DESIGNCAP/10, ZEROCHARGEVOLT * CELLCOUNT};
+	thresholds.relaxDetection.cellCount = CELLCOUNT;
+	std::vector<char const *> paths;
+	uint8_t channel = 0;
+
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--channel") == 0 && hasValue)
+		{
+			channel = static_cast<uint8_t>(atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--charge-cutoff-ma") == 0 && hasValue)
+		{
+			thresholds.chargeCutoff_mA = atoi(argv[++argIndex]);
+		}
+		else if(strcmp(arg, "--discharge-cutoff-mv") == 0 && hasValue)
+		{
+			thresholds.dischargeCutoff_mV = atoi(argv[++argIndex]);
+		}
+		else if(strcmp(arg, "--relax-charged-s") == 0 && hasValue)
+		{
+			thresholds.relaxChargedTime = std::chrono::seconds(atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--relax-discharged-s") == 0 && hasValue)
+		{
+			thresholds.relaxDischargedTime = std::chrono::seconds(atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--relax-early-exit") == 0)
+		{
+			thresholds.relaxEarlyExit = true;
+		}
+		else if(strcmp(arg, "--relax-slope-uvps") == 0 && hasValue)
+		{
+			thresholds.relaxDetection.slopeLimit_uVps = static_cast<float>(atof(argv[++argIndex]));
+		}
+		else if(arg[0] == '-')
+		{
+			fprintf(stderr, "Unknown option %s\n", arg);
+			return 1;
+		}
+		else
+		{
+			paths.push_back(arg);
+		}
+	}
+
+	if(paths.empty())
+	{
+		fprintf(stderr, "Usage: %s [options] log1.csv [log2.bin ...]\n", argv[0]);
+		return 1;
+	}
+
+	printf("Thresholds: charge cutoff %" PRIi32 " mA, discharge cutoff %" PRIu16 " mV, relax %lld s / %lld s",
+		thresholds.chargeCutoff_mA, thresholds.dischargeCutoff_mV,
+		static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(thresholds.relaxChargedTime).count()),
+		static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(thresholds.relaxDischargedTime).count()));
+	if(thresholds.relaxEarlyExit)
+	{
+		printf(" at most, ending early below %.2f uV/s per cell", thresholds.relaxDetection.slopeLimit_uVps);
+	}
+	printf("\n\n");
+
+	int result = 0;
+	for(char const * path : paths)
+	{
+		ChemIDTrace trace;
+		if(!loadChemIDTrace(path, trace, channel))
+		{
+			result = 1;
+			continue;
+		}
+		replay(path, trace, thresholds);
+	}
+	return result;
+}
@@ -0,0 +1,137 @@
+//
+// Checks a data flash image exported by soc-test ("Export Data Flash Image") and lists its contents.
+// The image may be embedded in a raw console capture; text before it is skipped.
+// Optionally writes just the image bytes to a second file, ready to send back for an import.
+//
+// Usage: flash-image-info <capture file> [clean image output file]
+//
+
+#include "FlashImage.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace
+{
+	class ImagePrinter : public FlashImage::Listener
+	{
+	public:
+		FlashImage::Writer * writer = nullptr;
+		bool complete = false;
+
+		bool onHeader(FlashImage::Header const & header) override
+		{
+			printf("Device type 0x%04" PRIx16 ", firmware version 0x%04" PRIx16 ", %" PRIu16 " blocks\n",
+				header.deviceType, header.firmwareVersion, header.blockCount);
+			if(writer != nullptr)
+			{
+				writer->writeHeader(header);
+			}
+			return true;
+		}
+
+		bool onBlock(FlashImage::Block const & block) override
+		{
+			printf("Subclass %3" PRIu8 " block %" PRIu8 ":", block.subclass, block.index);
+			for(uint8_t byte : block.data)
+			{
+				printf(" %02" PRIx8, byte);
+			}
+			printf("\n");
+			if(writer != nullptr)
+			{
+				writer->writeBlock(block);
+			}
+			return true;
+		}
+
+		void onEnd() override
+		{
+			complete = true;
+			if(writer != nullptr)
+			{
+				writer->writeEnd();
+			}
+		}
+
+		void onError(char const * message) override
+		{
+			fprintf(stderr, "Image error: %s\n", message);
+		}
+	};
+
+	class FileSink : public ByteSink
+	{
+		FILE * file;
+
+	public:
+		explicit FileSink(FILE * file):
+		file(file)
+		{}
+
+		void write(uint8_t const * data, size_t length) override
+		{
+			fwrite(data, 1, length, file);
+		}
+	};
+}
+
+int main(int argc, char ** argv)
+{
+	if(argc < 2)
+	{
+		fprintf(stderr, "Usage: %s <capture file> [clean image output file]\n", argv[0]);
+		return 1;
+	}
+
+	FILE * input = fopen(argv[1], "rb");
+	if(input == nullptr)
+	{
+		perror(argv[1]);
+		return 1;
+	}
+
+	FILE * output = nullptr;
+	if(argc > 2)
+	{
+		output = fopen(argv[2], "wb");
+		if(output == nullptr)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	FileSink sink(output);
+	FlashImage::Writer writer(sink);
+
+	ImagePrinter printer;
+	if(output != nullptr)
+	{
+		printer.writer = &writer;
+	}
+
+	FlashImage::Parser parser(printer);
+	uint8_t buffer[4096];
+	size_t bytesRead;
+	while(!parser.isFinished() && (bytesRead = fread(buffer, 1, sizeof(buffer), input)) > 0)
+	{
+		parser.feed(buffer, bytesRead);
+	}
+	fclose(input);
+
+	if(output != nullptr)
+	{
+		fclose(output);
+	}
+
+	if(!printer.complete)
+	{
+		if(!parser.hasFailed())
+		{
+			fprintf(stderr, "Image is incomplete\n");
+		}
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,106 @@
+//
+// Host stand-in for Mbed's FlashIAPBlockDevice: a region of simulated on-chip flash.
+//
+
+#include "FlashIAPBlockDevice.h"
+
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+FlashIAPBlockDevice::FlashIAPBlockDevice(uint32_t address, uint32_t size):
+address(address),
+contents(size, 0xFF)
+{
+}
+
+int FlashIAPBlockDevice::init()
+{
+	char const * file = getenv("BQ34_SIM_FLASH_FILE");
+	if(file == nullptr)
+	{
+		return mbed::BD_ERROR_OK;
+	}
+	backingFile = file;
+
+	// A missing or short file is flash that has never been written
+	FILE * input = fopen(file, "rb");
+	if(input != nullptr)
+	{
+		size_t const loaded = fread(contents.data(), 1, contents.size(), input);
+		(void)loaded;
+		fclose(input);
+	}
+	return mbed::BD_ERROR_OK;
+}
+
+int FlashIAPBlockDevice::deinit()
+{
+	return mbed::BD_ERROR_OK;
+}
+
+int FlashIAPBlockDevice::read(void * buffer, bd_addr_t addr, bd_size_t size)
+{
+	if(addr + size > contents.size())
+	{
+		return mbed::BD_ERROR_DEVICE_ERROR;
+	}
+	memcpy(buffer, contents.data() + addr, size);
+	return mbed::BD_ERROR_OK;
+}
+
+int FlashIAPBlockDevice::program(void const * buffer, bd_addr_t addr, bd_size_t size)
+{
+	if(!isAligned(addr, size, PROGRAM_SIZE))
+	{
+		return mbed::BD_ERROR_DEVICE_ERROR;
+	}
+
+	for(bd_size_t offset = 0; offset < size; offset++)
+	{
+		if(contents[addr + offset] != 0xFF)
+		{
+			fprintf(stderr, "FlashIAPBlockDevice: programming 0x%08" PRIx64 ", which is not erased\n", address + addr + offset);
+			return mbed::BD_ERROR_DEVICE_ERROR;
+		}
+	}
+
+	memcpy(contents.data() + addr, buffer, size);
+	save();
+	return mbed::BD_ERROR_OK;
+}
+
+int FlashIAPBlockDevice::erase(bd_addr_t addr, bd_size_t size)
+{
+	if(!isAligned(addr, size, PAGE_SIZE))
+	{
+		return mbed::BD_ERROR_DEVICE_ERROR;
+	}
+
+	memset(contents.data() + addr, 0xFF, size);
+	save();
+	return mbed::BD_ERROR_OK;
+}
+
+bool FlashIAPBlockDevice::isAligned(bd_addr_t addr, bd_size_t size, bd_size_t unit) const
+{
+	return addr % unit == 0 && size % unit == 0 && addr + size <= contents.size();
+}
+
+void FlashIAPBlockDevice::save()
+{
+	if(backingFile.empty())
+	{
+		return;
+	}
+
+	FILE * output = fopen(backingFile.c_str(), "wb");
+	if(output == nullptr)
+	{
+		fprintf(stderr, "FlashIAPBlockDevice: can't write %s\n", backingFile.c_str());
+		return;
+	}
+	fwrite(contents.data(), 1, contents.size(), output);
+	fclose(output);
+}
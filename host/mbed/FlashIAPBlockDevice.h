@@ -0,0 +1,61 @@
+//
+// Host stand-in for Mbed's FlashIAPBlockDevice: a region of simulated on-chip flash.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_FLASHIAPBLOCKDEVICE_H
+#define BQ34Z100G1_UTILS_HOST_FLASHIAPBLOCKDEVICE_H
+
+#include "blockdevice/BlockDevice.h"
+
+#include <string>
+#include <vector>
+
+// Where the checkpoints go, as flashiap-block-device.base-address and size would place them on a board
+#ifndef MBED_CONF_FLASHIAP_BLOCK_DEVICE_BASE_ADDRESS
+#define MBED_CONF_FLASHIAP_BLOCK_DEVICE_BASE_ADDRESS 0x08070000
+#endif
+#ifndef MBED_CONF_FLASHIAP_BLOCK_DEVICE_SIZE
+#define MBED_CONF_FLASHIAP_BLOCK_DEVICE_SIZE (8 * 2048)
+#endif
+
+/**
+ * Behaves like STM32L4-style flash: 2 kiB pages, 8 byte programming, erased bytes read 0xFF, and programming
+ * a byte that isn't erased is refused.  If the BQ34_SIM_FLASH_FILE environment variable names a file, the
+ * contents are loaded from it by init() and saved after every program and erase, so they survive a restart
+ * of the simulation like real flash survives a reset.  Otherwise the flash starts erased every run.
+ */
+class FlashIAPBlockDevice : public BlockDevice
+{
+public:
+	static constexpr bd_size_t PAGE_SIZE = 2048;
+	static constexpr bd_size_t PROGRAM_SIZE = 8;
+
+	// The address is only used for messages
+	explicit FlashIAPBlockDevice(uint32_t address = MBED_CONF_FLASHIAP_BLOCK_DEVICE_BASE_ADDRESS,
+		uint32_t size = MBED_CONF_FLASHIAP_BLOCK_DEVICE_SIZE);
+
+	int init() override;
+	int deinit() override;
+
+	int read(void * buffer, bd_addr_t addr, bd_size_t size) override;
+	int program(void const * buffer, bd_addr_t addr, bd_size_t size) override;
+	int erase(bd_addr_t addr, bd_size_t size) override;
+
+	bd_size_t get_read_size() const override { return 1; }
+	bd_size_t get_program_size() const override { return PROGRAM_SIZE; }
+	bd_size_t get_erase_size() const override { return PAGE_SIZE; }
+	bd_size_t get_erase_size(bd_addr_t addr) const override { (void)addr; return PAGE_SIZE; }
+	int get_erase_value() const override { return 0xFF; }
+	bd_size_t size() const override { return contents.size(); }
+	char const * get_type() const override { return "FLASHIAP"; }
+
+private:
+	uint32_t const address;
+	std::vector<uint8_t> contents;
+	std::string backingFile;
+
+	bool isAligned(bd_addr_t addr, bd_size_t size, bd_size_t unit) const;
+	void save();
+};
+
+#endif //BQ34Z100G1_UTILS_HOST_FLASHIAPBLOCKDEVICE_H
@@ -0,0 +1,54 @@
+//
+// Host stand-in for Mbed's BlockDevice interface.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_BLOCKDEVICE_H
+#define BQ34Z100G1_UTILS_HOST_BLOCKDEVICE_H
+
+#include <cstdint>
+
+namespace mbed
+{
+	typedef uint64_t bd_addr_t;
+	typedef uint64_t bd_size_t;
+
+	enum bd_error
+	{
+		BD_ERROR_OK = 0,
+		BD_ERROR_DEVICE_ERROR = -4001
+	};
+
+	/**
+	 * Storage made of read, program and erase units, with the same calls as in Mbed.
+	 */
+	class BlockDevice
+	{
+	public:
+		virtual ~BlockDevice() = default;
+
+		virtual int init() = 0;
+		virtual int deinit() = 0;
+		virtual int sync() { return BD_ERROR_OK; }
+
+		virtual int read(void * buffer, bd_addr_t addr, bd_size_t size) = 0;
+		virtual int program(void const * buffer, bd_addr_t addr, bd_size_t size) = 0;
+		virtual int erase(bd_addr_t addr, bd_size_t size) { (void)addr; (void)size; return BD_ERROR_OK; }
+
+		virtual bd_size_t get_read_size() const = 0;
+		virtual bd_size_t get_program_size() const = 0;
+		virtual bd_size_t get_erase_size() const { return get_program_size(); }
+		virtual bd_size_t get_erase_size(bd_addr_t addr) const { (void)addr; return get_erase_size(); }
+
+		// Value of erased bytes, or -1 if erased contents are undefined
+		virtual int get_erase_value() const { return -1; }
+
+		virtual bd_size_t size() const = 0;
+		virtual char const * get_type() const = 0;
+	};
+}
+
+using mbed::BlockDevice;
+using mbed::bd_addr_t;
+using mbed::bd_size_t;
+
+#endif //BQ34Z100G1_UTILS_HOST_BLOCKDEVICE_H
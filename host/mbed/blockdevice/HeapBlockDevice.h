@@ -0,0 +1,86 @@
+//
+// Host stand-in for Mbed's HeapBlockDevice: a block device in RAM.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_HEAPBLOCKDEVICE_H
+#define BQ34Z100G1_UTILS_HOST_HEAPBLOCKDEVICE_H
+
+#include "BlockDevice.h"
+
+#include <cstring>
+#include <vector>
+
+namespace mbed
+{
+	/**
+	 * Behaves like Mbed's: the contents start out as zeros, erase() changes nothing, and the erase value is
+	 * undefined, so code on top of it can't rely on erased bytes reading back as anything in particular.
+	 * Accesses that aren't aligned to the read, program or erase size fail, where Mbed's would assert.
+	 */
+	class HeapBlockDevice : public BlockDevice
+	{
+	public:
+		explicit HeapBlockDevice(bd_size_t size, bd_size_t block = 512):
+		HeapBlockDevice(size, block, block, block)
+		{
+		}
+
+		HeapBlockDevice(bd_size_t size, bd_size_t read, bd_size_t program, bd_size_t erase):
+		readSize(read),
+		programSize(program),
+		eraseSize(erase),
+		contents(size, 0)
+		{
+		}
+
+		int init() override { return BD_ERROR_OK; }
+		int deinit() override { return BD_ERROR_OK; }
+
+		int read(void * buffer, bd_addr_t addr, bd_size_t size) override
+		{
+			if(!isValid(addr, size, readSize))
+			{
+				return BD_ERROR_DEVICE_ERROR;
+			}
+			memcpy(buffer, contents.data() + addr, size);
+			return BD_ERROR_OK;
+		}
+
+		int program(void const * buffer, bd_addr_t addr, bd_size_t size) override
+		{
+			if(!isValid(addr, size, programSize))
+			{
+				return BD_ERROR_DEVICE_ERROR;
+			}
+			memcpy(contents.data() + addr, buffer, size);
+			return BD_ERROR_OK;
+		}
+
+		int erase(bd_addr_t addr, bd_size_t size) override
+		{
+			return isValid(addr, size, eraseSize) ? BD_ERROR_OK : BD_ERROR_DEVICE_ERROR;
+		}
+
+		bd_size_t get_read_size() const override { return readSize; }
+		bd_size_t get_program_size() const override { return programSize; }
+		bd_size_t get_erase_size() const override { return eraseSize; }
+		bd_size_t get_erase_size(bd_addr_t addr) const override { (void)addr; return eraseSize; }
+		bd_size_t size() const override { return contents.size(); }
+		char const * get_type() const override { return "HEAP"; }
+
+	private:
+		bd_size_t const readSize;
+		bd_size_t const programSize;
+		bd_size_t const eraseSize;
+		std::vector<uint8_t> contents;
+
+		bool isValid(bd_addr_t addr, bd_size_t size, bd_size_t unit) const
+		{
+			return addr % unit == 0 && size % unit == 0 && addr + size <= contents.size();
+		}
+	};
+}
+
+using mbed::HeapBlockDevice;
+
+#endif //BQ34Z100G1_UTILS_HOST_HEAPBLOCKDEVICE_H
@@ -0,0 +1,510 @@
+//
+// Host stand-in for the parts of mbed.h used by the utilities and the BQ34Z100 driver.
+// I2C transactions go to the simulated devices on the SimI2C bus, pins go to SimPins,
+// and all timing runs off the virtual SimClock so that hours of sleeping take milliseconds.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_MBED_H
+#define BQ34Z100G1_UTILS_HOST_MBED_H
+
+#include <chrono>
+#include <cerrno>
+#include <cinttypes>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+// Pin names.  Covers the STM32-style names used in pins.h.
+#define BQ34_HOST_PORT_PINS(port) \
+	port##_0, port##_1, port##_2, port##_3, port##_4, port##_5, port##_6, port##_7, \
+	port##_8, port##_9, port##_10, port##_11, port##_12, port##_13, port##_14, port##_15
+
+typedef enum
+{
+	BQ34_HOST_PORT_PINS(PA),
+	BQ34_HOST_PORT_PINS(PB),
+	BQ34_HOST_PORT_PINS(PC),
+	BQ34_HOST_PORT_PINS(PD),
+	BQ34_HOST_PORT_PINS(PE),
+	BQ34_HOST_PORT_PINS(PF),
+	BQ34_HOST_PORT_PINS(PG),
+	BQ34_HOST_PORT_PINS(PH),
+	BQ34_HOST_PORT_PINS(PI),
+	BQ34_HOST_PORT_PINS(PJ),
+	BQ34_HOST_PORT_PINS(PK),
+	PIN_COUNT,
+	NC = -1
+} PinName;
+
+#undef BQ34_HOST_PORT_PINS
+
+typedef enum
+{
+	PullNone,
+	PullUp,
+	PullDown,
+	PullDefault = PullNone
+} PinMode;
+
+typedef enum
+{
+	PIN_INPUT,
+	PIN_OUTPUT
+} PinDirection;
+
+/**
+ * Something that has to happen at an exact point in virtual time, e.g. a queued event.
+ * The clock splits its steps so that onDeadline() runs exactly at the deadline.
+ */
+class SimClockEvent
+{
+public:
+	virtual ~SimClockEvent() = default;
+
+	// Next time this needs to run, or microseconds::max() if nothing is scheduled
+	virtual std::chrono::microseconds getDeadline() const = 0;
+
+	// Called once the clock has reached the deadline.  Must move the deadline past now.
+	virtual void onDeadline(std::chrono::microseconds now) = 0;
+};
+
+namespace SimClock
+{
+	std::chrono::microseconds now();
+	void advance(std::chrono::microseconds duration);
+
+	void addEvent(SimClockEvent & event);
+	void removeEvent(SimClockEvent & event);
+}
+
+// A device on the simulated bus (SimBus.h)
+class SimI2CDevice;
+
+namespace mbed
+{
+	template<typename Signature>
+	using Callback = std::function<Signature>;
+
+	template<typename T, typename R, typename... ArgTs>
+	Callback<R(ArgTs...)> callback(T * obj, R (T::*method)(ArgTs...))
+	{
+		return [obj, method](ArgTs... args) { return (obj->*method)(args...); };
+	}
+
+	// Everything runs on one thread on the host, so there is nothing to lock out
+	class CriticalSectionLock
+	{
+	public:
+		CriticalSectionLock() {}
+	};
+
+	template<typename Lockable>
+	class ScopedLock
+	{
+	public:
+		explicit ScopedLock(Lockable & lockable):
+		lockable(lockable)
+		{
+			lockable.lock();
+		}
+
+		~ScopedLock()
+		{
+			lockable.unlock();
+		}
+
+		ScopedLock(ScopedLock const &) = delete;
+		ScopedLock & operator=(ScopedLock const &) = delete;
+
+	private:
+		Lockable & lockable;
+	};
+
+	/**
+	 * I2C master.  Addresses are 8-bit, as in Mbed.
+	 * Both the transaction API and the byte-level API are routed to the simulated device
+	 * registered for this bus and address.  Transaction API transfers are reported to I2CTransfers, as the
+	 * wrapped HAL calls report them on the board.
+	 */
+	class I2C
+	{
+	public:
+		enum Acknowledge
+		{
+			NoACK = 0,
+			ACK = 1
+		};
+
+		I2C(PinName sda, PinName scl);
+
+		void frequency(int hz);
+
+		// Transaction API.  Returns 0 on success (ACK), nonzero on NACK.
+		int read(int address, char * data, int length, bool repeated = false);
+		int write(int address, const char * data, int length, bool repeated = false);
+
+		// Byte-level API
+		int read(int ack);
+		int write(int data);
+		void start();
+		void stop();
+
+		void lock() {}
+		void unlock() {}
+
+		PinName getSDA() const { return sda; }
+
+	private:
+		PinName sda;
+		int hz = 100000;
+
+		// Check with SimI2C whether a transfer starting now goes through, as with injected faults it may not
+		bool startFault();
+
+		// state for the byte-level API
+		bool addressPending = false;
+		int byteAddress = -1;
+
+		// true if the last transfer ended with a repeated start instead of a stop
+		bool inTransaction = false;
+
+		void beginTransfer(bool repeated);
+
+		// Address a device and move the data with it, as both transaction API calls do.  Returns whether it ACKed.
+		bool transfer(int address, bool repeated, std::function<bool(SimI2CDevice &)> const & move);
+	};
+
+	class DigitalIn
+	{
+	public:
+		explicit DigitalIn(PinName pin);
+		DigitalIn(PinName pin, PinMode mode);
+
+		int read();
+		void mode(PinMode pull);
+		int is_connected() { return pin != NC; }
+
+		operator int() { return read(); }
+
+	private:
+		PinName pin;
+	};
+
+	class DigitalOut
+	{
+	public:
+		explicit DigitalOut(PinName pin);
+		DigitalOut(PinName pin, int value);
+
+		void write(int value);
+		int read();
+		int is_connected() { return pin != NC; }
+
+		DigitalOut & operator=(int value)
+		{
+			write(value);
+			return *this;
+		}
+		operator int() { return read(); }
+
+	private:
+		PinName pin;
+	};
+
+	/**
+	 * Open drain style GPIO on a SimPins pin, as used to clock out a stuck I2C bus: output() drives the written
+	 * value, and input() releases the pin, which the pull-up then takes high.
+	 */
+	class DigitalInOut
+	{
+	public:
+		explicit DigitalInOut(PinName pin);
+		DigitalInOut(PinName pin, PinDirection direction, PinMode mode, int value);
+
+		void write(int value);
+		int read();
+		void output();
+		void input();
+		void mode(PinMode pull);
+		int is_connected() { return pin != NC; }
+
+		DigitalInOut & operator=(int value)
+		{
+			write(value);
+			return *this;
+		}
+		operator int() { return read(); }
+
+	private:
+		PinName pin;
+		int value = 0;
+		bool isOutput = false;
+	};
+
+	/**
+	 * Edge interrupts on a SimPins pin.  Handlers run straight from the SimPins::write() that changes the level,
+	 * which on the host stands in for interrupt context.
+	 */
+	class InterruptIn
+	{
+	public:
+		explicit InterruptIn(PinName pin);
+		~InterruptIn();
+
+		InterruptIn(InterruptIn const &) = delete;
+		InterruptIn & operator=(InterruptIn const &) = delete;
+
+		void rise(Callback<void()> handler) { riseHandler = std::move(handler); }
+		void fall(Callback<void()> handler) { fallHandler = std::move(handler); }
+
+		int read();
+		operator int() { return read(); }
+
+		// Called by SimPins when the level changes
+		void onEdge(int level);
+
+	private:
+		PinName pin;
+		Callback<void()> riseHandler;
+		Callback<void()> fallHandler;
+	};
+
+	/**
+	 * Stopwatch timer running off the virtual clock.
+	 */
+	class Timer
+	{
+	public:
+		void start();
+		void stop();
+		void reset();
+		std::chrono::microseconds elapsed_time() const;
+
+	private:
+		bool running = false;
+		std::chrono::microseconds startTime{0};
+		std::chrono::microseconds accumulated{0};
+	};
+
+	class FileHandle
+	{
+	public:
+		explicit FileHandle(int fd): fd(fd) {}
+		virtual ~FileHandle() = default;
+		virtual ssize_t write(const void * buffer, size_t size) { return ::write(fd, buffer, size); }
+		virtual ssize_t read(void * buffer, size_t size) { return ::read(fd, buffer, size); }
+
+		// The simulation runs much faster than a real serial port, so a non-blocking console would only
+		// drop output.  The mode is remembered, but writes always block.
+		int set_blocking(bool blocking) { this->blocking = blocking; return 0; }
+		bool is_blocking() const { return blocking; }
+
+		// Since writes always block, there's never any room to wait for, and the callback is never called
+		void sigio(Callback<void()> func) { (void)func; }
+
+	protected:
+		FileHandle(): fd(-1) {}
+
+	private:
+		int fd;
+		bool blocking = true;
+	};
+
+	FileHandle * mbed_file_handle(int fd);
+
+	/**
+	 * UART connected to the simulated device attached to its TX pin (see SimSerial).  The device answers as soon as
+	 * it has been written to, so reads never wait: they return -EAGAIN when nothing has arrived, whatever the
+	 * blocking mode.  With nothing attached, writes are discarded.
+	 */
+	class BufferedSerial : public FileHandle
+	{
+	public:
+		BufferedSerial(PinName tx, PinName rx, int baud = 9600);
+
+		ssize_t write(const void * buffer, size_t size) override;
+		ssize_t read(void * buffer, size_t size) override;
+
+		void set_baud(int baud) { this->baud = baud; }
+
+	private:
+		PinName tx;
+		int baud;
+	};
+
+	/**
+	 * Geometry of the simulated on-chip flash: 512 kiB of 2 kiB pages, as on an STM32L4.  Only the queries used to
+	 * place regions in it are provided, the contents are FlashIAPBlockDevice's.
+	 */
+	class FlashIAP
+	{
+	public:
+		int init() { return 0; }
+		int deinit() { return 0; }
+
+		uint32_t get_flash_start() const { return 0x08000000; }
+		uint32_t get_flash_size() const { return 512 * 1024; }
+		uint32_t get_sector_size(uint32_t addr) const { (void)addr; return 2048; }
+		uint32_t get_page_size() const { return 8; }
+	};
+}
+
+// End of the program in the simulated flash
+#define FLASHIAP_APP_ROM_END_ADDR 0x08030000
+
+typedef enum
+{
+	osPriorityLow = 8,
+	osPriorityBelowNormal = 16,
+	osPriorityNormal = 24,
+	osPriorityAboveNormal = 32,
+	osPriorityHigh = 40,
+	osPriorityRealtime = 48
+} osPriority;
+
+typedef int32_t osStatus;
+constexpr osStatus osOK = 0;
+
+#define OS_STACK_SIZE 4096
+
+namespace rtos
+{
+	/**
+	 * There is only one real thread on the host.  start() runs the task straight away, so it must return
+	 * promptly: the EventQueue stand-in's dispatch_forever() does, and its events then run off the
+	 * virtual clock, as if the dispatching thread had priority over the one that is sleeping.
+	 */
+	class Thread
+	{
+	public:
+		explicit Thread(osPriority priority = osPriorityNormal, uint32_t stack_size = OS_STACK_SIZE,
+			unsigned char * stack_mem = nullptr, const char * name = nullptr)
+		{
+			(void)priority;
+			(void)stack_size;
+			(void)stack_mem;
+			(void)name;
+		}
+
+		osStatus start(mbed::Callback<void()> task)
+		{
+			task();
+			return osOK;
+		}
+
+		osStatus join() { return osOK; }
+	};
+
+	// Recursive, as in Mbed.  With one thread, it is never held by anyone else.
+	class Mutex
+	{
+	public:
+		void lock() { ++depth; }
+		bool trylock() { ++depth; return true; }
+		void unlock() { --depth; }
+
+	private:
+		int depth = 0;
+	};
+
+	struct Kernel
+	{
+		struct Clock
+		{
+			using duration = std::chrono::milliseconds;
+			using duration_u32 = std::chrono::duration<uint32_t, std::milli>;
+			using time_point = std::chrono::time_point<Clock, duration>;
+
+			static time_point now()
+			{
+				return time_point(std::chrono::duration_cast<duration>(SimClock::now()));
+			}
+		};
+	};
+
+	namespace ThisThread
+	{
+		inline void sleep_for(Kernel::Clock::duration_u32 rel_time)
+		{
+			SimClock::advance(rel_time);
+		}
+
+		inline void sleep_until(Kernel::Clock::time_point abs_time)
+		{
+			Kernel::Clock::time_point const now = Kernel::Clock::now();
+			if(abs_time > now)
+			{
+				SimClock::advance(abs_time - now);
+			}
+		}
+	}
+}
+
+#define EVENTS_EVENT_SIZE 64
+
+namespace events
+{
+	/**
+	 * Event queue whose events fire at exact virtual times while the application sleeps.
+	 * An event that sleeps, e.g. to back off before retrying a transfer, moves the clock on, but no other event
+	 * runs until it returns.  Events that fell due meanwhile then run late, as they would behind a busy thread.
+	 */
+	class EventQueue : public SimClockEvent
+	{
+	public:
+		explicit EventQueue(size_t size = 32 * EVENTS_EVENT_SIZE, unsigned char * buffer = nullptr);
+		~EventQueue() override;
+
+		int call(mbed::Callback<void()> f) { return post(std::chrono::milliseconds(0), std::chrono::milliseconds(0), std::move(f)); }
+		int call_in(std::chrono::milliseconds ms, mbed::Callback<void()> f) { return post(ms, std::chrono::milliseconds(0), std::move(f)); }
+		int call_every(std::chrono::milliseconds ms, mbed::Callback<void()> f) { return post(ms, ms, std::move(f)); }
+
+		bool cancel(int id);
+
+		// Events are only run once something dispatches the queue
+		void dispatch_forever() { dispatching = true; }
+		void break_dispatch() { dispatching = false; }
+
+		std::chrono::microseconds getDeadline() const override;
+		void onDeadline(std::chrono::microseconds now) override;
+
+	private:
+		struct Event
+		{
+			int id;
+			std::chrono::microseconds deadline;
+			std::chrono::microseconds period; // 0 for one-shot events
+			mbed::Callback<void()> f;
+		};
+
+		std::vector<Event> events;
+		int nextID = 1;
+		bool dispatching = false;
+
+		int post(std::chrono::milliseconds delay, std::chrono::milliseconds period, mbed::Callback<void()> f);
+	};
+}
+
+namespace mbed
+{
+	// Queue for deferring work out of interrupt handlers, dispatched from the start
+	events::EventQueue * mbed_event_queue();
+}
+
+inline void wait_us(int us)
+{
+	SimClock::advance(std::chrono::microseconds(us));
+}
+
+using namespace mbed;
+using namespace rtos;
+using namespace events;
+using namespace std;
+using namespace std::chrono_literals;
+
+#endif //BQ34Z100G1_UTILS_HOST_MBED_H
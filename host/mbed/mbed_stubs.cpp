@@ -0,0 +1,406 @@
+//
+// Implementation of the host mbed stand-ins.
+//
+
+#include "mbed.h"
+
+#include "I2CTransfers.h"
+#include "SimBus.h"
+
+namespace mbed
+{
+	I2C::I2C(PinName sda, PinName scl):
+	sda(sda)
+	{
+		SimI2C::attachPins(sda, scl);
+	}
+
+	void I2C::frequency(int hz)
+	{
+		this->hz = hz;
+	}
+
+	void I2C::beginTransfer(bool repeated)
+	{
+		if(!inTransaction)
+		{
+			SimI2C::countTransaction();
+		}
+		inTransaction = repeated;
+	}
+
+	bool I2C::startFault()
+	{
+		if(SimI2C::startTransfer(sda))
+		{
+			return false;
+		}
+		inTransaction = false;
+		return true;
+	}
+
+	int I2C::read(int address, char * data, int length, bool repeated)
+	{
+		bool const acknowledged = transfer(address, repeated, [data, length](SimI2CDevice & device)
+		{
+			return device.read(reinterpret_cast<uint8_t *>(data), length);
+		});
+		I2CTransfers::report(acknowledged ? length : 0, !acknowledged);
+		return acknowledged ? 0 : -1;
+	}
+
+	int I2C::write(int address, const char * data, int length, bool repeated)
+	{
+		bool const acknowledged = transfer(address, repeated, [data, length](SimI2CDevice & device)
+		{
+			return device.write(reinterpret_cast<uint8_t const *>(data), length);
+		});
+		I2CTransfers::report(acknowledged ? length : 0, !acknowledged);
+		return acknowledged ? 0 : -1;
+	}
+
+	bool I2C::transfer(int address, bool repeated, std::function<bool(SimI2CDevice &)> const & move)
+	{
+		beginTransfer(repeated);
+		if(startFault())
+		{
+			return false;
+		}
+
+		SimI2CDevice * device = SimI2C::find(sda, address);
+		if(device == nullptr)
+		{
+			inTransaction = false;
+			return false;
+		}
+
+		device->onStart();
+		return move(*device);
+	}
+
+	void I2C::start()
+	{
+		if(!inTransaction)
+		{
+			SimI2C::countTransaction();
+		}
+		inTransaction = true;
+		addressPending = true;
+	}
+
+	void I2C::stop()
+	{
+		inTransaction = false;
+		addressPending = false;
+		byteAddress = -1;
+	}
+
+	int I2C::write(int data)
+	{
+		if(addressPending)
+		{
+			addressPending = false;
+			byteAddress = data & 0xFF;
+			SimI2CDevice * device = SimI2C::find(sda, byteAddress);
+			if(startFault() || device == nullptr)
+			{
+				return 0;
+			}
+			device->onStart();
+			return 1;
+		}
+
+		SimI2CDevice * device = SimI2C::find(sda, byteAddress);
+		uint8_t const byte = data;
+		return device != nullptr && device->write(&byte, 1) ? 1 : 0;
+	}
+
+	int I2C::read(int ack)
+	{
+		(void)ack;
+		SimI2CDevice * device = SimI2C::find(sda, byteAddress);
+		uint8_t byte = 0xFF;
+		if(device != nullptr)
+		{
+			device->read(&byte, 1);
+		}
+		return byte;
+	}
+
+	DigitalIn::DigitalIn(PinName pin):
+	pin(pin)
+	{
+	}
+
+	DigitalIn::DigitalIn(PinName pin, PinMode mode):
+	pin(pin)
+	{
+		(void)mode;
+	}
+
+	int DigitalIn::read()
+	{
+		return SimPins::read(pin);
+	}
+
+	void DigitalIn::mode(PinMode pull)
+	{
+		(void)pull;
+	}
+
+	DigitalOut::DigitalOut(PinName pin):
+	pin(pin)
+	{
+	}
+
+	DigitalOut::DigitalOut(PinName pin, int value):
+	pin(pin)
+	{
+		write(value);
+	}
+
+	void DigitalOut::write(int value)
+	{
+		SimPins::write(pin, value);
+	}
+
+	int DigitalOut::read()
+	{
+		return SimPins::read(pin);
+	}
+
+	DigitalInOut::DigitalInOut(PinName pin):
+	pin(pin)
+	{
+	}
+
+	DigitalInOut::DigitalInOut(PinName pin, PinDirection direction, PinMode mode, int value):
+	pin(pin),
+	value(value)
+	{
+		(void)mode;
+		if(direction == PIN_OUTPUT)
+		{
+			output();
+		}
+	}
+
+	void DigitalInOut::write(int value)
+	{
+		this->value = value;
+		if(isOutput)
+		{
+			SimPins::write(pin, value);
+		}
+	}
+
+	int DigitalInOut::read()
+	{
+		return SimPins::read(pin);
+	}
+
+	void DigitalInOut::output()
+	{
+		isOutput = true;
+		SimPins::write(pin, value);
+	}
+
+	void DigitalInOut::input()
+	{
+		// released, so the pull-up takes the line high
+		isOutput = false;
+		SimPins::write(pin, 1);
+	}
+
+	void DigitalInOut::mode(PinMode pull)
+	{
+		(void)pull;
+	}
+
+	InterruptIn::InterruptIn(PinName pin):
+	pin(pin)
+	{
+		SimPins::attachInterrupt(pin, *this);
+	}
+
+	InterruptIn::~InterruptIn()
+	{
+		SimPins::detachInterrupt(*this);
+	}
+
+	int InterruptIn::read()
+	{
+		return SimPins::read(pin);
+	}
+
+	void InterruptIn::onEdge(int level)
+	{
+		Callback<void()> & handler = level ? riseHandler : fallHandler;
+		if(handler)
+		{
+			handler();
+		}
+	}
+
+	void Timer::start()
+	{
+		if(!running)
+		{
+			startTime = SimClock::now();
+			running = true;
+		}
+	}
+
+	void Timer::stop()
+	{
+		if(running)
+		{
+			accumulated += SimClock::now() - startTime;
+			running = false;
+		}
+	}
+
+	void Timer::reset()
+	{
+		accumulated = 0us;
+		startTime = SimClock::now();
+	}
+
+	std::chrono::microseconds Timer::elapsed_time() const
+	{
+		return running ? accumulated + (SimClock::now() - startTime) : accumulated;
+	}
+
+	events::EventQueue * mbed_event_queue()
+	{
+		static events::EventQueue * queue = []
+		{
+			static events::EventQueue sharedQueue;
+			sharedQueue.dispatch_forever();
+			return &sharedQueue;
+		}();
+		return queue;
+	}
+
+	FileHandle * mbed_file_handle(int fd)
+	{
+		static FileHandle stdinHandle(STDIN_FILENO);
+		static FileHandle stdoutHandle(STDOUT_FILENO);
+		static FileHandle stderrHandle(STDERR_FILENO);
+
+		switch(fd)
+		{
+			case STDIN_FILENO:
+				return &stdinHandle;
+			case STDOUT_FILENO:
+				return &stdoutHandle;
+			case STDERR_FILENO:
+				return &stderrHandle;
+			default:
+				return nullptr;
+		}
+	}
+
+	BufferedSerial::BufferedSerial(PinName tx, PinName rx, int baud):
+	tx(tx),
+	baud(baud)
+	{
+		(void)rx;
+	}
+
+	ssize_t BufferedSerial::write(const void * buffer, size_t size)
+	{
+		SimSerialDevice * device = SimSerial::find(tx);
+		if(device != nullptr)
+		{
+			device->receive(static_cast<uint8_t const *>(buffer), size);
+		}
+		return size;
+	}
+
+	ssize_t BufferedSerial::read(void * buffer, size_t size)
+	{
+		SimSerialDevice * device = SimSerial::find(tx);
+		size_t const count = device != nullptr ? device->transmit(static_cast<uint8_t *>(buffer), size) : 0;
+		return count > 0 ? static_cast<ssize_t>(count) : -EAGAIN;
+	}
+}
+
+namespace events
+{
+	EventQueue::EventQueue(size_t size, unsigned char * buffer)
+	{
+		(void)size;
+		(void)buffer;
+		SimClock::addEvent(*this);
+	}
+
+	EventQueue::~EventQueue()
+	{
+		SimClock::removeEvent(*this);
+	}
+
+	int EventQueue::post(std::chrono::milliseconds delay, std::chrono::milliseconds period, mbed::Callback<void()> f)
+	{
+		int const id = nextID++;
+		events.push_back({id, SimClock::now() + delay, period, std::move(f)});
+		return id;
+	}
+
+	bool EventQueue::cancel(int id)
+	{
+		for(auto eventIter = events.begin(); eventIter != events.end(); ++eventIter)
+		{
+			if(eventIter->id == id)
+			{
+				events.erase(eventIter);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	std::chrono::microseconds EventQueue::getDeadline() const
+	{
+		std::chrono::microseconds deadline = std::chrono::microseconds::max();
+		if(dispatching)
+		{
+			for(Event const & event : events)
+			{
+				deadline = std::min(deadline, event.deadline);
+			}
+		}
+		return deadline;
+	}
+
+	void EventQueue::onDeadline(std::chrono::microseconds now)
+	{
+		// Run due events in deadline order, one at a time, since an event may post or cancel others
+		while(true)
+		{
+			auto dueIter = events.end();
+			for(auto eventIter = events.begin(); eventIter != events.end(); ++eventIter)
+			{
+				if(eventIter->deadline <= now && (dueIter == events.end() || eventIter->deadline < dueIter->deadline))
+				{
+					dueIter = eventIter;
+				}
+			}
+			if(dueIter == events.end())
+			{
+				return;
+			}
+
+			mbed::Callback<void()> f = dueIter->f;
+			if(dueIter->period > std::chrono::microseconds(0))
+			{
+				dueIter->deadline += dueIter->period;
+			}
+			else
+			{
+				events.erase(dueIter);
+			}
+			f();
+		}
+	}
+}
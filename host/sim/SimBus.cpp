@@ -0,0 +1,342 @@
+//
+// Simulated I2C bus, GPIO pins and virtual clock that back the host mbed stand-ins.
+//
+
+#include "SimBus.h"
+
+#include <algorithm>
+#include <iterator>
+#include <map>
+#include <random>
+#include <vector>
+
+namespace
+{
+	struct SimState
+	{
+		std::map<std::pair<int, int>, SimI2CDevice *> i2cDevices;
+		std::multimap<int, SimI2CMux *> i2cMuxes; // by SDA pin
+		uint32_t transactionCount = 0;
+
+		SimI2C::Faults faults;
+		std::mt19937 faultGenerator;
+		std::map<int, int> i2cClockPins; // SDA pin by SCL pin
+		std::map<int, int> stuckBuses; // SCL rising edges still needed to free SDA, by SDA pin
+
+		std::map<int, SimSerialDevice *> serialDevices; // by TX pin
+
+		std::map<int, int> pinLevels;
+		std::multimap<int, InterruptIn *> interrupts; // by pin
+
+		std::chrono::microseconds now{0};
+		std::vector<SimClockListener *> listeners;
+		std::vector<SimClockEvent *> events;
+
+		// Set while events run.  An event that sleeps moves the clock on without running other events.
+		bool runningEvents = false;
+	};
+
+	// Function-local static so that it is usable from other static constructors
+	SimState & simState()
+	{
+		static SimState state;
+		return state;
+	}
+
+	std::chrono::microseconds nextDeadline()
+	{
+		std::chrono::microseconds deadline = std::chrono::microseconds::max();
+		for(SimClockEvent * event : simState().events)
+		{
+			deadline = std::min(deadline, event->getDeadline());
+		}
+		return deadline;
+	}
+
+	// Run every event whose deadline has been reached
+	void runDueEvents()
+	{
+		SimState & state = simState();
+		if(state.runningEvents)
+		{
+			return;
+		}
+
+		state.runningEvents = true;
+		while(nextDeadline() <= state.now)
+		{
+			// copy in case an event adds or removes events
+			std::vector<SimClockEvent *> events = state.events;
+			for(SimClockEvent * event : events)
+			{
+				if(event->getDeadline() <= state.now)
+				{
+					event->onDeadline(state.now);
+				}
+			}
+		}
+		state.runningEvents = false;
+	}
+}
+
+void SimI2CMux::attach(uint8_t channel, int address, SimI2CDevice & device)
+{
+	devices[{channel, address & 0xFE}] = &device;
+}
+
+SimI2CDevice * SimI2CMux::find(int address) const
+{
+	SimI2CDevice * found = nullptr;
+	for(uint8_t channel = 0; channel < CHANNEL_COUNT; channel++)
+	{
+		if(!(control & (1 << channel)))
+		{
+			continue;
+		}
+
+		auto deviceIter = devices.find({channel, address & 0xFE});
+		if(deviceIter != devices.end())
+		{
+			if(found != nullptr)
+			{
+				// two devices driving the bus at once
+				return nullptr;
+			}
+			found = deviceIter->second;
+		}
+	}
+	return found;
+}
+
+bool SimI2CMux::write(uint8_t const * data, size_t length)
+{
+	// every byte written replaces the control register
+	if(length > 0)
+	{
+		control = data[length - 1];
+	}
+	return true;
+}
+
+bool SimI2CMux::read(uint8_t * data, size_t length)
+{
+	std::fill(data, data + length, control);
+	return true;
+}
+
+void SimI2C::attach(PinName sda, int address, SimI2CDevice & device)
+{
+	simState().i2cDevices[{sda, address & 0xFE}] = &device;
+}
+
+void SimI2C::attachMux(PinName sda, int address, SimI2CMux & mux)
+{
+	attach(sda, address, mux);
+	simState().i2cMuxes.emplace(sda, &mux);
+}
+
+void SimI2C::detachAll()
+{
+	simState().i2cDevices.clear();
+	simState().i2cMuxes.clear();
+}
+
+SimI2CDevice * SimI2C::find(PinName sda, int address)
+{
+	auto & devices = simState().i2cDevices;
+	auto deviceIter = devices.find({sda, address & 0xFE});
+	if(deviceIter != devices.end())
+	{
+		return deviceIter->second;
+	}
+
+	auto muxRange = simState().i2cMuxes.equal_range(sda);
+	for(auto muxIter = muxRange.first; muxIter != muxRange.second; ++muxIter)
+	{
+		SimI2CDevice * device = muxIter->second->find(address);
+		if(device != nullptr)
+		{
+			return device;
+		}
+	}
+	return nullptr;
+}
+
+uint32_t SimI2C::getTransactionCount()
+{
+	return simState().transactionCount;
+}
+
+void SimI2C::resetTransactionCount()
+{
+	simState().transactionCount = 0;
+}
+
+void SimI2C::countTransaction()
+{
+	++simState().transactionCount;
+}
+
+void SimI2C::setFaults(Faults const & faults)
+{
+	simState().faults = faults;
+	simState().faultGenerator.seed(faults.seed);
+}
+
+void SimI2C::attachPins(PinName sda, PinName scl)
+{
+	simState().i2cClockPins[scl] = sda;
+}
+
+bool SimI2C::startTransfer(PinName sda)
+{
+	SimState & state = simState();
+	Faults const & faults = state.faults;
+	if(faults.nackRate <= 0 && faults.stretchRate <= 0 && faults.stuckRate <= 0)
+	{
+		return true;
+	}
+
+	std::uniform_real_distribution<double> chance;
+	if(state.stuckBuses.count(sda) == 0 && chance(state.faultGenerator) < faults.stuckRate)
+	{
+		state.stuckBuses[sda] = std::uniform_int_distribution<int>(1, 9)(state.faultGenerator);
+	}
+	if(state.stuckBuses.count(sda) > 0)
+	{
+		SimClock::advance(faults.busyTimeout);
+		return false;
+	}
+	if(chance(state.faultGenerator) < faults.nackRate)
+	{
+		return false;
+	}
+	if(chance(state.faultGenerator) < faults.stretchRate)
+	{
+		SimClock::advance(std::chrono::milliseconds(std::uniform_int_distribution<int>(1, 50)(state.faultGenerator)));
+	}
+	return true;
+}
+
+void SimSerial::attach(PinName tx, SimSerialDevice & device)
+{
+	simState().serialDevices[tx] = &device;
+}
+
+SimSerialDevice * SimSerial::find(PinName tx)
+{
+	auto & devices = simState().serialDevices;
+	auto deviceIter = devices.find(tx);
+	return deviceIter == devices.end() ? nullptr : deviceIter->second;
+}
+
+int SimPins::read(PinName pin)
+{
+	// a device holding a stuck bus's SDA low wins over anything else on the line
+	if(simState().stuckBuses.count(pin) > 0)
+	{
+		return 0;
+	}
+
+	auto & levels = simState().pinLevels;
+	auto levelIter = levels.find(pin);
+
+	// undriven pins float high
+	return levelIter == levels.end() ? 1 : levelIter->second;
+}
+
+void SimPins::write(PinName pin, int value)
+{
+	int const level = value ? 1 : 0;
+	bool const changed = read(pin) != level;
+	simState().pinLevels[pin] = level;
+	if(!changed)
+	{
+		return;
+	}
+
+	// each clock pulse on a stuck bus's SCL brings its device closer to finishing the byte it was sending
+	SimState & state = simState();
+	auto sclIter = state.i2cClockPins.find(pin);
+	if(level == 1 && sclIter != state.i2cClockPins.end())
+	{
+		auto stuckIter = state.stuckBuses.find(sclIter->second);
+		if(stuckIter != state.stuckBuses.end() && --stuckIter->second == 0)
+		{
+			state.stuckBuses.erase(stuckIter);
+		}
+	}
+
+	auto range = simState().interrupts.equal_range(pin);
+	for(auto interruptIter = range.first; interruptIter != range.second; ++interruptIter)
+	{
+		interruptIter->second->onEdge(level);
+	}
+}
+
+void SimPins::attachInterrupt(PinName pin, InterruptIn & interrupt)
+{
+	simState().interrupts.emplace(pin, &interrupt);
+}
+
+void SimPins::detachInterrupt(InterruptIn & interrupt)
+{
+	auto & interrupts = simState().interrupts;
+	for(auto interruptIter = interrupts.begin(); interruptIter != interrupts.end();)
+	{
+		interruptIter = interruptIter->second == &interrupt ? interrupts.erase(interruptIter) : std::next(interruptIter);
+	}
+}
+
+std::chrono::microseconds SimClock::now()
+{
+	return simState().now;
+}
+
+void SimClock::advance(std::chrono::microseconds duration)
+{
+	SimState & state = simState();
+	runDueEvents();
+	while(duration > 0us)
+	{
+		// stop exactly at the next event deadline, unless an event is sleeping and others have to wait anyway
+		std::chrono::microseconds step = std::min(duration, MAX_STEP);
+		if(!state.runningEvents)
+		{
+			step = std::min(step, nextDeadline() - state.now);
+		}
+		state.now += step;
+		duration -= step;
+
+		// copy in case a listener adds or removes listeners
+		std::vector<SimClockListener *> listeners = state.listeners;
+		for(SimClockListener * listener : listeners)
+		{
+			listener->onTick(state.now, step);
+		}
+
+		runDueEvents();
+	}
+}
+
+void SimClock::addListener(SimClockListener & listener)
+{
+	simState().listeners.push_back(&listener);
+}
+
+void SimClock::removeListener(SimClockListener & listener)
+{
+	auto & listeners = simState().listeners;
+	listeners.erase(std::remove(listeners.begin(), listeners.end(), &listener), listeners.end());
+}
+
+void SimClock::addEvent(SimClockEvent & event)
+{
+	simState().events.push_back(&event);
+}
+
+void SimClock::removeEvent(SimClockEvent & event)
+{
+	auto & events = simState().events;
+	events.erase(std::remove(events.begin(), events.end(), &event), events.end());
+}
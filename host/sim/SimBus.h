@@ -0,0 +1,165 @@
+//
+// Simulated I2C bus, GPIO pins and virtual clock that back the host mbed stand-ins.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_SIMBUS_H
+#define BQ34Z100G1_UTILS_HOST_SIMBUS_H
+
+#include <mbed.h>
+
+#include <map>
+
+/**
+ * A device that can be attached to the simulated I2C bus.
+ */
+class SimI2CDevice
+{
+public:
+	virtual ~SimI2CDevice() = default;
+
+	// Called at the start (or repeated start) of a transfer addressed to this device
+	virtual void onStart() {}
+
+	// Master writes bytes to the device.  Return false to NACK.
+	virtual bool write(uint8_t const * data, size_t length) = 0;
+
+	// Master reads bytes from the device.  Return false to NACK.
+	virtual bool read(uint8_t * data, size_t length) = 0;
+};
+
+/**
+ * A TCA9548A-style I2C switch.  Its control register has one bit per downstream channel, and devices
+ * on every enabled channel appear on the upstream bus.
+ */
+class SimI2CMux : public SimI2CDevice
+{
+public:
+	static constexpr uint8_t CHANNEL_COUNT = 8;
+
+	// Attach a device to one of the downstream channels, at the given 8-bit address
+	void attach(uint8_t channel, int address, SimI2CDevice & device);
+
+	/**
+	 * Find the device at the given address on the enabled channels.
+	 * Returns nullptr if nothing ACKs it, or if devices on two enabled channels would both answer.
+	 */
+	SimI2CDevice * find(int address) const;
+
+	uint8_t getControl() const { return control; }
+
+	bool write(uint8_t const * data, size_t length) override;
+	bool read(uint8_t * data, size_t length) override;
+
+private:
+	uint8_t control = 0;
+	std::map<std::pair<uint8_t, int>, SimI2CDevice *> devices;
+};
+
+namespace SimI2C
+{
+	/**
+	 * Attach a device to the bus whose SDA pin is sda, at the given 8-bit address.
+	 */
+	void attach(PinName sda, int address, SimI2CDevice & device);
+
+	/**
+	 * Attach a mux to the bus whose SDA pin is sda.  Devices behind it are found by find() while their channel is enabled.
+	 */
+	void attachMux(PinName sda, int address, SimI2CMux & mux);
+
+	// Remove every device from every bus
+	void detachAll();
+
+	// Find the device at the given address, directly on the bus or behind a mux, or nullptr if nothing ACKs it
+	SimI2CDevice * find(PinName sda, int address);
+
+	// Count of bus transactions (start ... stop, with repeated starts counted as part of the same transaction)
+	uint32_t getTransactionCount();
+	void resetTransactionCount();
+	void countTransaction();
+
+	/**
+	 * Bus faults to inject, each as the chance that a transfer runs into it.  A NACKed transfer fails at once.
+	 * A stretched one goes through, but a device holds SCL low for 1 to 50 ms first.  A stuck bus is a device
+	 * holding SDA low: transfers fail after the I2C HAL's busy timeout until SCL has been clocked as GPIO enough
+	 * times (1 to 9) for the device to finish its byte.
+	 */
+	struct Faults
+	{
+		double nackRate = 0;
+		double stretchRate = 0;
+		double stuckRate = 0;
+		std::chrono::microseconds busyTimeout{25000};
+		uint32_t seed = 1;
+	};
+
+	void setFaults(Faults const & faults);
+
+	// Record that sda and scl belong to the same bus, so that clocking scl can free a stuck sda
+	void attachPins(PinName sda, PinName scl);
+
+	/**
+	 * Called by the I2C stand-in as a transfer starts.  Moves the clock on for a stretched or stuck transfer.
+	 * @return false if the transfer fails with an injected fault
+	 */
+	bool startTransfer(PinName sda);
+}
+
+/**
+ * A device on the other end of a simulated UART, e.g. a bench instrument.
+ */
+class SimSerialDevice
+{
+public:
+	virtual ~SimSerialDevice() = default;
+
+	// Bytes sent to the device
+	virtual void receive(uint8_t const * data, size_t length) = 0;
+
+	// Bytes the device has sent back, up to length.  Returns the number copied.
+	virtual size_t transmit(uint8_t * data, size_t length) = 0;
+};
+
+namespace SimSerial
+{
+	/**
+	 * Connect a device to the UART whose TX pin is tx.
+	 */
+	void attach(PinName tx, SimSerialDevice & device);
+
+	// Find the device on the UART whose TX pin is tx, or nullptr if there is none
+	SimSerialDevice * find(PinName tx);
+}
+
+namespace SimPins
+{
+	int read(PinName pin);
+	void write(PinName pin, int value);
+
+	// Interrupts to run when a pin changes level
+	void attachInterrupt(PinName pin, InterruptIn & interrupt);
+	void detachInterrupt(InterruptIn & interrupt);
+}
+
+/**
+ * Something that needs to run as virtual time passes, e.g. a battery model.
+ */
+class SimClockListener
+{
+public:
+	virtual ~SimClockListener() = default;
+
+	// Called after the clock has advanced by dt, with now being the new time
+	virtual void onTick(std::chrono::microseconds now, std::chrono::microseconds dt) = 0;
+};
+
+namespace SimClock
+{
+	// Largest step that listeners will see when the clock advances
+	constexpr std::chrono::microseconds MAX_STEP = 1s;
+
+	void addListener(SimClockListener & listener);
+	void removeListener(SimClockListener & listener);
+}
+
+#endif //BQ34Z100G1_UTILS_HOST_SIMBUS_H
@@ -0,0 +1,172 @@
+//
+// Simulated bench multimeter with a SCPI serial interface.
+//
+
+#include "SimReferenceMeter.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+
+namespace
+{
+	// Noise of a 6.5 digit meter on its 100 V and 3 A ranges, roughly
+	constexpr double VOLTAGE_NOISE_V = 0.0005;
+	constexpr double CURRENT_NOISE_A = 0.0003;
+
+	// Size of the outlier readings, as a fraction of the reading
+	constexpr double OUTLIER_ERROR = 0.03;
+
+	// Convert the long forms of the keywords we know to the short forms, and everything to upper case
+	std::string shortForm(std::string const & command)
+	{
+		static constexpr struct
+		{
+			char const * longForm;
+			char const * shortForm;
+		} KEYWORDS[] = {
+			{"MEASURE", "MEAS"},
+			{"VOLTAGE", "VOLT"},
+			{"CURRENT", "CURR"},
+			{"SYSTEM", "SYST"},
+			{"ERROR", "ERR"},
+		};
+
+		std::string result;
+		std::string keyword;
+		auto flushKeyword = [&]() {
+			for(auto const & mapping : KEYWORDS)
+			{
+				if(keyword == mapping.longForm)
+				{
+					keyword = mapping.shortForm;
+				}
+			}
+			result += keyword;
+			keyword.clear();
+		};
+
+		for(char c : command)
+		{
+			if(c == ':' || c == '?')
+			{
+				flushKeyword();
+				result += c;
+			}
+			else if(!isspace(static_cast<unsigned char>(c)))
+			{
+				keyword += static_cast<char>(toupper(static_cast<unsigned char>(c)));
+			}
+		}
+		flushKeyword();
+		return result;
+	}
+}
+
+SimReferenceMeter::SimReferenceMeter(SimulatedBQ34Z100 & pack):
+pack(pack)
+{
+}
+
+void SimReferenceMeter::receive(uint8_t const * data, size_t length)
+{
+	for(size_t index = 0; index < length; index++)
+	{
+		char const c = static_cast<char>(data[index]);
+		if(c == '\n')
+		{
+			execute(line);
+			line.clear();
+		}
+		else if(c != '\r')
+		{
+			line += c;
+		}
+	}
+}
+
+size_t SimReferenceMeter::transmit(uint8_t * data, size_t length)
+{
+	size_t count = 0;
+	while(count < length && !output.empty())
+	{
+		data[count++] = output.front();
+		output.pop_front();
+	}
+	return count;
+}
+
+void SimReferenceMeter::execute(std::string const & command)
+{
+	std::string const normalized = shortForm(command);
+	if(normalized.empty())
+	{
+		return;
+	}
+
+	if(normalized == "*IDN?")
+	{
+		reply(IDENTITY);
+	}
+	else if(normalized == "*RST" || normalized == "*CLS")
+	{
+		errors.clear();
+	}
+	else if(normalized == "SYST:ERR?")
+	{
+		if(errors.empty())
+		{
+			reply("+0,\"No error\"");
+		}
+		else
+		{
+			reply(errors.front());
+			errors.pop_front();
+		}
+	}
+	else if(normalized == "MEAS:VOLT:DC?" || normalized == ":MEAS:VOLT:DC?")
+	{
+		replyReading(pack.getTrueVoltage_mV() / 1000, VOLTAGE_NOISE_V);
+	}
+	else if(normalized == "MEAS:CURR:DC?" || normalized == ":MEAS:CURR:DC?")
+	{
+		replyReading(pack.getTrueCurrent_mA() / 1000, CURRENT_NOISE_A);
+	}
+	else
+	{
+		errors.push_back("-113,\"Undefined header\"");
+	}
+}
+
+void SimReferenceMeter::reply(std::string const & text)
+{
+	output.insert(output.end(), text.begin(), text.end());
+	output.push_back('\n');
+}
+
+void SimReferenceMeter::replyReading(double value, double noiseSigma)
+{
+	value += noise() * noiseSigma;
+	if(++readingCount % OUTLIER_INTERVAL == 0)
+	{
+		value *= 1 + OUTLIER_ERROR;
+	}
+
+	char text[32];
+	snprintf(text, sizeof(text), "%+.8E", value);
+	reply(text);
+}
+
+double SimReferenceMeter::noise()
+{
+	// Sum of 12 uniform values (Irwin-Hall), from xorshift32
+	double sum = 0;
+	for(int index = 0; index < 12; index++)
+	{
+		randomState ^= randomState << 13;
+		randomState ^= randomState >> 17;
+		randomState ^= randomState << 5;
+		sum += randomState / 4294967296.0;
+	}
+	return sum - 6;
+}
@@ -0,0 +1,50 @@
+//
+// Simulated bench multimeter with a SCPI serial interface, measuring the true voltage and current of a simulated pack.
+// It is the reference for the automatic calibration in the host builds.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_SIMREFERENCEMETER_H
+#define BQ34Z100G1_UTILS_HOST_SIMREFERENCEMETER_H
+
+#include "SimBus.h"
+#include "SimulatedBQ34Z100.h"
+
+#include <deque>
+#include <string>
+
+/**
+ * Understands *IDN?, *RST, *CLS, SYST:ERR?, MEAS:VOLT:DC? and MEAS:CURR:DC? (short or long forms, any case).
+ * Readings are in volts and amps, in the usual "+1.54220000E+01" format, with a little random noise.
+ * Every OUTLIER_INTERVAL-th reading is off by a few percent, like a reading taken while a probe contact bounced.
+ * Unknown commands get no reply and add an error that SYST:ERR? reports, as on real instruments.
+ */
+class SimReferenceMeter : public SimSerialDevice
+{
+public:
+	static constexpr char const * IDENTITY = "BQ34SIM,REFERENCE-METER,0,1.0";
+	static constexpr unsigned int OUTLIER_INTERVAL = 11;
+
+	explicit SimReferenceMeter(SimulatedBQ34Z100 & pack);
+
+	void receive(uint8_t const * data, size_t length) override;
+	size_t transmit(uint8_t * data, size_t length) override;
+
+private:
+	SimulatedBQ34Z100 & pack;
+
+	std::string line;
+	std::deque<uint8_t> output;
+	std::deque<std::string> errors;
+
+	uint32_t randomState = 0x2545F491;
+	unsigned int readingCount = 0;
+
+	void execute(std::string const & command);
+	void reply(std::string const & text);
+	void replyReading(double value, double noiseSigma);
+
+	// Roughly normally distributed, with a standard deviation of 1
+	double noise();
+};
+
+#endif //BQ34Z100G1_UTILS_HOST_SIMREFERENCEMETER_H
@@ -0,0 +1,177 @@
+//
+// Creates the simulated pack that the host builds of the utilities talk to.
+//
+
+#include "SimSetup.h"
+#include "SimReferenceMeter.h"
+
+#include <BQ34Z100.h>
+#include "pins.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <memory>
+#include <unistd.h>
+#include <vector>
+
+namespace
+{
+	// Same layout as ChemIDChannelConfig, so the pins.h table can be used without the measurer's headers
+	struct ChannelWiring
+	{
+		PinName sda;
+		PinName scl;
+		int muxChannel;
+		PinName chargerEnablePin;
+		PinName chargeStatusPin;
+	};
+
+	constexpr ChannelWiring CHANNELS[] = {CHEMID_CHANNELS};
+
+	// Each pack starts this much emptier than the one before it, so that they don't all change phase together
+	constexpr double SOC_STEP_PER_CHANNEL = 0.05;
+
+	SimPackConfig makePackConfig(size_t channelIndex)
+	{
+		SimPackConfig config;
+		config.designCapacity_mAh = DESIGNCAP;
+#ifdef DESIGNENERGY
+		config.designEnergy_mWh = DESIGNENERGY;
+#endif
+		config.cellCount = CELLCOUNT;
+		config.terminateVoltage_mV = ZEROCHARGEVOLT;
+
+		config.chargerEnablePin = CHANNELS[channelIndex].chargerEnablePin;
+		config.chargerEnableLevel = CHARGER_PIN_ACTIVATE;
+		config.chargeStatusPin = CHANNELS[channelIndex].chargeStatusPin;
+		config.chargeStatusCharging = CHARGE_STATUS_CHARGING;
+		config.chargeStatusNotCharging = CHARGE_STATUS_NOT_CHARGING;
+
+		// soc-test's gauge is the first one
+		if(channelIndex == 0)
+		{
+			config.updatePin = GAUGE_UPDATE_PIN;
+		}
+
+		// e.g. 5000 for a gauge whose oscillator runs 0.5% slow
+		char const * clockError = getenv("BQ34_SIM_GAUGE_CLOCK_PPM");
+		if(clockError != nullptr)
+		{
+			config.updatePeriod += config.updatePeriod * atoll(clockError) / 1000000;
+		}
+
+		char const * initialSOC = getenv("BQ34_SIM_INITIAL_SOC");
+		if(initialSOC != nullptr)
+		{
+			config.initialSOC = atof(initialSOC);
+		}
+		config.initialSOC = std::max(0.0, config.initialSOC - SOC_STEP_PER_CHANNEL * channelIndex);
+		return config;
+	}
+
+	// Ends the program abruptly at a set virtual time, like the board losing power
+	class SimPowerLoss : public SimClockListener
+	{
+	public:
+		explicit SimPowerLoss(std::chrono::microseconds time): time(time) {}
+
+		void onTick(std::chrono::microseconds now, std::chrono::microseconds dt) override
+		{
+			(void)dt;
+			if(now >= time)
+			{
+				// Keep what was already "sent" to the console, but nothing else gets to run
+				fflush(stdout);
+				fprintf(stderr, "Simulated power loss at %lld s\n",
+					static_cast<long long>(std::chrono::duration_cast<std::chrono::seconds>(now).count()));
+				_exit(0);
+			}
+		}
+
+	private:
+		std::chrono::microseconds const time;
+	};
+
+	// One simulated pack per entry in CHEMID_CHANNELS, with muxes where the table uses them
+	struct SimSetup
+	{
+		std::vector<std::unique_ptr<SimulatedBQ34Z100>> gauges;
+		std::map<int, std::unique_ptr<SimI2CMux>> muxes; // by SDA pin
+		std::unique_ptr<SimPowerLoss> powerLoss;
+		std::unique_ptr<SimReferenceMeter> referenceMeter;
+
+		SimSetup()
+		{
+			// The menus read stdin with scanf().  Without a stdio buffer it can't swallow binary data
+			// that follows, e.g. an image for consoleRead().
+			setvbuf(stdin, nullptr, _IONBF, 0);
+
+			for(size_t channelIndex = 0; channelIndex < sizeof(CHANNELS) / sizeof(CHANNELS[0]); channelIndex++)
+			{
+				ChannelWiring const & wiring = CHANNELS[channelIndex];
+				SimPackConfig const config = makePackConfig(channelIndex);
+				gauges.push_back(std::make_unique<SimulatedBQ34Z100>(config));
+				SimulatedBQ34Z100 & gauge = *gauges.back();
+
+				// charger starts out in shutdown until the application drives the pin
+				SimPins::write(wiring.chargerEnablePin, CHARGER_PIN_DEACTIVATE);
+
+				if(wiring.muxChannel == CHEMID_NO_MUX)
+				{
+					SimI2C::attach(wiring.sda, SimulatedBQ34Z100::I2C_ADDRESS, gauge);
+				}
+				else
+				{
+					std::unique_ptr<SimI2CMux> & mux = muxes[wiring.sda];
+					if(!mux)
+					{
+						mux = std::make_unique<SimI2CMux>();
+						SimI2C::attachMux(wiring.sda, I2C_MUX_ADDRESS, *mux);
+					}
+					mux->attach(wiring.muxChannel, SimulatedBQ34Z100::I2C_ADDRESS, gauge);
+				}
+				SimClock::addListener(gauge);
+
+				// only a gauge with an update pin needs the clock to stop at each of its updates
+				if(config.updatePin != NC)
+				{
+					SimClock::addEvent(gauge);
+				}
+			}
+
+#ifdef REFERENCE_METER_TX
+			// the meter is wired to the first pack
+			referenceMeter = std::make_unique<SimReferenceMeter>(*gauges.front());
+			SimSerial::attach(REFERENCE_METER_TX, *referenceMeter);
+#endif
+
+			// Chance of each fault per I2C transfer, e.g. 0.01
+			SimI2C::Faults faults;
+			char const * nackRate = getenv("BQ34_SIM_I2C_NACK_RATE");
+			char const * stretchRate = getenv("BQ34_SIM_I2C_STRETCH_RATE");
+			char const * stuckRate = getenv("BQ34_SIM_I2C_STUCK_RATE");
+			faults.nackRate = nackRate != nullptr ? atof(nackRate) : 0;
+			faults.stretchRate = stretchRate != nullptr ? atof(stretchRate) : 0;
+			faults.stuckRate = stuckRate != nullptr ? atof(stuckRate) : 0;
+			SimI2C::setFaults(faults);
+
+			char const * powerLossTime = getenv("BQ34_SIM_POWER_LOSS_S");
+			if(powerLossTime != nullptr)
+			{
+				powerLoss = std::make_unique<SimPowerLoss>(std::chrono::seconds(atoll(powerLossTime)));
+				SimClock::addListener(*powerLoss);
+			}
+		}
+	};
+
+	// make sure the gauge exists before main() runs, even if nothing calls simGauge()
+	SimulatedBQ34Z100 & staticGauge = simGauge();
+}
+
+SimulatedBQ34Z100 & simGauge()
+{
+	static SimSetup setup;
+	return *setup.gauges.front();
+}
@@ -0,0 +1,23 @@
+//
+// Creates the simulated pack that the host builds of the utilities talk to.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_SIMSETUP_H
+#define BQ34Z100G1_UTILS_HOST_SIMSETUP_H
+
+#include "SimulatedBQ34Z100.h"
+
+/**
+ * Get the simulated gauge for the first pack in CHEMID_CHANNELS (by default, the one attached to BQ34_I2C_SDA).
+ * There is one simulated pack per entry in CHEMID_CHANNELS, each configured from the driver's pack settings
+ * and the pins in pins.h, with a simulated mux wherever the table uses one.  They are created on first use.
+ * The initial state of charge can be overridden with the BQ34_SIM_INITIAL_SOC environment variable (0-1).
+ * Each further pack starts 5% lower.
+ * A simulated SCPI reference meter measuring the first pack is connected to the REFERENCE_METER_TX UART.
+ * Setting BQ34_SIM_POWER_LOSS_S ends the program at that virtual time, as if the board had lost power.
+ * BQ34_SIM_I2C_NACK_RATE, BQ34_SIM_I2C_STRETCH_RATE and BQ34_SIM_I2C_STUCK_RATE inject bus faults, each as the
+ * chance per I2C transfer (see SimI2C::Faults).
+ */
+SimulatedBQ34Z100 & simGauge();
+
+#endif //BQ34Z100G1_UTILS_HOST_SIMSETUP_H
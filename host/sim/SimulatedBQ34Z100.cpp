@@ -0,0 +1,544 @@
+//
+// Software model of a BQ34Z100-G1 fuel gauge and the pack, charger and load around it.
+//
+
+#include "SimulatedBQ34Z100.h"
+
+#include <algorithm>
+#include <cmath>
+
+namespace
+{
+	// Standard command registers
+	constexpr uint8_t REG_CONTROL = 0x00;
+	constexpr uint8_t REG_SOC = 0x02;
+	constexpr uint8_t REG_MAX_ERROR = 0x03;
+	constexpr uint8_t REG_REMAINING = 0x04;
+	constexpr uint8_t REG_FULL_CHARGE = 0x06;
+	constexpr uint8_t REG_VOLTAGE = 0x08;
+	constexpr uint8_t REG_AVERAGE_CURRENT = 0x0A;
+	constexpr uint8_t REG_TEMPERATURE = 0x0C;
+	constexpr uint8_t REG_FLAGS = 0x0E;
+	constexpr uint8_t REG_CURRENT = 0x10;
+	constexpr uint8_t REG_FLAGS_B = 0x12;
+	constexpr uint8_t REG_SERIAL_NUMBER = 0x28;
+	constexpr uint8_t REG_INTERNAL_TEMPERATURE = 0x2A;
+	constexpr uint8_t REG_CYCLE_COUNT = 0x2C;
+	constexpr uint8_t REG_STATE_OF_HEALTH = 0x2E;
+	constexpr uint8_t REG_DESIGN_CAPACITY = 0x3C;
+	constexpr uint8_t REG_DATA_FLASH_CLASS = 0x3E;
+	constexpr uint8_t REG_DATA_FLASH_BLOCK = 0x3F;
+	constexpr uint8_t REG_BLOCK_DATA = 0x40;
+	constexpr uint8_t REG_BLOCK_DATA_CHECKSUM = 0x60;
+	constexpr uint8_t REG_BLOCK_DATA_CONTROL = 0x61;
+
+	// Control subcommands
+	constexpr uint16_t CTRL_CONTROL_STATUS = 0x0000;
+	constexpr uint16_t CTRL_DEVICE_TYPE = 0x0001;
+	constexpr uint16_t CTRL_FW_VERSION = 0x0002;
+	constexpr uint16_t CTRL_HW_VERSION = 0x0003;
+	constexpr uint16_t CTRL_RESET_DATA = 0x0005;
+	constexpr uint16_t CTRL_CHEM_ID = 0x0008;
+	constexpr uint16_t CTRL_BOARD_OFFSET = 0x0009;
+	constexpr uint16_t CTRL_CC_OFFSET = 0x000A;
+	constexpr uint16_t CTRL_SEALED = 0x0020;
+	constexpr uint16_t CTRL_IT_ENABLE = 0x0021;
+	constexpr uint16_t CTRL_CAL_ENABLE = 0x002D;
+	constexpr uint16_t CTRL_RESET = 0x0041;
+	constexpr uint16_t CTRL_EXIT_CAL = 0x0080;
+	constexpr uint16_t CTRL_ENTER_CAL = 0x0081;
+	constexpr uint16_t UNSEAL_KEY_1 = 0x0414;
+	constexpr uint16_t UNSEAL_KEY_2 = 0x3672;
+
+	// Control status bits
+	constexpr uint16_t STATUS_FAS = 1 << 14;
+	constexpr uint16_t STATUS_SS = 1 << 13;
+	constexpr uint16_t STATUS_CALEN = 1 << 12;
+	constexpr uint16_t STATUS_CCA = 1 << 11;
+	constexpr uint16_t STATUS_CSV = 1 << 9;
+	constexpr uint16_t STATUS_RUP_DIS = 1 << 2;
+	constexpr uint16_t STATUS_VOK = 1 << 1;
+	constexpr uint16_t STATUS_QEN = 1 << 0;
+
+	// Flags bits
+	constexpr uint16_t FLAG_FC = 1 << 9;
+	constexpr uint16_t FLAG_CHG = 1 << 8;
+	constexpr uint16_t FLAG_OCVTAKEN = 1 << 7;
+	constexpr uint16_t FLAG_SOC1 = 1 << 2;
+	constexpr uint16_t FLAG_SOCF = 1 << 1;
+	constexpr uint16_t FLAG_DSG = 1 << 0;
+
+	constexpr float DEFAULT_CC_GAIN = 0.4768f;
+	constexpr float DEFAULT_CC_DELTA = 567744.56f;
+	constexpr uint16_t DEFAULT_VOLTAGE_DIVIDER = 5000;
+
+	// Time the pack must be at rest before the gauge takes an OCV reading
+	constexpr double OCV_SETTLED_DVDT_PER_CELL = 4e-6; // V/s
+
+	// Per-cell open circuit voltage curve for a generic Li-ion cell
+	struct OCVPoint
+	{
+		double soc;
+		double voltage;
+	};
+	constexpr OCVPoint OCV_CURVE[] = {
+		{0.00, 2.75}, {0.03, 3.20}, {0.05, 3.35}, {0.10, 3.50}, {0.20, 3.62}, {0.30, 3.68}, {0.40, 3.73},
+		{0.50, 3.78}, {0.60, 3.85}, {0.70, 3.93}, {0.80, 4.00}, {0.90, 4.08}, {1.00, 4.20}
+	};
+
+	void putLE16(uint8_t * out, uint16_t value)
+	{
+		out[0] = value & 0xFF;
+		out[1] = value >> 8;
+	}
+
+	uint16_t clampU16(double value)
+	{
+		return static_cast<uint16_t>(std::clamp(std::lround(value), 0L, 65535L));
+	}
+
+	int16_t clampI16(double value)
+	{
+		return static_cast<int16_t>(std::clamp(std::lround(value), -32768L, 32767L));
+	}
+}
+
+SimulatedBQ34Z100::SimulatedBQ34Z100(SimPackConfig const & config):
+config(config),
+soc(config.initialSOC),
+controlStatus(STATUS_SS | STATUS_FAS | STATUS_CSV | STATUS_RUP_DIS)
+{
+	initDataFlash();
+	updateMeasurements();
+}
+
+void SimulatedBQ34Z100::initDataFlash()
+{
+	using namespace DataFlash;
+
+	writeFlash<int16_t>(DESIGN_CAPACITY, config.designCapacity_mAh);
+	writeFlash<int16_t>(DESIGN_ENERGY, config.designEnergy_mWh);
+	writeFlash(CELL_COUNT, config.cellCount);
+	writeFlash<int16_t>(CELL_TERMINATE_VOLTAGE, config.terminateVoltage_mV);
+	writeFlash<int16_t>(QMAX0, config.designCapacity_mAh);
+	updateStatus() = 0x00;
+	writeFlash(CC_GAIN, DEFAULT_CC_GAIN);
+	writeFlash(CC_DELTA, DEFAULT_CC_DELTA);
+	writeFlash(VOLTAGE_DIVIDER, DEFAULT_VOLTAGE_DIVIDER);
+}
+
+double SimulatedBQ34Z100::ocvPerCell(double stateOfCharge) const
+{
+	stateOfCharge = std::clamp(stateOfCharge, 0.0, 1.0);
+	for(size_t i = 1; i < std::size(OCV_CURVE); i++)
+	{
+		if(stateOfCharge <= OCV_CURVE[i].soc)
+		{
+			OCVPoint const & low = OCV_CURVE[i - 1];
+			OCVPoint const & high = OCV_CURVE[i];
+			return low.voltage + (high.voltage - low.voltage) * (stateOfCharge - low.soc) / (high.soc - low.soc);
+		}
+	}
+	return OCV_CURVE[std::size(OCV_CURVE) - 1].voltage;
+}
+
+double SimulatedBQ34Z100::getTrueVoltage_mV() const
+{
+	double const cellVoltage = ocvPerCell(soc) + polarization_V + current_A * config.seriesResistance_ohm;
+	return cellVoltage * config.cellCount * 1000;
+}
+
+void SimulatedBQ34Z100::setLoad(bool connected)
+{
+	loadConnected = connected;
+	restStart = SimClock::now();
+	belowTerminateSince = -1us;
+}
+
+void SimulatedBQ34Z100::stepBattery(std::chrono::microseconds now, double dt_s)
+{
+	double const capacity_Ah = config.designCapacity_mAh / 1000.0;
+
+	// Charger: enabled by the control pin, restarts after the pin is toggled
+	bool chargerEnabled = false;
+	if(config.chargerEnablePin != NC)
+	{
+		int const enableLevel = SimPins::read(config.chargerEnablePin);
+		if(enableLevel != lastChargerEnable)
+		{
+			lastChargerEnable = enableLevel;
+			chargerTerminated = false;
+		}
+		chargerEnabled = enableLevel == config.chargerEnableLevel && !chargerTerminated;
+	}
+
+	double newCurrent_A = 0;
+	if(chargerEnabled)
+	{
+		double const maxCurrent_A = config.chargeCurrentC * capacity_Ah;
+		double const headroom_V = config.chargeVoltage_mV / 1000.0 - ocvPerCell(soc) - polarization_V;
+		newCurrent_A = std::clamp(headroom_V / config.seriesResistance_ohm, 0.0, maxCurrent_A);
+		if(newCurrent_A < config.chargeTerminationC * capacity_Ah)
+		{
+			chargerTerminated = true;
+			newCurrent_A = 0;
+		}
+	}
+	if(charging && !(chargerEnabled && !chargerTerminated))
+	{
+		// charge finished or was stopped, start counting rest time
+		restStart = now;
+		restedAfterCharge = true;
+	}
+	charging = chargerEnabled && !chargerTerminated;
+
+	if(!charging && loadConnected)
+	{
+		newCurrent_A = -config.loadCurrentC * capacity_Ah;
+	}
+	current_A = newCurrent_A;
+
+	// Integrate charge and the polarization RC
+	soc = std::clamp(soc + current_A * dt_s / 3600.0 / capacity_Ah, 0.0, 1.0);
+	double const targetPolarization = current_A * config.polarizationResistance_ohm;
+	polarization_V += (targetPolarization - polarization_V) * (1 - std::exp(-dt_s / config.polarizationTimeConstant_s));
+
+	// Simulated operator
+	if(config.autoLoad && !charging)
+	{
+		if(!loadConnected && restedAfterCharge && now - restStart >= config.restBeforeLoad)
+		{
+			loadConnected = true;
+			restedAfterCharge = false;
+			belowTerminateSince = -1us;
+		}
+		else if(loadConnected)
+		{
+			// the operator goes by the voltage the gauge reports, like the person watching the log would
+			if(measuredVoltage_mV < config.terminateVoltage_mV * config.cellCount || soc <= 0)
+			{
+				if(belowTerminateSince < 0us)
+				{
+					belowTerminateSince = now;
+				}
+				if(now - belowTerminateSince >= config.operatorReactionTime || soc <= 0)
+				{
+					loadConnected = false;
+					restStart = now;
+				}
+			}
+		}
+	}
+	if(loadConnected && soc <= 0)
+	{
+		// pack protection cuts off the load
+		loadConnected = false;
+		restStart = now;
+	}
+}
+
+void SimulatedBQ34Z100::onTick(std::chrono::microseconds now, std::chrono::microseconds dt)
+{
+	double const previousVoltage = getTrueVoltage_mV();
+	stepBattery(now, std::chrono::duration<double>(dt).count());
+
+	// OCV measurement once the pack has settled
+	double const dt_s = std::chrono::duration<double>(dt).count();
+	double const dVdt_perCell = std::fabs(getTrueVoltage_mV() - previousVoltage) / 1000 / config.cellCount / dt_s;
+	bool const relaxed = std::fabs(current_A) < config.designCapacity_mAh / 1000.0 / 100 && dVdt_perCell < OCV_SETTLED_DVDT_PER_CELL;
+	if(std::fabs(current_A) > 0)
+	{
+		ocvTaken = false;
+		controlStatus |= STATUS_VOK;
+	}
+	else if(relaxed && !ocvTaken)
+	{
+		ocvTaken = true;
+		controlStatus &= ~STATUS_VOK;
+
+		// Impedance Track learning: Qmax is updated from two OCV readings far enough apart
+		if((controlStatus & STATUS_QEN) && updateStatus() == 0x04 && socAtLastOCV >= 0 && std::fabs(soc - socAtLastOCV) > 0.37)
+		{
+			updateStatus() = 0x05;
+			socAtQmaxUpdate = soc;
+		}
+		socAtLastOCV = soc;
+	}
+
+	// ...and Ra is updated during the next discharge
+	if(updateStatus() == 0x05 && current_A < 0 && socAtQmaxUpdate - soc > 0.1)
+	{
+		updateStatus() = 0x06;
+		controlStatus &= ~STATUS_RUP_DIS;
+	}
+
+	// Charger status output
+	if(config.chargeStatusPin != NC)
+	{
+		SimPins::write(config.chargeStatusPin, charging ? config.chargeStatusCharging : config.chargeStatusNotCharging);
+	}
+
+	updateIfDue(now);
+}
+
+std::chrono::microseconds SimulatedBQ34Z100::getDeadline() const
+{
+	return lastUpdate + config.updatePeriod;
+}
+
+void SimulatedBQ34Z100::onDeadline(std::chrono::microseconds now)
+{
+	// the tick that reached the deadline has normally done the update already
+	updateIfDue(now);
+}
+
+void SimulatedBQ34Z100::updateIfDue(std::chrono::microseconds now)
+{
+	// The gauge refreshes its measurements about once per second, on its own schedule
+	if(now - lastUpdate >= config.updatePeriod)
+	{
+		lastUpdate += (now - lastUpdate) / config.updatePeriod * config.updatePeriod;
+		updateMeasurements();
+		if(config.updatePin != NC)
+		{
+			SimPins::write(config.updatePin, !SimPins::read(config.updatePin));
+		}
+	}
+}
+
+void SimulatedBQ34Z100::updateMeasurements()
+{
+	++updateCount;
+
+	double const dividerRatio = readFlash(DataFlash::VOLTAGE_DIVIDER) / static_cast<double>(DEFAULT_VOLTAGE_DIVIDER);
+	double const ccGain = readFlash(DataFlash::CC_GAIN);
+	measuredVoltage_mV = getTrueVoltage_mV() * config.voltageGainError * dividerRatio;
+	double const measuredCurrent_mA = current_A * 1000 * config.currentGainError * DEFAULT_CC_GAIN / ccGain;
+
+	uint16_t const fullCharge_mAh = readFlash(DataFlash::QMAX0);
+	uint8_t const socPercent = static_cast<uint8_t>(std::lround(soc * 100));
+
+	uint16_t flags = 0;
+	if(socPercent >= 100)
+	{
+		flags |= FLAG_FC;
+	}
+	if(charging)
+	{
+		flags |= FLAG_CHG;
+	}
+	if(ocvTaken)
+	{
+		flags |= FLAG_OCVTAKEN;
+	}
+	if(socPercent <= 10)
+	{
+		flags |= FLAG_SOC1;
+	}
+	if(socPercent <= 2)
+	{
+		flags |= FLAG_SOCF;
+	}
+	if(current_A < 0)
+	{
+		flags |= FLAG_DSG;
+	}
+
+	registers[REG_SOC] = socPercent;
+	registers[REG_MAX_ERROR] = updateStatus() >= 0x06 ? 1 : 100;
+	putLE16(&registers[REG_REMAINING], clampU16(soc * fullCharge_mAh));
+	putLE16(&registers[REG_FULL_CHARGE], fullCharge_mAh);
+	putLE16(&registers[REG_VOLTAGE], clampU16(measuredVoltage_mV));
+
+	// This gauge setup reports current as a magnitude, which is what ChemIDMeasurer was written against
+	putLE16(&registers[REG_AVERAGE_CURRENT], static_cast<uint16_t>(clampI16(std::fabs(measuredCurrent_mA))));
+	putLE16(&registers[REG_CURRENT], static_cast<uint16_t>(clampI16(std::fabs(measuredCurrent_mA))));
+
+	putLE16(&registers[REG_TEMPERATURE], clampU16((config.temperature_C + 273.15) * 10));
+	putLE16(&registers[REG_FLAGS], flags);
+	putLE16(&registers[REG_FLAGS_B], 0);
+	putLE16(&registers[REG_SERIAL_NUMBER], 0x1234);
+	putLE16(&registers[REG_INTERNAL_TEMPERATURE], clampU16((config.temperature_C + 273.15) * 10));
+	putLE16(&registers[REG_CYCLE_COUNT], 0);
+	registers[REG_STATE_OF_HEALTH] = 100;
+	putLE16(&registers[REG_DESIGN_CAPACITY], config.designCapacity_mAh);
+}
+
+void SimulatedBQ34Z100::onStart()
+{
+	firstByteOfWrite = true;
+}
+
+bool SimulatedBQ34Z100::write(uint8_t const * data, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		if(firstByteOfWrite)
+		{
+			registerPointer = data[i];
+			firstByteOfWrite = false;
+		}
+		else
+		{
+			registerWritten(registerPointer, data[i]);
+			++registerPointer;
+		}
+	}
+	return true;
+}
+
+bool SimulatedBQ34Z100::read(uint8_t * data, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		if(registerPointer == REG_CONTROL || registerPointer == REG_CONTROL + 1)
+		{
+			uint8_t resultBytes[2];
+			putLE16(resultBytes, controlResult);
+			data[i] = resultBytes[registerPointer - REG_CONTROL];
+		}
+		else if(registerPointer == REG_BLOCK_DATA_CHECKSUM)
+		{
+			data[i] = blockChecksum();
+		}
+		else
+		{
+			data[i] = registers[registerPointer];
+		}
+		++registerPointer;
+	}
+	return true;
+}
+
+void SimulatedBQ34Z100::registerWritten(uint8_t address, uint8_t value)
+{
+	if(address >= REG_BLOCK_DATA && address < REG_BLOCK_DATA_CHECKSUM)
+	{
+		registers[address] = value;
+		return;
+	}
+
+	switch(address)
+	{
+		case REG_CONTROL:
+			registers[REG_CONTROL] = value;
+			break;
+
+		case REG_CONTROL + 1:
+			registers[REG_CONTROL + 1] = value;
+			executeControl(static_cast<uint16_t>(registers[REG_CONTROL] | (value << 8)));
+			break;
+
+		case REG_BLOCK_DATA_CONTROL:
+			blockDataControl = value == 0x00;
+			break;
+
+		case REG_DATA_FLASH_CLASS:
+			flashClass = value;
+			flashBlock = 0;
+			loadFlashBlock();
+			break;
+
+		case REG_DATA_FLASH_BLOCK:
+			flashBlock = value;
+			loadFlashBlock();
+			break;
+
+		case REG_BLOCK_DATA_CHECKSUM:
+			// Commit the block if the checksum matches and the gauge is unsealed
+			if(blockDataControl && !sealed && value == blockChecksum() && flashBlock < 8)
+			{
+				std::copy_n(&registers[REG_BLOCK_DATA], 32, dataFlash[flashClass].begin() + flashBlock * 32);
+			}
+			break;
+
+		default:
+			// read-only register
+			break;
+	}
+}
+
+void SimulatedBQ34Z100::executeControl(uint16_t subcommand)
+{
+	// Unseal key sequence
+	if(lastUnsealKey == UNSEAL_KEY_1 && subcommand == UNSEAL_KEY_2)
+	{
+		sealed = false;
+		controlStatus &= ~STATUS_SS;
+	}
+	else if(lastUnsealKey == 0xFFFF && subcommand == 0xFFFF && !sealed)
+	{
+		controlStatus &= ~STATUS_FAS;
+	}
+	lastUnsealKey = subcommand;
+
+	switch(subcommand)
+	{
+		case CTRL_CONTROL_STATUS:
+			controlResult = controlStatus;
+			break;
+		case CTRL_DEVICE_TYPE:
+			controlResult = 0x0100;
+			break;
+		case CTRL_FW_VERSION:
+			controlResult = 0x0017;
+			break;
+		case CTRL_HW_VERSION:
+			controlResult = 0x0060;
+			break;
+		case CTRL_CHEM_ID:
+			controlResult = chemID;
+			break;
+		case CTRL_RESET_DATA:
+		case CTRL_BOARD_OFFSET:
+		case CTRL_CC_OFFSET:
+			controlResult = 0;
+			break;
+		case CTRL_SEALED:
+			sealed = true;
+			controlStatus |= STATUS_SS | STATUS_FAS;
+			break;
+		case CTRL_IT_ENABLE:
+			controlStatus |= STATUS_QEN;
+			updateStatus() |= 0x04;
+			break;
+		case CTRL_CAL_ENABLE:
+			controlStatus ^= STATUS_CALEN;
+			break;
+		case CTRL_ENTER_CAL:
+			controlStatus |= STATUS_CCA;
+			break;
+		case CTRL_EXIT_CAL:
+			controlStatus &= ~STATUS_CCA;
+			break;
+		case CTRL_RESET:
+			blockDataControl = false;
+			updateMeasurements();
+			break;
+		default:
+			break;
+	}
+}
+
+void SimulatedBQ34Z100::loadFlashBlock()
+{
+	if(flashBlock < 8)
+	{
+		std::copy_n(dataFlash[flashClass].begin() + flashBlock * 32, 32, &registers[REG_BLOCK_DATA]);
+	}
+}
+
+uint8_t SimulatedBQ34Z100::blockChecksum() const
+{
+	uint8_t sum = 0;
+	for(size_t i = 0; i < 32; i++)
+	{
+		sum += registers[REG_BLOCK_DATA + i];
+	}
+	return 255 - sum;
+}
+
+uint8_t * SimulatedBQ34Z100::getFlashSubclass(uint8_t subclass)
+{
+	return dataFlash[subclass].data();
+}
@@ -0,0 +1,177 @@
+//
+// Software model of a BQ34Z100-G1 fuel gauge and the pack, charger and load around it.
+// Good enough to run the utilities end to end on a host: it has the standard command registers,
+// control subcommands, block data flash access with checksums, a simple battery model, and
+// charger control/status pins.  Measurements refresh once per second of virtual time, like the real gauge.
+//
+
+#ifndef BQ34Z100G1_UTILS_HOST_SIMULATEDBQ34Z100_H
+#define BQ34Z100G1_UTILS_HOST_SIMULATEDBQ34Z100_H
+
+#include "DataFlashSchema.h"
+#include "SimBus.h"
+
+#include <array>
+#include <map>
+
+struct SimPackConfig
+{
+	uint16_t designCapacity_mAh = 2200;
+	uint16_t designEnergy_mWh = 7920;
+	uint8_t cellCount = 4;
+	uint16_t terminateVoltage_mV = 3000; // per cell
+
+	double initialSOC = 0.5;
+
+	// Resistances per cell
+	double seriesResistance_ohm = 0.02;
+	double polarizationResistance_ohm = 0.015;
+	double polarizationTimeConstant_s = 1800;
+
+	double temperature_C = 25.0;
+
+	// Time between measurement updates.  The real gauge runs off its own oscillator, so this is never exactly 1 s.
+	std::chrono::microseconds updatePeriod = std::chrono::seconds(1);
+
+	// Output toggled on every measurement update, for hardware that provides such a signal
+	PinName updatePin = NC;
+
+	// Calibration errors of the uncalibrated gauge, as gain multipliers on the true values
+	double voltageGainError = 1.02;
+	double currentGainError = 0.97;
+
+	// Charger
+	PinName chargerEnablePin = NC;
+	int chargerEnableLevel = 0;
+	PinName chargeStatusPin = NC;
+	int chargeStatusCharging = 0;
+	int chargeStatusNotCharging = 1;
+	double chargeVoltage_mV = 4200; // per cell
+	double chargeCurrentC = 0.5; // constant current phase, as a fraction of capacity
+	double chargeTerminationC = 0.05; // charger stops once CV current falls below this
+
+	// Simulated operator: connects a load once the pack has rested after a charge (or after power-up),
+	// and removes it again after the pack has been below terminateVoltage_mV for the reaction time.
+	bool autoLoad = true;
+	double loadCurrentC = 0.1;
+	std::chrono::seconds restBeforeLoad = 2h + 1min;
+	std::chrono::seconds operatorReactionTime = 30s;
+};
+
+/**
+ * Simulated gauge and the pack it measures.  The model advances on the clock's ticks; when the gauge has an
+ * update pin, it is also a clock event so that the pin toggles exactly on its own update schedule.
+ */
+class SimulatedBQ34Z100 : public SimI2CDevice, public SimClockListener, public SimClockEvent
+{
+public:
+	static constexpr int I2C_ADDRESS = 0xAA;
+
+	explicit SimulatedBQ34Z100(SimPackConfig const & config);
+
+	// SimI2CDevice
+	void onStart() override;
+	bool write(uint8_t const * data, size_t length) override;
+	bool read(uint8_t * data, size_t length) override;
+
+	// SimClockListener
+	void onTick(std::chrono::microseconds now, std::chrono::microseconds dt) override;
+
+	// SimClockEvent: the next measurement update
+	std::chrono::microseconds getDeadline() const override;
+	void onDeadline(std::chrono::microseconds now) override;
+
+	// Model state, for tests and tools
+	double getTrueSOC() const { return soc; }
+	double getTrueCurrent_mA() const { return current_A * 1000; }
+	double getTrueVoltage_mV() const;
+	bool isLoadConnected() const { return loadConnected; }
+	bool isCharging() const { return charging; }
+
+	// Manually connect or disconnect the load (overrides the simulated operator until the next event)
+	void setLoad(bool connected);
+
+	// Direct access to a data flash subclass, for tests
+	uint8_t * getFlashSubclass(uint8_t subclass);
+
+	// Number of gauge measurement updates so far
+	uint32_t getUpdateCount() const { return updateCount; }
+
+private:
+	SimPackConfig config;
+
+	// --- battery model ---
+	double soc;
+	double polarization_V = 0;
+	double current_A = 0; // positive = charging
+	bool charging = false;
+	bool chargerTerminated = false;
+	int lastChargerEnable = -1;
+	bool loadConnected = false;
+	std::chrono::microseconds restStart{0};
+	std::chrono::microseconds belowTerminateSince{-1};
+	bool restedAfterCharge = true;
+
+	double ocvPerCell(double stateOfCharge) const;
+	void stepBattery(std::chrono::microseconds now, double dt_s);
+
+	// --- gauge ---
+	std::array<uint8_t, 256> registers{};
+	uint8_t registerPointer = 0;
+	bool firstByteOfWrite = false;
+	std::chrono::microseconds lastUpdate{0};
+	uint32_t updateCount = 0;
+	double measuredVoltage_mV = 0;
+
+	uint16_t controlStatus;
+	uint16_t controlResult = 0;
+	uint16_t lastUnsealKey = 0;
+	bool sealed = true;
+	bool ocvTaken = false;
+	double socAtLastOCV = -1;
+	double socAtQmaxUpdate = 0;
+	uint16_t chemID = 0x0100;
+
+	void updateIfDue(std::chrono::microseconds now);
+	void updateMeasurements();
+	void executeControl(uint16_t subcommand);
+	void registerWritten(uint8_t address, uint8_t value);
+
+	// --- data flash ---
+	std::map<uint8_t, std::array<uint8_t, 256>> dataFlash;
+	bool blockDataControl = false;
+	uint8_t flashClass = 0;
+	uint8_t flashBlock = 0;
+
+	void initDataFlash();
+	void loadFlashBlock();
+	uint8_t blockChecksum() const;
+
+	// Data flash values are big endian
+	template<typename T>
+	T readFlash(DataFlash::Field<T> const & field)
+	{
+		auto & flash = dataFlash[field.subclass];
+		uint32_t raw = 0;
+		for(uint8_t i = 0; i < field.WIDTH; i++)
+		{
+			raw = (raw << 8) | flash[field.offset + i];
+		}
+		return field.fromRaw(raw);
+	}
+
+	template<typename T>
+	void writeFlash(DataFlash::Field<T> const & field, T value)
+	{
+		auto & flash = dataFlash[field.subclass];
+		uint32_t const raw = field.toRaw(value);
+		for(uint8_t i = 0; i < field.WIDTH; i++)
+		{
+			flash[field.offset + i] = (raw >> (8 * (field.WIDTH - i - 1))) & 0xFF;
+		}
+	}
+
+	uint8_t & updateStatus() { return dataFlash[DataFlash::UPDATE_STATUS.subclass][DataFlash::UPDATE_STATUS.offset]; }
+};
+
+#endif //BQ34Z100G1_UTILS_HOST_SIMULATEDBQ34Z100_H
@@ -0,0 +1,814 @@
+//
+// Drives soc-test through its machine protocol, for fixture software.  A sequence of commands is sent
+// with several requests in flight at once, and every response is printed as one line of key=value pairs.
+//
+// Usage: soc-test-client (--device <serial port> | --sim <path to host soc-test>) [options] [command [args]] [; command ...]
+//
+// Options:
+//   --script <file>    read commands from a file, one per line (# starts a comment)
+//   --window <n>       requests in flight at once (4).  The target's receive buffer limits how far this helps.
+//   --timeout <ms>     how long to wait for a response or progress frame (5000)
+//   --no-progress      don't print progress frames from discharge, charge and relax
+//
+// Commands:
+//   ping, reset, status, telemetry, identity, write-settings,
+//   calibrate-voltage <pack mV>, calibrate-current <mA>, enable-cal, disable-cal, enable-it, reset-divider,
+//   auto-calibrate-voltage, auto-calibrate-current (against the reference meter; fail unless they converge),
+//   discharge [end mV] [period s], charge [period s], relax <longest rest s>,
+//   read-block <subclass> <index>, write-block <subclass> <index> <64 hex digits>,
+//   export-image <file>, import-image <file> [with-calibration], exit
+// The first command that fails stops the sequence, and the exit code is then 1.
+//
+
+#include "FlashImage.h"
+#include "MachineProtocol.h"
+#include "SocTestClient.h"
+
+#include <algorithm>
+#include <cinttypes>
+#include <csignal>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+using MachineProtocol::Command;
+using MachineProtocol::Status;
+
+namespace
+{
+	// One step of the sequence: either a request, or something done on the host once every earlier response is in
+	struct Step
+	{
+		bool isRequest = true;
+		Command command = Command::PING;
+		std::vector<uint8_t> arguments;
+
+		// Extra time this command may go without a response or progress frame
+		std::chrono::milliseconds extraTimeout{0};
+
+		// Handles the response, or runs the host action.  Returning false stops the sequence.
+		std::function<bool(SocTestClient::Response const &)> onResponse;
+		std::function<bool()> action;
+	};
+
+	// Print the response in the standard format, then any result fields
+	void printResponse(SocTestClient::Response const & response, char const * fields = "")
+	{
+		char const * name = MachineProtocol::commandName(response.command);
+		printf("%s %s%s%s\n", name != nullptr ? name : "UNKNOWN", MachineProtocol::statusName(response.status),
+			fields[0] != '\0' ? " " : "", fields);
+	}
+
+	// Response handler for results of type Result, formatted by format
+	template<typename Result>
+	std::function<bool(SocTestClient::Response const &)> resultPrinter(std::function<std::string(Result const &)> format)
+	{
+		return [format](SocTestClient::Response const & response) {
+			if(response.status != Status::OK)
+			{
+				printResponse(response);
+				return false;
+			}
+			MachineProtocol::PayloadReader reader = response.reader();
+			Result result;
+			decode(reader, result);
+			if(!reader.complete())
+			{
+				printResponse(response, "malformed_result=1");
+				return false;
+			}
+			printResponse(response, format(result).c_str());
+			return true;
+		};
+	}
+
+	// Response handler for commands without results
+	bool printStatusOnly(SocTestClient::Response const & response)
+	{
+		printResponse(response);
+		return response.status == Status::OK;
+	}
+
+	std::string format(char const * formatString, ...) __attribute__((format(printf, 1, 2)));
+	std::string format(char const * formatString, ...)
+	{
+		char buffer[512];
+		va_list args;
+		va_start(args, formatString);
+		vsnprintf(buffer, sizeof(buffer), formatString, args);
+		va_end(args);
+		return buffer;
+	}
+
+	std::string formatDevice(MachineProtocol::DeviceInfo const & device)
+	{
+		return format("device_type=0x%04" PRIx16 " fw_version=0x%04" PRIx16 " hw_version=0x%04" PRIx16,
+			device.deviceType, device.firmwareVersion, device.hardwareVersion);
+	}
+
+	std::string formatCycle(MachineProtocol::CycleResult const & result)
+	{
+		return format("samples=%" PRIu32 " dropped=%" PRIu32 " duration_s=%" PRIu32 " voltage_mV=%" PRIu16 " current_mA=%" PRIi16,
+			result.sampleCount, result.droppedCount, result.duration_s, result.finalVoltage_mV, result.finalCurrent_mA);
+	}
+
+	Step request(Command command, std::function<bool(SocTestClient::Response const &)> onResponse, std::vector<uint8_t> arguments = {})
+	{
+		Step step;
+		step.command = command;
+		step.arguments = std::move(arguments);
+		step.onResponse = std::move(onResponse);
+		return step;
+	}
+
+	Step hostAction(std::function<bool()> action)
+	{
+		Step step;
+		step.isRequest = false;
+		step.action = std::move(action);
+		return step;
+	}
+
+	// Little endian argument packing
+	void putU16(std::vector<uint8_t> & arguments, uint16_t value)
+	{
+		arguments.push_back(value & 0xFF);
+		arguments.push_back(value >> 8);
+	}
+
+	void putU32(std::vector<uint8_t> & arguments, uint32_t value)
+	{
+		putU16(arguments, value & 0xFFFF);
+		putU16(arguments, value >> 16);
+	}
+
+	bool parseNumber(char const * text, long minimum, long maximum, long & value)
+	{
+		char * end;
+		value = strtol(text, &end, 0);
+		return *text != '\0' && *end == '\0' && value >= minimum && value <= maximum;
+	}
+
+	bool parseHexBlock(char const * text, uint8_t * block)
+	{
+		if(strlen(text) != 2 * FlashImage::BLOCK_SIZE)
+		{
+			return false;
+		}
+		for(size_t index = 0; index < FlashImage::BLOCK_SIZE; index++)
+		{
+			char digits[3] = {text[2 * index], text[2 * index + 1], '\0'};
+			char * end;
+			block[index] = static_cast<uint8_t>(strtoul(digits, &end, 16));
+			if(*end != '\0')
+			{
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// Shared between the steps of one export-image or import-image command
+	struct ImageTransfer
+	{
+		std::string path;
+		FlashImage::Header header{};
+		std::vector<FlashImage::Block> blocks;
+		unsigned int blocksWritten = 0;
+		unsigned int blocksUnchanged = 0;
+		unsigned int blocksSkipped = 0;
+	};
+
+	class FileSink : public ByteSink
+	{
+	public:
+		explicit FileSink(FILE * file): file(file) {}
+
+		void write(uint8_t const * data, size_t length) override
+		{
+			fwrite(data, 1, length, file);
+		}
+
+	private:
+		FILE * file;
+	};
+
+	class ImageLoader : public FlashImage::Listener
+	{
+	public:
+		explicit ImageLoader(ImageTransfer & transfer): transfer(transfer) {}
+
+		bool complete = false;
+
+		bool onHeader(FlashImage::Header const & header) override
+		{
+			transfer.header = header;
+			return true;
+		}
+
+		bool onBlock(FlashImage::Block const & block) override
+		{
+			transfer.blocks.push_back(block);
+			return true;
+		}
+
+		void onEnd() override
+		{
+			complete = true;
+		}
+
+		void onError(char const * message) override
+		{
+			fprintf(stderr, "%s: %s\n", transfer.path.c_str(), message);
+		}
+
+	private:
+		ImageTransfer & transfer;
+	};
+
+	void addExportImage(std::vector<Step> & steps, char const * path)
+	{
+		auto const transfer = std::make_shared<ImageTransfer>();
+		transfer->path = path;
+
+		steps.push_back(request(Command::READ_IDENTITY, [transfer](SocTestClient::Response const & response) {
+			MachineProtocol::PayloadReader reader = response.reader();
+			MachineProtocol::Identity identity;
+			decode(reader, identity);
+			if(response.status != Status::OK || !reader.complete())
+			{
+				printResponse(response);
+				return false;
+			}
+			transfer->header.deviceType = identity.device.deviceType;
+			transfer->header.firmwareVersion = identity.device.firmwareVersion;
+			return true;
+		}));
+
+		for(size_t subclassIndex = 0; subclassIndex < FlashImage::SUBCLASS_COUNT; subclassIndex++)
+		{
+			FlashImage::SubclassInfo const & subclass = FlashImage::SUBCLASSES[subclassIndex];
+			for(uint8_t index = 0; index < subclass.blockCount; index++)
+			{
+				steps.push_back(request(Command::READ_FLASH_BLOCK, [transfer, subclass, index](SocTestClient::Response const & response) {
+					if(response.status != Status::OK || response.resultLength != FlashImage::BLOCK_SIZE)
+					{
+						printResponse(response, format("subclass=%" PRIu8 " index=%" PRIu8, subclass.subclass, index).c_str());
+						return false;
+					}
+					FlashImage::Block block;
+					block.subclass = subclass.subclass;
+					block.index = index;
+					memcpy(block.data, response.result, FlashImage::BLOCK_SIZE);
+					transfer->blocks.push_back(block);
+					return true;
+				}, {subclass.subclass, index}));
+			}
+		}
+
+		steps.push_back(hostAction([transfer]() {
+			FILE * file = fopen(transfer->path.c_str(), "wb");
+			if(file == nullptr)
+			{
+				fprintf(stderr, "Can't write %s\n", transfer->path.c_str());
+				return false;
+			}
+			transfer->header.blockCount = transfer->blocks.size();
+			FileSink sink(file);
+			FlashImage::Writer writer(sink);
+			writer.writeHeader(transfer->header);
+			for(FlashImage::Block const & block : transfer->blocks)
+			{
+				writer.writeBlock(block);
+			}
+			writer.writeEnd();
+			fclose(file);
+			printf("EXPORT_IMAGE OK blocks=%zu file=%s\n", transfer->blocks.size(), transfer->path.c_str());
+			return true;
+		}));
+	}
+
+	bool addImportImage(std::vector<Step> & steps, char const * path, bool includeCalibration)
+	{
+		auto const transfer = std::make_shared<ImageTransfer>();
+		transfer->path = path;
+
+		// The whole image is checked before anything is sent
+		FILE * file = fopen(path, "rb");
+		if(file == nullptr)
+		{
+			fprintf(stderr, "Can't open %s\n", path);
+			return false;
+		}
+		ImageLoader loader(*transfer);
+		FlashImage::Parser parser(loader);
+		uint8_t buffer[4096];
+		size_t bytesRead;
+		while(!parser.isFinished() && (bytesRead = fread(buffer, 1, sizeof(buffer), file)) > 0)
+		{
+			parser.feed(buffer, bytesRead);
+		}
+		fclose(file);
+		if(!loader.complete)
+		{
+			fprintf(stderr, "%s is not a complete data flash image\n", path);
+			return false;
+		}
+
+		steps.push_back(request(Command::READ_IDENTITY, [transfer](SocTestClient::Response const & response) {
+			MachineProtocol::PayloadReader reader = response.reader();
+			MachineProtocol::Identity identity;
+			decode(reader, identity);
+			if(response.status != Status::OK || !reader.complete())
+			{
+				printResponse(response);
+				return false;
+			}
+			if(identity.device.deviceType != transfer->header.deviceType)
+			{
+				printf("IMPORT_IMAGE WRONG_DEVICE image_device_type=0x%04" PRIx16 " device_type=0x%04" PRIx16 "\n",
+					transfer->header.deviceType, identity.device.deviceType);
+				return false;
+			}
+			if(identity.device.firmwareVersion != transfer->header.firmwareVersion)
+			{
+				fprintf(stderr, "Warning: image was taken from firmware version 0x%04" PRIx16 ", this gauge runs 0x%04" PRIx16 "\n",
+					transfer->header.firmwareVersion, identity.device.firmwareVersion);
+			}
+			return true;
+		}));
+
+		// Nothing is written until the device type has been checked
+		steps.push_back(hostAction([]() { return true; }));
+
+		for(FlashImage::Block const & block : transfer->blocks)
+		{
+			if(FlashImage::isCalibration(block.subclass) && !includeCalibration)
+			{
+				++transfer->blocksSkipped;
+				continue;
+			}
+			std::vector<uint8_t> arguments = {block.subclass, block.index};
+			arguments.insert(arguments.end(), block.data, block.data + FlashImage::BLOCK_SIZE);
+			steps.push_back(request(Command::WRITE_FLASH_BLOCK, [transfer, block](SocTestClient::Response const & response) {
+				if(response.status != Status::OK || response.resultLength != 1)
+				{
+					printResponse(response, format("subclass=%" PRIu8 " index=%" PRIu8, block.subclass, block.index).c_str());
+					return false;
+				}
+				++(response.result[0] ? transfer->blocksWritten : transfer->blocksUnchanged);
+				return true;
+			}, arguments));
+		}
+
+		steps.push_back(hostAction([transfer]() {
+			printf("IMPORT_IMAGE OK written=%u unchanged=%u calibration_skipped=%u\n", transfer->blocksWritten, transfer->blocksUnchanged,
+				transfer->blocksSkipped);
+			return true;
+		}));
+		return true;
+	}
+
+	/**
+	 * Turn one command and its arguments into steps.
+	 * @return false, after printing the problem, if the command is invalid
+	 */
+	bool addCommand(std::vector<Step> & steps, std::vector<std::string> const & words)
+	{
+		std::string const & name = words[0];
+		size_t const argCount = words.size() - 1;
+		auto arg = [&](size_t index) { return words[index + 1].c_str(); };
+		long value;
+		long value2;
+
+		if(name == "ping" && argCount == 0)
+		{
+			steps.push_back(request(Command::PING, [](SocTestClient::Response const & response) {
+				if(response.status != Status::OK || response.resultLength != 1)
+				{
+					printResponse(response);
+					return false;
+				}
+				printResponse(response, format("protocol_version=%" PRIu8, response.result[0]).c_str());
+				return true;
+			}));
+		}
+		else if(name == "reset" && argCount == 0)
+		{
+			steps.push_back(request(Command::RESET, resultPrinter<MachineProtocol::DeviceInfo>(formatDevice)));
+		}
+		else if(name == "status" && argCount == 0)
+		{
+			steps.push_back(request(Command::READ_STATUS, resultPrinter<MachineProtocol::StatusRegisters>(
+				[](MachineProtocol::StatusRegisters const & registers) {
+					return format("control_status=0x%04" PRIx16 " flags=0x%04" PRIx16 " flags_b=0x%04" PRIx16 " update_status=0x%02" PRIx8,
+						registers.controlStatus, registers.flags, registers.flagsB, registers.updateStatus);
+				})));
+		}
+		else if(name == "telemetry" && argCount == 0)
+		{
+			steps.push_back(request(Command::READ_TELEMETRY, resultPrinter<MachineProtocol::Telemetry>(
+				[](MachineProtocol::Telemetry const & telemetry) {
+					return format("soc_percent=%" PRIu8 " max_error_percent=%" PRIu8 " remaining_mAh=%" PRIu16 " full_charge_mAh=%" PRIu16
+						" voltage_mV=%" PRIu16 " average_current_mA=%" PRIi16 " temperature_dK=%" PRIu16 " flags=0x%04" PRIx16
+						" current_mA=%" PRIi16 " flags_b=0x%04" PRIx16,
+						telemetry.soc_percent, telemetry.maxError_percent, telemetry.remaining_mAh, telemetry.fullCharge_mAh,
+						telemetry.voltage_mV, telemetry.averageCurrent_mA, telemetry.temperature_dK, telemetry.flags,
+						telemetry.current_mA, telemetry.flagsB);
+				})));
+		}
+		else if(name == "identity" && argCount == 0)
+		{
+			steps.push_back(request(Command::READ_IDENTITY, resultPrinter<MachineProtocol::Identity>(
+				[](MachineProtocol::Identity const & identity) {
+					return formatDevice(identity.device) + format(" serial=%" PRIi32 " chem_id=0x%04" PRIx16, identity.serialNumber, identity.chemID);
+				})));
+		}
+		else if(name == "write-settings" && argCount == 0)
+		{
+			steps.push_back(request(Command::WRITE_SETTINGS, resultPrinter<MachineProtocol::SettingsResult>(
+				[](MachineProtocol::SettingsResult const & result) {
+					return format("written=%" PRIu8 " unchanged=%" PRIu8 " failed=%" PRIu8 " update_status=0x%02" PRIx8,
+						result.blocksWritten, result.blocksUnchanged, result.blocksFailed, result.updateStatus);
+				})));
+		}
+		else if(name == "calibrate-voltage" && argCount == 1 && parseNumber(arg(0), 1, UINT16_MAX, value))
+		{
+			std::vector<uint8_t> arguments;
+			putU16(arguments, value);
+			steps.push_back(request(Command::CALIBRATE_VOLTAGE, [](SocTestClient::Response const & response) {
+				if(response.status != Status::OK || response.resultLength != 2)
+				{
+					printResponse(response);
+					return false;
+				}
+				printResponse(response, format("voltage_divider=%u", response.result[0] | (response.result[1] << 8)).c_str());
+				return true;
+			}, arguments));
+		}
+		else if(name == "calibrate-current" && argCount == 1 && parseNumber(arg(0), INT16_MIN, INT16_MAX, value) && value != 0)
+		{
+			std::vector<uint8_t> arguments;
+			putU16(arguments, static_cast<uint16_t>(value));
+			steps.push_back(request(Command::CALIBRATE_CURRENT, printStatusOnly, arguments));
+		}
+		else if(name == "enable-cal" && argCount == 0)
+		{
+			steps.push_back(request(Command::ENABLE_CALIBRATION, printStatusOnly));
+		}
+		else if(name == "disable-cal" && argCount == 0)
+		{
+			steps.push_back(request(Command::DISABLE_CALIBRATION, printStatusOnly));
+		}
+		else if(name == "enable-it" && argCount == 0)
+		{
+			steps.push_back(request(Command::ENABLE_IT, printStatusOnly));
+		}
+		else if(name == "reset-divider" && argCount == 0)
+		{
+			steps.push_back(request(Command::RESET_VOLTAGE_DIVIDER, printStatusOnly));
+		}
+		else if((name == "auto-calibrate-voltage" || name == "auto-calibrate-current") && argCount == 0)
+		{
+			Step step = request(name == "auto-calibrate-voltage" ? Command::AUTO_CALIBRATE_VOLTAGE : Command::AUTO_CALIBRATE_CURRENT,
+				[](SocTestClient::Response const & response) {
+					MachineProtocol::PayloadReader reader = response.reader();
+					MachineProtocol::CalibrationResult result;
+					decode(reader, result);
+					if(response.status != Status::OK || !reader.complete())
+					{
+						printResponse(response);
+						return false;
+					}
+					printResponse(response, format("converged=%" PRIu8 " corrections=%" PRIu8 " reference=%" PRIi32 " gauge=%" PRIi32
+						" residual=%" PRIi32 " outliers=%" PRIu8 " setting=0x%" PRIx32,
+						result.converged, result.corrections, result.reference, result.gauge, result.gauge - result.reference,
+						result.rejected, result.setting).c_str());
+					return result.converged != 0;
+				});
+
+			// measurements take about 10 s each, and current calibration first waits 10 s for the charger
+			step.extraTimeout = std::chrono::seconds(30);
+			steps.push_back(step);
+		}
+		else if(name == "discharge" && argCount <= 2
+			&& (argCount < 1 || parseNumber(arg(0), 0, UINT16_MAX, value))
+			&& (argCount < 2 || parseNumber(arg(1), 0, UINT16_MAX, value2)))
+		{
+			uint16_t const period_s = argCount >= 2 ? value2 : 0;
+			std::vector<uint8_t> arguments;
+			putU16(arguments, argCount >= 1 ? value : 0);
+			putU16(arguments, period_s);
+			Step step = request(Command::DISCHARGE, resultPrinter<MachineProtocol::CycleResult>(formatCycle), arguments);
+			step.extraTimeout = std::chrono::seconds(period_s == 0 ? 10 : period_s);
+			steps.push_back(step);
+		}
+		else if(name == "charge" && argCount <= 1 && (argCount < 1 || parseNumber(arg(0), 0, UINT16_MAX, value)))
+		{
+			uint16_t const period_s = argCount >= 1 ? value : 0;
+			std::vector<uint8_t> arguments;
+			putU16(arguments, period_s);
+			Step step = request(Command::CHARGE, resultPrinter<MachineProtocol::CycleResult>(formatCycle), arguments);
+
+			// the charger gets 10 s to start before the first sample
+			step.extraTimeout = std::chrono::seconds(10 + (period_s == 0 ? 10 : period_s));
+			steps.push_back(step);
+		}
+		else if(name == "relax" && argCount == 1 && parseNumber(arg(0), 1, INT32_MAX, value))
+		{
+			std::vector<uint8_t> arguments;
+			putU32(arguments, value);
+			Step step = request(Command::RELAX, resultPrinter<MachineProtocol::RelaxResult>(
+				[](MachineProtocol::RelaxResult const & result) {
+					return format("duration_s=%" PRIu32 " settled_early=%" PRIu8, result.duration_s, result.settledEarly);
+				}), arguments);
+
+			// progress comes every tenth of the longest rest
+			step.extraTimeout = std::chrono::seconds(value / 10 + 10);
+			steps.push_back(step);
+		}
+		else if(name == "read-block" && argCount == 2 && parseNumber(arg(0), 0, UINT8_MAX, value) && parseNumber(arg(1), 0, UINT8_MAX, value2))
+		{
+			steps.push_back(request(Command::READ_FLASH_BLOCK, [](SocTestClient::Response const & response) {
+				if(response.status != Status::OK)
+				{
+					printResponse(response);
+					return false;
+				}
+				std::string hex = "data=";
+				for(size_t index = 0; index < response.resultLength; index++)
+				{
+					hex += format("%02" PRIx8, response.result[index]);
+				}
+				printResponse(response, hex.c_str());
+				return true;
+			}, {static_cast<uint8_t>(value), static_cast<uint8_t>(value2)}));
+		}
+		else if(name == "write-block" && argCount == 3 && parseNumber(arg(0), 0, UINT8_MAX, value) && parseNumber(arg(1), 0, UINT8_MAX, value2))
+		{
+			uint8_t block[FlashImage::BLOCK_SIZE];
+			if(!parseHexBlock(arg(2), block))
+			{
+				fprintf(stderr, "write-block needs %zu bytes of data as hex digits\n", FlashImage::BLOCK_SIZE);
+				return false;
+			}
+			std::vector<uint8_t> arguments = {static_cast<uint8_t>(value), static_cast<uint8_t>(value2)};
+			arguments.insert(arguments.end(), block, block + sizeof(block));
+			steps.push_back(request(Command::WRITE_FLASH_BLOCK, [](SocTestClient::Response const & response) {
+				if(response.status != Status::OK || response.resultLength != 1)
+				{
+					printResponse(response);
+					return false;
+				}
+				printResponse(response, format("written=%" PRIu8, response.result[0]).c_str());
+				return true;
+			}, arguments));
+		}
+		else if(name == "export-image" && argCount == 1)
+		{
+			addExportImage(steps, arg(0));
+		}
+		else if(name == "import-image" && (argCount == 1 || (argCount == 2 && strcmp(arg(1), "with-calibration") == 0)))
+		{
+			return addImportImage(steps, arg(0), argCount == 2);
+		}
+		else if(name == "exit" && argCount == 0)
+		{
+			steps.push_back(request(Command::EXIT, printStatusOnly));
+		}
+		else
+		{
+			std::string line = name;
+			for(size_t index = 0; index < argCount; index++)
+			{
+				line += " " + words[index + 1];
+			}
+			fprintf(stderr, "Invalid command: %s\n", line.c_str());
+			return false;
+		}
+		return true;
+	}
+
+	// Split a script line into words, dropping comments
+	std::vector<std::string> splitWords(char const * line)
+	{
+		std::vector<std::string> words;
+		std::string word;
+		for(char const * c = line; *c != '\0' && *c != '#'; c++)
+		{
+			if(*c == ' ' || *c == '\t' || *c == '\r' || *c == '\n')
+			{
+				if(!word.empty())
+				{
+					words.push_back(word);
+					word.clear();
+				}
+			}
+			else
+			{
+				word += *c;
+			}
+		}
+		if(!word.empty())
+		{
+			words.push_back(word);
+		}
+		return words;
+	}
+
+	/**
+	 * Run the steps with up to window requests in flight.
+	 * @return true if every step succeeded
+	 */
+	bool runSteps(SocTestClient & client, std::vector<Step> & steps, size_t window, std::chrono::milliseconds timeout)
+	{
+		// Steps sent but not answered, in order
+		std::deque<std::pair<uint8_t, Step const *>> inFlight;
+		size_t nextStep = 0;
+		bool ok = true;
+
+		while(nextStep < steps.size() || !inFlight.empty())
+		{
+			Step const * const step = ok && nextStep < steps.size() ? &steps[nextStep] : nullptr;
+
+			// Keep the pipeline full.  Host actions wait for every earlier response.
+			if(step != nullptr && step->isRequest && inFlight.size() < window)
+			{
+				uint8_t const requestID = client.send(step->command, step->arguments.data(), step->arguments.size());
+				inFlight.emplace_back(requestID, step);
+				++nextStep;
+				continue;
+			}
+			if(step != nullptr && !step->isRequest && inFlight.empty())
+			{
+				ok = step->action();
+				++nextStep;
+				continue;
+			}
+			if(inFlight.empty())
+			{
+				// stopped after a failure
+				break;
+			}
+
+			// Long commands may be quiet for a while, so allow for the longest one in flight
+			std::chrono::milliseconds stepTimeout = timeout;
+			for(auto const & entry : inFlight)
+			{
+				stepTimeout = std::max(stepTimeout, timeout + entry.second->extraTimeout);
+			}
+
+			SocTestClient::Response response;
+			if(!client.receive(response, stepTimeout))
+			{
+				printf("%s TIMEOUT\n", MachineProtocol::commandName(inFlight.front().second->command));
+				return false;
+			}
+			if(response.requestID != inFlight.front().first)
+			{
+				fprintf(stderr, "Response to request %" PRIu8 " arrived out of order\n", response.requestID);
+				return false;
+			}
+			Step const * const answered = inFlight.front().second;
+			inFlight.pop_front();
+
+			// Responses to requests pipelined after a failure are still read, but not reported
+			if(ok)
+			{
+				ok = answered->onResponse(response);
+			}
+		}
+		return ok && nextStep == steps.size();
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	char const * devicePath = nullptr;
+	char const * simulatorPath = nullptr;
+	char const * scriptPath = nullptr;
+	size_t window = 4;
+	std::chrono::milliseconds timeout(5000);
+	bool showProgress = true;
+	std::vector<std::vector<std::string>> commands;
+
+	std::vector<std::string> words;
+	bool usageError = false;
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--device") == 0 && hasValue)
+		{
+			devicePath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--sim") == 0 && hasValue)
+		{
+			simulatorPath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--script") == 0 && hasValue)
+		{
+			scriptPath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--window") == 0 && hasValue)
+		{
+			window = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--timeout") == 0 && hasValue)
+		{
+			timeout = std::chrono::milliseconds(std::max(1, atoi(argv[++argIndex])));
+		}
+		else if(strcmp(arg, "--no-progress") == 0)
+		{
+			showProgress = false;
+		}
+		else if(strcmp(arg, ";") == 0)
+		{
+			if(!words.empty())
+			{
+				commands.push_back(words);
+				words.clear();
+			}
+		}
+		else if(arg[0] == '-' && arg[1] == '-')
+		{
+			usageError = true;
+			break;
+		}
+		else
+		{
+			words.push_back(arg);
+		}
+	}
+	if(!words.empty())
+	{
+		commands.push_back(words);
+	}
+
+	if(usageError || (devicePath == nullptr) == (simulatorPath == nullptr))
+	{
+		fprintf(stderr, "Usage: %s (--device <serial port> | --sim <soc-test>) [--script <file>] [--window <n>] [--timeout <ms>] [--no-progress] "
+			"[command [args]] [; command ...]\n", argv[0]);
+		return 1;
+	}
+
+	if(scriptPath != nullptr)
+	{
+		FILE * script = fopen(scriptPath, "r");
+		if(script == nullptr)
+		{
+			fprintf(stderr, "Can't open %s\n", scriptPath);
+			return 1;
+		}
+		char line[512];
+		while(fgets(line, sizeof(line), script) != nullptr)
+		{
+			std::vector<std::string> lineWords = splitWords(line);
+			if(!lineWords.empty())
+			{
+				commands.push_back(lineWords);
+			}
+		}
+		fclose(script);
+	}
+
+	// Check the whole sequence before touching the target
+	std::vector<Step> steps;
+	for(std::vector<std::string> const & command : commands)
+	{
+		if(!addCommand(steps, command))
+		{
+			return 1;
+		}
+	}
+
+	// A simulator that exits early shouldn't kill the client
+	signal(SIGPIPE, SIG_IGN);
+
+	SocTestClient client;
+	if(devicePath != nullptr ? !client.openSerial(devicePath) : !client.startSimulator(simulatorPath))
+	{
+		return 1;
+	}
+	if(!client.enterMachineMode(std::chrono::milliseconds(std::max<int64_t>(timeout.count(), 3000))))
+	{
+		fprintf(stderr, "soc-test did not enter machine mode\n");
+		return 1;
+	}
+
+	if(showProgress)
+	{
+		client.setProgressHandler([](uint8_t, Command command, MachineProtocol::Progress const & progress) {
+			printf("%s PROGRESS elapsed_ms=%" PRIu32 " voltage_mV=%" PRIu16 " current_mA=%" PRIi16 "\n",
+				MachineProtocol::commandName(command), progress.elapsed_ms, progress.voltage_mV, progress.current_mA);
+		});
+	}
+
+	return runSteps(client, steps, window, timeout) ? 0 : 1;
+}
@@ -0,0 +1,125 @@
+//
+// Takes the records out of a telemetry log dump (soc-test's "Dump Telemetry Log"), checks their sequence
+// numbers, and writes their payloads out back to back.  The payloads are chem ID log frames, so the output
+// can go straight into chemid-log-decode:
+//
+//   telemetry-log-extract capture.bin | chemid-log-decode --split run
+//
+// Usage: telemetry-log-extract [input file] [output file]
+// Input and output default to stdin and stdout.  Console text around the dump is skipped.
+// The range of sequence numbers and any gaps in it go to stderr, along with the sequence number to ask for
+// in the next dump so that it only sends what is new.
+//
+
+#include "TelemetryLog.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+class PayloadWriter : public TelemetryLog::Listener
+{
+	FILE * const output;
+
+public:
+	size_t records = 0;
+	size_t skippedBytes = 0;
+	size_t gaps = 0;
+	uint64_t missingRecords = 0;
+	uint32_t firstSequence = 0;
+	uint32_t lastSequence = 0;
+
+	explicit PayloadWriter(FILE * output):
+	output(output)
+	{}
+
+	void onRecord(uint32_t sequence, uint8_t const * payload, size_t size) override
+	{
+		if(records > 0 && sequence != lastSequence + 1)
+		{
+			++gaps;
+			if(sequence > lastSequence)
+			{
+				missingRecords += sequence - lastSequence - 1;
+				fprintf(stderr, "Gap: records %" PRIu32 " to %" PRIu32 " missing\n", lastSequence + 1, sequence - 1);
+			}
+			else
+			{
+				fprintf(stderr, "Sequence went back from %" PRIu32 " to %" PRIu32 " (log reset, or two dumps in one capture)\n",
+					lastSequence, sequence);
+			}
+		}
+		if(records == 0)
+		{
+			firstSequence = sequence;
+		}
+		lastSequence = sequence;
+		++records;
+		fwrite(payload, 1, size, output);
+	}
+
+	void onSkippedByte() override
+	{
+		++skippedBytes;
+	}
+};
+
+int main(int argc, char ** argv)
+{
+	if(argc > 3 || (argc > 1 && argv[1][0] == '-' && argv[1][1] != '\0'))
+	{
+		fprintf(stderr, "Usage: %s [input file] [output file]\n", argv[0]);
+		return 1;
+	}
+
+	FILE * input = stdin;
+	FILE * output = stdout;
+	if(argc > 1)
+	{
+		input = fopen(argv[1], "rb");
+		if(input == nullptr)
+		{
+			perror(argv[1]);
+			return 1;
+		}
+	}
+	if(argc > 2)
+	{
+		output = fopen(argv[2], "wb");
+		if(output == nullptr)
+		{
+			perror(argv[2]);
+			return 1;
+		}
+	}
+
+	PayloadWriter writer(output);
+	TelemetryLog::Parser parser(writer);
+	uint8_t buffer[4096];
+	size_t bytesRead;
+	while((bytesRead = fread(buffer, 1, sizeof(buffer), input)) > 0)
+	{
+		parser.feed(buffer, bytesRead);
+	}
+
+	if(writer.records == 0)
+	{
+		fprintf(stderr, "No records found (%zu bytes skipped)\n", writer.skippedBytes);
+	}
+	else
+	{
+		fprintf(stderr, "Extracted %zu records, %" PRIu32 " to %" PRIu32 ", with %zu gaps (%" PRIu64 " records missing).  "
+			"%zu other bytes skipped.\n", writer.records, writer.firstSequence, writer.lastSequence, writer.gaps,
+			writer.missingRecords, writer.skippedBytes);
+		fprintf(stderr, "To get only newer records next time, dump from %" PRIu32 "\n", writer.lastSequence + 1);
+	}
+
+	if(output != stdout)
+	{
+		fclose(output);
+	}
+	if(input != stdin)
+	{
+		fclose(input);
+	}
+	return writer.gaps > 0 ? 2 : 0;
+}
@@ -0,0 +1,379 @@
+//
+// Checks TelemetryLog on the block devices it runs on: a HeapBlockDevice with flash-like pages, one with
+// SD-card-like 512 byte blocks, and the simulated on-chip flash.  On each, the log is filled around the ring
+// several times with resets (re-initializing without flushing) and writes cut off halfway, and after every
+// reset it checks that appending carries on from the newest stored record, that dumps from any sequence
+// number send exactly the stored records in order, and that every sector was erased as often as the others.
+// Then it times appending and dumping.
+//
+// Usage: telemetry-log-verify [--laps <n>]
+//   --laps <n>  trips around each ring (default 8)
+// Exits with 1 if any check fails.
+//
+
+#include "TelemetryLog.h"
+#include "FlashIAPBlockDevice.h"
+#include "blockdevice/HeapBlockDevice.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <vector>
+
+namespace
+{
+	// Payloads are made from their sequence numbers, so any record read back can be checked
+	size_t payloadSize(uint32_t sequence)
+	{
+		return 1 + (sequence * 37) % 96;
+	}
+
+	void makePayload(uint32_t sequence, uint8_t * payload)
+	{
+		for(size_t i = 0; i < payloadSize(sequence); i++)
+		{
+			payload[i] = static_cast<uint8_t>(sequence * 31 + i);
+		}
+	}
+
+	uint32_t failures = 0;
+
+	void check(bool condition, char const * device, char const * what, uint32_t value)
+	{
+		if(!condition && failures++ < 20)
+		{
+			printf("  FAILED on %s: %s (%" PRIu32 ")\n", device, what, value);
+		}
+	}
+
+	/**
+	 * Passes everything on to another device, counting erases per erase unit, and can cut a program off
+	 * halfway as a reset would.
+	 */
+	class TestDevice : public BlockDevice
+	{
+	public:
+		explicit TestDevice(BlockDevice & target):
+		target(target)
+		{}
+
+		// Erases of each erase unit, by address
+		std::map<bd_addr_t, uint32_t> eraseCounts;
+
+		// Count of programs to let through before cutting one off, or -1 for none
+		int programsBeforeTear = -1;
+		bool torn = false;
+
+		int init() override { return target.init(); }
+		int deinit() override { return target.deinit(); }
+		int sync() override { return target.sync(); }
+		int read(void * buffer, bd_addr_t addr, bd_size_t size) override { return target.read(buffer, addr, size); }
+
+		int program(void const * buffer, bd_addr_t addr, bd_size_t size) override
+		{
+			if(torn)
+			{
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			if(programsBeforeTear >= 0 && programsBeforeTear-- == 0)
+			{
+				// Only the first half makes it, and the device is gone until the next "reset"
+				torn = true;
+				bd_size_t const half = size / 2 / target.get_program_size() * target.get_program_size();
+				target.program(buffer, addr, half);
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			return target.program(buffer, addr, size);
+		}
+
+		int erase(bd_addr_t addr, bd_size_t size) override
+		{
+			if(torn)
+			{
+				return mbed::BD_ERROR_DEVICE_ERROR;
+			}
+			for(bd_size_t offset = 0; offset < size; offset += target.get_erase_size(addr + offset))
+			{
+				++eraseCounts[addr + offset];
+			}
+			return target.erase(addr, size);
+		}
+
+		bd_size_t get_read_size() const override { return target.get_read_size(); }
+		bd_size_t get_program_size() const override { return target.get_program_size(); }
+		bd_size_t get_erase_size() const override { return target.get_erase_size(); }
+		bd_size_t get_erase_size(bd_addr_t addr) const override { return target.get_erase_size(addr); }
+		int get_erase_value() const override { return target.get_erase_value(); }
+		bd_size_t size() const override { return target.size(); }
+		char const * get_type() const override { return target.get_type(); }
+
+	private:
+		BlockDevice & target;
+	};
+
+	// Checks a dump record by record
+	class DumpChecker : public ByteSink, public TelemetryLog::Listener
+	{
+	public:
+		uint32_t records = 0;
+		uint32_t firstSequence = 0;
+		uint32_t lastSequence = 0;
+		uint32_t badRecords = 0;
+		uint32_t outOfOrder = 0;
+		size_t skippedBytes = 0;
+		size_t writes = 0;
+
+		DumpChecker():
+		parser(*this)
+		{}
+
+		void write(uint8_t const * data, size_t length) override
+		{
+			++writes;
+			parser.feed(data, length);
+		}
+
+		void onRecord(uint32_t sequence, uint8_t const * payload, size_t size) override
+		{
+			uint8_t expected[TelemetryLog::MAX_PAYLOAD_SIZE];
+			makePayload(sequence, expected);
+			if(size != payloadSize(sequence) || memcmp(payload, expected, size) != 0)
+			{
+				++badRecords;
+			}
+			if(records > 0 && sequence != lastSequence + 1)
+			{
+				++outOfOrder;
+			}
+			if(records == 0)
+			{
+				firstSequence = sequence;
+			}
+			lastSequence = sequence;
+			++records;
+		}
+
+		void onSkippedByte() override
+		{
+			++skippedBytes;
+		}
+
+	private:
+		TelemetryLog::Parser parser;
+	};
+
+	// Throws the bytes away, for timing dumps
+	class NullSink : public ByteSink
+	{
+	public:
+		size_t bytes = 0;
+
+		void write(uint8_t const * data, size_t length) override
+		{
+			(void)data;
+			bytes += length;
+		}
+	};
+
+	// Dump from a sequence number and check that exactly the records from there to the newest come out
+	void checkDump(TelemetryLog & log, char const * name, uint32_t from)
+	{
+		DumpChecker checker;
+		uint32_t reported = 0;
+		int const result = log.dump(from, checker, &reported);
+		uint32_t const first = std::max(from, log.getFirstSequence());
+		uint32_t const expectedCount = log.getNextSequence() > first ? log.getNextSequence() - first : 0;
+
+		check(result == TelemetryLog::OK, name, "dump result", static_cast<uint32_t>(-result));
+		check(checker.records == expectedCount, name, "records dumped", checker.records);
+		check(reported == checker.records, name, "records reported by dump", reported);
+		check(checker.badRecords == 0, name, "records with the wrong contents", checker.badRecords);
+		check(checker.outOfOrder == 0, name, "records out of order", checker.outOfOrder);
+		check(checker.skippedBytes == 0, name, "bytes between records", static_cast<uint32_t>(checker.skippedBytes));
+		if(expectedCount > 0)
+		{
+			check(checker.firstSequence == first, name, "first record dumped", checker.firstSequence);
+			check(checker.lastSequence == log.getNextSequence() - 1, name, "last record dumped", checker.lastSequence);
+		}
+	}
+
+	void checkDumps(TelemetryLog & log, char const * name)
+	{
+		uint32_t const first = log.getFirstSequence();
+		uint32_t const next = log.getNextSequence();
+		for(uint32_t from : {0u, first, first + (next - first) / 3, first + (next - first) / 2, next - 1, next, next + 100})
+		{
+			checkDump(log, name, from);
+		}
+	}
+
+	void verifyDevice(char const * name, BlockDevice & target, TelemetryLog::Config const & config, int laps)
+	{
+		TestDevice device(target);
+		uint32_t const failuresBefore = failures;
+
+		TelemetryLog log(device, config);
+		check(log.init() == TelemetryLog::OK, name, "init", 0);
+		check(log.reset() == TelemetryLog::OK, name, "reset", 0);
+		check(log.getRecordCount() == 0 && log.getNextSequence() == 1, name, "empty after reset", log.getRecordCount());
+		bd_size_t const capacity = log.getCapacity();
+		bd_size_t const sectorSize = log.getSectorSize();
+		uint32_t const sectorCount = static_cast<uint32_t>(capacity / sectorSize);
+		printf("%s: %" PRIu32 " sectors of %" PRIu32 " bytes, %zu byte batches\n", name, sectorCount,
+			static_cast<uint32_t>(sectorSize), log.getBatchSize());
+		device.eraseCounts.clear();
+
+		// Average record size is about 56 bytes
+		uint64_t const totalRecords = static_cast<uint64_t>(laps) * capacity / 56;
+		uint8_t payload[TelemetryLog::MAX_PAYLOAD_SIZE];
+		uint32_t resets = 0;
+		uint32_t tears = 0;
+		uint32_t wraps = 0;
+		uint32_t previousFirst = log.getFirstSequence();
+		for(uint64_t written = 0; written < totalRecords; written++)
+		{
+			uint32_t const sequence = log.getNextSequence();
+			makePayload(sequence, payload);
+			log.append(payload, payloadSize(sequence));
+
+			if(log.getFirstSequence() != previousFirst)
+			{
+				++wraps;
+				previousFirst = log.getFirstSequence();
+			}
+
+			// Every so often: a flush, a reset, or a reset halfway through programming
+			uint32_t const event = written % 997;
+			if(event == 100)
+			{
+				check(log.flush() == TelemetryLog::OK, name, "flush", sequence);
+			}
+			else if(event == 500 || event == 900)
+			{
+				if(event == 900)
+				{
+					device.programsBeforeTear = 0;
+					log.flush();
+					++tears;
+				}
+
+				// What was programmed before the reset is what init() has to find
+				uint32_t const storedFirst = log.getFirstSequence();
+				uint32_t const storedNext = log.getNextSequence();
+				device.torn = false;
+				device.programsBeforeTear = -1;
+				check(log.init() == TelemetryLog::OK, name, "init after a reset", sequence);
+				++resets;
+				if(event == 500)
+				{
+					// Only what was in RAM is lost
+					check(log.getNextSequence() <= storedNext, name, "next sequence after a reset", log.getNextSequence());
+					check(storedNext - log.getNextSequence() < log.getBatchSize() / TelemetryLog::RECORD_OVERHEAD, name,
+						"records lost by a reset", storedNext - log.getNextSequence());
+				}
+				// A cut off program can come after an erase that left the old records there to read
+				bool const oldestKept = event == 900 ? log.getFirstSequence() <= storedFirst : log.getFirstSequence() == storedFirst;
+				check(oldestKept, name, "oldest record after a reset", log.getFirstSequence());
+				checkDumps(log, name);
+			}
+		}
+		check(wraps > 0, name, "the ring wrapped around", wraps);
+		checkDumps(log, name);
+
+		// Every full trip erases each sector once, so they can only differ by the trip in progress, and by the
+		// sector erased again after each cut off program
+		uint32_t minErases = UINT32_MAX;
+		uint32_t maxErases = 0;
+		for(uint32_t sector = 0; sector < sectorCount; sector++)
+		{
+			uint32_t const erases = device.eraseCounts[config.start + sector * sectorSize];
+			minErases = std::min(minErases, erases);
+			maxErases = std::max(maxErases, erases);
+		}
+		check(maxErases - minErases <= 1 + tears, name, "spread of erases per sector", maxErases - minErases);
+
+		printf("  %" PRIu64 " records, %" PRIu32 " resets (%" PRIu32 " cut off while programming), oldest record moved %" PRIu32
+			" times, %" PRIu32 " to %" PRIu32 " erases per sector: %s\n", totalRecords, resets, tears, wraps, minErases,
+			maxErases, failures == failuresBefore ? "passed" : "FAILED");
+	}
+
+	void benchmark(char const * name, BlockDevice & device, TelemetryLog::Config const & config)
+	{
+		TelemetryLog log(device, config);
+		log.init();
+		log.reset();
+		uint32_t const resetPrograms = log.getProgramCount();
+
+		// Chem ID sample frames are about 90 bytes
+		constexpr size_t RECORD_PAYLOAD = 90;
+		uint8_t payload[RECORD_PAYLOAD] = {};
+		uint32_t const records = static_cast<uint32_t>(log.getCapacity() / (RECORD_PAYLOAD + TelemetryLog::RECORD_OVERHEAD)) * 4;
+		auto startTime = std::chrono::steady_clock::now();
+		for(uint32_t record = 0; record < records; record++)
+		{
+			log.append(payload, sizeof(payload));
+		}
+		log.flush();
+		double const appendSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		constexpr int ROUNDS = 20;
+		NullSink sink;
+		startTime = std::chrono::steady_clock::now();
+		for(int round = 0; round < ROUNDS; round++)
+		{
+			log.dump(0, sink);
+		}
+		double const dumpSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+
+		printf("  %-30s append %6.2f M records/s (%.1f records per program), dump %7.1f MB/s\n", name,
+			records / appendSeconds / 1e6, static_cast<double>(records) / (log.getProgramCount() - resetPrograms),
+			sink.bytes / dumpSeconds / 1e6);
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	int laps = 8;
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		if(strcmp(argv[argIndex], "--laps") == 0 && argIndex + 1 < argc)
+		{
+			laps = std::max(1, atoi(argv[++argIndex]));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--laps <n>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	// The simulated flash must start erased, not from a checkpoint file
+	unsetenv("BQ34_SIM_FLASH_FILE");
+
+	// As with telemetry-log-in-ram: flash-like 2 kiB pages in RAM
+	HeapBlockDevice heapPages(64 * 1024, 1, 1, 2048);
+	verifyDevice("HeapBlockDevice, 2 kiB pages", heapPages, TelemetryLog::Config(), laps);
+
+	// SD cards: everything in 512 byte blocks, so each sector is one batch
+	HeapBlockDevice heapBlocks(32 * 1024, 512);
+	verifyDevice("HeapBlockDevice, 512 B blocks", heapBlocks, TelemetryLog::Config(), laps);
+
+	// On-chip flash, using part of the device
+	FlashIAPBlockDevice flash(0x08060000, 80 * 1024);
+	TelemetryLog::Config flashConfig;
+	flashConfig.start = 8 * 1024;
+	flashConfig.size = 64 * 1024;
+	verifyDevice("FlashIAPBlockDevice", flash, flashConfig, laps);
+
+	printf("\nBenchmark:\n");
+	benchmark("HeapBlockDevice, 2 kiB pages", heapPages, TelemetryLog::Config());
+	benchmark("HeapBlockDevice, 512 B blocks", heapBlocks, TelemetryLog::Config());
+	benchmark("FlashIAPBlockDevice", flash, flashConfig);
+
+	printf("\n%s\n", failures == 0 ? "All checks passed" : "Some checks FAILED");
+	return failures == 0 ? 0 : 1;
+}
@@ -0,0 +1,627 @@
+//
+// Microbenchmarks of the code that runs for every sample or gauge access: status bit decoding, Xemics
+// conversions, data flash field extraction, log row formatting and encoding, and transactions on the
+// simulated I2C bus.  Results can be saved as a baseline and later runs checked against it, so that a
+// change that slows one of these paths down is caught before it reaches the board.  Before the timings, the
+// I2C transactions that one telemetry sample takes on the simulated bus are counted, for the burst read and for
+// the separate register reads it replaces.
+//
+// Usage: utils-bench [--filter <text>] [--min-time <ms>] [--repeat <n>] [--save <file>] [--compare <file>] [--threshold <percent>]
+//   --filter <text>        only run the benchmarks whose name contains text
+//   --min-time <ms>        run each benchmark for at least this long per repeat (default 100)
+//   --repeat <n>           repeats per benchmark, of which the fastest counts (default 5)
+//   --save <file>          write the results to a baseline file
+//   --compare <file>       compare the results against a baseline file
+//   --threshold <percent>  slowdown against the baseline that counts as a regression (default 15)
+// The baseline is CSV: one "name,operations per second" line per benchmark, after a # comment line.
+// Exits with 1 if any benchmark is slower than its baseline by more than the threshold.
+//
+
+#include "ChemIDLog.h"
+#include "DataFlashCache.h"
+#include "DataFlashSchema.h"
+#include "FaultTolerantI2C.h"
+#include "FixedFormat.h"
+#include "GaugeBits.h"
+#include "GaugeTelemetry.h"
+#include "PhaseStatistics.h"
+#include "SimBus.h"
+#include "SimSetup.h"
+#include "TelemetryLog.h"
+#include "Xemics.h"
+#include "pins.h"
+
+#include <BQ34Z100.h>
+#include <blockdevice/HeapBlockDevice.h>
+
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <random>
+#include <string>
+#include <vector>
+
+using namespace std::chrono_literals;
+
+namespace
+{
+	// Keeps the compiler from optimizing the benchmark loops away
+	volatile uint32_t benchmarkSink;
+
+	// Inputs are taken from tables of this many entries, so that branches see varied data
+	constexpr size_t INPUT_COUNT = 1024;
+
+	/**
+	 * A benchmark runs the given number of operations and returns something that depends on all of them.
+	 */
+	struct Benchmark
+	{
+		std::string name;
+		std::function<uint32_t(uint32_t operations)> run;
+	};
+
+	struct Result
+	{
+		std::string name;
+		double operationsPerSecond;
+	};
+
+	uint32_t floatBits(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	// Counts what an encoder sends, as the console or telemetry log would receive it
+	class CountingSink : public ByteSink
+	{
+	public:
+		void write(uint8_t const * data, size_t length) override
+		{
+			(void)data;
+			bytes += length;
+		}
+
+		uint32_t bytes = 0;
+	};
+
+	/**
+	 * Run a benchmark in batches that double in size until minTime has passed, repeat that, and return the
+	 * best rate.  The fastest repeat is the one least disturbed by the rest of the system.
+	 */
+	double measure(Benchmark const & benchmark, std::chrono::milliseconds minTime, int repeats)
+	{
+		double best = 0;
+		for(int repeat = 0; repeat < repeats; repeat++)
+		{
+			uint32_t accumulator = 0;
+			uint64_t operations = 0;
+			uint32_t batch = 1;
+			auto const startTime = std::chrono::steady_clock::now();
+			std::chrono::duration<double> elapsed{0};
+			while(elapsed < minTime)
+			{
+				accumulator += benchmark.run(batch);
+				operations += batch;
+				elapsed = std::chrono::steady_clock::now() - startTime;
+				if(batch < (1u << 20))
+				{
+					batch *= 2;
+				}
+			}
+			benchmarkSink = accumulator;
+			best = std::max(best, operations / elapsed.count());
+		}
+		return best;
+	}
+
+	std::vector<ChemIDLog::Sample> makeSamples(std::mt19937 & generator)
+	{
+		// A 3-cell pack in the ranges a chem ID run goes through, 5 s apart
+		std::uniform_int_distribution<int> voltage(9000, 12600);
+		std::uniform_int_distribution<int> current(-2200, 2200);
+		std::uniform_int_distribution<int> temperature(2930, 3130);
+		std::uniform_int_distribution<int> soc(0, 100);
+		std::vector<ChemIDLog::Sample> samples(INPUT_COUNT);
+		for(size_t index = 0; index < INPUT_COUNT; index++)
+		{
+			samples[index].elapsed_s = 5 * index;
+			samples[index].voltage_mV = voltage(generator);
+			samples[index].current_mA = current(generator);
+			samples[index].temperature_dK = temperature(generator);
+			samples[index].soc_percent = soc(generator);
+		}
+		return samples;
+	}
+
+	PhaseStatistics::Summary makeSummary(std::vector<ChemIDLog::Sample> const & samples)
+	{
+		PhaseStatistics statistics;
+		for(ChemIDLog::Sample const & sample : samples)
+		{
+			statistics.add({std::chrono::seconds(sample.elapsed_s), sample.voltage_mV, sample.current_mA,
+				sample.temperature_dK, static_cast<uint16_t>(2000 + sample.soc_percent)});
+		}
+		return statistics.summarize();
+	}
+
+	// Inputs and objects under test, shared by the benchmarks
+	struct Fixture
+	{
+		std::vector<uint16_t> registers;
+		std::vector<float> floats;
+		std::vector<uint32_t> encodings;
+		std::vector<ChemIDLog::Sample> samples;
+		PhaseStatistics::Summary summary;
+
+		I2C bus{BQ34_I2C_SDA, BQ34_I2C_SCL};
+		BQ34Z100 gauge{bus, 100000};
+		FaultTolerantI2C transport{bus, BQ34_I2C_SDA, BQ34_I2C_SCL};
+		GaugeTelemetry telemetry{transport};
+		DataFlashCache flash{bus};
+
+		HeapBlockDevice device{64 * 1024, 1, 1, 2048};
+		TelemetryLog log{device};
+	};
+
+	void setUp(Fixture & fixture)
+	{
+		std::mt19937 generator(1234);
+
+		// Status registers, as soc-test's status printout and the sampling loops' bit watching decode them
+		fixture.registers.resize(INPUT_COUNT);
+		std::uniform_int_distribution<uint16_t> registerValue;
+		for(uint16_t & value : fixture.registers)
+		{
+			value = registerValue(generator);
+		}
+
+		// Calibration constants span a few decades either side of 1
+		fixture.floats.resize(INPUT_COUNT);
+		fixture.encodings.resize(INPUT_COUNT);
+		std::uniform_real_distribution<float> logMagnitude(-6, 6);
+		for(size_t index = 0; index < INPUT_COUNT; index++)
+		{
+			fixture.floats[index] = std::pow(10.0f, logMagnitude(generator)) * (index % 2 ? -1 : 1);
+			fixture.encodings[index] = Xemics::fromFloat(fixture.floats[index]);
+		}
+
+		fixture.samples = makeSamples(generator);
+		fixture.summary = makeSummary(fixture.samples);
+
+		// The data flash fields are read out of cached blocks
+		fixture.gauge.unseal();
+		if(!fixture.flash.load(DataFlash::DESIGN_CAPACITY, DataFlash::PACK_CONFIGURATION, DataFlash::QMAX0, DataFlash::CC_GAIN))
+		{
+			fprintf(stderr, "Could not read the simulated gauge's data flash\n");
+			exit(2);
+		}
+
+		if(fixture.log.init() != TelemetryLog::OK)
+		{
+			fprintf(stderr, "Could not start the telemetry log\n");
+			exit(2);
+		}
+	}
+
+	// Transactions that reaching the simulated gauge took, as counted by the bus stand-in
+	template<typename Read>
+	uint32_t countTransactions(Read read)
+	{
+		SimI2C::resetTransactionCount();
+		read();
+		return SimI2C::getTransactionCount();
+	}
+
+	void printTransactionsPerSample(Fixture & fixture)
+	{
+		BQ34Z100 & gauge = fixture.gauge;
+		uint32_t const burst = countTransactions([&fixture]
+		{
+			TelemetrySnapshot snapshot;
+			fixture.telemetry.read(snapshot);
+		});
+
+		// The register reads chem-id-measurer's sampling loop and soc-test's displayData() made per sample
+		uint32_t const chemIDSample = countTransactions([&gauge]
+		{
+			gauge.getVoltage();
+			gauge.getCurrent();
+			gauge.getTemperature();
+			gauge.getSOC();
+		});
+		uint32_t const displayData = countTransactions([&gauge]
+		{
+			gauge.getSOC();
+			gauge.getVoltage();
+			gauge.getCurrent();
+			gauge.getRemaining();
+			gauge.getTemperature();
+			gauge.getError();
+		});
+
+		printf("I2C transactions per telemetry sample (simulated bus):\n");
+		printf("  %-44s %4" PRIu32 "\n", "GaugeTelemetry::read", burst);
+		printf("  %-44s %4" PRIu32 "\n", "chem ID sample, one read per register", chemIDSample);
+		printf("  %-44s %4" PRIu32 "\n\n", "displayData(), one read per register", displayData);
+	}
+
+	std::vector<Benchmark> makeBenchmarks(Fixture & fixture)
+	{
+		std::vector<Benchmark> benchmarks;
+
+		// Status bit decoding
+		benchmarks.push_back({"GaugeBits::formatBitfield", [&fixture](uint32_t operations)
+		{
+			char report[GaugeBits::BITFIELD_REPORT_SIZE];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += GaugeBits::formatBitfield(report, sizeof(report), "Flags", GaugeBits::FLAGS_BIT_DESCS,
+					fixture.registers[operation % INPUT_COUNT]);
+			}
+			return total;
+		}});
+		benchmarks.push_back({"GaugeBits::formatTransitions", [&fixture](uint32_t operations)
+		{
+			char record[128];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += GaugeBits::formatTransitions(record, sizeof(record), "FLAGS", GaugeBits::FLAGS_NAMES,
+					fixture.registers[operation % INPUT_COUNT], fixture.registers[(operation + 1) % INPUT_COUNT]);
+			}
+			return total;
+		}});
+
+		// Xemics conversions, ours and the driver's
+		benchmarks.push_back({"Xemics::fromFloat", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += Xemics::fromFloat(fixture.floats[operation % INPUT_COUNT]);
+			}
+			return total;
+		}});
+		benchmarks.push_back({"Xemics::toFloat", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += floatBits(Xemics::toFloat(fixture.encodings[operation % INPUT_COUNT]));
+			}
+			return total;
+		}});
+		benchmarks.push_back({"BQ34Z100::floatToXemics", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += BQ34Z100::floatToXemics(fixture.floats[operation % INPUT_COUNT]);
+			}
+			return total;
+		}});
+		benchmarks.push_back({"BQ34Z100::xemicsToFloat", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += floatBits(BQ34Z100::xemicsToFloat(fixture.encodings[operation % INPUT_COUNT]));
+			}
+			return total;
+		}});
+
+		// Data flash fields out of cached blocks, as soc-test prints and edits its settings
+		benchmarks.push_back({"DataFlashCache::get (integer fields)", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				int16_t capacity = 0;
+				uint16_t packConfiguration = 0;
+				uint8_t cellCount = 0;
+				int16_t qmax = 0;
+				fixture.flash.get(DataFlash::DESIGN_CAPACITY, capacity);
+				fixture.flash.get(DataFlash::PACK_CONFIGURATION, packConfiguration);
+				fixture.flash.get(DataFlash::CELL_COUNT, cellCount);
+				fixture.flash.get(DataFlash::QMAX0, qmax);
+				total += capacity + packConfiguration + cellCount + qmax;
+			}
+			return total;
+		}});
+		benchmarks.push_back({"DataFlashCache::get (Xemics fields)", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				float gain = 0;
+				float delta = 0;
+				fixture.flash.get(DataFlash::CC_GAIN, gain);
+				fixture.flash.get(DataFlash::CC_DELTA, delta);
+				total += floatBits(gain) + floatBits(delta);
+			}
+			return total;
+		}});
+
+		// The per-sample output of chem-id-measurer and soc-test's sampling loops
+		benchmarks.push_back({"ChemIDLog::formatCSVRow", [&fixture](uint32_t operations)
+		{
+			char row[ChemIDLog::CSV_ROW_SIZE];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += ChemIDLog::formatCSVRow(row, sizeof(row), fixture.samples[operation % INPUT_COUNT], ChemIDLog::Event::NONE);
+			}
+			return total;
+		}});
+		benchmarks.push_back({"ChemIDLog::formatCSVRow (phase end)", [&fixture](uint32_t operations)
+		{
+			RelaxDetector::Evidence const evidence{true, 1800, -1500, 2000, 600, true, true};
+			char row[ChemIDLog::CSV_ROW_SIZE];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += ChemIDLog::formatCSVRow(row, sizeof(row), fixture.samples[operation % INPUT_COUNT],
+					ChemIDLog::Event::RELAX_CHARGED_DONE);
+				total += ChemIDLog::formatCSVNote(row, sizeof(row), &evidence, &fixture.summary);
+			}
+			return total;
+		}});
+		benchmarks.push_back({"ChemIDLog::Encoder::addSample", [&fixture](uint32_t operations)
+		{
+			CountingSink sink;
+			ChemIDLog::Encoder encoder(sink);
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				encoder.addSample(fixture.samples[operation % INPUT_COUNT]);
+			}
+			encoder.flush();
+			return sink.bytes;
+		}});
+		benchmarks.push_back({"FixedFormatter sample row", [&fixture](uint32_t operations)
+		{
+			// As soc-test's printSample()
+			char row[48];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				ChemIDLog::Sample const & sample = fixture.samples[operation % INPUT_COUNT];
+				FixedFormatter formatter(row, sizeof(row));
+				formatter.fixed(static_cast<int32_t>(sample.elapsed_s * 100), 2).text(",\t")
+					.unsignedInt(sample.voltage_mV).text(",\t")
+					.signedInt(sample.current_mA).text("\r\n");
+				total += formatter.length();
+			}
+			return total;
+		}});
+		benchmarks.push_back({"PhaseStatistics::formatSummary", [&fixture](uint32_t operations)
+		{
+			char line[ChemIDLog::CSV_ROW_SIZE];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				fixture.summary.charge_uAh = static_cast<int32_t>(operation);
+				total += PhaseStatistics::formatSummary(line, sizeof(line), fixture.summary);
+			}
+			return total;
+		}});
+
+		// Storing the encoded samples, including the batch programs into a RAM device
+		benchmarks.push_back({"TelemetryLog::append (40 bytes)", [&fixture](uint32_t operations)
+		{
+			uint8_t payload[40] = {};
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				payload[0] = static_cast<uint8_t>(operation);
+				fixture.log.append(payload, sizeof(payload));
+			}
+			return fixture.log.getNextSequence();
+		}});
+
+		// Whole transactions through the I2C stand-in and the simulated gauge's register model
+		benchmarks.push_back({"GaugeTelemetry::read (simulated I2C)", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				TelemetrySnapshot snapshot;
+				total += fixture.telemetry.read(snapshot) ? snapshot.voltage_mV : 0;
+			}
+			return total;
+		}});
+		benchmarks.push_back({"BQ34Z100::getVoltage (simulated I2C)", [&fixture](uint32_t operations)
+		{
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				total += fixture.gauge.getVoltage();
+			}
+			return total;
+		}});
+		benchmarks.push_back({"DataFlashCache block read (simulated I2C)", [&fixture](uint32_t operations)
+		{
+			uint8_t block[DataFlashCache::BLOCK_SIZE];
+			uint32_t total = 0;
+			for(uint32_t operation = 0; operation < operations; operation++)
+			{
+				fixture.flash.clear();
+				total += fixture.flash.readBlockData(DataFlash::CC_GAIN.subclass, 0, block) ? block[0] : 0;
+			}
+			return total;
+		}});
+
+		return benchmarks;
+	}
+
+	bool saveBaseline(char const * path, std::vector<Result> const & results)
+	{
+		FILE * file = fopen(path, "w");
+		if(file == nullptr)
+		{
+			return false;
+		}
+		fprintf(file, "# benchmark,operations per second\n");
+		for(Result const & result : results)
+		{
+			fprintf(file, "%s,%.1f\n", result.name.c_str(), result.operationsPerSecond);
+		}
+		return fclose(file) == 0;
+	}
+
+	bool loadBaseline(char const * path, std::vector<Result> & baseline)
+	{
+		FILE * file = fopen(path, "r");
+		if(file == nullptr)
+		{
+			return false;
+		}
+		char line[256];
+		while(fgets(line, sizeof(line), file) != nullptr)
+		{
+			// The name may hold anything but a comma, so split at the last one
+			char * const comma = strrchr(line, ',');
+			if(line[0] == '#' || comma == nullptr)
+			{
+				continue;
+			}
+			*comma = '\0';
+			baseline.push_back({line, strtod(comma + 1, nullptr)});
+		}
+		fclose(file);
+		return true;
+	}
+
+	/**
+	 * Print each result next to its baseline.
+	 * @return Number of benchmarks that got slower by more than threshold percent
+	 */
+	int compare(std::vector<Result> const & results, std::vector<Result> const & baseline, double threshold)
+	{
+		int regressions = 0;
+		printf("\nAgainst the baseline (regression threshold %.0f%%):\n", threshold);
+		for(Result const & result : results)
+		{
+			Result const * saved = nullptr;
+			for(Result const & entry : baseline)
+			{
+				if(entry.name == result.name)
+				{
+					saved = &entry;
+				}
+			}
+			if(saved == nullptr || saved->operationsPerSecond <= 0)
+			{
+				printf("  %-44s  not in the baseline\n", result.name.c_str());
+				continue;
+			}
+
+			double const change = (result.operationsPerSecond / saved->operationsPerSecond - 1) * 100;
+			bool const regressed = change < -threshold;
+			printf("  %-44s %+7.1f%%%s\n", result.name.c_str(), change, regressed ? "  REGRESSION" : "");
+			if(regressed)
+			{
+				++regressions;
+			}
+		}
+		return regressions;
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	char const * filter = nullptr;
+	std::chrono::milliseconds minTime = 100ms;
+	int repeats = 5;
+	char const * savePath = nullptr;
+	char const * comparePath = nullptr;
+	double threshold = 15;
+
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--filter") == 0 && hasValue)
+		{
+			filter = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--min-time") == 0 && hasValue)
+		{
+			minTime = std::chrono::milliseconds(std::max(1, atoi(argv[++argIndex])));
+		}
+		else if(strcmp(arg, "--repeat") == 0 && hasValue)
+		{
+			repeats = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--save") == 0 && hasValue)
+		{
+			savePath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--compare") == 0 && hasValue)
+		{
+			comparePath = argv[++argIndex];
+		}
+		else if(strcmp(arg, "--threshold") == 0 && hasValue)
+		{
+			threshold = std::max(0.0, atof(argv[++argIndex]));
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--filter <text>] [--min-time <ms>] [--repeat <n>] [--save <file>] [--compare <file>] [--threshold <percent>]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	std::vector<Result> baseline;
+	if(comparePath != nullptr && !loadBaseline(comparePath, baseline))
+	{
+		fprintf(stderr, "Could not read baseline %s\n", comparePath);
+		return 1;
+	}
+
+	Fixture fixture;
+	setUp(fixture);
+	printTransactionsPerSample(fixture);
+
+	printf("Benchmark (single thread, best of %d runs of at least %" PRId64 " ms):\n", repeats,
+		static_cast<int64_t>(minTime.count()));
+	std::vector<Result> results;
+	for(Benchmark const & benchmark : makeBenchmarks(fixture))
+	{
+		if(filter != nullptr && benchmark.name.find(filter) == std::string::npos)
+		{
+			continue;
+		}
+		double const rate = measure(benchmark, minTime, repeats);
+		printf("  %-44s %10.3f M ops/s %10.1f ns/op\n", benchmark.name.c_str(), rate / 1e6, 1e9 / rate);
+		fflush(stdout);
+		results.push_back({benchmark.name, rate});
+	}
+
+	if(savePath != nullptr)
+	{
+		if(!saveBaseline(savePath, results))
+		{
+			fprintf(stderr, "Could not write baseline %s\n", savePath);
+			return 1;
+		}
+		printf("\nSaved the baseline to %s\n", savePath);
+	}
+
+	if(comparePath != nullptr)
+	{
+		int const regressions = compare(results, baseline, threshold);
+		if(regressions > 0)
+		{
+			printf("%d benchmark(s) regressed\n", regressions);
+			return 1;
+		}
+		printf("No regressions\n");
+	}
+	return 0;
+}
@@ -0,0 +1,266 @@
+//
+// Checks the Xemics conversions in Xemics.h against a straightforward reference implementation over
+// every 32-bit Xemics encoding and every 32-bit float bit pattern, split across all cores, then
+// benchmarks them next to the driver's conversions.  The driver's conversions are only timed: they are a port of
+// TI's code, which truncates and encodes 0 as 0.00001, so they aren't expected to match the reference exactly.
+//
+// Usage: xemics-verify [--stride <n>] [--threads <n>] [--bench-only]
+//   --stride <n>   only check every nth pattern (default 1, i.e. all 2^32)
+//   --threads <n>  worker threads (default: number of cores)
+//   --bench-only   skip the exhaustive check
+// Exits with 1 if any conversion disagrees with the reference.
+//
+
+#include "Xemics.h"
+
+#include <BQ34Z100.h>
+
+#include <atomic>
+#include <chrono>
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <random>
+#include <thread>
+#include <vector>
+
+namespace
+{
+	uint32_t floatBits(float value)
+	{
+		uint32_t bits;
+		memcpy(&bits, &value, sizeof(bits));
+		return bits;
+	}
+
+	float bitsToFloat(uint32_t bits)
+	{
+		float value;
+		memcpy(&value, &bits, sizeof(value));
+		return value;
+	}
+
+	// Reference implementations, written for clarity from the format description in Xemics.h
+	uint32_t referenceFromFloat(float value)
+	{
+		if(std::isnan(value))
+		{
+			return 0;
+		}
+
+		uint32_t const sign = std::signbit(value) ? Xemics::SIGN_BIT : 0;
+		double const magnitude = std::fabs(static_cast<double>(value));
+		if(magnitude < std::ldexp(1.0, -129))
+		{
+			return 0;
+		}
+		if(magnitude >= std::ldexp(1.0, 127))
+		{
+			return Xemics::MAX_MAGNITUDE | sign;
+		}
+
+		int exponent;
+		double const fraction = std::frexp(magnitude, &exponent); // [0.5, 1)
+		uint32_t const mantissa = static_cast<uint32_t>(std::ldexp(fraction, 24));
+		return (static_cast<uint32_t>(exponent + 128) << 24) | sign | (mantissa & Xemics::MANTISSA_MASK);
+	}
+
+	float referenceToFloat(uint32_t xemics)
+	{
+		if(xemics == 0)
+		{
+			return 0;
+		}
+
+		int const exponent = static_cast<int>(xemics >> 24) - 128;
+		double const mantissa = (xemics & Xemics::MANTISSA_MASK) | Xemics::SIGN_BIT;
+		double const magnitude = std::ldexp(mantissa / (1 << 24), exponent);
+		return static_cast<float>((xemics & Xemics::SIGN_BIT) ? -magnitude : magnitude);
+	}
+
+	struct CheckResult
+	{
+		uint64_t checked = 0;
+		uint64_t toFloatErrors = 0;
+		uint64_t fromFloatErrors = 0;
+		uint64_t roundTripErrors = 0;
+	};
+
+	std::atomic<uint32_t> reportedErrors{0};
+
+	void reportError(char const * what, uint32_t input, uint32_t expected, uint32_t actual)
+	{
+		// only show the first few
+		if(reportedErrors++ < 10)
+		{
+			printf("  %s(0x%08" PRIx32 "): expected 0x%08" PRIx32 ", got 0x%08" PRIx32 "\n", what, input, expected, actual);
+		}
+	}
+
+	void checkRange(uint64_t begin, uint64_t end, uint64_t stride, CheckResult & result)
+	{
+		for(uint64_t pattern64 = begin; pattern64 < end; pattern64 += stride)
+		{
+			uint32_t const pattern = static_cast<uint32_t>(pattern64);
+			++result.checked;
+
+			// pattern as a Xemics encoding
+			uint32_t const expectedFloat = floatBits(referenceToFloat(pattern));
+			uint32_t const actualFloat = floatBits(Xemics::toFloat(pattern));
+			uint32_t const arithmeticFloat = floatBits(Xemics::detail::toFloatArithmetic(pattern));
+			if(actualFloat != expectedFloat || arithmeticFloat != expectedFloat)
+			{
+				++result.toFloatErrors;
+				reportError("toFloat", pattern, expectedFloat, actualFloat != expectedFloat ? actualFloat : arithmeticFloat);
+			}
+
+			// Encodings above the denormal range survive a round trip exactly
+			if((pattern >> 24) >= 3 && Xemics::fromFloat(bitsToFloat(actualFloat)) != pattern)
+			{
+				++result.roundTripErrors;
+				reportError("round trip", pattern, pattern, Xemics::fromFloat(bitsToFloat(actualFloat)));
+			}
+
+			// pattern as a float
+			float const value = bitsToFloat(pattern);
+			uint32_t const expectedXemics = referenceFromFloat(value);
+			uint32_t const actualXemics = Xemics::fromFloat(value);
+			uint32_t const arithmeticXemics = Xemics::detail::fromFloatArithmetic(value);
+			if(actualXemics != expectedXemics || arithmeticXemics != expectedXemics)
+			{
+				++result.fromFloatErrors;
+				reportError("fromFloat", pattern, expectedXemics, actualXemics != expectedXemics ? actualXemics : arithmeticXemics);
+			}
+		}
+	}
+
+	bool runExhaustiveCheck(uint64_t stride, unsigned int threadCount)
+	{
+		constexpr uint64_t PATTERN_COUNT = 1ULL << 32;
+		printf("Checking %" PRIu64 " patterns in each direction on %u threads...\n", (PATTERN_COUNT + stride - 1) / stride, threadCount);
+
+		auto const startTime = std::chrono::steady_clock::now();
+
+		// Give each thread a contiguous chunk that starts on the stride
+		std::vector<CheckResult> results(threadCount);
+		std::vector<std::thread> threads;
+		uint64_t const stepsPerThread = (PATTERN_COUNT / stride + threadCount) / threadCount;
+		for(unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+		{
+			uint64_t const begin = std::min(PATTERN_COUNT, threadIndex * stepsPerThread * stride);
+			uint64_t const end = std::min(PATTERN_COUNT, (threadIndex + 1) * stepsPerThread * stride);
+			threads.emplace_back(checkRange, begin, end, stride, std::ref(results[threadIndex]));
+		}
+
+		CheckResult total;
+		for(unsigned int threadIndex = 0; threadIndex < threadCount; threadIndex++)
+		{
+			threads[threadIndex].join();
+			total.checked += results[threadIndex].checked;
+			total.toFloatErrors += results[threadIndex].toFloatErrors;
+			total.fromFloatErrors += results[threadIndex].fromFloatErrors;
+			total.roundTripErrors += results[threadIndex].roundTripErrors;
+		}
+
+		double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		printf("Checked %" PRIu64 " patterns in %.1f s: %" PRIu64 " toFloat, %" PRIu64 " fromFloat and %" PRIu64 " round trip mismatches\n\n",
+			total.checked, seconds, total.toFloatErrors, total.fromFloatErrors, total.roundTripErrors);
+
+		return total.toFloatErrors == 0 && total.fromFloatErrors == 0 && total.roundTripErrors == 0;
+	}
+
+	// Keeps the compiler from optimizing the benchmark loops away
+	volatile uint32_t benchmarkSink;
+
+	template<typename Input, typename Convert>
+	void benchmark(char const * name, std::vector<Input> const & inputs, Convert convert)
+	{
+		constexpr int ROUNDS = 10;
+		uint32_t accumulator = 0;
+
+		auto const startTime = std::chrono::steady_clock::now();
+		for(int round = 0; round < ROUNDS; round++)
+		{
+			for(Input const & input : inputs)
+			{
+				accumulator += convert(input);
+			}
+		}
+		double const seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+		benchmarkSink = accumulator;
+
+		printf("  %-36s %8.1f M conversions/s\n", name, ROUNDS * inputs.size() / seconds / 1e6);
+	}
+
+	void runBenchmark()
+	{
+		// Realistic inputs: calibration constants span a few decades either side of 1
+		constexpr size_t INPUT_COUNT = 1 << 20;
+		std::mt19937 generator(1234);
+		std::uniform_real_distribution<float> logMagnitude(-6, 6);
+		std::vector<float> floats(INPUT_COUNT);
+		std::vector<uint32_t> encodings(INPUT_COUNT);
+		for(size_t index = 0; index < INPUT_COUNT; index++)
+		{
+			floats[index] = std::pow(10.0f, logMagnitude(generator)) * (index % 2 ? -1 : 1);
+			encodings[index] = Xemics::fromFloat(floats[index]);
+		}
+
+		printf("Benchmark (single thread; the driver's conversions truncate, so its results may differ by 1 LSB):\n");
+		benchmark("Xemics::fromFloat", floats, [](float value) { return Xemics::fromFloat(value); });
+		benchmark("Xemics::detail::fromFloatArithmetic", floats, [](float value) { return Xemics::detail::fromFloatArithmetic(value); });
+		benchmark("BQ34Z100::floatToXemics", floats, [](float value) { return BQ34Z100::floatToXemics(value); });
+		benchmark("Xemics::toFloat", encodings, [](uint32_t xemics) { return floatBits(Xemics::toFloat(xemics)); });
+		benchmark("Xemics::detail::toFloatArithmetic", encodings, [](uint32_t xemics) { return floatBits(Xemics::detail::toFloatArithmetic(xemics)); });
+		benchmark("BQ34Z100::xemicsToFloat", encodings, [](uint32_t xemics) { return floatBits(BQ34Z100::xemicsToFloat(xemics)); });
+	}
+}
+
+int main(int argc, char ** argv)
+{
+	uint64_t stride = 1;
+	unsigned int threadCount = std::max(1u, std::thread::hardware_concurrency());
+	bool benchOnly = false;
+
+	for(int argIndex = 1; argIndex < argc; argIndex++)
+	{
+		char const * arg = argv[argIndex];
+		bool const hasValue = argIndex + 1 < argc;
+		if(strcmp(arg, "--stride") == 0 && hasValue)
+		{
+			stride = std::max(1LL, atoll(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--threads") == 0 && hasValue)
+		{
+			threadCount = std::max(1, atoi(argv[++argIndex]));
+		}
+		else if(strcmp(arg, "--bench-only") == 0)
+		{
+			benchOnly = true;
+		}
+		else
+		{
+			fprintf(stderr, "Usage: %s [--stride <n>] [--threads <n>] [--bench-only]\n", argv[0]);
+			return 1;
+		}
+	}
+
+#if XEMICS_HAS_BIT_CAST
+	printf("Using the bit cast implementation\n");
+#else
+	printf("Using the arithmetic implementation\n");
+#endif
+	printf("Default CC Gain 0.4768 = 0x%08" PRIx32 ", CC Delta 567744.56 = 0x%08" PRIx32 " (computed at compile time)\n\n",
+		Xemics::DEFAULT_CC_GAIN, Xemics::DEFAULT_CC_DELTA);
+
+	bool passed = true;
+	if(!benchOnly)
+	{
+		passed = runExhaustiveCheck(stride, threadCount);
+	}
+	runBenchmark();
+
+	return passed ? 0 : 1;
+}
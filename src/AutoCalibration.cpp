@@ -0,0 +1,207 @@
+//
+// Closed-loop calibration of the gauge's voltage divider and current sense gain against a reference meter.
+//
+
+#include "AutoCalibration.h"
+#include "RobustMean.h"
+#include "Xemics.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+	// The gauge refreshes Voltage() and Current() this often, so closer readings would repeat themselves
+	constexpr std::chrono::milliseconds GAUGE_UPDATE_PERIOD = 1s;
+
+	// Time for new calibration constants to show up in the readings
+	constexpr std::chrono::milliseconds SETTLE_TIME = 2s;
+}
+
+char const * AutoCalibrator::outcomeName(Outcome outcome)
+{
+	switch(outcome)
+	{
+		case Outcome::CONVERGED: return "converged";
+		case Outcome::NOT_CONVERGED: return "did not converge";
+		case Outcome::METER_ERROR: return "reference meter error";
+		case Outcome::GAUGE_ERROR: return "gauge error";
+		case Outcome::NO_CURRENT: return "no current flowing";
+		case Outcome::CURRENT_REVERSED: return "meter and gauge disagree on the current direction";
+		case Outcome::FLASH_WRITE_FAILED: return "data flash write failed";
+	}
+	return "unknown";
+}
+
+AutoCalibrator::AutoCalibrator(I2C & i2c, BQ34Z100 & soc, ReferenceMeter & meter, Config const & config):
+i2c(i2c),
+soc(soc),
+meter(meter),
+config(config)
+{
+}
+
+AutoCalibrator::Result AutoCalibrator::calibrateVoltage(MeasurementHandler onMeasurement)
+{
+	return calibrate(Quantity::VOLTAGE, onMeasurement);
+}
+
+AutoCalibrator::Result AutoCalibrator::calibrateCurrent(MeasurementHandler onMeasurement)
+{
+	return calibrate(Quantity::CURRENT, onMeasurement);
+}
+
+AutoCalibrator::Result AutoCalibrator::calibrate(Quantity quantity, MeasurementHandler & onMeasurement)
+{
+	int32_t const tolerance = quantity == Quantity::VOLTAGE ? config.voltageTolerance_mV : config.currentTolerance_mA;
+	DataFlashCache flash(i2c);
+
+	Result result{};
+	while(true)
+	{
+		if(!measure(quantity, result.last))
+		{
+			result.outcome = Outcome::METER_ERROR;
+			return result;
+		}
+		if(!readSetting(quantity, flash, result.setting))
+		{
+			result.outcome = Outcome::GAUGE_ERROR;
+			return result;
+		}
+		if(onMeasurement)
+		{
+			onMeasurement(result.corrections, result.last);
+		}
+
+		if(std::abs(result.last.error()) <= tolerance)
+		{
+			result.outcome = Outcome::CONVERGED;
+			return result;
+		}
+		if(result.corrections >= config.maxCorrections)
+		{
+			result.outcome = Outcome::NOT_CONVERGED;
+			return result;
+		}
+
+		if(!correct(quantity, flash, result.last, result.outcome))
+		{
+			return result;
+		}
+		++result.corrections;
+		ThisThread::sleep_for(SETTLE_TIME);
+	}
+}
+
+bool AutoCalibrator::measure(Quantity quantity, Measurement & measurement)
+{
+	size_t const count = std::max<uint8_t>(config.samples, 1);
+	int32_t gaugeReadings[UINT8_MAX];
+	int32_t meterReadings[UINT8_MAX];
+
+	for(size_t index = 0; index < count; index++)
+	{
+		if(index > 0)
+		{
+			ThisThread::sleep_for(GAUGE_UPDATE_PERIOD);
+		}
+
+		bool meterOK;
+		if(quantity == Quantity::VOLTAGE)
+		{
+			gaugeReadings[index] = soc.getVoltage();
+			meterOK = meter.measureVoltage(meterReadings[index]);
+		}
+		else
+		{
+			gaugeReadings[index] = soc.getCurrent();
+			meterOK = meter.measureCurrent(meterReadings[index]);
+		}
+		if(!meterOK)
+		{
+			return false;
+		}
+	}
+
+	RobustMean const gauge = robustMean(gaugeReadings, count, 1);
+	RobustMean const reference = robustMean(meterReadings, count, 1);
+	measurement.gauge = gauge.mean;
+	measurement.reference = reference.mean;
+	measurement.rejected = gauge.rejected + reference.rejected;
+	return true;
+}
+
+bool AutoCalibrator::readSetting(Quantity quantity, DataFlashCache & flash, uint32_t & setting)
+{
+	if(quantity == Quantity::VOLTAGE)
+	{
+		uint16_t divider;
+		if(!flash.get(DataFlash::VOLTAGE_DIVIDER, divider))
+		{
+			return false;
+		}
+		setting = divider;
+		return true;
+	}
+	float gain;
+	if(!flash.get(DataFlash::CC_GAIN, gain))
+	{
+		return false;
+	}
+	setting = Xemics::fromFloat(gain);
+	return true;
+}
+
+bool AutoCalibrator::correct(Quantity quantity, DataFlashCache & flash, Measurement const & measurement, Outcome & failure)
+{
+	if(quantity == Quantity::VOLTAGE)
+	{
+		uint16_t divider;
+		if(measurement.gauge <= 0 || measurement.reference <= 0 || !flash.get(DataFlash::VOLTAGE_DIVIDER, divider))
+		{
+			failure = Outcome::GAUGE_ERROR;
+			return false;
+		}
+		int64_t const scaled = (static_cast<int64_t>(divider) * measurement.reference + measurement.gauge / 2) / measurement.gauge;
+		flash.set<uint16_t>(DataFlash::VOLTAGE_DIVIDER, std::clamp<int64_t>(scaled, 1, UINT16_MAX));
+	}
+	else
+	{
+		if(std::abs(measurement.reference) < config.minCurrent_mA)
+		{
+			failure = Outcome::NO_CURRENT;
+			return false;
+		}
+		if(measurement.gauge == 0)
+		{
+			failure = Outcome::GAUGE_ERROR;
+			return false;
+		}
+		if((measurement.gauge < 0) != (measurement.reference < 0))
+		{
+			failure = Outcome::CURRENT_REVERSED;
+			return false;
+		}
+
+		float gain;
+		float delta;
+		if(!flash.get(DataFlash::CC_GAIN, gain) || !flash.get(DataFlash::CC_DELTA, delta))
+		{
+			failure = Outcome::GAUGE_ERROR;
+			return false;
+		}
+
+		// CC Delta is CC Gain scaled for charge instead of current, so both move together
+		float const ratio = static_cast<float>(measurement.gauge) / measurement.reference;
+		flash.set(DataFlash::CC_GAIN, gain * ratio);
+		flash.set(DataFlash::CC_DELTA, delta * ratio);
+	}
+
+	if(flash.commit().blocksFailed > 0)
+	{
+		failure = Outcome::FLASH_WRITE_FAILED;
+		return false;
+	}
+	return true;
+}
@@ -0,0 +1,107 @@
+//
+// Closed-loop calibration of the gauge's voltage divider and current sense gain against a reference meter.
+//
+
+#ifndef BQ34Z100G1_UTILS_AUTOCALIBRATION_H
+#define BQ34Z100G1_UTILS_AUTOCALIBRATION_H
+
+#include "BQ34Z100.h"
+#include "DataFlashCache.h"
+#include "ReferenceMeter.h"
+#include "mbed.h"
+
+#include <cstdint>
+
+/**
+ * Each measurement pairs up gauge and meter readings, one per gauge update, and averages each side with
+ * outlier rejection.  If the gauge is off by more than the tolerance, the calibration constant is scaled
+ * by reference / gauge, written to data flash, and the pack is measured again, up to maxCorrections times.
+ * The last measurement is always taken with the final constants, so its difference is the residual error.
+ *
+ * Unlike the driver's calibrateVoltage() and calibrateShunt(), which correct from a single gauge reading,
+ * this starts from whatever the gauge holds and never resets it.  The gauge must be unsealed.
+ */
+class AutoCalibrator
+{
+public:
+	struct Config
+	{
+		uint8_t samples = 10; // paired readings per measurement, at most 255
+		uint8_t maxCorrections = 4;
+		uint16_t voltageTolerance_mV = 5; // for the pack voltage
+		uint16_t currentTolerance_mA = 3;
+		int32_t minCurrent_mA = 100; // current calibration needs at least this much flowing
+	};
+
+	enum class Outcome : uint8_t
+	{
+		CONVERGED, // residual within the tolerance
+		NOT_CONVERGED, // still outside the tolerance after maxCorrections
+		METER_ERROR, // the reference meter didn't answer or gave an invalid reading
+		GAUGE_ERROR, // the gauge read zero, or its calibration data couldn't be read
+		NO_CURRENT, // less than minCurrent_mA flowing
+		CURRENT_REVERSED, // meter and gauge disagree on the direction of the current
+		FLASH_WRITE_FAILED
+	};
+
+	static char const * outcomeName(Outcome outcome);
+
+	// One measurement, in mV or mA
+	struct Measurement
+	{
+		int32_t reference;
+		int32_t gauge;
+		uint8_t rejected; // outliers left out, meter and gauge together
+
+		int32_t error() const { return gauge - reference; }
+	};
+
+	struct Result
+	{
+		Outcome outcome;
+		uint8_t corrections; // how many times the calibration constant was changed
+		Measurement last; // taken after the last correction, unless the outcome is an error
+
+		// Voltage divider (mV) or CC Gain (Xemics) in the gauge at the end
+		uint32_t setting;
+	};
+
+	// Called after each measurement, with the number of corrections made before it
+	using MeasurementHandler = Callback<void(uint8_t corrections, Measurement const & measurement)>;
+
+	AutoCalibrator(I2C & i2c, BQ34Z100 & soc, ReferenceMeter & meter, Config const & config);
+
+	/**
+	 * Calibrate the voltage divider.  The pack should be at rest, with the meter across it.
+	 */
+	Result calibrateVoltage(MeasurementHandler onMeasurement = nullptr);
+
+	/**
+	 * Calibrate CC Gain, and CC Delta along with it.  A steady current of at least minCurrent_mA must be
+	 * flowing through the sense resistor and the meter, e.g. from the charger.
+	 */
+	Result calibrateCurrent(MeasurementHandler onMeasurement = nullptr);
+
+private:
+	I2C & i2c;
+	BQ34Z100 & soc;
+	ReferenceMeter & meter;
+	Config config;
+
+	enum class Quantity
+	{
+		VOLTAGE,
+		CURRENT
+	};
+
+	Result calibrate(Quantity quantity, MeasurementHandler & onMeasurement);
+	bool measure(Quantity quantity, Measurement & measurement);
+
+	// Read the divider or CC Gain
+	bool readSetting(Quantity quantity, DataFlashCache & flash, uint32_t & setting);
+
+	// Scale the calibration constants by reference / gauge and write them to the gauge.  On failure, sets why.
+	bool correct(Quantity quantity, DataFlashCache & flash, Measurement const & measurement, Outcome & failure);
+};
+
+#endif //BQ34Z100G1_UTILS_AUTOCALIBRATION_H
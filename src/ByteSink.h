@@ -0,0 +1,21 @@
+//
+// Destination for binary data such as log frames or data flash images.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_BYTESINK_H
+#define BQ34Z100G1_UTILS_BYTESINK_H
+
+#include <cstddef>
+#include <cstdint>
+
+class ByteSink
+{
+public:
+	virtual void write(uint8_t const * data, size_t length) = 0;
+
+protected:
+	~ByteSink() = default;
+};
+
+#endif //BQ34Z100G1_UTILS_BYTESINK_H
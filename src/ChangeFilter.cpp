@@ -0,0 +1,79 @@
+//
+// Decides which voltage/current readings are worth printing when logging for a long time.
+//
+
+#include "ChangeFilter.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+ChangeFilter::ChangeFilter(Config const & config):
+config(config)
+{
+}
+
+ChangeFilter::Decision ChangeFilter::update(std::chrono::milliseconds timestamp, uint16_t voltage_mV, int16_t current_mA)
+{
+	trackCadence(timestamp, voltage_mV, current_mA);
+
+	bool const changed = !hasReport
+		|| std::abs(voltage_mV - reportedVoltage_mV) > config.voltageDeadband_mV
+		|| std::abs(current_mA - reportedCurrent_mA) > config.currentDeadband_mA;
+
+	Decision decision = Decision::SUPPRESS;
+	if(changed)
+	{
+		decision = Decision::REPORT;
+		hasReport = true;
+		reportedVoltage_mV = voltage_mV;
+		reportedCurrent_mA = current_mA;
+	}
+	else if(config.heartbeatInterval.count() > 0 && timestamp - lastOutputTime >= config.heartbeatInterval)
+	{
+		decision = Decision::HEARTBEAT;
+	}
+
+	if(decision == Decision::SUPPRESS)
+	{
+		++suppressedCount;
+		++totalSuppressedCount;
+	}
+	else
+	{
+		suppressedCount = 0;
+		lastOutputTime = timestamp;
+	}
+	return decision;
+}
+
+void ChangeFilter::trackCadence(std::chrono::milliseconds timestamp, uint16_t voltage_mV, int16_t current_mA)
+{
+	bool const changed = hasReading && (voltage_mV != lastVoltage_mV || current_mA != lastCurrent_mA);
+	hasReading = true;
+	lastVoltage_mV = voltage_mV;
+	lastCurrent_mA = current_mA;
+
+	if(!changed)
+	{
+		return;
+	}
+
+	// A refresh that happens to produce the same values is invisible, so intervals can come out as
+	// multiples of the real one.  The shortest recent interval is the best estimate.
+	if(hasChange)
+	{
+		intervals[intervalCount % INTERVAL_HISTORY] = timestamp - lastChangeTime;
+		++intervalCount;
+	}
+	hasChange = true;
+	lastChangeTime = timestamp;
+}
+
+std::chrono::milliseconds ChangeFilter::getUpdateInterval() const
+{
+	if(intervalCount == 0)
+	{
+		return std::chrono::milliseconds(0);
+	}
+	return *std::min_element(intervals, intervals + std::min(intervalCount, INTERVAL_HISTORY));
+}
@@ -0,0 +1,85 @@
+//
+// Decides which voltage/current readings are worth printing when logging for a long time.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_CHANGEFILTER_H
+#define BQ34Z100G1_UTILS_CHANGEFILTER_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * The gauge only refreshes its readings about once per second, so polling faster than that mostly
+ * produces repeats.  This filter passes a reading on only if it differs from the last reported one
+ * by more than a deadband.  With both deadbands at 0, every distinct value the gauge produced is
+ * reported, so the output is lossless.  A heartbeat is due if nothing was reported for a while,
+ * so a quiet log can be told apart from a stalled one.
+ *
+ * It also estimates the gauge's refresh interval from how often consecutive readings change.
+ */
+class ChangeFilter
+{
+public:
+	struct Config
+	{
+		// Changes of this size or smaller are suppressed
+		uint16_t voltageDeadband_mV = 0;
+		uint16_t currentDeadband_mA = 0;
+
+		// Longest time without output.  0 disables the heartbeat.
+		std::chrono::milliseconds heartbeatInterval = std::chrono::seconds(60);
+	};
+
+	enum class Decision
+	{
+		SUPPRESS,
+		REPORT,
+		HEARTBEAT // nothing changed, but the heartbeat interval has passed
+	};
+
+	explicit ChangeFilter(Config const & config);
+
+	// Feed the next reading.  Timestamps must not go backwards.
+	Decision update(std::chrono::milliseconds timestamp, uint16_t voltage_mV, int16_t current_mA);
+
+	/**
+	 * Estimated interval between gauge refreshes: the shortest recent interval between changed readings.
+	 * 0 until at least two changes have been seen.
+	 */
+	std::chrono::milliseconds getUpdateInterval() const;
+
+	// Readings suppressed since the last report or heartbeat
+	uint32_t getSuppressedCount() const { return suppressedCount; }
+
+	// Readings suppressed in total
+	uint32_t getTotalSuppressedCount() const { return totalSuppressedCount; }
+
+private:
+	// Number of recent refresh intervals to estimate the cadence from
+	static constexpr size_t INTERVAL_HISTORY = 8;
+
+	Config config;
+
+	bool hasReading = false;
+	uint16_t lastVoltage_mV = 0;
+	int16_t lastCurrent_mA = 0;
+	std::chrono::milliseconds lastChangeTime{0};
+	bool hasChange = false;
+
+	bool hasReport = false;
+	uint16_t reportedVoltage_mV = 0;
+	int16_t reportedCurrent_mA = 0;
+	std::chrono::milliseconds lastOutputTime{0};
+
+	std::chrono::milliseconds intervals[INTERVAL_HISTORY] = {};
+	size_t intervalCount = 0;
+
+	uint32_t suppressedCount = 0;
+	uint32_t totalSuppressedCount = 0;
+
+	void trackCadence(std::chrono::milliseconds timestamp, uint16_t voltage_mV, int16_t current_mA);
+};
+
+#endif //BQ34Z100G1_UTILS_CHANGEFILTER_H
@@ -0,0 +1,484 @@
+//
+// Small power-loss-safe key-value store for checkpoints, on top of a BlockDevice such as on-chip flash.
+//
+
+#include "CheckpointStore.h"
+#include "Crc16.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	void putLE32(uint8_t * out, uint32_t value)
+	{
+		for(size_t i = 0; i < 4; i++)
+		{
+			out[i] = (value >> (8 * i)) & 0xFF;
+		}
+	}
+
+	uint32_t getLE32(uint8_t const * in)
+	{
+		return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+	}
+
+	bd_size_t roundUp(bd_size_t value, bd_size_t multiple)
+	{
+		return (value + multiple - 1) / multiple * multiple;
+	}
+}
+
+CheckpointStore::CheckpointStore(BlockDevice & device):
+device(device)
+{
+}
+
+int CheckpointStore::init()
+{
+	ready = false;
+	if(device.init() != 0)
+	{
+		return ERROR_DEVICE;
+	}
+
+	// Slots have to start on program and read boundaries.  Both are powers of 2 on any real device.
+	slotSize = roundUp(MIN_SLOT_SIZE, std::max(device.get_program_size(), device.get_read_size()));
+	if(slotSize > MAX_SLOT_SIZE)
+	{
+		return ERROR_DEVICE;
+	}
+
+	// Use the last two erase units, which are the furthest away from anything else on the device
+	bd_size_t const deviceSize = device.size();
+	if(deviceSize == 0)
+	{
+		return ERROR_DEVICE;
+	}
+	areas[1].size = device.get_erase_size(deviceSize - 1);
+	if(areas[1].size >= deviceSize)
+	{
+		return ERROR_DEVICE;
+	}
+	areas[1].start = deviceSize - areas[1].size;
+	areas[0].size = device.get_erase_size(areas[1].start - 1);
+	if(areas[0].size > areas[1].start)
+	{
+		return ERROR_DEVICE;
+	}
+	areas[0].start = areas[1].start - areas[0].size;
+
+	// Switching areas needs room for every key plus the record being written
+	if(slotsPerArea(0) <= MAX_KEYS || slotsPerArea(1) <= MAX_KEYS)
+	{
+		return ERROR_DEVICE;
+	}
+
+	for(IndexEntry & entry : index)
+	{
+		entry.used = false;
+	}
+
+	// Find the newest record of every key, and where each area's records end
+	uint32_t newestSequence[2] = {0, 0};
+	int64_t lastUsedSlot[2] = {-1, -1};
+	for(uint8_t area = 0; area < 2; area++)
+	{
+		for(uint32_t slot = 0; slot < slotsPerArea(area); slot++)
+		{
+			Record record;
+			bool blank;
+			bool const valid = readRecord(area, slot, record, blank);
+			if(!blank)
+			{
+				// including records cut off by a reset, since they can't be programmed again without an erase
+				lastUsedSlot[area] = slot;
+			}
+			if(!valid)
+			{
+				continue;
+			}
+
+			newestSequence[area] = std::max(newestSequence[area], record.sequence);
+
+			IndexEntry * entry = findEntry(record.key);
+			if(entry == nullptr)
+			{
+				entry = std::find_if(std::begin(index), std::end(index), [](IndexEntry const & e) { return !e.used; });
+				if(entry == std::end(index))
+				{
+					continue;
+				}
+				entry->used = true;
+				strcpy(entry->key, record.key);
+			}
+			else if(entry->sequence > record.sequence)
+			{
+				continue;
+			}
+
+			entry->area = area;
+			entry->slot = slot;
+			entry->sequence = record.sequence;
+			entry->removed = record.flags & RECORD_FLAG_REMOVED;
+		}
+	}
+
+	activeArea = newestSequence[1] > newestSequence[0] ? 1 : 0;
+	nextSequence = std::max(newestSequence[0], newestSequence[1]) + 1;
+	nextSlot = static_cast<uint32_t>(lastUsedSlot[activeArea] + 1);
+
+	if(newestSequence[0] == 0 && newestSequence[1] == 0 && lastUsedSlot[0] >= 0)
+	{
+		// Nothing of ours on the device, but something else is in the way
+		int const result = eraseArea(0);
+		if(result != OK)
+		{
+			return result;
+		}
+		nextSlot = 0;
+	}
+
+	ready = true;
+	return consolidate();
+}
+
+int CheckpointStore::set(char const * key, void const * data, size_t size)
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+	if(!validKey(key) || size > MAX_DATA_SIZE || (data == nullptr && size > 0))
+	{
+		return ERROR_INVALID_ARGUMENT;
+	}
+
+	IndexEntry * entry = findEntry(key);
+	if(entry != nullptr && !entry->removed)
+	{
+		// Don't wear the flash writing what is already there
+		Record record;
+		bool blank;
+		if(readRecord(entry->area, entry->slot, record, blank) && record.dataSize == size
+			&& memcmp(record.data, data, size) == 0)
+		{
+			return OK;
+		}
+	}
+	else if(entry == nullptr)
+	{
+		entry = std::find_if(std::begin(index), std::end(index), [](IndexEntry const & e) { return !e.used; });
+		if(entry == std::end(index))
+		{
+			return ERROR_FULL;
+		}
+
+		// Counts as removed until its first record is written
+		entry->used = true;
+		entry->removed = true;
+		strcpy(entry->key, key);
+	}
+
+	return appendRecord(*entry, 0, data, size);
+}
+
+int CheckpointStore::get(char const * key, void * buffer, size_t bufferSize, size_t * actualSize)
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+	if(!validKey(key))
+	{
+		return ERROR_INVALID_ARGUMENT;
+	}
+
+	IndexEntry const * entry = findEntry(key);
+	if(entry == nullptr || entry->removed)
+	{
+		return ERROR_NOT_FOUND;
+	}
+
+	Record record;
+	bool blank;
+	if(!readRecord(entry->area, entry->slot, record, blank))
+	{
+		return ERROR_DEVICE;
+	}
+
+	memcpy(buffer, record.data, std::min(bufferSize, record.dataSize));
+	if(actualSize != nullptr)
+	{
+		*actualSize = record.dataSize;
+	}
+	return OK;
+}
+
+int CheckpointStore::remove(char const * key)
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+	if(!validKey(key))
+	{
+		return ERROR_INVALID_ARGUMENT;
+	}
+
+	IndexEntry * entry = findEntry(key);
+	if(entry == nullptr || entry->removed)
+	{
+		return ERROR_NOT_FOUND;
+	}
+	return appendRecord(*entry, RECORD_FLAG_REMOVED, nullptr, 0);
+}
+
+int CheckpointStore::reset()
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+
+	for(uint8_t area = 0; area < 2; area++)
+	{
+		int const result = eraseArea(area);
+		if(result != OK)
+		{
+			return result;
+		}
+	}
+
+	for(IndexEntry & entry : index)
+	{
+		entry.used = false;
+	}
+	activeArea = 0;
+	nextSlot = 0;
+	nextSequence = 1;
+	return OK;
+}
+
+bool CheckpointStore::readRecord(uint8_t area, uint32_t slot, Record & record, bool & blank)
+{
+	uint8_t buffer[MAX_SLOT_SIZE];
+	blank = false;
+	if(device.read(buffer, slotAddress(area, slot), slotSize) != 0)
+	{
+		return false;
+	}
+
+	int const eraseValue = device.get_erase_value();
+	if(eraseValue >= 0)
+	{
+		blank = std::all_of(buffer, buffer + slotSize, [eraseValue](uint8_t byte) { return byte == eraseValue; });
+	}
+
+	uint8_t const keyLength = buffer[2];
+	uint8_t const dataSize = buffer[3];
+	bool valid = buffer[0] == RECORD_MAGIC && keyLength > 0 && keyLength <= MAX_KEY_LENGTH && dataSize <= MAX_DATA_SIZE;
+	if(valid)
+	{
+		size_t const crcOffset = HEADER_SIZE + keyLength + dataSize;
+		uint16_t const storedCRC = buffer[crcOffset] | (buffer[crcOffset + 1] << 8);
+		valid = crc16(buffer, crcOffset) == storedCRC;
+	}
+
+	if(!valid)
+	{
+		// Without a known erase value, anything that isn't a record may be written over
+		if(eraseValue < 0)
+		{
+			blank = true;
+		}
+		return false;
+	}
+
+	record.flags = buffer[1];
+	record.sequence = getLE32(buffer + 4);
+	memcpy(record.key, buffer + HEADER_SIZE, keyLength);
+	record.key[keyLength] = '\0';
+	memcpy(record.data, buffer + HEADER_SIZE + keyLength, dataSize);
+	record.dataSize = dataSize;
+	return true;
+}
+
+int CheckpointStore::appendRecord(IndexEntry & entry, uint8_t flags, void const * data, size_t size)
+{
+	if(nextSlot >= slotsPerArea(activeArea))
+	{
+		int const result = switchAreas();
+		if(result != OK)
+		{
+			return result;
+		}
+	}
+
+	uint32_t const sequence = nextSequence++;
+	uint32_t const slot = nextSlot++;
+	int const result = programRecord(activeArea, slot, sequence, entry.key, flags, data, size);
+	if(result != OK)
+	{
+		return result;
+	}
+
+	// The entry may have been dropped by the switch if this is its first record
+	entry.used = true;
+	entry.area = activeArea;
+	entry.slot = slot;
+	entry.sequence = sequence;
+	entry.removed = flags & RECORD_FLAG_REMOVED;
+	return OK;
+}
+
+int CheckpointStore::programRecord(uint8_t area, uint32_t slot, uint32_t sequence, char const * key, uint8_t flags,
+	void const * data, size_t size)
+{
+	size_t const keyLength = strlen(key);
+
+	// Pad with the erase value, so the padding doesn't program any bits
+	int const eraseValue = device.get_erase_value();
+	uint8_t buffer[MAX_SLOT_SIZE];
+	memset(buffer, eraseValue >= 0 ? eraseValue : 0xFF, slotSize);
+
+	buffer[0] = RECORD_MAGIC;
+	buffer[1] = flags;
+	buffer[2] = static_cast<uint8_t>(keyLength);
+	buffer[3] = static_cast<uint8_t>(size);
+	putLE32(buffer + 4, sequence);
+	memcpy(buffer + HEADER_SIZE, key, keyLength);
+	if(size > 0)
+	{
+		memcpy(buffer + HEADER_SIZE + keyLength, data, size);
+	}
+
+	size_t const crcOffset = HEADER_SIZE + keyLength + size;
+	uint16_t const crc = crc16(buffer, crcOffset);
+	buffer[crcOffset] = crc & 0xFF;
+	buffer[crcOffset + 1] = crc >> 8;
+
+	return device.program(buffer, slotAddress(area, slot), slotSize) == 0 ? OK : ERROR_DEVICE;
+}
+
+int CheckpointStore::switchAreas()
+{
+	uint8_t const newArea = 1 - activeArea;
+	int result = eraseArea(newArea);
+	if(result != OK)
+	{
+		return result;
+	}
+
+	// The old area stays intact until the next switch, so a reset partway through loses nothing
+	uint32_t slot = 0;
+	for(IndexEntry & entry : index)
+	{
+		if(!entry.used)
+		{
+			continue;
+		}
+		if(entry.removed)
+		{
+			// Nothing is left of it in the new area
+			entry.used = false;
+			continue;
+		}
+
+		Record record;
+		bool blank;
+		if(!readRecord(entry.area, entry.slot, record, blank))
+		{
+			return ERROR_DEVICE;
+		}
+
+		uint32_t const sequence = nextSequence++;
+		result = programRecord(newArea, slot, sequence, entry.key, 0, record.data, record.dataSize);
+		if(result != OK)
+		{
+			return result;
+		}
+		entry.area = newArea;
+		entry.slot = slot++;
+		entry.sequence = sequence;
+	}
+
+	activeArea = newArea;
+	nextSlot = slot;
+	return OK;
+}
+
+int CheckpointStore::consolidate()
+{
+	for(IndexEntry & entry : index)
+	{
+		if(!entry.used || entry.removed || entry.area == activeArea)
+		{
+			continue;
+		}
+
+		Record record;
+		bool blank;
+		if(!readRecord(entry.area, entry.slot, record, blank))
+		{
+			return ERROR_DEVICE;
+		}
+
+		int const result = appendRecord(entry, 0, record.data, record.dataSize);
+		if(result != OK)
+		{
+			return result;
+		}
+	}
+	return OK;
+}
+
+int CheckpointStore::eraseArea(uint8_t area)
+{
+	++eraseCount;
+	if(device.erase(areas[area].start, areas[area].size) != 0)
+	{
+		return ERROR_DEVICE;
+	}
+	if(device.get_erase_value() >= 0)
+	{
+		return OK;
+	}
+
+	// Erasing leaves the old contents on some devices (RAM, SD cards), and records from before the erase would be
+	// found again after a reset, bringing removed keys back.  Overwrite them, from the start so that a reset
+	// partway through leaves the newest record of every key that is left.
+	uint8_t blank[MAX_SLOT_SIZE];
+	memset(blank, 0xFF, sizeof(blank));
+	for(bd_size_t offset = 0; offset < areas[area].size; offset += slotSize)
+	{
+		bd_size_t const length = std::min<bd_size_t>(slotSize, areas[area].size - offset);
+		if(device.program(blank, areas[area].start + offset, length) != 0)
+		{
+			return ERROR_DEVICE;
+		}
+	}
+	return OK;
+}
+
+CheckpointStore::IndexEntry * CheckpointStore::findEntry(char const * key)
+{
+	for(IndexEntry & entry : index)
+	{
+		if(entry.used && strcmp(entry.key, key) == 0)
+		{
+			return &entry;
+		}
+	}
+	return nullptr;
+}
+
+bool CheckpointStore::validKey(char const * key)
+{
+	if(key == nullptr)
+	{
+		return false;
+	}
+	size_t const length = strlen(key);
+	return length > 0 && length <= MAX_KEY_LENGTH;
+}
@@ -0,0 +1,143 @@
+//
+// Small power-loss-safe key-value store for checkpoints, on top of a BlockDevice such as on-chip flash.
+//
+
+#ifndef BQ34Z100G1_UTILS_CHECKPOINTSTORE_H
+#define BQ34Z100G1_UTILS_CHECKPOINTSTORE_H
+
+#include <mbed.h>
+#include "blockdevice/BlockDevice.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Stores a handful of small values under string keys, with the same set()/get()/remove() calls as Mbed's KVStore.
+ *
+ * The store is a log: every set() programs one fixed-size, CRC-protected record into the next free slot, and
+ * the newest record for a key wins.  A write that is cut off by a reset fails its CRC and is ignored, leaving
+ * the previous value in place.  Records go into two areas (the last two erase units of the device) in turn.
+ * Once the active area is full, the other one is erased, the current value of every key is copied across,
+ * and writing carries on there, so each erase unit is only erased once per area's worth of writes and both
+ * wear at the same rate.  A set() to the value that is already stored writes nothing.
+ */
+class CheckpointStore
+{
+public:
+	// Return codes, as for KVStore
+	static constexpr int OK = 0;
+	static constexpr int ERROR_NOT_FOUND = -1;
+	static constexpr int ERROR_INVALID_ARGUMENT = -2;
+	static constexpr int ERROR_DEVICE = -3;
+	static constexpr int ERROR_FULL = -4; // too many keys
+	static constexpr int ERROR_NOT_READY = -5; // init() not called or failed
+
+	// Longest key, not counting the terminator
+	static constexpr size_t MAX_KEY_LENGTH = 16;
+
+	static constexpr size_t MAX_DATA_SIZE = 32;
+
+	// Most distinct keys that can be stored
+	static constexpr size_t MAX_KEYS = 12;
+
+	explicit CheckpointStore(BlockDevice & device);
+
+	/**
+	 * Initialize the device and find the newest record for every key.
+	 * Also finishes moving the keys across if a reset interrupted the switch to the other area.
+	 */
+	int init();
+
+	int set(char const * key, void const * data, size_t size);
+
+	/**
+	 * Copy out the value of a key.
+	 * @param actualSize if not null, set to the size of the stored value, which may be more than was copied
+	 */
+	int get(char const * key, void * buffer, size_t bufferSize, size_t * actualSize = nullptr);
+
+	int remove(char const * key);
+
+	// Erase both areas, removing every key
+	int reset();
+
+	// Number of erases done since init(), for checking wear
+	uint32_t getEraseCount() const { return eraseCount; }
+
+private:
+	static constexpr uint8_t RECORD_MAGIC = 0xC7;
+	static constexpr uint8_t RECORD_FLAG_REMOVED = 1 << 0;
+
+	// magic, flags, key length, data length and sequence number
+	static constexpr size_t HEADER_SIZE = 8;
+	static constexpr size_t CRC_SIZE = 2;
+	static constexpr size_t MIN_SLOT_SIZE = HEADER_SIZE + MAX_KEY_LENGTH + MAX_DATA_SIZE + CRC_SIZE;
+
+	// Largest slot allowed, for devices with a big program size
+	static constexpr size_t MAX_SLOT_SIZE = 256;
+
+	struct Area
+	{
+		bd_addr_t start = 0;
+		bd_size_t size = 0;
+	};
+
+	// Where the newest record of a key is
+	struct IndexEntry
+	{
+		bool used = false;
+		char key[MAX_KEY_LENGTH + 1];
+		uint8_t area = 0;
+		uint32_t slot = 0;
+		uint32_t sequence = 0;
+		bool removed = false;
+	};
+
+	// A record as read back from a slot
+	struct Record
+	{
+		uint8_t flags;
+		uint32_t sequence;
+		char key[MAX_KEY_LENGTH + 1];
+		uint8_t data[MAX_DATA_SIZE];
+		size_t dataSize;
+	};
+
+	BlockDevice & device;
+	bool ready = false;
+
+	Area areas[2];
+	size_t slotSize = 0;
+	uint8_t activeArea = 0;
+	uint32_t nextSlot = 0; // in the active area
+	uint32_t nextSequence = 1;
+	uint32_t eraseCount = 0;
+
+	IndexEntry index[MAX_KEYS];
+
+	uint32_t slotsPerArea(uint8_t area) const { return static_cast<uint32_t>(areas[area].size / slotSize); }
+	bd_addr_t slotAddress(uint8_t area, uint32_t slot) const { return areas[area].start + static_cast<bd_addr_t>(slot) * slotSize; }
+
+	// Read and check one slot.  Sets blank if the slot has never been programmed since its last erase.
+	bool readRecord(uint8_t area, uint32_t slot, Record & record, bool & blank);
+
+	// Program a record for the entry's key into the next free slot of the active area, switching areas first if it is full
+	int appendRecord(IndexEntry & entry, uint8_t flags, void const * data, size_t size);
+
+	// Program a record at the given position
+	int programRecord(uint8_t area, uint32_t slot, uint32_t sequence, char const * key, uint8_t flags,
+		void const * data, size_t size);
+
+	// Erase the other area and move the current value of every key into it
+	int switchAreas();
+
+	// Copy any key whose newest record is not in the active area into it
+	int consolidate();
+
+	int eraseArea(uint8_t area);
+
+	IndexEntry * findEntry(char const * key);
+	static bool validKey(char const * key);
+};
+
+#endif //BQ34Z100G1_UTILS_CHECKPOINTSTORE_H
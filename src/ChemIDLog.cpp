@@ -0,0 +1,438 @@
+//
+// Compact binary log format for chem ID measurement runs.
+//
+
+#include "ChemIDLog.h"
+#include "Crc16.h"
+#include "FixedFormat.h"
+
+#include <cinttypes>
+#include <cstdio>
+
+namespace ChemIDLog
+{
+	namespace
+	{
+		void putLE16(uint8_t * out, uint16_t value)
+		{
+			out[0] = value & 0xFF;
+			out[1] = value >> 8;
+		}
+
+		void putLE32(uint8_t * out, uint32_t value)
+		{
+			putLE16(out, value & 0xFFFF);
+			putLE16(out + 2, value >> 16);
+		}
+
+		uint16_t getLE16(uint8_t const * in)
+		{
+			return static_cast<uint16_t>(in[0] | (in[1] << 8));
+		}
+
+		uint32_t getLE32(uint8_t const * in)
+		{
+			return getLE16(in) | (static_cast<uint32_t>(getLE16(in + 2)) << 16);
+		}
+
+		bool fitsInInt8(int32_t value)
+		{
+			return value >= INT8_MIN && value <= INT8_MAX;
+		}
+
+		void encodeAbsolute(uint8_t * out, Sample const & sample)
+		{
+			putLE32(out, sample.elapsed_s);
+			putLE16(out + 4, sample.voltage_mV);
+			putLE16(out + 6, static_cast<uint16_t>(sample.current_mA));
+			putLE16(out + 8, sample.temperature_dK);
+			out[10] = sample.soc_percent;
+		}
+
+		// Bits of the relax evidence flags byte
+		constexpr uint8_t EVIDENCE_SETTLED = 1 << 0;
+		constexpr uint8_t EVIDENCE_OCV_TAKEN_KNOWN = 1 << 1;
+		constexpr uint8_t EVIDENCE_OCV_TAKEN = 1 << 2;
+
+		void encodeEvidence(uint8_t * out, RelaxDetector::Evidence const & evidence)
+		{
+			out[0] = (evidence.settled ? EVIDENCE_SETTLED : 0) | (evidence.ocvTakenKnown ? EVIDENCE_OCV_TAKEN_KNOWN : 0)
+				| (evidence.ocvTaken ? EVIDENCE_OCV_TAKEN : 0);
+			putLE32(out + 1, evidence.relaxTime_s);
+			putLE32(out + 5, static_cast<uint32_t>(evidence.slope_nVps));
+			putLE32(out + 9, evidence.slopeLimit_nVps);
+			putLE32(out + 13, evidence.underLimitTime_s);
+		}
+
+		void decodeEvidence(uint8_t const * in, RelaxDetector::Evidence & evidence)
+		{
+			evidence.settled = in[0] & EVIDENCE_SETTLED;
+			evidence.ocvTakenKnown = in[0] & EVIDENCE_OCV_TAKEN_KNOWN;
+			evidence.ocvTaken = in[0] & EVIDENCE_OCV_TAKEN;
+			evidence.relaxTime_s = getLE32(in + 1);
+			evidence.slope_nVps = static_cast<int32_t>(getLE32(in + 5));
+			evidence.slopeLimit_nVps = getLE32(in + 9);
+			evidence.underLimitTime_s = getLE32(in + 13);
+		}
+
+		void encodeQuantity(uint8_t * out, PhaseStatistics::Quantity const & quantity)
+		{
+			putLE32(out, static_cast<uint32_t>(quantity.min));
+			putLE32(out + 4, static_cast<uint32_t>(quantity.max));
+			putLE32(out + 8, static_cast<uint32_t>(quantity.mean_x10));
+			putLE32(out + 12, quantity.stdDev_x10);
+		}
+
+		void decodeQuantity(uint8_t const * in, PhaseStatistics::Quantity & quantity)
+		{
+			quantity.min = static_cast<int32_t>(getLE32(in));
+			quantity.max = static_cast<int32_t>(getLE32(in + 4));
+			quantity.mean_x10 = static_cast<int32_t>(getLE32(in + 8));
+			quantity.stdDev_x10 = getLE32(in + 12);
+		}
+
+		void encodeSummary(uint8_t * out, PhaseStatistics::Summary const & summary)
+		{
+			putLE32(out, summary.duration_s);
+			putLE32(out + 4, summary.sampleCount);
+			putLE32(out + 8, static_cast<uint32_t>(summary.charge_uAh));
+			putLE32(out + 12, static_cast<uint32_t>(summary.energy_uWh));
+			putLE16(out + 16, summary.remainingStart_mAh);
+			putLE16(out + 18, summary.remainingEnd_mAh);
+			encodeQuantity(out + 20, summary.voltage_mV);
+			encodeQuantity(out + 36, summary.current_mA);
+			encodeQuantity(out + 52, summary.temperature_dK);
+		}
+
+		void decodeSummary(uint8_t const * in, PhaseStatistics::Summary & summary)
+		{
+			summary.duration_s = getLE32(in);
+			summary.sampleCount = getLE32(in + 4);
+			summary.charge_uAh = static_cast<int32_t>(getLE32(in + 8));
+			summary.energy_uWh = static_cast<int32_t>(getLE32(in + 12));
+			summary.remainingStart_mAh = getLE16(in + 16);
+			summary.remainingEnd_mAh = getLE16(in + 18);
+			decodeQuantity(in + 20, summary.voltage_mV);
+			decodeQuantity(in + 36, summary.current_mA);
+			decodeQuantity(in + 52, summary.temperature_dK);
+		}
+
+		void decodeAbsolute(uint8_t const * in, Sample & sample)
+		{
+			sample.elapsed_s = getLE32(in);
+			sample.voltage_mV = getLE16(in + 4);
+			sample.current_mA = static_cast<int16_t>(getLE16(in + 6));
+			sample.temperature_dK = getLE16(in + 8);
+			sample.soc_percent = in[10];
+		}
+	}
+
+	char const * eventComment(Event event)
+	{
+		switch(event)
+		{
+			case Event::CHARGE_STARTED:
+				return "Activating charger and entering CHARGE";
+			case Event::CHARGE_DONE:
+				return "Deactivating charger and entering RELAX_CHARGED";
+			case Event::RELAX_CHARGED_DONE:
+				return "Done relaxing and entering discharge -- please disconnect charger and connect C/10 load now.";
+			case Event::DISCHARGE_DONE:
+				return "Done discharging -- please remove C/10 load now.";
+			case Event::DONE:
+				return "Done!";
+			case Event::RESUMED:
+				return "Resumed from checkpoint after a reset";
+			default:
+				return "";
+		}
+	}
+
+	int formatCSVRow(char * buffer, size_t size, Sample const & sample, Event event)
+	{
+		// Temperature is converted the same way as BQ34Z100::getTemperature(), but in hundredths of a degree.
+		// Kelvin to Celsius is exact at that resolution, so the extra zeros give the same text as printing the float with %f.
+		int32_t const temperature_cC = static_cast<int32_t>(sample.temperature_dK) * 10 - 27315;
+
+		FixedFormatter row(buffer, size);
+		row.unsignedInt(sample.elapsed_s).text(", ")
+			.unsignedInt(sample.voltage_mV).text(", ")
+			.signedInt(sample.current_mA).text(", ")
+			.fixed(temperature_cC, 2).text("0000, ")
+			.unsignedInt(sample.soc_percent).text(", ")
+			.text(eventComment(event)).character('\n');
+		return static_cast<int>(row.length());
+	}
+
+	int formatCSVNote(char * buffer, size_t size, RelaxDetector::Evidence const * relaxEvidence,
+		PhaseStatistics::Summary const * phaseSummary)
+	{
+		if(relaxEvidence == nullptr && phaseSummary == nullptr)
+		{
+			if(size > 0)
+			{
+				buffer[0] = '\0';
+			}
+			return 0;
+		}
+
+		char evidenceText[128] = "";
+		if(relaxEvidence != nullptr)
+		{
+			RelaxDetector::formatEvidence(evidenceText, sizeof(evidenceText), *relaxEvidence);
+		}
+
+		char summaryText[320] = "";
+		if(phaseSummary != nullptr)
+		{
+			PhaseStatistics::formatSummary(summaryText, sizeof(summaryText), *phaseSummary);
+		}
+
+		FixedFormatter note(buffer, size);
+		note.text("# ").text(evidenceText).text(relaxEvidence != nullptr && phaseSummary != nullptr ? " " : "")
+			.text(summaryText).character('\n');
+		return static_cast<int>(note.length());
+	}
+
+	Encoder::Encoder(Sink & sink, uint8_t channel):
+	sink(sink),
+	channel(channel % MAX_CHANNELS)
+	{
+	}
+
+	void Encoder::start()
+	{
+		uint8_t const version = FORMAT_VERSION;
+		sendFrame(FrameType::START, &version, 1);
+	}
+
+	void Encoder::addEvent(Event event, RelaxDetector::Evidence const * relaxEvidence, PhaseStatistics::Summary const * phaseSummary)
+	{
+		// Keep ordering: the event applies to the sample after everything already buffered
+		flush();
+
+		uint8_t eventPayload[1 + RELAX_EVIDENCE_SIZE + PHASE_SUMMARY_SIZE];
+		size_t eventLength = 0;
+		eventPayload[eventLength++] = static_cast<uint8_t>(event);
+		if(relaxEvidence != nullptr)
+		{
+			encodeEvidence(eventPayload + eventLength, *relaxEvidence);
+			eventLength += RELAX_EVIDENCE_SIZE;
+		}
+		if(phaseSummary != nullptr)
+		{
+			encodeSummary(eventPayload + eventLength, *phaseSummary);
+			eventLength += PHASE_SUMMARY_SIZE;
+		}
+		sendFrame(FrameType::EVENT, eventPayload, eventLength);
+	}
+
+	void Encoder::addSample(Sample const & sample)
+	{
+		if(samplesInFrame > 0)
+		{
+			int32_t const deltaTime = static_cast<int64_t>(sample.elapsed_s) - previous.elapsed_s;
+			int32_t const deltaVoltage = static_cast<int32_t>(sample.voltage_mV) - previous.voltage_mV;
+			int32_t const deltaCurrent = static_cast<int32_t>(sample.current_mA) - previous.current_mA;
+			int32_t const deltaTemperature = static_cast<int32_t>(sample.temperature_dK) - previous.temperature_dK;
+			int32_t const deltaSOC = static_cast<int32_t>(sample.soc_percent) - previous.soc_percent;
+
+			if(deltaTime >= 0 && deltaTime <= UINT8_MAX && fitsInInt8(deltaVoltage) && fitsInInt8(deltaCurrent)
+				&& fitsInInt8(deltaTemperature) && fitsInInt8(deltaSOC))
+			{
+				uint8_t * out = payload + payloadLength;
+				out[0] = static_cast<uint8_t>(deltaTime);
+				out[1] = static_cast<uint8_t>(static_cast<int8_t>(deltaVoltage));
+				out[2] = static_cast<uint8_t>(static_cast<int8_t>(deltaCurrent));
+				out[3] = static_cast<uint8_t>(static_cast<int8_t>(deltaTemperature));
+				out[4] = static_cast<uint8_t>(static_cast<int8_t>(deltaSOC));
+				payloadLength += DELTA_SAMPLE_SIZE;
+				++samplesInFrame;
+				previous = sample;
+
+				if(samplesInFrame == MAX_SAMPLES_PER_FRAME)
+				{
+					flush();
+				}
+				return;
+			}
+
+			// Too big a jump to encode as a delta, so start a new frame
+			flush();
+		}
+
+		encodeAbsolute(payload, sample);
+		payloadLength = ABSOLUTE_SAMPLE_SIZE;
+		samplesInFrame = 1;
+		previous = sample;
+	}
+
+	void Encoder::flush()
+	{
+		if(samplesInFrame == 0)
+		{
+			return;
+		}
+
+		sendFrame(FrameType::SAMPLES, payload, payloadLength);
+		payloadLength = 0;
+		samplesInFrame = 0;
+	}
+
+	void Encoder::sendFrame(FrameType type, uint8_t const * data, size_t length)
+	{
+		uint8_t const typeByte = static_cast<uint8_t>(channel << 4) | static_cast<uint8_t>(type);
+		uint8_t header[3] = {SYNC, typeByte, static_cast<uint8_t>(length)};
+		uint16_t crc = crc16(header + 1, 2);
+		crc = crc16(data, length, crc);
+
+		uint8_t crcBytes[2];
+		putLE16(crcBytes, crc);
+
+		sink.write(header, sizeof(header));
+		sink.write(data, length);
+		sink.write(crcBytes, sizeof(crcBytes));
+	}
+
+	Decoder::Decoder(Listener & listener):
+	listener(listener)
+	{
+	}
+
+	void Decoder::feed(uint8_t const * data, size_t dataLength)
+	{
+		for(size_t i = 0; i < dataLength; i++)
+		{
+			uint8_t const byte = data[i];
+			switch(parseState)
+			{
+				case ParseState::SYNC:
+					if(byte == SYNC)
+					{
+						parseState = ParseState::TYPE;
+					}
+					break;
+
+				case ParseState::TYPE:
+					type = byte;
+					parseState = ParseState::LENGTH;
+					break;
+
+				case ParseState::LENGTH:
+					length = byte;
+					received = 0;
+					if(length > MAX_PAYLOAD_SIZE)
+					{
+						listener.onBadFrame();
+						parseState = ParseState::SYNC;
+					}
+					else
+					{
+						parseState = length > 0 ? ParseState::PAYLOAD : ParseState::CRC_LOW;
+					}
+					break;
+
+				case ParseState::PAYLOAD:
+					payload[received++] = byte;
+					if(received == length)
+					{
+						parseState = ParseState::CRC_LOW;
+					}
+					break;
+
+				case ParseState::CRC_LOW:
+					receivedCRC = byte;
+					parseState = ParseState::CRC_HIGH;
+					break;
+
+				case ParseState::CRC_HIGH:
+				{
+					receivedCRC |= static_cast<uint16_t>(byte) << 8;
+					parseState = ParseState::SYNC;
+
+					uint8_t const header[2] = {type, length};
+					uint16_t crc = crc16(header, 2);
+					crc = crc16(payload, length, crc);
+					if(crc == receivedCRC)
+					{
+						handleFrame();
+					}
+					else
+					{
+						listener.onBadFrame();
+					}
+					break;
+				}
+			}
+		}
+	}
+
+	void Decoder::handleFrame()
+	{
+		uint8_t const channel = type >> 4;
+		Event & pendingEvent = pendingEvents[channel];
+
+		switch(static_cast<FrameType>(type & 0x0F))
+		{
+			case FrameType::START:
+				if(length == 1)
+				{
+					pendingEvent = Event::NONE;
+					listener.onStart(channel, payload[0]);
+					return;
+				}
+				break;
+
+			case FrameType::EVENT:
+			{
+				// The optional parts have different sizes, so the length tells which ones are there
+				size_t const extraLength = length - 1u;
+				bool const hasEvidence = extraLength == RELAX_EVIDENCE_SIZE || extraLength == RELAX_EVIDENCE_SIZE + PHASE_SUMMARY_SIZE;
+				bool const hasSummary = extraLength == PHASE_SUMMARY_SIZE || extraLength == RELAX_EVIDENCE_SIZE + PHASE_SUMMARY_SIZE;
+				if(length >= 1 && (extraLength == 0 || hasEvidence || hasSummary))
+				{
+					pendingEvent = static_cast<Event>(payload[0]);
+					if(hasEvidence)
+					{
+						RelaxDetector::Evidence evidence;
+						decodeEvidence(payload + 1, evidence);
+						listener.onRelaxEvidence(channel, evidence);
+					}
+					if(hasSummary)
+					{
+						PhaseStatistics::Summary summary;
+						decodeSummary(payload + (hasEvidence ? 1 + RELAX_EVIDENCE_SIZE : 1), summary);
+						listener.onPhaseSummary(channel, summary);
+					}
+					return;
+				}
+				break;
+			}
+
+			case FrameType::SAMPLES:
+				if(length >= ABSOLUTE_SAMPLE_SIZE && (length - ABSOLUTE_SAMPLE_SIZE) % DELTA_SAMPLE_SIZE == 0)
+				{
+					Sample sample;
+					decodeAbsolute(payload, sample);
+					listener.onSample(channel, sample, pendingEvent);
+					pendingEvent = Event::NONE;
+
+					for(size_t offset = ABSOLUTE_SAMPLE_SIZE; offset < length; offset += DELTA_SAMPLE_SIZE)
+					{
+						uint8_t const * in = payload + offset;
+						sample.elapsed_s += in[0];
+						sample.voltage_mV += static_cast<int8_t>(in[1]);
+						sample.current_mA += static_cast<int8_t>(in[2]);
+						sample.temperature_dK += static_cast<int8_t>(in[3]);
+						sample.soc_percent += static_cast<int8_t>(in[4]);
+						listener.onSample(channel, sample, Event::NONE);
+					}
+					return;
+				}
+				break;
+		}
+
+		// Valid CRC but nonsensical contents
+		listener.onBadFrame();
+	}
+}
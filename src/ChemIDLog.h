@@ -0,0 +1,199 @@
+//
+// Compact binary log format for chem ID measurement runs.
+// This file has no Mbed dependencies so that the host-side decoder can share it.
+//
+// Each frame on the wire looks like:
+//   SYNC (0xA5) | type (1 byte) | payload length (1 byte) | payload | CRC-16/CCITT (2 bytes, little endian)
+// The CRC covers the type, length and payload bytes.
+// The low nibble of the type byte is the frame type, and the high nibble is the channel (pack) that the frame
+// belongs to, so runs on several packs can be interleaved in one stream.  Version 1 logs only used channel 0.
+//
+// Frame types:
+//   START:   format version (1 byte).  Marks the beginning of a run on the channel; the decoder prints the CSV header.
+//   EVENT:   event code (1 byte).  Attaches a state-change comment to the next sample.
+//            Optionally followed by RELAX_EVIDENCE_SIZE bytes saying why a relax phase ended (version 3),
+//            then optionally by PHASE_SUMMARY_SIZE bytes of statistics over the phase that ended (version 4).
+//   SAMPLES: one absolute base sample followed by up to MAX_SAMPLES_PER_FRAME - 1 delta samples.
+//            Every frame starts with an absolute sample, so frames can be decoded independently.
+//
+
+#ifndef BQ34Z100G1_UTILS_CHEMIDLOG_H
+#define BQ34Z100G1_UTILS_CHEMIDLOG_H
+
+#include "ByteSink.h"
+#include "PhaseStatistics.h"
+#include "RelaxDetector.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace ChemIDLog
+{
+	constexpr uint8_t SYNC = 0xA5;
+	constexpr uint8_t FORMAT_VERSION = 4;
+
+	// Channels that fit in the high nibble of the frame type
+	constexpr uint8_t MAX_CHANNELS = 16;
+
+	enum class FrameType : uint8_t
+	{
+		START = 0x01,
+		EVENT = 0x02,
+		SAMPLES = 0x03
+	};
+
+	// State-change comments, sent as codes in binary mode
+	enum class Event : uint8_t
+	{
+		NONE = 0,
+		CHARGE_STARTED = 1,
+		CHARGE_DONE = 2,
+		RELAX_CHARGED_DONE = 3,
+		DISCHARGE_DONE = 4,
+		DONE = 5,
+		RESUMED = 6 // not a state change: the run carried on from a checkpoint after a reset
+	};
+
+	// Header line of the CSV that TI's GPCCHEM tool expects
+	constexpr char const * CSV_HEADER = "Elapsed Time (s), Voltage (mV), Current (mA), Temperature (deg C), SoC (%), Comments\n";
+
+	/**
+	 * Get the CSV comment text for an event.  Returns an empty string for NONE or unknown codes.
+	 */
+	char const * eventComment(Event event);
+
+	// One row of the chem ID CSV, in the gauge's native integer units
+	struct Sample
+	{
+		uint32_t elapsed_s;
+		uint16_t voltage_mV;
+		int16_t current_mA; // already sign-corrected (discharge is negative)
+		uint16_t temperature_dK; // 0.1 K, as reported by the gauge
+		uint8_t soc_percent;
+	};
+
+	// Encoded sizes
+	constexpr size_t ABSOLUTE_SAMPLE_SIZE = 11;
+	constexpr size_t DELTA_SAMPLE_SIZE = 5;
+	constexpr size_t RELAX_EVIDENCE_SIZE = 17;
+	constexpr size_t PHASE_SUMMARY_SIZE = 68;
+	constexpr size_t MAX_SAMPLES_PER_FRAME = 16;
+	constexpr size_t FRAME_OVERHEAD = 5; // sync, type, length and CRC
+	constexpr size_t MAX_PAYLOAD_SIZE = ABSOLUTE_SAMPLE_SIZE + (MAX_SAMPLES_PER_FRAME - 1) * DELTA_SAMPLE_SIZE;
+	constexpr size_t MAX_FRAME_SIZE = MAX_PAYLOAD_SIZE + FRAME_OVERHEAD;
+	static_assert(1 + RELAX_EVIDENCE_SIZE + PHASE_SUMMARY_SIZE <= MAX_PAYLOAD_SIZE, "event frame doesn't fit");
+
+	// Buffer size that fits any row from formatCSVRow() or note from formatCSVNote()
+	constexpr size_t CSV_ROW_SIZE = 576;
+
+	/**
+	 * Format a sample as one CSV row (including the trailing newline).
+	 * Fields are formatted with integer arithmetic only, as this runs for every sample.
+	 * @return Number of characters written.
+	 */
+	int formatCSVRow(char * buffer, size_t size, Sample const & sample, Event event);
+
+	/**
+	 * Format the evidence for ending a relax phase and the statistics of the phase that ended as a line starting
+	 * with "# ", to follow the row of the event.  They contain commas, so they never go in the row itself, which
+	 * keeps the six columns that GPCCHEM expects.  GPCCHEM doesn't take the note lines either, so they are
+	 * only written on request (chemid-csv-notes, or chemid-log-decode --notes).
+	 * @return Number of characters written, 0 if both are null.
+	 */
+	int formatCSVNote(char * buffer, size_t size, RelaxDetector::Evidence const * relaxEvidence,
+		PhaseStatistics::Summary const * phaseSummary);
+
+	// Destination for encoded frames
+	using Sink = ByteSink;
+
+	/**
+	 * Batches samples into delta-encoded frames.
+	 * Samples are held until a frame fills up, an event is logged, or flush() is called.
+	 * Each channel needs its own encoder.  Encoders for different channels can share a sink.
+	 */
+	class Encoder
+	{
+	public:
+		explicit Encoder(Sink & sink, uint8_t channel = 0);
+
+		// Send the START frame
+		void start();
+
+		// Send an event, optionally with the evidence for ending a relax phase and the statistics of the phase that ended.
+		// It will be attached to the next sample.
+		void addEvent(Event event, RelaxDetector::Evidence const * relaxEvidence = nullptr,
+			PhaseStatistics::Summary const * phaseSummary = nullptr);
+
+		void addSample(Sample const & sample);
+
+		// Send any buffered samples
+		void flush();
+
+	private:
+		Sink & sink;
+		uint8_t const channel;
+
+		uint8_t payload[MAX_PAYLOAD_SIZE];
+		size_t payloadLength = 0;
+		size_t samplesInFrame = 0;
+		Sample previous{};
+
+		void sendFrame(FrameType type, uint8_t const * data, size_t length);
+	};
+
+	// Receives decoded records
+	class Listener
+	{
+	public:
+		virtual void onStart(uint8_t channel, uint8_t formatVersion) = 0;
+		virtual void onSample(uint8_t channel, Sample const & sample, Event event) = 0;
+
+		// Called before the onSample() for an event that came with relax evidence
+		virtual void onRelaxEvidence(uint8_t channel, RelaxDetector::Evidence const & evidence) { (void)channel; (void)evidence; }
+
+		// Likewise for an event that came with a phase summary
+		virtual void onPhaseSummary(uint8_t channel, PhaseStatistics::Summary const & summary) { (void)channel; (void)summary; }
+		virtual void onBadFrame() {}
+	protected:
+		~Listener() = default;
+	};
+
+	/**
+	 * Incremental frame parser.  Bytes can be fed in any chunk size.
+	 * Frames with a bad CRC are dropped and the parser resynchronizes on the next SYNC byte.
+	 */
+	class Decoder
+	{
+	public:
+		explicit Decoder(Listener & listener);
+
+		void feed(uint8_t const * data, size_t length);
+
+	private:
+		Listener & listener;
+
+		enum class ParseState
+		{
+			SYNC,
+			TYPE,
+			LENGTH,
+			PAYLOAD,
+			CRC_LOW,
+			CRC_HIGH
+		};
+		ParseState parseState = ParseState::SYNC;
+
+		uint8_t type = 0;
+		uint8_t length = 0;
+		uint8_t payload[MAX_PAYLOAD_SIZE];
+		size_t received = 0;
+		uint16_t receivedCRC = 0;
+
+		// Event waiting for the next sample, per channel
+		Event pendingEvents[MAX_CHANNELS] = {};
+
+		void handleFrame();
+	};
+}
+
+#endif //BQ34Z100G1_UTILS_CHEMIDLOG_H
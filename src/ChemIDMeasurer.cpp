@@ -3,121 +3,519 @@
 //
 
 #include "ChemIDMeasurer.h"
+#include <algorithm>
 #include <cinttypes>
 
+#include "FixedFormat.h"
 #include "pins.h"
 
-ChemIDMeasurer::ChemIDMeasurer():
-i2c(BQ34_I2C_SDA, BQ34_I2C_SCL),
-soc(i2c, 100000),
-chgPin(ACTIVATE_CHARGER_PIN),
-shdnPin(CHARGE_STATUS_PIN)
+namespace
 {
+	constexpr ChemIDChannelConfig CHANNEL_CONFIGS[] = {CHEMID_CHANNELS};
+	constexpr size_t CHANNEL_COUNT = sizeof(CHANNEL_CONFIGS) / sizeof(CHANNEL_CONFIGS[0]);
+	static_assert(CHANNEL_COUNT <= ChemIDMeasurer::MAX_CHANNELS, "Too many packs in CHEMID_CHANNELS");
+
+	// Fits "ch<n>, " and its terminator
+	constexpr size_t CHANNEL_TAG_SIZE = 8;
+
+	ChemIDStateMachine::Thresholds makeThresholds()
+	{
+		ChemIDStateMachine::Thresholds thresholds{DESIGNCAP/10, ZEROCHARGEVOLT * CELLCOUNT};
+#if MBED_CONF_APP_RELAX_EARLY_EXIT
+		thresholds.relaxEarlyExit = true;
+		thresholds.relaxDetection.cellCount = CELLCOUNT;
+#endif
+		return thresholds;
+	}
+
+	// Periodic checkpoints are at least this far apart.  Zero turns checkpointing off.
+	constexpr std::chrono::seconds CHECKPOINT_INTERVAL(MBED_CONF_APP_CHEMID_CHECKPOINT_INTERVAL);
+
+	constexpr TelemetrySampler::Timing SAMPLE_TIMING = MBED_CONF_APP_GAUGE_SYNCHRONIZED_SAMPLING ?
+		TelemetrySampler::Timing::GAUGE_UPDATES : TelemetrySampler::Timing::FIXED;
+
+	// Bump if the checkpoint layout changes, so old checkpoints are ignored
+	constexpr uint8_t CHECKPOINT_VERSION = 1;
+
+	// What is saved for each channel, under the key "chemid-ch<n>"
+	struct ChannelCheckpoint
+	{
+		uint8_t channelCount; // a checkpoint from a different pack setup is ignored
+		ChemIDStateMachine::State state;
+		uint32_t elapsed_ms; // time of the checkpoint
+		uint32_t stateStart_ms;
+		uint32_t logSequence; // samples logged up to the checkpoint
+	};
+
+	constexpr size_t CHECKPOINT_SIZE = 15;
+
+	void putLE32(uint8_t * out, uint32_t value)
+	{
+		for(size_t i = 0; i < 4; i++)
+		{
+			out[i] = (value >> (8 * i)) & 0xFF;
+		}
+	}
+
+	uint32_t getLE32(uint8_t const * in)
+	{
+		return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+	}
+
+	void encodeCheckpoint(uint8_t * out, ChannelCheckpoint const & checkpoint)
+	{
+		out[0] = CHECKPOINT_VERSION;
+		out[1] = checkpoint.channelCount;
+		out[2] = static_cast<uint8_t>(checkpoint.state);
+		putLE32(out + 3, checkpoint.elapsed_ms);
+		putLE32(out + 7, checkpoint.stateStart_ms);
+		putLE32(out + 11, checkpoint.logSequence);
+	}
+
+	bool decodeCheckpoint(uint8_t const * in, ChannelCheckpoint & checkpoint)
+	{
+		if(in[0] != CHECKPOINT_VERSION || in[2] == static_cast<uint8_t>(ChemIDStateMachine::State::INIT)
+			|| in[2] > static_cast<uint8_t>(ChemIDStateMachine::State::DONE))
+		{
+			return false;
+		}
+		checkpoint.channelCount = in[1];
+		checkpoint.state = static_cast<ChemIDStateMachine::State>(in[2]);
+		checkpoint.elapsed_ms = getLE32(in + 3);
+		checkpoint.stateStart_ms = getLE32(in + 7);
+		checkpoint.logSequence = getLE32(in + 11);
+		return true;
+	}
+
+	void checkpointKey(char * key, size_t size, uint8_t channel)
+	{
+		snprintf(key, size, "chemid-ch%" PRIu8, channel);
+	}
+
+	GaugeTelemetry makeTelemetry(ChemIDChannelConfig const & config, FaultTolerantI2C & bus, I2CMux * mux)
+	{
+		if(config.muxChannel == CHEMID_NO_MUX)
+		{
+			return GaugeTelemetry(bus);
+		}
+		return GaugeTelemetry(bus, *mux, static_cast<uint8_t>(config.muxChannel));
+	}
+}
+
+ChemIDMeasurer::Channel::Channel(uint8_t index, ChemIDChannelConfig const & config, Bus & bus, ByteSink & logSink,
+	ByteSink & storageSink):
+index(index),
+telemetry(makeTelemetry(config, *bus.transport, bus.mux.get())),
+chgPin(config.chargeStatusPin),
+shdnPin(config.chargerEnablePin),
+stateMachine(makeThresholds())
+#if MBED_CONF_APP_CHEMID_BINARY_LOG
+,logEncoder(logSink, index)
+#endif
+,storageEncoder(storageSink, index)
+{
+#if !MBED_CONF_APP_CHEMID_BINARY_LOG
+	(void)logSink;
+#endif
+
 	//Initially keep charger in shdn
-	shdnPin.write(1);
+	shdnPin.write(CHARGER_PIN_DEACTIVATE);
 
 	// Disable MCU pullup resistors
 	chgPin.mode(PinMode::PullNone);
 }
 
-void ChemIDMeasurer::activateCharger()
+void ChemIDMeasurer::Channel::activateCharger()
 {
-	shdnPin.write(0);
+	shdnPin.write(CHARGER_PIN_ACTIVATE);
 }
 
-void ChemIDMeasurer::deactivateCharger()
+void ChemIDMeasurer::Channel::deactivateCharger()
 {
-	shdnPin.write(1);
+	shdnPin.write(CHARGER_PIN_DEACTIVATE);
 }
 
-void ChemIDMeasurer::setState(ChemIDMeasurer::State newState)
+ChemIDMeasurer::ChemIDMeasurer()
 {
-	state = newState;
-	stateTimer.reset();
+	GaugeTelemetry * gauges[MAX_CHANNELS];
+	for(ChemIDChannelConfig const & config : CHANNEL_CONFIGS)
+	{
+		Bus & bus = getBus(config);
+		if(config.muxChannel != CHEMID_NO_MUX && !bus.mux)
+		{
+			bus.mux = std::make_unique<I2CMux>(*bus.i2c, I2C_MUX_ADDRESS);
+		}
+
+		channels[channelCount] = std::make_unique<Channel>(channelCount, config, bus, console, telemetryLog.getLog());
+		gauges[channelCount] = &channels[channelCount]->telemetry;
+		++channelCount;
+	}
+
+	// Two gauges directly on the same bus would answer to the same address
+	for(size_t first = 0; first < channelCount; first++)
+	{
+		for(size_t second = first + 1; second < channelCount; second++)
+		{
+			ChemIDChannelConfig const & a = CHANNEL_CONFIGS[first];
+			ChemIDChannelConfig const & b = CHANNEL_CONFIGS[second];
+			if(a.sda == b.sda && (a.muxChannel == b.muxChannel || a.muxChannel == CHEMID_NO_MUX || b.muxChannel == CHEMID_NO_MUX))
+			{
+				printf("Warning: packs %zu and %zu in CHEMID_CHANNELS conflict on the same I2C bus\r\n", first, second);
+			}
+		}
+	}
+
+	sampler = std::make_unique<TelemetrySampler>(gauges, channelCount);
+}
+
+ChemIDMeasurer::Bus & ChemIDMeasurer::getBus(ChemIDChannelConfig const & config)
+{
+	for(size_t busIndex = 0; busIndex < busCount; busIndex++)
+	{
+		if(buses[busIndex].sda == config.sda && buses[busIndex].scl == config.scl)
+		{
+			return buses[busIndex];
+		}
+	}
+
+	Bus & bus = buses[busCount++];
+	bus.sda = config.sda;
+	bus.scl = config.scl;
+	bus.i2c = std::make_unique<I2C>(config.sda, config.scl);
+	bus.i2c->frequency(100000);
+	bus.transport = std::make_unique<FaultTolerantI2C>(*bus.i2c, config.sda, config.scl);
+	return bus;
 }
 
 void ChemIDMeasurer::runMeasurement()
 {
-	totalTimer.start();
-	stateTimer.start();
-
-	while(state != State::DONE)
-	{
-		// read data
-		uint16_t voltage_mV = soc.getVoltage();
-		int32_t current_mA = soc.getCurrent();
-		double temperatureC = soc.getTemperature();
-		char const * comment = "";
-
-		// update based on state
-		switch (state)
-		{
-			case State::INIT:
-				// Print header
-				printf("Elapsed Time (s), Voltage (mV), Current (mA), Temperature (deg C), SoC (%%), Comments\n");
-				setState(State::CHARGE);
-				activateCharger();
-				comment = "Activating charger and entering CHARGE";
-				break;
-
-			case State::CHARGE:
-				// threshold current = C/10
-				if(current_mA < DESIGNCAP/10)
-				{
-					deactivateCharger();
-					setState(State::RELAX_CHARGED);
-					comment = "Deactivating charger and entering RELAX_CHARGED";
-				}
-				break;
-
-			case State::RELAX_CHARGED:
-				if(stateTimer.elapsed_time() > 2h)
-				{
-					setState(State::DISCHARGE);
-					comment = "Done relaxing and entering discharge -- please disconnect charger and connect C/10 load now.";
-				}
-				break;
-
-			case State::DISCHARGE:
-				// Change states once we hit the termination voltage
-				if(voltage_mV < ZEROCHARGEVOLT * CELLCOUNT)
-				{
-					setState(State::RELAX_DISCHARGED);
-					comment = "Done discharging -- please remove C/10 load now.";
-				}
-				// BQ34Z100 reports positive current always, but TI's tool expects discharging to
-				// be negative current.
-				current_mA *= -1;
-				break;
-
-			case State::RELAX_DISCHARGED:
-				if(stateTimer.elapsed_time() > 5h)
-				{
-					setState(State::DONE);
-					comment = "Done!";
-				}
-				break;
-
-			default:
-				// will never be hit but here to silence warning
-				break;
-		}
-
-
-		// print data column
-		printf("%" PRIi64 ", %" PRIi16 ", %" PRIi32 ", %f, %" PRIu8 ", %s\n",
-			std::chrono::duration_cast<std::chrono::seconds>(totalTimer.elapsed_time()).count(),
-			voltage_mV, current_mA, temperatureC, soc.getSOC(), comment);
-
-		// wait, update freq is every 5 seconds
+	using State = ChemIDStateMachine::State;
+
+	resumeFromCheckpoints();
+	telemetryLog.start();
+
+	size_t channelsRunning = 0;
+	for(size_t channelIndex = 0; channelIndex < channelCount; channelIndex++)
+	{
+		if(channels[channelIndex]->stateMachine.getState() != State::DONE)
+		{
+			++channelsRunning;
+		}
+	}
+
+	// update freq is every 5 seconds, in step with the gauges' own updates unless gauge-synchronized-sampling
+	// is off.  Sampling runs on its own thread, so the sample times stay exact even if the console falls behind.
+	console.start();
+	sampler->start(5s, SAMPLE_TIMING);
+
+	while(channelsRunning > 0)
+	{
+		// read data.  All fields come from one burst so they belong to the same gauge update.
+		TelemetrySampler::Sample timedSample;
+		sampler->waitForSample(timedSample);
+
+		Channel & channel = *channels[timedSample.source];
+		if(channel.stateMachine.getState() == State::DONE)
+		{
+			// this pack is finished, but the others are still going
+			continue;
+		}
+		if(!timedSample.valid)
+		{
+			// the gauge couldn't be read this time.  Its charger is left as it is until the next good sample.
+			continue;
+		}
+
+		processSample(channel, timedSample);
+		if(channel.stateMachine.getState() == State::DONE)
+		{
+			--channelsRunning;
+		}
+	}
+
+	sampler->stop();
+	console.stop();
+	if(console.getDroppedCount() > 0)
+	{
+		printf("Warning: the console fell behind and %" PRIu32 " log writes were dropped\r\n", console.getDroppedCount());
+	}
+	if(sampler->getReadErrorCount() > 0)
+	{
+		printf("Warning: %" PRIu32 " of %" PRIu32 " gauge reads failed and were left out of the log\r\n",
+			sampler->getReadErrorCount(), sampler->getReadCount());
+	}
+	for(size_t busIndex = 0; busIndex < busCount; busIndex++)
+	{
+		FaultTolerantI2C::Counters const & counters = buses[busIndex].transport->getCounters();
+		if(counters.retries > 0 || counters.recoveries > 0)
+		{
+			printf("Warning: I2C bus %zu needed %" PRIu32 " retries (%" PRIu32 " timed out) and %" PRIu32
+				" bus recoveries (%" PRIu32 " failed)\r\n", busIndex, counters.retries, counters.timeouts,
+				counters.recoveries, counters.failedRecoveries);
+		}
+	}
+	if(telemetryLog.isReady() && (telemetryLog.getLog().flush() != TelemetryLog::OK || telemetryLog.getLog().getWriteErrorCount() > 0))
+	{
+		printf("Warning: %" PRIu32 " records could not be kept in the telemetry log\r\n", telemetryLog.getLog().getWriteErrorCount());
+	}
+
+	// The run is complete, so the next one starts from scratch
+	if(checkpointsReady)
+	{
+		for(size_t channelIndex = 0; channelIndex < channelCount; channelIndex++)
+		{
+			char key[CheckpointStore::MAX_KEY_LENGTH + 1];
+			checkpointKey(key, sizeof(key), channelIndex);
+			checkpoints.remove(key);
+		}
+	}
+}
+
+void ChemIDMeasurer::resumeFromCheckpoints()
+{
+	if(CHECKPOINT_INTERVAL == 0s)
+	{
+		return;
+	}
+
+	int const result = checkpoints.init();
+	if(result != CheckpointStore::OK)
+	{
+		printf("Warning: checkpoint flash not available (error %d), this run can't be resumed after a reset\r\n", result);
+		return;
+	}
+	checkpointsReady = true;
+
+	ChannelCheckpoint saved[MAX_CHANNELS];
+	bool found[MAX_CHANNELS] = {};
+	bool anyFound = false;
+	uint32_t latest_ms = 0;
+	for(size_t channelIndex = 0; channelIndex < channelCount; channelIndex++)
+	{
+		char key[CheckpointStore::MAX_KEY_LENGTH + 1];
+		checkpointKey(key, sizeof(key), channelIndex);
+
+		uint8_t data[CHECKPOINT_SIZE];
+		size_t size;
+		if(checkpoints.get(key, data, sizeof(data), &size) == CheckpointStore::OK && size == CHECKPOINT_SIZE
+			&& decodeCheckpoint(data, saved[channelIndex]) && saved[channelIndex].channelCount == channelCount)
+		{
+			found[channelIndex] = true;
+			anyFound = true;
+			latest_ms = std::max(latest_ms, saved[channelIndex].elapsed_ms);
+		}
+	}
+	if(!anyFound)
+	{
+		return;
+	}
+
+	// There's no telling how long the board was off.  Carry on from where the next checkpoint would have been,
+	// which is after every sample that can have been logged before the reset.
+	timeBase = std::chrono::milliseconds(latest_ms) + CHECKPOINT_INTERVAL;
+
+	bool chargerRestarted = false;
+	for(size_t channelIndex = 0; channelIndex < channelCount; channelIndex++)
+	{
+		if(!found[channelIndex])
+		{
+			continue;
+		}
+
+		Channel & channel = *channels[channelIndex];
+		ChannelCheckpoint const & checkpoint = saved[channelIndex];
+		channel.stateMachine.resume(checkpoint.state, std::chrono::milliseconds(checkpoint.stateStart_ms), timeBase);
+		channel.logSequence = checkpoint.logSequence;
+		channel.lastCheckpoint = timeBase;
+		channel.resumed = true;
+
+		if(checkpoint.state == ChemIDStateMachine::State::CHARGE)
+		{
+			channel.activateCharger();
+			chargerRestarted = true;
+		}
+	}
+
+	// As on a fresh start, give the charger a sample period to get going before its current is checked
+	if(chargerRestarted)
+	{
 		ThisThread::sleep_for(5s);
 	}
 }
 
+void ChemIDMeasurer::saveCheckpoint(Channel & channel, std::chrono::milliseconds elapsed)
+{
+	if(!checkpointsReady)
+	{
+		return;
+	}
+
+	ChannelCheckpoint checkpoint;
+	checkpoint.channelCount = channelCount;
+	checkpoint.state = channel.stateMachine.getState();
+	checkpoint.elapsed_ms = elapsed.count();
+	checkpoint.stateStart_ms = channel.stateMachine.getStateStartTime().count();
+	checkpoint.logSequence = channel.logSequence;
+
+	uint8_t data[CHECKPOINT_SIZE];
+	encodeCheckpoint(data, checkpoint);
+
+	char key[CheckpointStore::MAX_KEY_LENGTH + 1];
+	checkpointKey(key, sizeof(key), channel.index);
+	int const result = checkpoints.set(key, data, sizeof(data));
+	if(result != CheckpointStore::OK)
+	{
+		// printf() can't be used while the measurement loop owns the console
+		char warning[128];
+		int const length = snprintf(warning, sizeof(warning),
+			"Warning: writing a checkpoint failed (error %d), checkpoints are off for the rest of this run\r\n", result);
+		console.write(warning, std::min(static_cast<size_t>(length), sizeof(warning) - 1));
+		checkpointsReady = false;
+		return;
+	}
+	channel.lastCheckpoint = elapsed;
+}
+
+void ChemIDMeasurer::printCSV(char const * channelTag, char const * text)
+{
+	// One write per line, so that if the console falls behind, whole lines are dropped
+	char line[CHANNEL_TAG_SIZE + ChemIDLog::CSV_ROW_SIZE];
+	FixedFormatter formatter(line, sizeof(line));
+	formatter.text(channelTag).text(text);
+	console.write(formatter.c_str(), formatter.length());
+}
+
+void ChemIDMeasurer::processSample(Channel & channel, TelemetrySampler::Sample const & timedSample)
+{
+	using State = ChemIDStateMachine::State;
+
+	TelemetrySnapshot const & snapshot = timedSample.telemetry;
+	// Whole seconds, as logged, so that chemid-replay sees exactly the times that the state machine saw here.
+	// Samples in step with the gauge's updates come a few milliseconds either side of a whole second.
+	std::chrono::milliseconds const elapsed = std::chrono::duration_cast<std::chrono::seconds>(timeBase + timedSample.timestamp);
+
+#if !MBED_CONF_APP_CHEMID_BINARY_LOG
+	// With several packs, every row is prefixed with its channel so the stream can be split up again
+	char channelTag[CHANNEL_TAG_SIZE] = "";
+	if(channelCount > 1)
+	{
+		FixedFormatter(channelTag, sizeof(channelTag)).text("ch").unsignedInt(channel.index).text(", ");
+	}
+#endif
+
+	if(channel.stateMachine.getState() == State::INIT)
+	{
+		// Print header
+#if MBED_CONF_APP_CHEMID_BINARY_LOG
+		channel.logEncoder.start();
+#else
+		printCSV(channelTag, ChemIDLog::CSV_HEADER);
+#endif
+		if(telemetryLog.isReady())
+		{
+			channel.storageEncoder.start();
+		}
+	}
+
+	// update based on state
+	ChemIDStateMachine::Output const output = channel.stateMachine.update({elapsed, snapshot.voltage_mV, snapshot.current_mA, snapshot.flags});
+	RelaxDetector::Evidence const * relaxEvidence = output.hasRelaxEvidence ? &output.relaxEvidence : nullptr;
+
+	// The sample that ends a phase is the last one of that phase and the first one of the next, so the
+	// integration has no gap.  The summary goes out with the event, so the capacity is known straight away.
+	// Charge and energy are integrated over the exact sample times, not the whole seconds that are logged.
+	PhaseStatistics::Reading const reading{timeBase + timedSample.timestamp, snapshot.voltage_mV, output.current_mA,
+		snapshot.temperature_dK, snapshot.remaining_mAh};
+	channel.phaseStatistics.add(reading);
+	PhaseStatistics::Summary phaseSummary;
+	PhaseStatistics::Summary const * finishedPhase = nullptr;
+	if(output.event != ChemIDLog::Event::NONE)
+	{
+		if(output.event != ChemIDLog::Event::CHARGE_STARTED && channel.phaseStatistics.getSampleCount() > 1)
+		{
+			phaseSummary = channel.phaseStatistics.summarize();
+			finishedPhase = &phaseSummary;
+		}
+		channel.phaseStatistics.reset();
+		channel.phaseStatistics.add(reading);
+	}
+
+	// Mark where a resumed run picks up, unless a state change needs the comment
+	ChemIDLog::Event logEvent = output.event;
+	if(channel.resumed && logEvent == ChemIDLog::Event::NONE)
+	{
+		logEvent = ChemIDLog::Event::RESUMED;
+	}
+	channel.resumed = false;
+	if(output.event == ChemIDLog::Event::CHARGE_STARTED)
+	{
+		channel.activateCharger();
+	}
+	else if(output.event == ChemIDLog::Event::CHARGE_DONE)
+	{
+		channel.deactivateCharger();
+	}
+
+	ChemIDLog::Sample sample;
+	sample.elapsed_s = std::chrono::duration_cast<std::chrono::seconds>(elapsed).count();
+	sample.voltage_mV = snapshot.voltage_mV;
+	sample.current_mA = output.current_mA;
+	sample.temperature_dK = snapshot.temperature_dK;
+	sample.soc_percent = snapshot.soc_percent;
+
+	// print data column
+#if MBED_CONF_APP_CHEMID_BINARY_LOG
+	if(logEvent != ChemIDLog::Event::NONE)
+	{
+		channel.logEncoder.addEvent(logEvent, relaxEvidence, finishedPhase);
+	}
+	channel.logEncoder.addSample(sample);
+	if(channel.stateMachine.getState() == State::DONE)
+	{
+		channel.logEncoder.flush();
+	}
+#else
+	char row[ChemIDLog::CSV_ROW_SIZE];
+	ChemIDLog::formatCSVRow(row, sizeof(row), sample, logEvent);
+	printCSV(channelTag, row);
+#if MBED_CONF_APP_CHEMID_CSV_NOTES
+	if(ChemIDLog::formatCSVNote(row, sizeof(row), relaxEvidence, finishedPhase) > 0)
+	{
+		printCSV(channelTag, row);
+	}
+#endif
+#endif
+
+	if(telemetryLog.isReady())
+	{
+		if(logEvent != ChemIDLog::Event::NONE)
+		{
+			channel.storageEncoder.addEvent(logEvent, relaxEvidence, finishedPhase);
+		}
+		channel.storageEncoder.addSample(sample);
+
+		// A state change is worth keeping straight away, even though it leaves the rest of a batch empty
+		if(output.event != ChemIDLog::Event::NONE)
+		{
+			channel.storageEncoder.flush();
+			telemetryLog.getLog().flush();
+		}
+	}
+	++channel.logSequence;
+
+	// Checkpoint every state change straight away, and the progress through a state now and then.
+	// This runs just after the gauges were read, so an erase has most of a sample period to finish.  That hides a
+	// page erase, but a 128 kiB sector stalls the MCU for 1-2 s and can make the next sample late.
+	if(output.event != ChemIDLog::Event::NONE || elapsed - channel.lastCheckpoint >= CHECKPOINT_INTERVAL)
+	{
+		saveCheckpoint(channel, elapsed);
+	}
+}
+
 ChemIDMeasurer measurer;
 
 int main()
 {
 	measurer.runMeasurement();
 	return 0;
-}
\ No newline at end of file
+}
@@ -7,43 +7,151 @@
 
 #include <BQ34Z100.h>
 
+#include <memory>
+
+#include "CheckpointStore.h"
+#include "ChemIDLog.h"
+#include "ChemIDStateMachine.h"
+#include "ConsoleIO.h"
+#include "FaultTolerantI2C.h"
+#include "GaugeTelemetry.h"
+#include "I2CMux.h"
+#include "PhaseStatistics.h"
+#include "TelemetryRecorder.h"
+#include "TelemetrySampler.h"
+
+#include "FlashIAPBlockDevice.h"
+
+// How one pack is wired up.  See CHEMID_CHANNELS in pins.h.
+struct ChemIDChannelConfig
+{
+	PinName sda;
+	PinName scl;
+	int muxChannel;
+	PinName chargerEnablePin;
+	PinName chargeStatusPin;
+};
+
+/**
+ * Runs the chem ID measurement on every pack in CHEMID_CHANNELS at once.
+ * Each pack has its own state machine and charger, so they finish each phase independently.
+ * All gauge reads go through one sampler thread, and the output is a single log stream
+ * with each row tagged by channel.
+ *
+ * Each pack's state is checkpointed to on-chip flash at every state change and every
+ * chemid-checkpoint-interval seconds, so a run interrupted by a reset carries on where it left off.
+ *
+ * Every pack's samples also go into the telemetry log as binary frames, whatever the console log format,
+ * so the run can be dumped from soc-test afterwards even if nothing was capturing the console.
+ *
+ * A gauge that can't be read, even after retries and recovering its bus, just misses that sample: the state
+ * machines only ever see good readings, and the failures are reported when the run is over.
+ */
 class ChemIDMeasurer
 {
-    I2C i2c;
-	BQ34Z100 soc;
+public:
+	static constexpr size_t MAX_CHANNELS = TelemetrySampler::MAX_SOURCES;
 
-	// charger control pins
-	DigitalIn chgPin;
-	DigitalOut shdnPin;
+private:
+	// One I2C peripheral, shared by every pack wired to its pins
+	struct Bus
+	{
+		PinName sda = NC;
+		PinName scl = NC;
+		std::unique_ptr<I2C> i2c;
 
-	Timer totalTimer;
-	Timer stateTimer;
+		// Retries and bus recovery for the gauges' reads
+		std::unique_ptr<FaultTolerantI2C> transport;
 
-	enum class State
+		// Only created if a pack on this bus is behind a mux
+		std::unique_ptr<I2CMux> mux;
+	};
+
+	// Everything belonging to one pack
+	struct Channel
 	{
-		INIT, // Initial state.
-		CHARGE, // First, charge to full power until charge current <= C/100.
-		RELAX_CHARGED, // Relax for two hours to reach open circuit voltage
-		DISCHARGE, // Discharge at C/10 until the term voltage is reached
-		RELAX_DISCHARGED, // Relax for five hours to reach open circuit voltage
-		DONE // Measurement finished
+		uint8_t const index;
+		GaugeTelemetry telemetry;
+
+		// charger control pins
+		DigitalIn chgPin;
+		DigitalOut shdnPin;
+
+		// Decides when each phase of the measurement is over
+		ChemIDStateMachine stateMachine;
+
+		// Statistics of the current phase, logged with the event that ends it.  Starts over after a reset.
+		PhaseStatistics phaseStatistics;
+
+#if MBED_CONF_APP_CHEMID_BINARY_LOG
+		ChemIDLog::Encoder logEncoder;
+#endif
+
+		// Frames for the telemetry log
+		ChemIDLog::Encoder storageEncoder;
+
+		// Number of samples logged so far, kept across resets
+		uint32_t logSequence = 0;
+
+		// Time of the last checkpoint
+		std::chrono::milliseconds lastCheckpoint{0};
+
+		// Set if the next sample is the first one after resuming from a checkpoint
+		bool resumed = false;
+
+		Channel(uint8_t index, ChemIDChannelConfig const & config, Bus & bus, ByteSink & logSink, ByteSink & storageSink);
+
+		// Turn the charger on
+		void activateCharger();
+
+		// Turn the charger off.
+		void deactivateCharger();
 	};
-	State state = State::INIT;
 
-	// Turn the charger on
-	void activateCharger();
+	// Log rows or frames from every channel go to the console without blocking the measurement loop
+	ConsoleQueue console;
+
+	Bus buses[MAX_CHANNELS];
+	size_t busCount = 0;
+
+	std::unique_ptr<Channel> channels[MAX_CHANNELS];
+	size_t channelCount = 0;
+
+	// Reads every gauge every 5 seconds on its own thread
+	std::unique_ptr<TelemetrySampler> sampler;
+
+	// Checkpoints of every channel, kept in on-chip flash
+	FlashIAPBlockDevice checkpointFlash;
+	CheckpointStore checkpoints{checkpointFlash};
+	bool checkpointsReady = false;
+
+	// Samples of every channel, kept on the board.  The frames are programmed a batch at a time, and at every
+	// state change, so a reset loses at most the samples since the last batch was programmed.
+	TelemetryRecorder telemetryLog;
+
+	// Elapsed time at which the sampler was started.  Nonzero when resuming from a checkpoint.
+	std::chrono::milliseconds timeBase{0};
+
+	// Get the bus for the given pins, creating it on first use
+	Bus & getBus(ChemIDChannelConfig const & config);
+
+	// Run one sample through its channel's state machine and log it
+	void processSample(Channel & channel, TelemetrySampler::Sample const & timedSample);
+
+	// Open the checkpoint flash and restore every channel that has a checkpoint
+	void resumeFromCheckpoints();
 
-	// Turn the charger off.
-	void deactivateCharger();
+	void saveCheckpoint(Channel & channel, std::chrono::milliseconds elapsed);
 
-	// Change current state.
-	void setState(State newState);
+	// Queue one line of the CSV log, prefixed with the channel tag
+	void printCSV(char const * channelTag, char const * text);
 
 public:
 	ChemIDMeasurer();
 
 	/**
-	 * Loop to run the ID measurement
+	 * Loop to run the ID measurement.  Returns once every pack is done.
+	 * If the board was reset partway through a run, the run is resumed from its checkpoints.
 	 */
 	void runMeasurement();
 };
@@ -0,0 +1,122 @@
+//
+// State logic of the chem ID measurement.
+//
+
+#include "ChemIDStateMachine.h"
+
+ChemIDStateMachine::ChemIDStateMachine(Thresholds const & thresholds):
+thresholds(thresholds),
+relaxDetector(thresholds.relaxDetection)
+{
+}
+
+void ChemIDStateMachine::setState(State newState, std::chrono::milliseconds now)
+{
+	state = newState;
+	stateStart = now;
+
+	if(state == State::RELAX_CHARGED || state == State::RELAX_DISCHARGED)
+	{
+		relaxDetector.reset(now);
+	}
+}
+
+void ChemIDStateMachine::resume(State state, std::chrono::milliseconds stateStart, std::chrono::milliseconds now)
+{
+	setState(state, now);
+	this->stateStart = stateStart;
+}
+
+bool ChemIDStateMachine::relaxDone(Input const & input, std::chrono::milliseconds maxTime, Output & output)
+{
+	bool const timedOut = input.elapsed - stateStart > maxTime;
+	if(!thresholds.relaxEarlyExit)
+	{
+		return timedOut;
+	}
+
+	bool const settled = relaxDetector.update(input.elapsed, input.voltage_mV, input.current_mA, input.flags);
+	if(settled || timedOut)
+	{
+		output.hasRelaxEvidence = true;
+		output.relaxEvidence = relaxDetector.getEvidence(settled);
+		return true;
+	}
+	return false;
+}
+
+ChemIDStateMachine::Output ChemIDStateMachine::update(Input const & input)
+{
+	Output output{ChemIDLog::Event::NONE, input.current_mA, false, {}};
+
+	switch (state)
+	{
+		case State::INIT:
+			setState(State::CHARGE, input.elapsed);
+			output.event = ChemIDLog::Event::CHARGE_STARTED;
+			break;
+
+		case State::CHARGE:
+			if(input.current_mA < thresholds.chargeCutoff_mA)
+			{
+				setState(State::RELAX_CHARGED, input.elapsed);
+				output.event = ChemIDLog::Event::CHARGE_DONE;
+			}
+			break;
+
+		case State::RELAX_CHARGED:
+			if(relaxDone(input, thresholds.relaxChargedTime, output))
+			{
+				setState(State::DISCHARGE, input.elapsed);
+				output.event = ChemIDLog::Event::RELAX_CHARGED_DONE;
+			}
+			break;
+
+		case State::DISCHARGE:
+			// Change states once we hit the termination voltage
+			if(input.voltage_mV < thresholds.dischargeCutoff_mV)
+			{
+				setState(State::RELAX_DISCHARGED, input.elapsed);
+				output.event = ChemIDLog::Event::DISCHARGE_DONE;
+			}
+			// BQ34Z100 reports positive current always, but TI's tool expects discharging to
+			// be negative current.
+			output.current_mA *= -1;
+			break;
+
+		case State::RELAX_DISCHARGED:
+			if(relaxDone(input, thresholds.relaxDischargedTime, output))
+			{
+				setState(State::DONE, input.elapsed);
+				output.event = ChemIDLog::Event::DONE;
+			}
+			break;
+
+		default:
+			// will never be hit but here to silence warning
+			break;
+	}
+
+	return output;
+}
+
+char const * ChemIDStateMachine::stateName(State state)
+{
+	switch(state)
+	{
+		case State::INIT:
+			return "INIT";
+		case State::CHARGE:
+			return "CHARGE";
+		case State::RELAX_CHARGED:
+			return "RELAX_CHARGED";
+		case State::DISCHARGE:
+			return "DISCHARGE";
+		case State::RELAX_DISCHARGED:
+			return "RELAX_DISCHARGED";
+		case State::DONE:
+			return "DONE";
+		default:
+			return "?";
+	}
+}
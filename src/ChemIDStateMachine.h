@@ -0,0 +1,103 @@
+//
+// State logic of the chem ID measurement, separated from the gauge and charger I/O
+// so that recorded traces can be replayed through it on a host.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_CHEMIDSTATEMACHINE_H
+#define BQ34Z100G1_UTILS_CHEMIDSTATEMACHINE_H
+
+#include "ChemIDLog.h"
+#include "RelaxDetector.h"
+
+#include <chrono>
+#include <cstdint>
+
+class ChemIDStateMachine
+{
+public:
+	enum class State
+	{
+		INIT, // Initial state.
+		CHARGE, // First, charge to full power until charge current <= C/10.
+		RELAX_CHARGED, // Relax for two hours to reach open circuit voltage
+		DISCHARGE, // Discharge at C/10 until the term voltage is reached
+		RELAX_DISCHARGED, // Relax for five hours to reach open circuit voltage
+		DONE // Measurement finished
+	};
+
+	// Thresholds that decide when each state ends
+	struct Thresholds
+	{
+		int32_t chargeCutoff_mA; // leave CHARGE once the charge current drops below this
+		uint16_t dischargeCutoff_mV; // leave DISCHARGE once the voltage drops below this
+		std::chrono::milliseconds relaxChargedTime = std::chrono::hours(2);
+		std::chrono::milliseconds relaxDischargedTime = std::chrono::hours(5);
+
+		// If set, the relax phases also end as soon as relaxDetection finds the pack settled,
+		// with the times above as upper bounds
+		bool relaxEarlyExit = false;
+		RelaxDetector::Config relaxDetection{};
+	};
+
+	// One measurement, timestamped from the start of the run
+	struct Input
+	{
+		std::chrono::milliseconds elapsed;
+		uint16_t voltage_mV;
+		int32_t current_mA; // as reported by the gauge
+		int32_t flags = -1; // gauge Flags(), or -1 if not known (e.g. replaying a log)
+	};
+
+	struct Output
+	{
+		// State change that happened on this sample, if any
+		ChemIDLog::Event event;
+
+		// Current to log.  TI's tool expects discharge current to be negative.
+		int32_t current_mA;
+
+		// With relaxEarlyExit, why the relax phase that ended on this sample ended
+		bool hasRelaxEvidence;
+		RelaxDetector::Evidence relaxEvidence;
+	};
+
+	explicit ChemIDStateMachine(Thresholds const & thresholds);
+
+	/**
+	 * Feed the next sample and run any state transition it triggers.
+	 * Transitions into CHARGE and out of it (CHARGE_STARTED and CHARGE_DONE events) mean the charger
+	 * should be turned on and off.
+	 */
+	Output update(Input const & input);
+
+	/**
+	 * Pick up a run checkpointed before a reset, in the given state as entered at stateStart.
+	 * A relax phase's detector starts over at now, so an early exit waits its minimum time again.
+	 */
+	void resume(State state, std::chrono::milliseconds stateStart, std::chrono::milliseconds now);
+
+	State getState() const { return state; }
+
+	// Time the current state was entered
+	std::chrono::milliseconds getStateStartTime() const { return stateStart; }
+
+	Thresholds const & getThresholds() const { return thresholds; }
+
+	static char const * stateName(State state);
+
+private:
+	Thresholds thresholds;
+
+	State state = State::INIT;
+	std::chrono::milliseconds stateStart{0};
+
+	RelaxDetector relaxDetector;
+
+	// Check whether a relax phase is over, filling in the evidence if relaxEarlyExit is on
+	bool relaxDone(Input const & input, std::chrono::milliseconds maxTime, Output & output);
+
+	void setState(State newState, std::chrono::milliseconds now);
+};
+
+#endif //BQ34Z100G1_UTILS_CHEMIDSTATEMACHINE_H
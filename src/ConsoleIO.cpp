@@ -0,0 +1,91 @@
+//
+// Raw binary access to the console serial port, and non-blocking output for loops that must keep their timing.
+//
+
+#include "ConsoleIO.h"
+
+#include <algorithm>
+
+void ConsoleSink::write(uint8_t const * data, size_t length)
+{
+	// anything printf()ed earlier has to go out first
+	fflush(stdout);
+	mbed::mbed_file_handle(STDOUT_FILENO)->write(data, length);
+}
+
+void ConsoleQueue::start()
+{
+	fflush(stdout);
+	mbed::FileHandle * const console = mbed::mbed_file_handle(STDOUT_FILENO);
+	console->set_blocking(false);
+	console->sigio(mbed::callback(this, &ConsoleQueue::onConsoleReady));
+}
+
+void ConsoleQueue::stop()
+{
+	mbed::FileHandle * const console = mbed::mbed_file_handle(STDOUT_FILENO);
+	console->sigio(nullptr);
+	console->set_blocking(true);
+
+	// Blocking now, so this sends everything
+	pump();
+}
+
+void ConsoleQueue::write(uint8_t const * data, size_t length)
+{
+	mbed::ScopedLock<rtos::Mutex> lock(mutex);
+
+	// Make room first if the driver has caught up
+	pump();
+
+	if(length > CAPACITY - queueLength)
+	{
+		++droppedCount;
+		return;
+	}
+
+	size_t const end = (queueStart + queueLength) % CAPACITY;
+	size_t const firstPart = std::min(length, CAPACITY - end);
+	memcpy(queue + end, data, firstPart);
+	memcpy(queue, data + firstPart, length - firstPart);
+	queueLength += length;
+
+	pump();
+}
+
+void ConsoleQueue::pump()
+{
+	mbed::ScopedLock<rtos::Mutex> lock(mutex);
+	mbed::FileHandle * const console = mbed::mbed_file_handle(STDOUT_FILENO);
+	while(queueLength > 0)
+	{
+		// Send the part up to the end of the buffer, then the part that wrapped around
+		size_t const chunk = std::min(queueLength, CAPACITY - queueStart);
+		ssize_t const written = console->write(queue + queueStart, chunk);
+		if(written <= 0)
+		{
+			// -EAGAIN: the driver's transmit buffer is full
+			return;
+		}
+
+		queueStart = (queueStart + written) % CAPACITY;
+		queueLength -= written;
+		if(static_cast<size_t>(written) < chunk)
+		{
+			return;
+		}
+	}
+}
+
+void ConsoleQueue::onConsoleReady()
+{
+	// Also raised for received data, in which case the pump finds nothing more to send
+	mbed::mbed_event_queue()->call(mbed::callback(this, &ConsoleQueue::pump));
+}
+
+ssize_t consoleRead(uint8_t * buffer, size_t length)
+{
+	// a prompt printf()ed earlier has to go out before waiting for the answer
+	fflush(stdout);
+	return mbed::mbed_file_handle(STDIN_FILENO)->read(buffer, length);
+}
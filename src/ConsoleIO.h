@@ -0,0 +1,73 @@
+//
+// Raw binary access to the console serial port, and non-blocking output for loops that must keep their timing.
+//
+
+#ifndef BQ34Z100G1_UTILS_CONSOLEIO_H
+#define BQ34Z100G1_UTILS_CONSOLEIO_H
+
+#include "ByteSink.h"
+
+#include <mbed.h>
+
+/**
+ * Sends binary data to the console.  Writes go straight to the console file handle
+ * so that newline conversion can't mangle them.
+ */
+class ConsoleSink : public ByteSink
+{
+public:
+	void write(uint8_t const * data, size_t length) override;
+};
+
+/**
+ * Non-blocking console output through a bounded queue.
+ *
+ * Between start() and stop(), the console is switched to non-blocking mode.  Each write() is copied into the
+ * queue whole, and the queue is handed on to the serial driver only as fast as its interrupt-driven transmit
+ * buffer takes it, so a host that is slow to read never stalls the caller.  Whenever that buffer has room again,
+ * the driver's sigio callback has the rest of the queue sent from the shared event queue, so queued output
+ * doesn't wait for the next write().  A write that doesn't fit is dropped whole (never half a line or half a
+ * frame) and counted, so a host that falls behind sees rows missing, not corrupted.  Nothing may be printf()ed
+ * while the queue is started, as stdio would see the console as busy too.
+ */
+class ConsoleQueue : public ByteSink
+{
+public:
+	static constexpr size_t CAPACITY = 2048;
+
+	// Flush anything printf()ed so far and switch the console to non-blocking writes
+	void start();
+
+	// Wait for the queue to empty, then switch the console back to blocking so printf() can be used again
+	void stop();
+
+	void write(uint8_t const * data, size_t length) override;
+	void write(char const * text, size_t length) { write(reinterpret_cast<uint8_t const *>(text), length); }
+
+	// Pass as much queued data to the driver as it can take without blocking.  Also done by every write(),
+	// and whenever the driver's transmit buffer has room again.
+	void pump();
+
+	// Number of writes dropped because the queue was full
+	uint32_t getDroppedCount() const { return droppedCount; }
+
+private:
+	// sigio callback, in interrupt context
+	void onConsoleReady();
+
+	// pump() runs on the shared event queue's thread as well as the writer's
+	rtos::Mutex mutex;
+	uint8_t queue[CAPACITY];
+	size_t queueStart = 0; // oldest byte
+	size_t queueLength = 0;
+	uint32_t droppedCount = 0;
+};
+
+/**
+ * Read raw bytes from the console, bypassing stdio buffering and newline conversion.
+ * Blocks until at least one byte is available.
+ * @return Number of bytes read, or a negative error code.
+ */
+ssize_t consoleRead(uint8_t * buffer, size_t length);
+
+#endif //BQ34Z100G1_UTILS_CONSOLEIO_H
@@ -0,0 +1,28 @@
+//
+// CRC-16/CCITT (polynomial 0x1021), used to protect binary logs and images.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_CRC16_H
+#define BQ34Z100G1_UTILS_CRC16_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Compute or continue a CRC-16/CCITT.  Pass the previous result as crc to checksum data in pieces.
+ */
+inline uint16_t crc16(uint8_t const * data, size_t length, uint16_t crc = 0xFFFF)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		crc ^= static_cast<uint16_t>(data[i]) << 8;
+		for(int bit = 0; bit < 8; bit++)
+		{
+			crc = (crc & 0x8000) ? static_cast<uint16_t>((crc << 1) ^ 0x1021) : static_cast<uint16_t>(crc << 1);
+		}
+	}
+	return crc;
+}
+
+#endif //BQ34Z100G1_UTILS_CRC16_H
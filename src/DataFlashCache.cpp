@@ -0,0 +1,268 @@
+//
+// Cache of BQ34Z100 data flash blocks with dirty tracking.
+//
+
+#include "DataFlashCache.h"
+#include "I2CProfiler.h"
+
+#include <cstring>
+
+namespace
+{
+	// Registers used for block data flash access
+	constexpr uint8_t REG_DATA_FLASH_CLASS = 0x3E; // followed by DataFlashBlock at 0x3F
+	constexpr uint8_t REG_BLOCK_DATA = 0x40;
+	constexpr uint8_t REG_BLOCK_DATA_CHECKSUM = 0x60;
+	constexpr uint8_t REG_BLOCK_DATA_CONTROL = 0x61;
+}
+
+DataFlashCache::DataFlashCache(I2C & i2c):
+i2c(i2c)
+{
+}
+
+bool DataFlashCache::read(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t & value)
+{
+	if(length == 0 || length > 4 || (offset % BLOCK_SIZE) + length > BLOCK_SIZE)
+	{
+		return false;
+	}
+
+	Block * block = getBlock(subclass, offset / BLOCK_SIZE);
+	if(block == nullptr)
+	{
+		return false;
+	}
+
+	value = 0;
+	for(uint8_t i = 0; i < length; i++)
+	{
+		value = (value << 8) | block->data[offset % BLOCK_SIZE + i];
+	}
+	return true;
+}
+
+bool DataFlashCache::write(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t value)
+{
+	return writeBits(subclass, offset, length, 0xFFFFFFFF, value);
+}
+
+bool DataFlashCache::writeBits(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t mask, uint32_t value)
+{
+	uint32_t oldValue;
+	if(!read(subclass, offset, length, oldValue))
+	{
+		return false;
+	}
+
+	uint32_t const newValue = (oldValue & ~mask) | (value & mask);
+
+	Block * block = getBlock(subclass, offset / BLOCK_SIZE);
+	for(uint8_t i = 0; i < length; i++)
+	{
+		block->data[offset % BLOCK_SIZE + i] = (newValue >> (8 * (length - i - 1))) & 0xFF;
+	}
+	return true;
+}
+
+bool DataFlashCache::readBlockData(uint8_t subclass, uint8_t index, uint8_t * data)
+{
+	Block * block = getBlock(subclass, index);
+	if(block == nullptr)
+	{
+		return false;
+	}
+
+	memcpy(data, block->data, BLOCK_SIZE);
+	return true;
+}
+
+bool DataFlashCache::writeBlockData(uint8_t subclass, uint8_t index, uint8_t const * data)
+{
+	Block * block = getBlock(subclass, index);
+	if(block == nullptr)
+	{
+		return false;
+	}
+
+	memcpy(block->data, data, BLOCK_SIZE);
+	return true;
+}
+
+DataFlashCache::CommitResult DataFlashCache::commit()
+{
+	CommitResult result{0, 0, 0};
+
+	for(Block & block : blocks)
+	{
+		if(!block.valid)
+		{
+			continue;
+		}
+
+		if(memcmp(block.data, block.gauge, BLOCK_SIZE) == 0)
+		{
+			++result.blocksUnchanged;
+			continue;
+		}
+
+		// The gauge only commits the block once it receives a matching checksum
+		bool written;
+		{
+			I2CProfiler::Access access({I2CProfiler::Kind::DATA_FLASH_WRITE, block.subclass});
+			written = selectBlock(block.subclass, block.index) && writeBlock(block.data);
+		}
+		if(!written)
+		{
+			++result.blocksFailed;
+			continue;
+		}
+
+		// Give the gauge time to program the flash, then read back to verify
+		ThisThread::sleep_for(100ms);
+		uint8_t readBack[BLOCK_SIZE];
+		if(!readBlock(block.subclass, block.index, readBack) || memcmp(readBack, block.data, BLOCK_SIZE) != 0)
+		{
+			++result.blocksFailed;
+
+			// Keep the cache in sync with what is really on the gauge, leaving the edits pending
+			block.valid = readBlock(block.subclass, block.index, block.gauge);
+			continue;
+		}
+
+		memcpy(block.gauge, block.data, BLOCK_SIZE);
+		++result.blocksWritten;
+	}
+
+	return result;
+}
+
+char const * DataFlashCache::errorText(Error error)
+{
+	switch(error)
+	{
+		case Error::NONE: return "no error";
+		case Error::GAUGE_ERROR: return "gauge did not answer";
+		case Error::OUT_OF_BLOCKS: return "out of cache blocks, increase MAX_BLOCKS";
+		default: return "unknown error";
+	}
+}
+
+void DataFlashCache::clear()
+{
+	for(Block & block : blocks)
+	{
+		block.valid = false;
+	}
+	blockDataControlEnabled = false;
+}
+
+DataFlashCache::Block * DataFlashCache::getBlock(uint8_t subclass, uint8_t index)
+{
+	Block * freeBlock = nullptr;
+	for(Block & block : blocks)
+	{
+		if(block.valid && block.subclass == subclass && block.index == index)
+		{
+			return &block;
+		}
+		if(!block.valid && freeBlock == nullptr)
+		{
+			freeBlock = &block;
+		}
+	}
+
+	if(freeBlock == nullptr)
+	{
+		lastError = Error::OUT_OF_BLOCKS;
+		return nullptr;
+	}
+
+	if(!readBlock(subclass, index, freeBlock->gauge))
+	{
+		lastError = Error::GAUGE_ERROR;
+		return nullptr;
+	}
+
+	memcpy(freeBlock->data, freeBlock->gauge, BLOCK_SIZE);
+	freeBlock->subclass = subclass;
+	freeBlock->index = index;
+	freeBlock->valid = true;
+	return freeBlock;
+}
+
+bool DataFlashCache::selectBlock(uint8_t subclass, uint8_t index)
+{
+	if(!blockDataControlEnabled)
+	{
+		uint8_t const enableCommand[] = {REG_BLOCK_DATA_CONTROL, 0x00};
+		if(!writeRegisters(enableCommand, sizeof(enableCommand)))
+		{
+			return false;
+		}
+		blockDataControlEnabled = true;
+	}
+
+	// DataFlashClass and DataFlashBlock are adjacent, so both go in one write
+	uint8_t const selectCommand[] = {REG_DATA_FLASH_CLASS, subclass, index};
+	if(!writeRegisters(selectCommand, sizeof(selectCommand)))
+	{
+		return false;
+	}
+
+	// let the gauge load the block into the BlockData registers
+	ThisThread::sleep_for(2ms);
+	return true;
+}
+
+bool DataFlashCache::readBlock(uint8_t subclass, uint8_t index, uint8_t * data)
+{
+	I2CProfiler::Access access({I2CProfiler::Kind::DATA_FLASH_READ, subclass});
+	bool success = selectBlock(subclass, index);
+	if(success)
+	{
+		char const command = REG_BLOCK_DATA;
+		++transactionCount;
+		success = i2c.write(I2C_ADDRESS, &command, 1, true) == 0;
+		if(success)
+		{
+			success = i2c.read(I2C_ADDRESS, reinterpret_cast<char *>(data), BLOCK_SIZE) == 0;
+		}
+		else
+		{
+			i2c.stop();
+		}
+	}
+
+	return success;
+}
+
+bool DataFlashCache::writeBlock(uint8_t const * data)
+{
+	uint8_t command[BLOCK_SIZE + 1];
+	command[0] = REG_BLOCK_DATA;
+	memcpy(command + 1, data, BLOCK_SIZE);
+	if(!writeRegisters(command, sizeof(command)))
+	{
+		return false;
+	}
+
+	uint8_t const checksumCommand[] = {REG_BLOCK_DATA_CHECKSUM, checksum(data)};
+	return writeRegisters(checksumCommand, sizeof(checksumCommand));
+}
+
+bool DataFlashCache::writeRegisters(uint8_t const * data, size_t length)
+{
+	++transactionCount;
+	return i2c.write(I2C_ADDRESS, reinterpret_cast<char const *>(data), length) == 0;
+}
+
+uint8_t DataFlashCache::checksum(uint8_t const * data)
+{
+	uint8_t sum = 0;
+	for(size_t i = 0; i < BLOCK_SIZE; i++)
+	{
+		sum += data[i];
+	}
+	return 255 - sum;
+}
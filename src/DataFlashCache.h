@@ -0,0 +1,156 @@
+//
+// Cache of BQ34Z100 data flash blocks with dirty tracking.
+// Each 32-byte block is read from the gauge once, edits are applied in memory,
+// and commit() writes back only the blocks whose contents actually changed, then verifies them.
+//
+
+#ifndef BQ34Z100G1_UTILS_DATAFLASHCACHE_H
+#define BQ34Z100G1_UTILS_DATAFLASHCACHE_H
+
+#include "DataFlashSchema.h"
+
+#include <mbed.h>
+#include <cstdint>
+#include <type_traits>
+
+class DataFlashCache
+{
+public:
+	static constexpr size_t BLOCK_SIZE = DataFlash::BLOCK_SIZE;
+
+	// Maximum number of distinct blocks that can be cached at once
+	static constexpr size_t MAX_BLOCKS = 8;
+
+	struct CommitResult
+	{
+		uint8_t blocksWritten;
+		uint8_t blocksUnchanged;
+		uint8_t blocksFailed; // write or verify failed
+	};
+
+	// Why a block couldn't be accessed
+	enum class Error : uint8_t
+	{
+		NONE,
+		GAUGE_ERROR, // reading the block from the gauge failed
+		OUT_OF_BLOCKS // the cache already holds MAX_BLOCKS other blocks
+	};
+
+	explicit DataFlashCache(I2C & i2c);
+
+	/**
+	 * Read a field of the data flash schema, e.g. get(DataFlash::DESIGN_CAPACITY, capacity).
+	 * The containing block is read from the gauge on first access only.
+	 * @return false if the block could not be read
+	 */
+	template<typename T>
+	bool get(DataFlash::Field<T> const & field, T & value)
+	{
+		uint32_t raw;
+		if(!read(field.subclass, field.offset, field.WIDTH, raw))
+		{
+			return false;
+		}
+		value = field.fromRaw(raw);
+		return true;
+	}
+
+	/**
+	 * Set a field.  Only the cached copy is changed until commit().
+	 */
+	template<typename T>
+	bool set(DataFlash::Field<T> const & field, T value)
+	{
+		return write(field.subclass, field.offset, field.WIDTH, field.toRaw(value));
+	}
+
+	/**
+	 * Set only the bits in mask of an integer field to the corresponding bits of value.
+	 */
+	template<typename T>
+	bool setBits(DataFlash::Field<T> const & field, T mask, T value)
+	{
+		static_assert(std::is_integral_v<T>, "only integer fields have bits");
+		return writeBits(field.subclass, field.offset, field.WIDTH, field.toRaw(mask), field.toRaw(value));
+	}
+
+	/**
+	 * Read every block that the given fields live in, one block read per distinct block however many
+	 * fields share it.  Later get()s and set()s of these fields then need no I2C traffic.
+	 * @return false if any block could not be read
+	 */
+	template<typename... T>
+	bool load(DataFlash::Field<T> const &... fields)
+	{
+		return ((getBlock(fields.subclass, fields.block()) != nullptr) && ...);
+	}
+
+	/**
+	 * Copy a whole 32-byte block out of the cache, reading it from the gauge on first access.
+	 */
+	bool readBlockData(uint8_t subclass, uint8_t index, uint8_t * data);
+
+	/**
+	 * Replace the cached contents of a whole block.  Like write(), nothing reaches the gauge until commit(),
+	 * and a block set to what the gauge already holds will be skipped.
+	 */
+	bool writeBlockData(uint8_t subclass, uint8_t index, uint8_t const * data);
+
+	/**
+	 * Write every block that differs from what was read from the gauge, then read it back to verify.
+	 * The gauge must be unsealed.
+	 */
+	CommitResult commit();
+
+	// Forget all cached blocks, e.g. after the gauge has been reset
+	void clear();
+
+	// Reason for the last failed get(), set(), setBits(), load() or block access, for the caller to report.
+	// The cache prints nothing itself, as the console may be carrying binary frames.
+	Error getLastError() const { return lastError; }
+
+	// Describe an error, e.g. "out of cache blocks, increase MAX_BLOCKS"
+	static char const * errorText(Error error);
+
+	// Number of I2C transactions issued since the last resetTransactionCount()
+	uint32_t getTransactionCount() const { return transactionCount; }
+	void resetTransactionCount() { transactionCount = 0; }
+
+private:
+	// 8-bit I2C address of the BQ34Z100
+	static constexpr int I2C_ADDRESS = 0xAA;
+
+	struct Block
+	{
+		bool valid = false;
+		uint8_t subclass = 0;
+		uint8_t index = 0;
+		uint8_t gauge[BLOCK_SIZE]; // contents as last read from the gauge
+		uint8_t data[BLOCK_SIZE]; // contents with edits applied
+	};
+
+	I2C & i2c;
+	Block blocks[MAX_BLOCKS];
+	bool blockDataControlEnabled = false;
+	uint32_t transactionCount = 0;
+	Error lastError = Error::NONE;
+
+	// Untyped access behind the schema accessors: a big endian field of up to 4 bytes, at an offset from the
+	// start of the subclass.  Fields may not cross a block boundary.
+	bool read(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t & value);
+	bool write(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t value);
+	bool writeBits(uint8_t subclass, uint8_t offset, uint8_t length, uint32_t mask, uint32_t value);
+
+	// Find the cached block, reading it from the gauge if needed.  Returns nullptr on failure.
+	Block * getBlock(uint8_t subclass, uint8_t index);
+
+	bool selectBlock(uint8_t subclass, uint8_t index);
+	bool readBlock(uint8_t subclass, uint8_t index, uint8_t * data);
+	bool writeBlock(uint8_t const * data);
+
+	bool writeRegisters(uint8_t const * data, size_t length);
+
+	static uint8_t checksum(uint8_t const * data);
+};
+
+#endif //BQ34Z100G1_UTILS_DATAFLASHCACHE_H
@@ -0,0 +1,205 @@
+//
+// Compile-time schema of the bq34z100-G1 data flash: every subclass, and the fields that this project uses,
+// with their C type, location and units.  DataFlashCache's typed accessors take these instead of raw
+// subclass/offset/length triples, so a field's width, block and signedness can't be mistyped at a call site.
+// This file has no Mbed dependencies.
+//
+// All data flash values are big endian (unlike the little endian standard commands).  Integer fields are
+// two's complement, and float fields are in the Xemics format (see Xemics.h).  Offsets are from the start of
+// the subclass, as in the TRM; the block is offset / 32.
+//
+
+#ifndef BQ34Z100G1_UTILS_DATAFLASHSCHEMA_H
+#define BQ34Z100G1_UTILS_DATAFLASHSCHEMA_H
+
+#include "Xemics.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace DataFlash
+{
+	constexpr size_t BLOCK_SIZE = 32;
+
+	// Data flash subclasses of the bq34z100-G1 and how many 32-byte blocks each spans,
+	// from the data flash summary in the technical reference manual
+	struct Subclass
+	{
+		uint8_t subclass;
+		uint8_t blockCount;
+		char const * name;
+	};
+
+	constexpr Subclass SUBCLASSES[] = {
+		{2, 1, "Safety"},
+		{32, 1, "Charge Inhibit Config"},
+		{34, 1, "Charge"},
+		{36, 1, "Charge Termination"},
+		{38, 1, "JEITA"},
+		{48, 2, "Data"},
+		{49, 1, "Discharge"},
+		{56, 1, "Manufacturer Data"},
+		{58, 1, "Lifetime Data"},
+		{59, 1, "Lifetime Temp Samples"},
+		{64, 1, "Registers"},
+		{65, 1, "Lifetime Resolution"},
+		{66, 1, "LED Display"},
+		{67, 1, "Power"},
+		{68, 1, "Manufacturer Info"},
+		{80, 3, "IT Cfg"},
+		{81, 1, "Current Thresholds"},
+		{82, 1, "State"},
+		{88, 1, "R_a0"},
+		{89, 1, "R_a0x"},
+		{104, 1, "Calibration Data"},
+		{107, 1, "Calibration Current"},
+		{112, 1, "Security Codes"},
+	};
+	constexpr size_t SUBCLASS_COUNT = sizeof(SUBCLASSES) / sizeof(SUBCLASSES[0]);
+
+	// Number of blocks in a subclass, or 0 if it isn't in the schema
+	constexpr uint8_t blockCount(uint8_t subclass)
+	{
+		for(Subclass const & entry : SUBCLASSES)
+		{
+			if(entry.subclass == subclass)
+			{
+				return entry.blockCount;
+			}
+		}
+		return 0;
+	}
+
+	enum class Unit : uint8_t
+	{
+		NONE, // flags, counts and codes
+		MILLIAMP_HOURS,
+		MILLIWATT_HOURS,
+		MILLIVOLTS,
+		MILLIAMPS,
+		MILLIOHMS
+	};
+
+	// Width and conversion of each C type that a field can have
+	template<typename T>
+	struct Encoding;
+
+	template<>
+	struct Encoding<uint8_t>
+	{
+		static constexpr uint8_t WIDTH = 1;
+		static constexpr uint32_t toRaw(uint8_t value) { return value; }
+		static constexpr uint8_t fromRaw(uint32_t raw) { return static_cast<uint8_t>(raw); }
+	};
+
+	template<>
+	struct Encoding<int8_t>
+	{
+		static constexpr uint8_t WIDTH = 1;
+		static constexpr uint32_t toRaw(int8_t value) { return static_cast<uint8_t>(value); }
+		static constexpr int8_t fromRaw(uint32_t raw) { return static_cast<int8_t>(static_cast<uint8_t>(raw)); }
+	};
+
+	template<>
+	struct Encoding<uint16_t>
+	{
+		static constexpr uint8_t WIDTH = 2;
+		static constexpr uint32_t toRaw(uint16_t value) { return value; }
+		static constexpr uint16_t fromRaw(uint32_t raw) { return static_cast<uint16_t>(raw); }
+	};
+
+	template<>
+	struct Encoding<int16_t>
+	{
+		static constexpr uint8_t WIDTH = 2;
+		static constexpr uint32_t toRaw(int16_t value) { return static_cast<uint16_t>(value); }
+		static constexpr int16_t fromRaw(uint32_t raw) { return static_cast<int16_t>(static_cast<uint16_t>(raw)); }
+	};
+
+	template<>
+	struct Encoding<uint32_t>
+	{
+		static constexpr uint8_t WIDTH = 4;
+		static constexpr uint32_t toRaw(uint32_t value) { return value; }
+		static constexpr uint32_t fromRaw(uint32_t raw) { return raw; }
+	};
+
+	template<>
+	struct Encoding<float>
+	{
+		static constexpr uint8_t WIDTH = 4;
+		static constexpr uint32_t toRaw(float value) { return Xemics::fromFloat(value); }
+		static constexpr float fromRaw(uint32_t raw) { return Xemics::toFloat(raw); }
+	};
+
+	/**
+	 * One value in data flash.  T is its type on the gauge (uint16_t for U2, int16_t for I2, float for F4, ...),
+	 * which fixes its width and how its bytes are interpreted.
+	 */
+	template<typename T>
+	struct Field
+	{
+		using Value = T;
+		static constexpr uint8_t WIDTH = Encoding<T>::WIDTH;
+
+		char const * name;
+		uint8_t subclass;
+		uint8_t offset; // from the start of the subclass
+		Unit unit;
+
+		constexpr uint8_t block() const { return offset / BLOCK_SIZE; }
+		constexpr uint8_t offsetInBlock() const { return offset % BLOCK_SIZE; }
+
+		// Inside a known subclass, and not crossing a block boundary
+		constexpr bool isValid() const
+		{
+			return block() < blockCount(subclass) && static_cast<size_t>(offsetInBlock() + WIDTH) <= BLOCK_SIZE;
+		}
+
+		// Conversions between the value and its bytes read as a big endian unsigned integer
+		static constexpr uint32_t toRaw(T value) { return Encoding<T>::toRaw(value); }
+		static constexpr T fromRaw(uint32_t raw) { return Encoding<T>::fromRaw(raw); }
+	};
+
+	// Data
+	constexpr Field<int16_t> DESIGN_CAPACITY{"Design Capacity", 48, 11, Unit::MILLIAMP_HOURS};
+	constexpr Field<int16_t> DESIGN_ENERGY{"Design Energy", 48, 13, Unit::MILLIWATT_HOURS};
+
+	// Registers
+	constexpr Field<uint16_t> PACK_CONFIGURATION{"Pack Configuration", 64, 0, Unit::NONE};
+	constexpr Field<uint8_t> LED_CONFIG{"LED Config", 64, 4, Unit::NONE};
+	constexpr Field<uint8_t> CELL_COUNT{"Cell Count", 64, 7, Unit::NONE};
+
+	// IT Cfg
+	constexpr Field<uint8_t> LOAD_SELECT{"Load Select", 80, 0, Unit::NONE};
+	constexpr Field<uint8_t> LOAD_MODE{"Load Mode", 80, 1, Unit::NONE};
+	constexpr Field<int16_t> RES_CURRENT{"Res Current", 80, 10, Unit::MILLIAMPS};
+	constexpr Field<int16_t> CELL_TERMINATE_VOLTAGE{"Cell Terminate Voltage", 80, 53, Unit::MILLIVOLTS};
+
+	// State
+	constexpr Field<int16_t> QMAX0{"QMax0", 82, 0, Unit::MILLIAMP_HOURS};
+	constexpr Field<uint8_t> UPDATE_STATUS{"Update Status", 82, 4, Unit::NONE};
+
+	// Calibration Data
+	constexpr Field<float> CC_GAIN{"CC Gain", 104, 0, Unit::MILLIOHMS};
+	constexpr Field<float> CC_DELTA{"CC Delta", 104, 4, Unit::MILLIOHMS};
+	constexpr Field<int16_t> CC_OFFSET{"CC Offset", 104, 8, Unit::NONE};
+	constexpr Field<int8_t> BOARD_OFFSET{"Board Offset", 104, 10, Unit::NONE};
+	constexpr Field<uint16_t> VOLTAGE_DIVIDER{"Voltage Divider", 104, 14, Unit::MILLIVOLTS};
+
+	namespace detail
+	{
+		template<typename... T>
+		constexpr bool allValid(Field<T> const &... fields)
+		{
+			return (fields.isValid() && ...);
+		}
+	}
+
+	static_assert(detail::allValid(DESIGN_CAPACITY, DESIGN_ENERGY, PACK_CONFIGURATION, LED_CONFIG, CELL_COUNT,
+		LOAD_SELECT, LOAD_MODE, RES_CURRENT, CELL_TERMINATE_VOLTAGE, QMAX0, UPDATE_STATUS,
+		CC_GAIN, CC_DELTA, CC_OFFSET, BOARD_OFFSET, VOLTAGE_DIVIDER),
+		"data flash field outside its subclass or across a block boundary");
+}
+
+#endif //BQ34Z100G1_UTILS_DATAFLASHSCHEMA_H
@@ -0,0 +1,151 @@
+//
+// I2C transactions that ride out transient bus faults: timed attempts, bounded retries with backoff, and
+// recovery of a bus that a device is holding low.
+//
+
+#include "FaultTolerantI2C.h"
+#include "I2CTransfers.h"
+
+#include <new>
+
+namespace
+{
+	// Held for every transaction and recovery, on all buses, so that each attempt's tally only holds its own
+	// transfers.  Mbed's I2C serializes transfers across all buses anyway.
+	Mutex busMutex;
+}
+
+FaultTolerantI2C::FaultTolerantI2C(I2C & i2c, PinName sda, PinName scl):
+FaultTolerantI2C(i2c, sda, scl, Config())
+{
+}
+
+FaultTolerantI2C::FaultTolerantI2C(I2C & i2c, PinName sda, PinName scl, Config const & config):
+i2c(i2c),
+sda(sda),
+scl(scl),
+config(config)
+{
+}
+
+FaultTolerantI2C::Result FaultTolerantI2C::transact(Attempt attempt, void * context)
+{
+	ScopedLock<Mutex> lock(busMutex);
+	++counters.transactions;
+
+	Result result{Status::OK, 0};
+	std::chrono::milliseconds backoff = config.firstBackoff;
+	for(uint8_t attemptIndex = 0; attemptIndex < config.maxAttempts; attemptIndex++)
+	{
+		if(attemptIndex > 0)
+		{
+			if(failuresInARow >= config.failuresBeforeRecovery && !recoverBus())
+			{
+				result.status = Status::BUS_STUCK;
+				break;
+			}
+			ThisThread::sleep_for(backoff);
+			backoff *= 2;
+			++result.retries;
+			++counters.retries;
+		}
+
+		Timer timer;
+		timer.start();
+		bool acknowledged;
+		{
+			I2CTransfers::Tally tally;
+			acknowledged = attempt(context, i2c) && tally.getCounts().nacks == 0;
+		}
+		bool const late = timer.elapsed_time() > config.attemptTimeout;
+		if(acknowledged && !late)
+		{
+			failuresInARow = 0;
+			result.status = Status::OK;
+			return result;
+		}
+
+		if(late)
+		{
+			++counters.timeouts;
+		}
+		result.status = late ? Status::TIMEOUT : Status::NACK;
+		if(failuresInARow < UINT8_MAX)
+		{
+			++failuresInARow;
+		}
+	}
+
+	++counters.failedTransactions;
+	return result;
+}
+
+bool FaultTolerantI2C::recoverBus()
+{
+	// Nothing else may be using the I2C object while it is constructed again
+	ScopedLock<Mutex> lock(busMutex);
+	++counters.recoveries;
+	failuresInARow = 0;
+
+	bool released = false;
+	{
+		// Take the pins over as GPIO.  As on an open drain bus, a line is only ever driven low, and released by
+		// making it an input again so that the pull-up takes it high.
+		DigitalInOut sdaPin(sda, PIN_INPUT, PullNone, 0);
+		DigitalInOut sclPin(scl, PIN_INPUT, PullNone, 0);
+		int const halfPeriod_us = RECOVERY_HALF_PERIOD.count();
+
+		// If SCL is low, some other master or a stuck device owns the bus, and clocking it would do no good
+		if(sclPin.read() == 1)
+		{
+			for(int clock = 0; clock < RECOVERY_CLOCKS && sdaPin.read() == 0; clock++)
+			{
+				sclPin.output();
+				wait_us(halfPeriod_us);
+				sclPin.input();
+				wait_us(halfPeriod_us);
+			}
+			released = sdaPin.read() == 1;
+		}
+
+		if(released)
+		{
+			// STOP: SDA rises while SCL is high, which resets every device's bus state machine
+			sclPin.output();
+			wait_us(halfPeriod_us);
+			sdaPin.output();
+			wait_us(halfPeriod_us);
+			sclPin.input();
+			wait_us(halfPeriod_us);
+			sdaPin.input();
+			wait_us(halfPeriod_us);
+		}
+	}
+
+	// Mbed has no call that initializes an I2C peripheral again, but constructing the object does, and it
+	// also gives the pins back to the peripheral.  References to the object stay valid, as it is the same type.
+	i2c.~I2C();
+	new(&i2c) I2C(sda, scl);
+	i2c.frequency(config.frequency_hz);
+
+	if(!released)
+	{
+		++counters.failedRecoveries;
+	}
+	return released;
+}
+
+std::chrono::microseconds FaultTolerantI2C::getWorstCaseLatency() const
+{
+	// Every attempt runs to its timeout, and the bus is recovered before every retry.  A recovery is at most
+	// the clock pulses and the STOP.
+	std::chrono::microseconds const recovery = (2 * RECOVERY_CLOCKS + 4) * RECOVERY_HALF_PERIOD;
+	std::chrono::microseconds latency = config.maxAttempts * config.attemptTimeout;
+	std::chrono::milliseconds backoff = config.firstBackoff;
+	for(uint8_t retry = 1; retry < config.maxAttempts; retry++)
+	{
+		latency += backoff + recovery;
+		backoff *= 2;
+	}
+	return latency;
+}
@@ -0,0 +1,138 @@
+//
+// I2C transactions that ride out transient bus faults: timed attempts, bounded retries with backoff, and
+// recovery of a bus that a device is holding low.
+//
+
+#ifndef BQ34Z100G1_UTILS_FAULTTOLERANTI2C_H
+#define BQ34Z100G1_UTILS_FAULTTOLERANTI2C_H
+
+#include <mbed.h>
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Runs transactions on an I2C peripheral so that none of them holds up its caller for longer than
+ * getWorstCaseLatency(), whatever the devices on the bus do.
+ *
+ * A transaction is a function that does the transfers of one attempt and returns whether it succeeded.  It also
+ * fails if the I2C layer reported any of its transfers as not acknowledged (see I2CTransfers.h), so a driver call,
+ * which doesn't tell, can be run as a transaction that always returns true.  It is run up to maxAttempts times,
+ * with a backoff before each retry that doubles every time.
+ * An attempt that took longer than attemptTimeout, e.g. because a device stretched the clock, counts as failed
+ * even if it was acknowledged, as its data no longer belongs to the time it was asked for.  Mbed's blocking
+ * transfers can't be interrupted, so on a stuck bus an attempt only ends when the I2C HAL's own timeout runs
+ * out.  The default attemptTimeout covers the STM32 HAL's 25 ms, and it has to cover the HAL's timeout for the
+ * worst case latency to hold.
+ *
+ * After failuresBeforeRecovery failed attempts in a row, counted across transactions, the bus is recovered
+ * before the next retry: SCL is clocked as GPIO up to 9 times, until a device that was cut off halfway through
+ * sending a byte lets go of SDA, then a STOP is sent and the I2C peripheral is initialized again.  If SDA is
+ * still low after that, the transaction gives up with BUS_STUCK instead of using up its remaining attempts.
+ *
+ * Transactions and recoveries hold a lock shared by every FaultTolerantI2C, so one on another thread waits for
+ * them to finish, and getWorstCaseLatency() can add up to one more transaction's worth.  Code on another thread
+ * that uses the I2C object directly could run into the object being constructed again, and its transfers would
+ * count against the transaction in progress, so any access that can overlap a transaction must be made as one.
+ */
+class FaultTolerantI2C
+{
+public:
+	struct Config
+	{
+		// Attempts per transaction, including the first
+		uint8_t maxAttempts = 3;
+
+		// Wait before the first retry
+		std::chrono::milliseconds firstBackoff{2};
+
+		// Longest an attempt may take and still count as successful
+		std::chrono::microseconds attemptTimeout{25000};
+
+		// Failed attempts in a row after which the bus is recovered
+		uint8_t failuresBeforeRecovery = 2;
+
+		int frequency_hz = 100000;
+	};
+
+	enum class Status : uint8_t
+	{
+		OK,
+		NACK, // the last attempt wasn't acknowledged
+		TIMEOUT, // the last attempt took longer than attemptTimeout
+		BUS_STUCK // SDA was still low after recovering the bus
+	};
+
+	struct Result
+	{
+		Status status;
+		uint8_t retries;
+
+		bool ok() const { return status == Status::OK; }
+	};
+
+	// Totals since construction or resetCounters()
+	struct Counters
+	{
+		uint32_t transactions;
+		uint32_t failedTransactions; // every attempt failed
+		uint32_t retries;
+		uint32_t timeouts; // attempts that took longer than attemptTimeout
+		uint32_t recoveries;
+		uint32_t failedRecoveries; // SDA still low afterwards
+	};
+
+	// One attempt at a transaction.  Returns true if it succeeded.
+	using Attempt = bool (*)(void * context, I2C & i2c);
+
+	/**
+	 * @param i2c Peripheral on the sda and scl pins.  Recovering the bus constructs it again in place, so other
+	 *     code, e.g. the driver, can go on using it by reference in later transactions.  It must be the only I2C
+	 *     object on these pins: another one would not be constructed again, and would keep the peripheral state
+	 *     from before the recovery.  soc-test's driver and sampler share one object, as do the packs on each of
+	 *     chem-id-measurer's buses.
+	 */
+	FaultTolerantI2C(I2C & i2c, PinName sda, PinName scl);
+	FaultTolerantI2C(I2C & i2c, PinName sda, PinName scl, Config const & config);
+
+	Result transact(Attempt attempt, void * context);
+
+	// Run a function object taking I2C & as a transaction
+	template<typename Function>
+	Result transact(Function & attempt)
+	{
+		return transact([](void * context, I2C & i2c) { return (*static_cast<Function *>(context))(i2c); }, &attempt);
+	}
+
+	/**
+	 * Clock out a device that is holding SDA low, send a STOP and initialize the I2C peripheral again.
+	 * Does no harm on a bus that is fine.  Waits for a transaction in progress on another thread.
+	 * @return false if SDA is still low, or something is holding SCL low
+	 */
+	bool recoverBus();
+
+	// Upper bound on the time one transact() takes
+	std::chrono::microseconds getWorstCaseLatency() const;
+
+	I2C & getI2C() { return i2c; }
+
+	Counters const & getCounters() const { return counters; }
+	void resetCounters() { counters = {}; }
+
+private:
+	// Enough for a device to finish any byte it was sending: 8 data bits and the ACK
+	static constexpr int RECOVERY_CLOCKS = 9;
+
+	// Half a period of the recovery clock, which runs at 50 kHz so that it suits any device on the bus
+	static constexpr std::chrono::microseconds RECOVERY_HALF_PERIOD{10};
+
+	I2C & i2c;
+	PinName const sda;
+	PinName const scl;
+	Config const config;
+
+	uint8_t failuresInARow = 0;
+	Counters counters{};
+};
+
+#endif //BQ34Z100G1_UTILS_FAULTTOLERANTI2C_H
@@ -0,0 +1,142 @@
+//
+// Integer-only text formatting for the telemetry that the tools print every sample.
+//
+
+#include "FixedFormat.h"
+
+namespace
+{
+	// Enough for any 32 bit value in decimal or hex.  Longer zero padding is cut short.
+	constexpr size_t MAX_DIGITS = 32;
+
+	uint32_t magnitude(int32_t value)
+	{
+		// works for INT32_MIN too
+		return value < 0 ? 0U - static_cast<uint32_t>(value) : static_cast<uint32_t>(value);
+	}
+}
+
+FixedFormatter::FixedFormatter(char * buffer, size_t size):
+buffer(buffer),
+size(size)
+{
+	if(size > 0)
+	{
+		buffer[0] = '\0';
+	}
+	else
+	{
+		overflow = true;
+	}
+}
+
+FixedFormatter & FixedFormatter::text(char const * string)
+{
+	while(*string != '\0')
+	{
+		character(*string++);
+	}
+	return *this;
+}
+
+FixedFormatter & FixedFormatter::text(char const * string, size_t length)
+{
+	for(size_t index = 0; index < length; index++)
+	{
+		character(string[index]);
+	}
+	return *this;
+}
+
+FixedFormatter & FixedFormatter::character(char c)
+{
+	if(used + 1 < size)
+	{
+		buffer[used++] = c;
+		buffer[used] = '\0';
+	}
+	else
+	{
+		overflow = true;
+	}
+	return *this;
+}
+
+FixedFormatter & FixedFormatter::unsignedInt(uint32_t value, uint8_t minDigits)
+{
+	char digits[MAX_DIGITS];
+	size_t count = 0;
+	do
+	{
+		digits[count++] = static_cast<char>('0' + value % 10);
+		value /= 10;
+	}
+	while(value != 0 && count < MAX_DIGITS);
+
+	while(count < minDigits && count < MAX_DIGITS)
+	{
+		digits[count++] = '0';
+	}
+
+	appendReversed(digits, count);
+	return *this;
+}
+
+FixedFormatter & FixedFormatter::signedInt(int32_t value)
+{
+	if(value < 0)
+	{
+		character('-');
+	}
+	return unsignedInt(magnitude(value));
+}
+
+FixedFormatter & FixedFormatter::hex(uint32_t value, uint8_t minDigits)
+{
+	char digits[MAX_DIGITS];
+	size_t count = 0;
+	do
+	{
+		digits[count++] = "0123456789abcdef"[value & 0xF];
+		value >>= 4;
+	}
+	while(value != 0 && count < MAX_DIGITS);
+
+	while(count < minDigits && count < MAX_DIGITS)
+	{
+		digits[count++] = '0';
+	}
+
+	appendReversed(digits, count);
+	return *this;
+}
+
+FixedFormatter & FixedFormatter::fixed(int32_t value, uint8_t decimals)
+{
+	uint32_t scale = 1;
+	for(uint8_t decimal = 0; decimal < decimals; decimal++)
+	{
+		scale *= 10;
+	}
+
+	uint32_t const absolute = magnitude(value);
+	if(value < 0)
+	{
+		character('-');
+	}
+	unsignedInt(absolute / scale);
+	if(decimals > 0)
+	{
+		character('.');
+		unsignedInt(absolute % scale, decimals);
+	}
+	return *this;
+}
+
+void FixedFormatter::appendReversed(char const * digits, size_t count)
+{
+	while(count > 0)
+	{
+		character(digits[--count]);
+	}
+}
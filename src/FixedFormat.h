@@ -0,0 +1,59 @@
+//
+// Integer-only text formatting for the telemetry that the tools print every sample.
+// Unlike snprintf(), nothing here parses a format string or touches floating point: fractional values
+// are passed as fixed-point integers and printed digit by digit into a buffer owned by the caller.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_FIXEDFORMAT_H
+#define BQ34Z100G1_UTILS_FIXEDFORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Builds one line of text in a fixed buffer.  Calls can be chained, e.g.
+ * formatter.fixed(centiseconds, 2).text(",\t").unsignedInt(voltage_mV).
+ * The buffer is always null terminated.  Text that doesn't fit is cut off and truncated() is set.
+ */
+class FixedFormatter
+{
+public:
+	// size includes the terminator
+	FixedFormatter(char * buffer, size_t size);
+
+	FixedFormatter & text(char const * string);
+	FixedFormatter & text(char const * string, size_t length);
+	FixedFormatter & character(char c);
+
+	// Decimal, padded with leading zeros to at least minDigits
+	FixedFormatter & unsignedInt(uint32_t value, uint8_t minDigits = 1);
+	FixedFormatter & signedInt(int32_t value);
+
+	// Lowercase hexadecimal, padded with leading zeros to at least minDigits
+	FixedFormatter & hex(uint32_t value, uint8_t minDigits = 1);
+
+	/**
+	 * Print a fixed-point number as value / 10^decimals with exactly that many decimal places,
+	 * e.g. fixed(-505, 2) gives "-5.05".  decimals can be at most 9.
+	 */
+	FixedFormatter & fixed(int32_t value, uint8_t decimals);
+
+	char const * c_str() const { return buffer; }
+
+	// Number of characters in the buffer, not counting the terminator
+	size_t length() const { return used; }
+
+	bool truncated() const { return overflow; }
+
+private:
+	char * buffer;
+	size_t size;
+	size_t used = 0;
+	bool overflow = false;
+
+	// Append characters that were generated backwards, least significant digit first
+	void appendReversed(char const * digits, size_t count);
+};
+
+#endif //BQ34Z100G1_UTILS_FIXEDFORMAT_H
@@ -0,0 +1,233 @@
+//
+// Versioned image format for cloning the complete data flash of a BQ34Z100.
+//
+
+#include "FlashImage.h"
+#include "Crc16.h"
+
+#include <cstring>
+
+namespace FlashImage
+{
+	namespace
+	{
+		constexpr size_t HEADER_LENGTH = 1 + 2 + 2 + 2 + 2; // after the magic
+		constexpr size_t BLOCK_LENGTH = 1 + 1 + BLOCK_SIZE + 2; // after the marker
+		constexpr size_t END_LENGTH = 2 + 2; // after the marker
+
+		void putLE16(uint8_t * out, uint16_t value)
+		{
+			out[0] = value & 0xFF;
+			out[1] = value >> 8;
+		}
+
+		uint16_t getLE16(uint8_t const * in)
+		{
+			return static_cast<uint16_t>(in[0] | (in[1] << 8));
+		}
+	}
+
+	size_t totalBlockCount()
+	{
+		size_t count = 0;
+		for(size_t i = 0; i < SUBCLASS_COUNT; i++)
+		{
+			count += SUBCLASSES[i].blockCount;
+		}
+		return count;
+	}
+
+	Writer::Writer(ByteSink & sink):
+	sink(sink)
+	{
+	}
+
+	void Writer::writeWithCRC(uint8_t const * data, size_t length)
+	{
+		uint8_t crcBytes[2];
+		putLE16(crcBytes, crc16(data, length));
+		sink.write(data, length);
+		sink.write(crcBytes, sizeof(crcBytes));
+	}
+
+	void Writer::writeHeader(Header const & header)
+	{
+		uint8_t fields[HEADER_LENGTH - 2];
+		fields[0] = FORMAT_VERSION;
+		putLE16(fields + 1, header.deviceType);
+		putLE16(fields + 3, header.firmwareVersion);
+		putLE16(fields + 5, header.blockCount);
+
+		sink.write(MAGIC, sizeof(MAGIC));
+		writeWithCRC(fields, sizeof(fields));
+		blocksWritten = 0;
+	}
+
+	void Writer::writeBlock(Block const & block)
+	{
+		uint8_t fields[BLOCK_LENGTH - 2];
+		fields[0] = block.subclass;
+		fields[1] = block.index;
+		memcpy(fields + 2, block.data, BLOCK_SIZE);
+
+		sink.write(&BLOCK_MARKER, 1);
+		writeWithCRC(fields, sizeof(fields));
+		++blocksWritten;
+	}
+
+	void Writer::writeEnd()
+	{
+		uint8_t fields[END_LENGTH - 2];
+		putLE16(fields, blocksWritten);
+
+		sink.write(&END_MARKER, 1);
+		writeWithCRC(fields, sizeof(fields));
+	}
+
+	Parser::Parser(Listener & listener):
+	listener(listener)
+	{
+	}
+
+	void Parser::expect(State newState, size_t length)
+	{
+		state = newState;
+		received = 0;
+		expected = length;
+	}
+
+	void Parser::fail(char const * message)
+	{
+		state = State::FAILED;
+		listener.onError(message);
+	}
+
+	void Parser::feed(uint8_t const * data, size_t length)
+	{
+		for(size_t i = 0; i < length && !isFinished(); i++)
+		{
+			uint8_t const byte = data[i];
+			switch(state)
+			{
+				case State::MAGIC:
+					if(byte == MAGIC[received])
+					{
+						if(++received == sizeof(MAGIC))
+						{
+							expect(State::HEADER, HEADER_LENGTH);
+						}
+					}
+					else
+					{
+						received = byte == MAGIC[0] ? 1 : 0;
+					}
+					break;
+
+				case State::MARKER:
+					if(byte == BLOCK_MARKER)
+					{
+						expect(State::BLOCK, BLOCK_LENGTH);
+					}
+					else if(byte == END_MARKER)
+					{
+						expect(State::END, END_LENGTH);
+					}
+					else
+					{
+						fail("unknown record type");
+					}
+					break;
+
+				case State::HEADER:
+				case State::BLOCK:
+				case State::END:
+					record[received++] = byte;
+					if(received == expected)
+					{
+						handleRecord();
+					}
+					break;
+
+				default:
+					break;
+			}
+		}
+	}
+
+	void Parser::handleRecord()
+	{
+		if(crc16(record, expected - 2) != getLE16(record + expected - 2))
+		{
+			fail("CRC mismatch");
+			return;
+		}
+
+		switch(state)
+		{
+			case State::HEADER:
+			{
+				if(record[0] != FORMAT_VERSION)
+				{
+					fail("unsupported image format version");
+					return;
+				}
+
+				Header header;
+				header.deviceType = getLE16(record + 1);
+				header.firmwareVersion = getLE16(record + 3);
+				header.blockCount = getLE16(record + 5);
+				if(header.blockCount > MAX_BLOCKS)
+				{
+					fail("too many blocks");
+					return;
+				}
+
+				expectedBlocks = header.blockCount;
+				blocksReceived = 0;
+				if(!listener.onHeader(header))
+				{
+					state = State::FAILED;
+					return;
+				}
+				break;
+			}
+
+			case State::BLOCK:
+			{
+				// Refused before it gets to the listener, which may already be programming the blocks
+				if(blocksReceived >= expectedBlocks)
+				{
+					fail("more blocks than the header announced");
+					return;
+				}
+
+				Block block;
+				block.subclass = record[0];
+				block.index = record[1];
+				memcpy(block.data, record + 2, BLOCK_SIZE);
+				++blocksReceived;
+				if(!listener.onBlock(block))
+				{
+					state = State::FAILED;
+					return;
+				}
+				break;
+			}
+
+			case State::END:
+				if(getLE16(record) != blocksReceived || blocksReceived != expectedBlocks)
+				{
+					fail("block count mismatch");
+					return;
+				}
+				state = State::DONE;
+				listener.onEnd();
+				return;
+
+			default:
+				break;
+		}
+
+		expect(State::MARKER, 0);
+	}
+}
@@ -0,0 +1,140 @@
+//
+// Versioned image format for cloning the complete data flash of a BQ34Z100.
+// This file has no Mbed dependencies so that host tools can share it.
+//
+// Layout (multi-byte fields little endian):
+//   Header:  "BQIM" | format version (1) | device type (2) | firmware version (2) | block count (2) | CRC-16 (2)
+//   Block:   'B' | subclass (1) | block index (1) | data (32) | CRC-16 (2)
+//   End:     'E' | block count (2) | CRC-16 (2)
+// Each CRC covers the bytes of its own record after the marker (after the magic, for the header).
+// Records can be consumed one at a time, so an image can be streamed without holding it in RAM.
+//
+
+#ifndef BQ34Z100G1_UTILS_FLASHIMAGE_H
+#define BQ34Z100G1_UTILS_FLASHIMAGE_H
+
+#include "ByteSink.h"
+#include "DataFlashSchema.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace FlashImage
+{
+	constexpr uint8_t MAGIC[4] = {'B', 'Q', 'I', 'M'};
+	constexpr uint8_t FORMAT_VERSION = 1;
+	constexpr size_t BLOCK_SIZE = DataFlash::BLOCK_SIZE;
+
+	// Upper limit on blocks in an image, so that readers can use fixed size storage
+	constexpr size_t MAX_BLOCKS = 32;
+
+	constexpr uint8_t BLOCK_MARKER = 'B';
+	constexpr uint8_t END_MARKER = 'E';
+
+	struct Header
+	{
+		uint16_t deviceType;
+		uint16_t firmwareVersion;
+		uint16_t blockCount;
+	};
+
+	struct Block
+	{
+		uint8_t subclass;
+		uint8_t index;
+		uint8_t data[BLOCK_SIZE];
+	};
+
+	// An image holds every subclass in the data flash schema
+	using SubclassInfo = DataFlash::Subclass;
+	constexpr SubclassInfo const * SUBCLASSES = DataFlash::SUBCLASSES;
+	constexpr size_t SUBCLASS_COUNT = DataFlash::SUBCLASS_COUNT;
+
+	// Total number of blocks in a full image
+	size_t totalBlockCount();
+
+	// Calibration Data (104) and Calibration Current (107) hold the gauge's own sense resistor and divider
+	// calibration, which doesn't carry over to another board, so imports leave them out unless asked to
+	constexpr bool isCalibration(uint8_t subclass)
+	{
+		return subclass == 104 || subclass == 107;
+	}
+
+	// Flow control of soc-test's image import: after the header and after each block, one of these is sent back
+	constexpr uint8_t ACK = 0x06; // send the next record
+	constexpr uint8_t NAK = 0x15; // the import has stopped, a message follows
+
+	class Writer
+	{
+	public:
+		explicit Writer(ByteSink & sink);
+
+		void writeHeader(Header const & header);
+		void writeBlock(Block const & block);
+		void writeEnd();
+
+	private:
+		ByteSink & sink;
+		uint16_t blocksWritten = 0;
+
+		void writeWithCRC(uint8_t const * data, size_t length);
+	};
+
+	// Receives records from the parser.  Returning false from a callback aborts parsing.
+	class Listener
+	{
+	public:
+		virtual bool onHeader(Header const & header) = 0;
+		virtual bool onBlock(Block const & block) = 0;
+		virtual void onEnd() = 0;
+		virtual void onError(char const * message) = 0;
+
+	protected:
+		~Listener() = default;
+	};
+
+	/**
+	 * Incremental image parser.  Bytes can be fed in any chunk size.
+	 * Anything before the magic is skipped, so the image can follow other console output.
+	 * Any error (bad CRC, unknown record, block count mismatch) stops parsing.  A block past the count in the
+	 * header is refused before it reaches the listener.
+	 */
+	class Parser
+	{
+	public:
+		explicit Parser(Listener & listener);
+
+		void feed(uint8_t const * data, size_t length);
+
+		// True once the end record has been parsed or parsing has failed
+		bool isFinished() const { return state == State::DONE || state == State::FAILED; }
+		bool hasFailed() const { return state == State::FAILED; }
+
+	private:
+		Listener & listener;
+
+		enum class State
+		{
+			MAGIC,
+			HEADER,
+			MARKER,
+			BLOCK,
+			END,
+			DONE,
+			FAILED
+		};
+		State state = State::MAGIC;
+
+		uint8_t record[2 + BLOCK_SIZE + 2];
+		size_t received = 0;
+		size_t expected = 0;
+		uint16_t expectedBlocks = 0;
+		uint16_t blocksReceived = 0;
+
+		void expect(State newState, size_t length);
+		void fail(char const * message);
+		void handleRecord();
+	};
+}
+
+#endif //BQ34Z100G1_UTILS_FLASHIMAGE_H
@@ -0,0 +1,90 @@
+//
+// Names of the bits in the gauge's status registers, and compact reports of which of them changed.
+//
+
+#include "GaugeBits.h"
+#include "FixedFormat.h"
+
+#include <cstdio>
+
+namespace GaugeBits
+{
+	namespace
+	{
+		// Append one bit to the record, keeping track of the total length like snprintf() would
+		void appendBit(char * buffer, size_t size, int & length, char const * prefix, NameTable const & names, size_t bit)
+		{
+			size_t const offset = length < 0 ? size : static_cast<size_t>(length);
+			char * const out = offset < size ? buffer + offset : nullptr;
+			size_t const remaining = offset < size ? size - offset : 0;
+
+			std::string_view const name = names[bit];
+			int written;
+			if(name.empty())
+			{
+				written = snprintf(out, remaining, " %sb%zu", prefix, bit);
+			}
+			else
+			{
+				written = snprintf(out, remaining, " %s%.*s", prefix, static_cast<int>(name.size()), name.data());
+			}
+			length += written;
+		}
+	}
+
+	int formatTransitions(char * buffer, size_t size, char const * registerName, NameTable const & names,
+		uint16_t previous, uint16_t current)
+	{
+		uint16_t const changed = previous ^ current;
+		if(changed == 0)
+		{
+			return 0;
+		}
+
+		int length = snprintf(buffer, size, "%s", registerName);
+		for(size_t bit = BIT_COUNT; bit-- > 0;)
+		{
+			if(changed & (1 << bit))
+			{
+				appendBit(buffer, size, length, (current & (1 << bit)) ? "+" : "-", names, bit);
+			}
+		}
+		return length;
+	}
+
+	int formatSetBits(char * buffer, size_t size, char const * registerName, NameTable const & names, uint16_t value)
+	{
+		int length = snprintf(buffer, size, "%s =", registerName);
+		for(size_t bit = BIT_COUNT; bit-- > 0;)
+		{
+			if(value & (1 << bit))
+			{
+				appendBit(buffer, size, length, "", names, bit);
+			}
+		}
+		return length;
+	}
+
+	int formatBitfield(char * buffer, size_t size, char const * registerName, Descriptions const & descriptions,
+		uint16_t value)
+	{
+		FixedFormatter formatter(buffer, size);
+		formatter.character('\n').text(registerName).text(": 0x").hex(value).text(" (0b");
+		for(size_t bit = BIT_COUNT; bit-- > 0;)
+		{
+			formatter.character((value & (1 << bit)) ? '1' : '0');
+		}
+		formatter.text(")\n");
+
+		// Descriptions are in reverse order numerically
+		for(size_t bit = BIT_COUNT; bit-- > 0;)
+		{
+			char const * const description = descriptions[BIT_COUNT - 1 - bit];
+			if(description != nullptr)
+			{
+				formatter.text("- ").text(description).text(": ").character((value & (1 << bit)) ? '1' : '0').character('\n');
+			}
+		}
+		return static_cast<int>(formatter.length());
+	}
+}
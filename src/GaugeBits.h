@@ -0,0 +1,146 @@
+//
+// Names of the bits in the gauge's Control Status, Flags and FlagsB registers, and compact reports of
+// which of them changed.
+// The name tables are built at compile time from the descriptions.  This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_GAUGEBITS_H
+#define BQ34Z100G1_UTILS_GAUGEBITS_H
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+namespace GaugeBits
+{
+	constexpr size_t BIT_COUNT = 16;
+
+	// Descriptions of each bit, from bit 15 down to bit 0.  nullptr for reserved bits.
+	using Descriptions = char const * const[BIT_COUNT];
+
+	constexpr Descriptions STATUS_BIT_DESCS = {
+		nullptr,
+		"Full Access Sealed (FAS)",
+		"Sealed (SS)",
+		"Calibration Enabled (CALEN)",
+		"Coulomb Counter Calibrating (CCA)",
+		"Board Calibration Active (BCA)",
+		"Valid Data Flash Checksum (CSV)",
+		nullptr,
+		nullptr,
+		nullptr,
+		"Full Sleep Mode (FULLSLEEP)",
+		"Sleep Mode (SLEEP)",
+		"Impedance Track using Constant Power (LDMD)",
+		"Ra Updates Disabled (RUP_DIS)",
+		"Voltage OK for Qmax Updates (VOK)",
+		"Qmax Updates Enabled (QEN)"
+	};
+
+	constexpr Descriptions FLAGS_BIT_DESCS = {
+		"Overtemperature in Charge (OTC)",
+		"Overtemperature in Discharge (OTD)",
+		"High Battery Voltage (BATHI)",
+		"Low Battery Voltage (BATLOW)",
+		"Charge Inhibited (CHG_INH)",
+		"Charging Not Allowed (XCHG)",
+		"Full Charge (FC)",
+		"Charge Allowed (CHG)",
+		"Open Circuit Voltage Measurement Performed (OCVTAKEN)",
+		nullptr,
+		nullptr,
+		"Update Cycle Needed (CF)",
+		nullptr,
+		"SoC Threshold 1 Reached (SOC1)",
+		"SoC Threshold Final Reached (SOCF)",
+		"Discharge Detected (DSG)"
+	};
+
+	constexpr Descriptions FLAGSB_BIT_DESCS = {
+		"State of Health Calc Active (SOH)",
+		"LiFePO4 Relax Enabled (LIFE)",
+		"Waiting for Depth of Discharge Measurement (FIRSTDOD)",
+		nullptr,
+		nullptr,
+		"Depth of Discharge at End of Charge Updated (DODEOC)",
+		"Remaining Capacity Changed (DTRC)",
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr,
+		nullptr
+	};
+
+	// Short names of each bit, indexed by bit number.  Empty for reserved bits.
+	using NameTable = std::array<std::string_view, BIT_COUNT>;
+
+	/**
+	 * Get the short name from a description: the text in its last pair of parentheses, e.g. "SOC1",
+	 * or the whole description if it has none.
+	 */
+	constexpr std::string_view shortName(char const * description)
+	{
+		if(description == nullptr)
+		{
+			return {};
+		}
+
+		std::string_view const text(description);
+		size_t const open = text.rfind('(');
+		size_t const close = text.rfind(')');
+		if(open == std::string_view::npos || close == std::string_view::npos || close < open)
+		{
+			return text;
+		}
+		return text.substr(open + 1, close - open - 1);
+	}
+
+	constexpr NameTable makeNameTable(Descriptions const & descriptions)
+	{
+		NameTable names{};
+		for(size_t bit = 0; bit < BIT_COUNT; bit++)
+		{
+			names[bit] = shortName(descriptions[BIT_COUNT - 1 - bit]);
+		}
+		return names;
+	}
+
+	constexpr NameTable STATUS_NAMES = makeNameTable(STATUS_BIT_DESCS);
+	constexpr NameTable FLAGS_NAMES = makeNameTable(FLAGS_BIT_DESCS);
+	constexpr NameTable FLAGSB_NAMES = makeNameTable(FLAGSB_BIT_DESCS);
+
+	static_assert(FLAGS_NAMES[2] == "SOC1" && FLAGS_NAMES[7] == "OCVTAKEN" && STATUS_NAMES[13] == "SS",
+		"bit name tables are out of order");
+
+	/**
+	 * Describe the bits that changed between two readings of a register as one record, e.g.
+	 * "FLAGS +SOC1 -DSG".  Bits set are prefixed with +, bits cleared with -, and reserved bits
+	 * go by number, e.g. "+b10".
+	 * @return Number of characters written, as snprintf().  0 if nothing changed.
+	 */
+	int formatTransitions(char * buffer, size_t size, char const * registerName, NameTable const & names,
+		uint16_t previous, uint16_t current);
+
+	/**
+	 * Describe every set bit of a register, for the first reading, e.g. "FLAGS = CHG DSG".
+	 */
+	int formatSetBits(char * buffer, size_t size, char const * registerName, NameTable const & names, uint16_t value);
+
+	// Buffer size that fits any report from formatBitfield()
+	constexpr size_t BITFIELD_REPORT_SIZE = 1024;
+
+	/**
+	 * Describe a register in full, for soc-test's status printout: a blank line, the name with the value in
+	 * hex and binary, then one "- description: 0/1" line for every bit that isn't reserved.
+	 * @return Number of characters written.
+	 */
+	int formatBitfield(char * buffer, size_t size, char const * registerName, Descriptions const & descriptions,
+		uint16_t value);
+}
+
+#endif //BQ34Z100G1_UTILS_GAUGEBITS_H
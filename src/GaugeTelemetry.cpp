@@ -0,0 +1,89 @@
+//
+// Burst reader for the BQ34Z100's standard command block.
+//
+
+#include "GaugeTelemetry.h"
+#include "FaultTolerantI2C.h"
+#include "I2CMux.h"
+#include "I2CProfiler.h"
+
+namespace
+{
+	// Standard commands are little endian
+	uint16_t readLE16(uint8_t const * bytes)
+	{
+		return static_cast<uint16_t>(bytes[0] | (bytes[1] << 8));
+	}
+}
+
+GaugeTelemetry::GaugeTelemetry(FaultTolerantI2C & bus):
+bus(bus)
+{
+}
+
+GaugeTelemetry::GaugeTelemetry(FaultTolerantI2C & bus, I2CMux & mux, uint8_t muxChannel):
+bus(bus),
+mux(&mux),
+muxChannel(muxChannel)
+{
+}
+
+bool GaugeTelemetry::read(TelemetrySnapshot & snapshot)
+{
+	char const command = FIRST_REGISTER;
+	char block[BLOCK_LENGTH];
+
+	// Every attempt selects the mux channel again, as a failed one leaves the mux state unknown
+	auto attempt = [this, &command, &block](I2C & i2c)
+	{
+		if(mux != nullptr && !mux->select(muxChannel))
+		{
+			return false;
+		}
+
+		// Set the register pointer, then read the block with a repeated start.
+		// The gauge auto-increments the register address, so this is a single bus transaction.
+		if(i2c.write(I2C_ADDRESS, &command, 1, true) != 0)
+		{
+			i2c.stop();
+			return false;
+		}
+		if(i2c.read(I2C_ADDRESS, block, BLOCK_LENGTH) != 0)
+		{
+			if(mux != nullptr)
+			{
+				mux->invalidate();
+			}
+			return false;
+		}
+		return true;
+	};
+	FaultTolerantI2C::Result result;
+	{
+		I2CProfiler::Access access({I2CProfiler::Kind::BURST, FIRST_REGISTER});
+		result = bus.transact(attempt);
+		access.setRetries(result.retries);
+	}
+	if(!result.ok())
+	{
+		return false;
+	}
+
+	decode(reinterpret_cast<uint8_t const *>(block), snapshot);
+	return true;
+}
+
+void GaugeTelemetry::decode(uint8_t const * block, TelemetrySnapshot & snapshot)
+{
+	// offsets are relative to FIRST_REGISTER
+	snapshot.soc_percent = block[0x02 - FIRST_REGISTER];
+	snapshot.maxError_percent = block[0x03 - FIRST_REGISTER];
+	snapshot.remaining_mAh = readLE16(block + 0x04 - FIRST_REGISTER);
+	snapshot.fullCharge_mAh = readLE16(block + 0x06 - FIRST_REGISTER);
+	snapshot.voltage_mV = readLE16(block + 0x08 - FIRST_REGISTER);
+	snapshot.averageCurrent_mA = static_cast<int16_t>(readLE16(block + 0x0A - FIRST_REGISTER));
+	snapshot.temperature_dK = readLE16(block + 0x0C - FIRST_REGISTER);
+	snapshot.flags = readLE16(block + 0x0E - FIRST_REGISTER);
+	snapshot.current_mA = static_cast<int16_t>(readLE16(block + 0x10 - FIRST_REGISTER));
+	snapshot.flagsB = readLE16(block + 0x12 - FIRST_REGISTER);
+}
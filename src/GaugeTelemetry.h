@@ -0,0 +1,85 @@
+//
+// Burst reader for the BQ34Z100's standard command block.
+//
+
+#ifndef BQ34Z100G1_UTILS_GAUGETELEMETRY_H
+#define BQ34Z100G1_UTILS_GAUGETELEMETRY_H
+
+#include <mbed.h>
+#include <cstdint>
+
+class FaultTolerantI2C;
+class I2CMux;
+
+/**
+ * One set of readings decoded from the standard command registers.
+ * Since every field comes out of the same I2C burst, they all belong to the same gauge update.
+ */
+struct TelemetrySnapshot
+{
+	uint8_t soc_percent = 0; // StateOfCharge (0x02)
+	uint8_t maxError_percent = 0; // MaxError (0x03)
+	uint16_t remaining_mAh = 0; // RemainingCapacity (0x04)
+	uint16_t fullCharge_mAh = 0; // FullChargeCapacity (0x06)
+	uint16_t voltage_mV = 0; // Voltage (0x08)
+	int16_t averageCurrent_mA = 0; // AverageCurrent (0x0A)
+	uint16_t temperature_dK = 0; // Temperature (0x0C), in units of 0.1 K
+	uint16_t flags = 0; // Flags (0x0E)
+	int16_t current_mA = 0; // Current (0x10)
+	uint16_t flagsB = 0; // FlagsB (0x12)
+
+	// Temperature converted the same way as BQ34Z100::getTemperature()
+	double temperatureC() const
+	{
+		return temperature_dK / 10.0 - 273.15;
+	}
+
+	// true if every register matches, i.e. the gauge hasn't updated in between (or its update changed nothing)
+	bool sameReadings(TelemetrySnapshot const & other) const
+	{
+		return soc_percent == other.soc_percent && maxError_percent == other.maxError_percent
+			&& remaining_mAh == other.remaining_mAh && fullCharge_mAh == other.fullCharge_mAh
+			&& voltage_mV == other.voltage_mV && averageCurrent_mA == other.averageCurrent_mA
+			&& temperature_dK == other.temperature_dK && flags == other.flags
+			&& current_mA == other.current_mA && flagsB == other.flagsB;
+	}
+};
+
+class GaugeTelemetry
+{
+public:
+	// 8-bit I2C address of the BQ34Z100
+	static constexpr int I2C_ADDRESS = 0xAA;
+
+	// Register range covered by one burst: StateOfCharge (0x02) through the end of FlagsB (0x13)
+	static constexpr uint8_t FIRST_REGISTER = 0x02;
+	static constexpr size_t BLOCK_LENGTH = 0x14 - FIRST_REGISTER;
+
+	explicit GaugeTelemetry(FaultTolerantI2C & bus);
+
+	/**
+	 * Reader for a gauge behind a mux channel.  The channel is selected before every read,
+	 * so gauges on other channels of the same mux can be read in between.
+	 */
+	GaugeTelemetry(FaultTolerantI2C & bus, I2CMux & mux, uint8_t muxChannel);
+
+	/**
+	 * Read the whole standard command block in one I2C transaction and decode it.
+	 * Failed attempts are retried, and the bus recovered, by the FaultTolerantI2C, so a read never takes
+	 * longer than its getWorstCaseLatency().
+	 * @return true on success.  On failure, snapshot is left untouched.
+	 */
+	bool read(TelemetrySnapshot & snapshot);
+
+	/**
+	 * Decode a raw register block (starting at FIRST_REGISTER) into a snapshot.
+	 */
+	static void decode(uint8_t const * block, TelemetrySnapshot & snapshot);
+
+private:
+	FaultTolerantI2C & bus;
+	I2CMux * const mux = nullptr;
+	uint8_t const muxChannel = 0;
+};
+
+#endif //BQ34Z100G1_UTILS_GAUGETELEMETRY_H
@@ -0,0 +1,187 @@
+//
+// Locks sampling onto the BQ34Z100's own measurement updates.
+//
+
+#include "GaugeUpdateTracker.h"
+
+#include <algorithm>
+
+using namespace std::chrono;
+
+GaugeUpdateTracker::GaugeUpdateTracker():
+GaugeUpdateTracker(Config())
+{
+}
+
+GaugeUpdateTracker::GaugeUpdateTracker(Config const & config):
+config(config),
+updatePeriod(config.updatePeriod)
+{
+}
+
+char const * GaugeUpdateTracker::stateName(State state)
+{
+	switch(state)
+	{
+		case State::IDLE: return "idle";
+		case State::SEARCHING: return "searching";
+		case State::TRACKING: return "tracking";
+		case State::FREE_RUNNING: return "free running";
+	}
+	return "unknown";
+}
+
+void GaugeUpdateTracker::start(milliseconds newSamplePeriod)
+{
+	samplePeriod = newSamplePeriod;
+	updatesPerSample = std::max<uint32_t>(1, (samplePeriod + config.updatePeriod / 2) / config.updatePeriod);
+	updatePeriod = config.updatePeriod;
+	periodMeasured = false;
+	freeRunLength = 0;
+	freeRunLeft = 0;
+	misses = 0;
+	readCount = 0;
+	missCount = 0;
+	state = State::IDLE;
+}
+
+GaugeUpdateTracker::Step GaugeUpdateTracker::observe(milliseconds now, bool changed)
+{
+	++readCount;
+
+	switch(state)
+	{
+		case State::IDLE:
+			// The first reading is a sample whenever it comes, and the fixed period starts from there
+			nextSampleDue = now + samplePeriod;
+			return search(true, now);
+
+		case State::SEARCHING:
+		{
+			// Keep to the fixed period while searching, in case it takes longer than a sample period
+			bool const due = now >= nextSampleDue;
+			if(due)
+			{
+				nextSampleDue += samplePeriod;
+			}
+
+			if(changed)
+			{
+				// The update happened since the last poll
+				lastUpdate = now;
+				misses = 0;
+				freeRunLength = 0;
+				state = State::TRACKING;
+				if(due)
+				{
+					return trackUpdate(true, updatesPerSample);
+				}
+
+				// Wait for the update closest to when the next sample is due
+				microseconds const untilDue = nextSampleDue - now;
+				uint32_t const updates = std::max<uint32_t>(1, (untilDue + updatePeriod / 2) / updatePeriod);
+				return trackUpdate(false, updates);
+			}
+
+			if(now >= searchEnd)
+			{
+				freeRunLength = freeRunLength == 0 ? config.freeRunSamples
+					: std::min<uint16_t>(freeRunLength * 2, config.maxFreeRunSamples);
+				freeRunLeft = freeRunLength;
+				return freeRun(due, now);
+			}
+			return {due, now + config.pollInterval};
+		}
+
+		case State::FREE_RUNNING:
+			// Changes since the last sample mean there are updates to find again
+			nextSampleDue += samplePeriod;
+			if(freeRunLeft > 0)
+			{
+				--freeRunLeft;
+			}
+			if(changed && freeRunLeft == 0)
+			{
+				return search(true, now);
+			}
+			return {true, nextSampleDue};
+
+		case State::TRACKING:
+			break;
+	}
+
+	if(!windowOpen)
+	{
+		windowOpen = true;
+		return {false, now + config.pollInterval};
+	}
+
+	if(changed)
+	{
+		// Time the update against the last one seen, over all the updates in between
+		microseconds const measured = (now - lastUpdate) / updatesToTarget;
+		microseconds const tolerance = config.updatePeriod * config.driftTolerance_ppm / 1000000;
+		if(measured > config.updatePeriod - tolerance && measured < config.updatePeriod + tolerance)
+		{
+			updatePeriod = periodMeasured ? updatePeriod + (measured - updatePeriod) / 4 : measured;
+			periodMeasured = true;
+		}
+
+		lastUpdate = now;
+		misses = 0;
+		return trackUpdate(true, updatesPerSample);
+	}
+
+	if(now >= target() + windowHalfWidth(updatesToTarget))
+	{
+		// Either the readings didn't change, or the update was missed.  Assume it came on time: this reading
+		// was taken after it either way.
+		++missCount;
+		lastUpdate = target();
+		if(++misses >= config.maxMisses)
+		{
+			// Polling gains nothing while the readings stay the same
+			nextSampleDue = now + samplePeriod;
+			freeRunLeft = 0;
+			return freeRun(true, now);
+		}
+		return trackUpdate(true, updatesPerSample);
+	}
+
+	return {false, now + config.pollInterval};
+}
+
+microseconds GaugeUpdateTracker::target() const
+{
+	return lastUpdate + updatePeriod * updatesToTarget;
+}
+
+microseconds GaugeUpdateTracker::windowHalfWidth(uint32_t updates) const
+{
+	uint32_t const tolerance_ppm = periodMeasured ? config.trackingTolerance_ppm : config.driftTolerance_ppm;
+	microseconds const drift = updatePeriod * updates * tolerance_ppm / 1000000;
+
+	// Never reach as far as the updates on either side
+	return std::min<microseconds>(config.guard + drift, updatePeriod / 2 - config.pollInterval);
+}
+
+GaugeUpdateTracker::Step GaugeUpdateTracker::trackUpdate(bool sample, uint32_t updates)
+{
+	updatesToTarget = updates;
+	windowOpen = false;
+	microseconds const windowStart = target() - windowHalfWidth(updates);
+	return {sample, duration_cast<milliseconds>(windowStart)};
+}
+
+GaugeUpdateTracker::Step GaugeUpdateTracker::freeRun(bool sample, milliseconds now)
+{
+	state = State::FREE_RUNNING;
+	return {sample, std::max(nextSampleDue, now + config.pollInterval)};
+}
+
+GaugeUpdateTracker::Step GaugeUpdateTracker::search(bool sample, milliseconds now)
+{
+	state = State::SEARCHING;
+	searchEnd = now + config.updatePeriod * config.searchUpdates;
+	return {sample, now + config.pollInterval};
+}
@@ -0,0 +1,142 @@
+//
+// Locks sampling onto the BQ34Z100's own measurement updates, which it detects from readings that change.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_GAUGEUPDATETRACKER_H
+#define BQ34Z100G1_UTILS_GAUGEUPDATETRACKER_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * The gauge refreshes its measurements about once per second from its own oscillator, which can be a few
+ * percent off the MCU's clock.  Sampling on a fixed MCU period therefore drifts across the gauge's updates,
+ * so every now and then a sample repeats the previous one or skips an update.
+ *
+ * This tracker tells the sampler when to read so that each sample is taken just after an update.  To find
+ * an update it polls the gauge until a reading differs from the one before it (SEARCHING).  From then on it
+ * predicts the update due at the next sample time and only polls in a short window around it (TRACKING),
+ * measuring the gauge's update period from the updates it sees so that the window can stay narrow.
+ * Between windows nothing is read, so the MCU can sleep.
+ *
+ * Readings that never change, e.g. a pack at rest with a steady voltage, can't be told apart from a missed
+ * update, but then it also doesn't matter when they are read.  After a few predicted updates without a change,
+ * or a search that finds nothing, the tracker reads once per sample period on the MCU's clock (FREE_RUNNING).
+ * Once a sample differs from the one before it, it searches again.  Readings that change only every few
+ * updates make searches fail too, so each failed search doubles the number of samples before the next one.
+ */
+class GaugeUpdateTracker
+{
+public:
+	// Time between gauge updates according to the datasheet
+	static constexpr std::chrono::milliseconds NOMINAL_UPDATE_PERIOD = std::chrono::seconds(1);
+
+	struct Config
+	{
+		std::chrono::milliseconds updatePeriod = NOMINAL_UPDATE_PERIOD;
+
+		// Time between reads while looking for an update.  Also the timing resolution of the samples.
+		std::chrono::milliseconds pollInterval = std::chrono::milliseconds(20);
+
+		// Polling starts this long before a predicted update and stops this long after it,
+		// plus the drift allowance below
+		std::chrono::milliseconds guard = std::chrono::milliseconds(40);
+
+		// How far off the gauge's update period may be before it has been measured, and after
+		uint32_t driftTolerance_ppm = 30000;
+		uint32_t trackingTolerance_ppm = 2000;
+
+		// Predicted updates in a row without a change before free running
+		uint8_t maxMisses = 3;
+
+		// Update periods to search for a change before free running
+		uint8_t searchUpdates = 3;
+
+		// Samples to free run for before searching again, after the first failed search and at most
+		uint16_t freeRunSamples = 4;
+		uint16_t maxFreeRunSamples = 256;
+	};
+
+	enum class State : uint8_t
+	{
+		IDLE, // not started
+		SEARCHING,
+		TRACKING,
+		FREE_RUNNING
+	};
+
+	// What to do with a reading, and when to read next
+	struct Step
+	{
+		bool sample; // the reading is a fresh measurement and a sample is due
+		std::chrono::milliseconds nextRead;
+	};
+
+	GaugeUpdateTracker();
+	explicit GaugeUpdateTracker(Config const & config);
+
+	/**
+	 * Start sampling, with one sample per samplePeriod, rounded to a whole number of gauge updates.
+	 * The first reading should be taken straight away, and is always a sample.
+	 */
+	void start(std::chrono::milliseconds samplePeriod);
+
+	/**
+	 * Feed a reading.
+	 * @param changed true if it differs from the reading before it
+	 */
+	Step observe(std::chrono::milliseconds now, bool changed);
+
+	State getState() const { return state; }
+
+	// Measured time between gauge updates, or the nominal one until an update has been timed
+	std::chrono::microseconds getUpdatePeriod() const { return updatePeriod; }
+
+	// Reads since start(), and predicted updates that showed no change
+	uint32_t getReadCount() const { return readCount; }
+	uint32_t getMissCount() const { return missCount; }
+
+	static char const * stateName(State state);
+
+private:
+	Config config;
+	State state = State::IDLE;
+
+	std::chrono::milliseconds samplePeriod{0};
+
+	// Gauge updates between samples while tracking
+	uint32_t updatesPerSample = 1;
+
+	std::chrono::microseconds updatePeriod;
+	bool periodMeasured = false;
+
+	// SEARCHING and FREE_RUNNING: when the next sample is due on the fixed period
+	std::chrono::milliseconds nextSampleDue{0};
+	std::chrono::milliseconds searchEnd{0};
+	uint16_t freeRunLength = 0; // doubled by every failed search, reset by a successful one
+	uint16_t freeRunLeft = 0;
+
+	// TRACKING
+	std::chrono::microseconds lastUpdate{0};
+	uint32_t updatesToTarget = 0;
+	bool windowOpen = false; // the first read of a window is the baseline that later reads are compared to
+	uint8_t misses = 0;
+
+	uint32_t readCount = 0;
+	uint32_t missCount = 0;
+
+	// Time of the update that the current window is waiting for
+	std::chrono::microseconds target() const;
+
+	// Half the width of the window around an update that is this many updates away
+	std::chrono::microseconds windowHalfWidth(uint32_t updates) const;
+
+	// Wait for the update this many updates after the last one
+	Step trackUpdate(bool sample, uint32_t updates);
+
+	Step search(bool sample, std::chrono::milliseconds now);
+	Step freeRun(bool sample, std::chrono::milliseconds now);
+};
+
+#endif //BQ34Z100G1_UTILS_GAUGEUPDATETRACKER_H
@@ -0,0 +1,36 @@
+//
+// Driver for a TCA9548A-style 8 channel I2C switch.
+//
+
+#include "I2CMux.h"
+
+I2CMux::I2CMux(I2C & i2c, int address):
+i2c(i2c),
+address(address)
+{
+}
+
+bool I2CMux::select(uint8_t channel)
+{
+	if(channel >= CHANNEL_COUNT)
+	{
+		return false;
+	}
+
+	if(selected == channel)
+	{
+		return true;
+	}
+
+	// The control register has one enable bit per channel
+	char const control = static_cast<char>(1 << channel);
+	if(i2c.write(address, &control, 1) != 0)
+	{
+		// The mux state is unknown now, so rewrite it next time
+		selected = NONE;
+		return false;
+	}
+
+	selected = channel;
+	return true;
+}
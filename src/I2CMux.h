@@ -0,0 +1,43 @@
+//
+// Driver for a TCA9548A-style 8 channel I2C switch.
+//
+
+#ifndef BQ34Z100G1_UTILS_I2CMUX_H
+#define BQ34Z100G1_UTILS_I2CMUX_H
+
+#include <mbed.h>
+#include <cstdint>
+
+/**
+ * Connects one downstream channel of the mux to the upstream bus at a time, so that several gauges
+ * with the same address can share one I2C peripheral.
+ * The selected channel is cached, and the control register is only rewritten when it changes.
+ */
+class I2CMux
+{
+public:
+	// 8-bit address with A2..A0 tied low
+	static constexpr int DEFAULT_ADDRESS = 0xE0;
+
+	static constexpr uint8_t CHANNEL_COUNT = 8;
+
+	explicit I2CMux(I2C & i2c, int address = DEFAULT_ADDRESS);
+
+	/**
+	 * Connect the given channel (and disconnect all others).
+	 * @return false if the channel is out of range or the mux did not ACK.
+	 */
+	bool select(uint8_t channel);
+
+	// Forget the cached selection, e.g. after the mux may have been reset.  The next select() always writes.
+	void invalidate() { selected = NONE; }
+
+private:
+	static constexpr int NONE = -1;
+
+	I2C & i2c;
+	int const address;
+	int selected = NONE;
+};
+
+#endif //BQ34Z100G1_UTILS_I2CMUX_H
@@ -0,0 +1,259 @@
+//
+// Opt-in latency instrumentation for gauge I2C accesses.
+//
+
+#include "I2CProfiler.h"
+
+#include <cinttypes>
+#include <cstring>
+
+#if defined(DWT) && defined(DWT_CTRL_CYCCNTENA_Msk)
+#define I2CPROFILER_USE_DWT 1
+#elif defined(DEVICE_USTICKER)
+#define I2CPROFILER_USE_USTICKER 1
+#include <hal/us_ticker_api.h>
+#else
+#include <chrono>
+#endif
+
+namespace I2CProfiler
+{
+	namespace
+	{
+		CommandStats commands[MAX_COMMANDS];
+		size_t commandCount = 0;
+
+		// Accesses that didn't fit in the table
+		uint32_t overflowCalls = 0;
+
+#if I2CPROFILER_USE_DWT
+		uint64_t now()
+		{
+			// Enable the cycle counter on first use
+			if(!(DWT->CTRL & DWT_CTRL_CYCCNTENA_Msk))
+			{
+				CoreDebug->DEMCR |= CoreDebug_DEMCR_TRCENA_Msk;
+				DWT->CYCCNT = 0;
+				DWT->CTRL |= DWT_CTRL_CYCCNTENA_Msk;
+			}
+			return DWT->CYCCNT;
+		}
+
+		uint64_t toNanoseconds(uint64_t ticks)
+		{
+			return ticks * 1000000000ULL / SystemCoreClock;
+		}
+
+		// The counter is 32 bits, so differences have to wrap at 32 bits
+		uint64_t ticksBetween(uint64_t start, uint64_t end)
+		{
+			return static_cast<uint32_t>(end - start);
+		}
+#elif I2CPROFILER_USE_USTICKER
+		uint64_t now()
+		{
+			return us_ticker_read();
+		}
+
+		uint64_t toNanoseconds(uint64_t ticks)
+		{
+			return ticks * 1000;
+		}
+
+		uint64_t ticksBetween(uint64_t start, uint64_t end)
+		{
+			uint32_t const mask = (1ULL << us_ticker_get_info()->bits) - 1;
+			return (end - start) & mask;
+		}
+#else
+		uint64_t now()
+		{
+			return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				std::chrono::steady_clock::now().time_since_epoch()).count();
+		}
+
+		uint64_t toNanoseconds(uint64_t ticks)
+		{
+			return ticks;
+		}
+
+		uint64_t ticksBetween(uint64_t start, uint64_t end)
+		{
+			return end - start;
+		}
+#endif
+
+		size_t bucketIndex(uint32_t elapsed_ns)
+		{
+			uint32_t micros = elapsed_ns / 1000;
+			size_t bucket = 0;
+			while(micros > 0 && bucket < BUCKET_COUNT - 1)
+			{
+				micros >>= 1;
+				++bucket;
+			}
+			return bucket;
+		}
+
+		char const * standardCommandName(uint16_t reg)
+		{
+			switch(reg)
+			{
+				case 0x02: return "StateOfCharge";
+				case 0x03: return "MaxError";
+				case 0x04: return "RemainingCapacity";
+				case 0x06: return "FullChargeCapacity";
+				case 0x08: return "Voltage";
+				case 0x0A: return "AverageCurrent";
+				case 0x0C: return "Temperature";
+				case 0x0E: return "Flags";
+				case 0x10: return "Current";
+				case 0x12: return "FlagsB";
+				case 0x28: return "SerialNumber";
+				default: return "";
+			}
+		}
+
+		void formatCommand(char * buffer, size_t size, CommandID id)
+		{
+			switch(id.kind)
+			{
+				case Kind::STANDARD:
+					snprintf(buffer, size, "std 0x%02" PRIx16 " %s", id.code, standardCommandName(id.code));
+					break;
+				case Kind::BURST:
+					snprintf(buffer, size, "burst from 0x%02" PRIx16, id.code);
+					break;
+				case Kind::CONTROL:
+					snprintf(buffer, size, "ctrl 0x%04" PRIx16, id.code);
+					break;
+				case Kind::DATA_FLASH_READ:
+					snprintf(buffer, size, "flash read %" PRIu16, id.code);
+					break;
+				case Kind::DATA_FLASH_WRITE:
+					snprintf(buffer, size, "flash write %" PRIu16, id.code);
+					break;
+			}
+		}
+	}
+
+	Stopwatch::Stopwatch():
+	start(now())
+	{
+	}
+
+	uint32_t Stopwatch::elapsed_ns() const
+	{
+		uint64_t const elapsed = toNanoseconds(ticksBetween(start, now()));
+		return elapsed > UINT32_MAX ? UINT32_MAX : static_cast<uint32_t>(elapsed);
+	}
+
+#if MBED_CONF_APP_I2C_PROFILING
+	void record(CommandID id, uint32_t elapsed_ns, size_t bytes, bool nacked, uint8_t retries)
+	{
+		// the sampler thread records too
+		CriticalSectionLock lock;
+
+		CommandStats * stats = nullptr;
+		for(size_t commandIndex = 0; commandIndex < commandCount; commandIndex++)
+		{
+			if(commands[commandIndex].id.kind == id.kind && commands[commandIndex].id.code == id.code)
+			{
+				stats = &commands[commandIndex];
+				break;
+			}
+		}
+
+		if(stats == nullptr)
+		{
+			if(commandCount == MAX_COMMANDS)
+			{
+				++overflowCalls;
+				return;
+			}
+
+			stats = &commands[commandCount++];
+			*stats = CommandStats{};
+			stats->id = id;
+			stats->min_ns = UINT32_MAX;
+		}
+
+		++stats->calls;
+		stats->nacks += nacked ? 1 : 0;
+		stats->retries += retries;
+		stats->bytes += bytes;
+		stats->min_ns = elapsed_ns < stats->min_ns ? elapsed_ns : stats->min_ns;
+		stats->max_ns = elapsed_ns > stats->max_ns ? elapsed_ns : stats->max_ns;
+		stats->total_ns += elapsed_ns;
+		++stats->buckets[bucketIndex(elapsed_ns)];
+	}
+#endif
+
+	void reset()
+	{
+		CriticalSectionLock lock;
+		commandCount = 0;
+		overflowCalls = 0;
+	}
+
+	void printReport()
+	{
+		if(!ENABLED)
+		{
+			printf("I2C profiling is disabled.  Set \"i2c-profiling\": true in mbed_app.json5 to enable it.\r\n");
+			return;
+		}
+
+		// Work on a copy so that printing doesn't hold up the sampler
+		static CommandStats snapshot[MAX_COMMANDS];
+		size_t count;
+		uint32_t overflow;
+		{
+			CriticalSectionLock lock;
+			count = commandCount;
+			overflow = overflowCalls;
+			memcpy(snapshot, commands, count * sizeof(CommandStats));
+		}
+
+		printf("%-30s %7s %6s %7s %9s %10s %10s %10s\r\n", "Command", "Calls", "NACKs", "Retries", "Bytes",
+			"Min (us)", "Mean (us)", "Max (us)");
+		for(size_t commandIndex = 0; commandIndex < count; commandIndex++)
+		{
+			CommandStats const & stats = snapshot[commandIndex];
+			char name[32];
+			formatCommand(name, sizeof(name), stats.id);
+			printf("%-30s %7" PRIu32 " %6" PRIu32 " %7" PRIu32 " %9" PRIu32 " %10.1f %10.1f %10.1f\r\n", name,
+				stats.calls, stats.nacks, stats.retries, stats.bytes, stats.min_ns / 1000.0,
+				stats.total_ns / 1000.0 / stats.calls, stats.max_ns / 1000.0);
+
+			for(size_t bucket = 0; bucket < BUCKET_COUNT; bucket++)
+			{
+				if(stats.buckets[bucket] == 0)
+				{
+					continue;
+				}
+
+				char label[32];
+				if(bucket == 0)
+				{
+					snprintf(label, sizeof(label), "< 1 us");
+				}
+				else if(bucket == BUCKET_COUNT - 1)
+				{
+					snprintf(label, sizeof(label), ">= %" PRIu32 " us", static_cast<uint32_t>(1) << (bucket - 1));
+				}
+				else
+				{
+					snprintf(label, sizeof(label), "[%" PRIu32 ", %" PRIu32 ") us", static_cast<uint32_t>(1) << (bucket - 1),
+						static_cast<uint32_t>(1) << bucket);
+				}
+				printf("    %22s: %" PRIu32 "\r\n", label, stats.buckets[bucket]);
+			}
+		}
+
+		if(overflow > 0)
+		{
+			printf("%" PRIu32 " accesses to further commands were not recorded, increase MAX_COMMANDS\r\n", overflow);
+		}
+	}
+}
@@ -0,0 +1,145 @@
+//
+// Opt-in latency instrumentation for gauge I2C accesses.
+// Enable with "i2c-profiling": true in mbed_app.json5.  When disabled, recording compiles to nothing.
+//
+
+#ifndef BQ34Z100G1_UTILS_I2CPROFILER_H
+#define BQ34Z100G1_UTILS_I2CPROFILER_H
+
+#include "I2CTransfers.h"
+
+#include <mbed.h>
+
+#include <cstddef>
+#include <cstdint>
+
+#ifndef MBED_CONF_APP_I2C_PROFILING
+#define MBED_CONF_APP_I2C_PROFILING 0
+#endif
+
+namespace I2CProfiler
+{
+	enum class Kind : uint8_t
+	{
+		STANDARD, // standard command, code is the register
+		BURST, // burst read of consecutive standard commands, code is the first register
+		CONTROL, // Control() subcommand, code is the subcommand
+		DATA_FLASH_READ, // data flash block read, code is the subclass
+		DATA_FLASH_WRITE // data flash block write, code is the subclass
+	};
+
+	struct CommandID
+	{
+		Kind kind;
+		uint16_t code;
+	};
+
+	// Latency buckets: bucket 0 is < 1 us, bucket n is [2^(n-1), 2^n) us, the last one is open ended
+	constexpr size_t BUCKET_COUNT = 20;
+
+	// Distinct commands that can be tracked.  Further commands are counted as overflow.
+	constexpr size_t MAX_COMMANDS = 32;
+
+	struct CommandStats
+	{
+		CommandID id;
+		uint32_t calls;
+		uint32_t nacks;
+		uint32_t retries;
+		uint32_t bytes;
+		uint32_t min_ns;
+		uint32_t max_ns;
+		uint64_t total_ns;
+		uint32_t buckets[BUCKET_COUNT];
+	};
+
+	/**
+	 * Measures one access.  Counts CPU cycles with the DWT cycle counter where the core has one,
+	 * otherwise uses the microsecond ticker, or std::chrono::steady_clock on the host.
+	 */
+	class Stopwatch
+	{
+	public:
+		Stopwatch();
+
+		// Time since construction, in nanoseconds (saturates at about 4.3 s)
+		uint32_t elapsed_ns() const;
+
+	private:
+		uint64_t start;
+	};
+
+#if MBED_CONF_APP_I2C_PROFILING
+	constexpr bool ENABLED = true;
+
+	/**
+	 * Record one access to the gauge.
+	 * @param bytes Bytes moved over the bus, in both directions, including register addresses
+	 * @param nacked Whether any of its transfers wasn't acknowledged
+	 * @param retries How many times the access had to be retried
+	 */
+	void record(CommandID id, uint32_t elapsed_ns, size_t bytes, bool nacked, uint8_t retries = 0);
+
+	/**
+	 * One access to the gauge, recorded when it goes out of scope.  Its bytes and NACKs are what the I2C layer
+	 * reported for the transfers made meanwhile (see I2CTransfers.h), so any code can be profiled, e.g. a
+	 * driver call, which doesn't tell whether it was acknowledged.
+	 */
+	class Access
+	{
+	public:
+		explicit Access(CommandID id):
+		id(id)
+		{}
+
+		~Access()
+		{
+			I2CTransfers::Counts const & counts = tally.getCounts();
+			record(id, stopwatch.elapsed_ns(), counts.bytes, counts.nacks > 0, retries);
+		}
+
+		Access(Access const &) = delete;
+		Access & operator=(Access const &) = delete;
+
+		// For an access that FaultTolerantI2C ran, the retries it took
+		void setRetries(uint8_t count) { retries = count; }
+
+	private:
+		CommandID const id;
+		uint8_t retries = 0;
+		I2CTransfers::Tally tally;
+		Stopwatch stopwatch;
+	};
+#else
+	constexpr bool ENABLED = false;
+
+	inline void record(CommandID, uint32_t, size_t, bool, uint8_t = 0) {}
+
+	// Nothing is measured, so the clock isn't read either
+	class Access
+	{
+	public:
+		explicit Access(CommandID) {}
+		void setRetries(uint8_t) {}
+	};
+#endif
+
+	// Forget everything recorded so far
+	void reset();
+
+	// Print a table of all commands and their latency histograms
+	void printReport();
+
+	/**
+	 * Record a call into the driver as one access.
+	 * Returns whatever the call returns.
+	 */
+	template<typename F>
+	auto profile(CommandID id, F && f) -> decltype(f())
+	{
+		Access access(id);
+		return f();
+	}
+}
+
+#endif //BQ34Z100G1_UTILS_I2CPROFILER_H
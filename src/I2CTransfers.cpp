@@ -0,0 +1,71 @@
+//
+// Outcome of every I2C transfer, as the I2C layer reports it.
+//
+
+#include "I2CTransfers.h"
+
+#if DEVICE_I2C
+#include <hal/i2c_api.h>
+#endif
+
+namespace I2CTransfers
+{
+	namespace
+	{
+		// The tally that transfers go to, or nullptr
+		Tally * innermost = nullptr;
+	}
+
+	Tally::Tally():
+	outer(innermost)
+	{
+		innermost = this;
+	}
+
+	Tally::~Tally()
+	{
+		innermost = outer;
+		if(outer != nullptr)
+		{
+			outer->counts.transfers += counts.transfers;
+			outer->counts.bytes += counts.bytes;
+			outer->counts.nacks += counts.nacks;
+		}
+	}
+
+	void report(size_t bytes, bool nacked)
+	{
+		Tally * const tally = innermost;
+		if(tally == nullptr)
+		{
+			return;
+		}
+		++tally->counts.transfers;
+		tally->counts.bytes += bytes;
+		tally->counts.nacks += nacked ? 1 : 0;
+	}
+}
+
+#if DEVICE_I2C
+// The board's I2C layer.  src/CMakeLists.txt links with --wrap for these, so mbed::I2C's calls come here first.
+// They return the number of bytes moved, or a negative error.
+extern "C"
+{
+	int __real_i2c_read(i2c_t * obj, int address, char * data, int length, int stop);
+	int __real_i2c_write(i2c_t * obj, int address, const char * data, int length, int stop);
+
+	int __wrap_i2c_read(i2c_t * obj, int address, char * data, int length, int stop)
+	{
+		int const result = __real_i2c_read(obj, address, data, length, stop);
+		I2CTransfers::report(result > 0 ? result : 0, result != length);
+		return result;
+	}
+
+	int __wrap_i2c_write(i2c_t * obj, int address, const char * data, int length, int stop)
+	{
+		int const result = __real_i2c_write(obj, address, data, length, stop);
+		I2CTransfers::report(result > 0 ? result : 0, result != length);
+		return result;
+	}
+}
+#endif
@@ -0,0 +1,54 @@
+//
+// Outcome of every I2C transfer, as the I2C layer reports it.  On the board, the HAL's i2c_read() and
+// i2c_write(), which every mbed::I2C transfer ends up in, are wrapped at link time.  On the host, the I2C
+// stand-in reports its transfers itself.
+//
+
+#ifndef BQ34Z100G1_UTILS_I2CTRANSFERS_H
+#define BQ34Z100G1_UTILS_I2CTRANSFERS_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace I2CTransfers
+{
+	struct Counts
+	{
+		uint32_t transfers;
+		uint32_t bytes; // moved in either direction, not counting address bytes
+		uint32_t nacks; // transfers that weren't acknowledged all the way through
+	};
+
+	/**
+	 * Counts the transfers reported while it exists, e.g. to find out whether a driver call, which doesn't
+	 * say, was acknowledged.  Tallies nest: when one ends, its counts are added to the one it was opened in.
+	 * Transfers are counted whichever thread makes them, so a tally only belongs to its own code while no
+	 * other thread uses the I2C buses.
+	 */
+	class Tally
+	{
+	public:
+		Tally();
+		~Tally();
+
+		Tally(Tally const &) = delete;
+		Tally & operator=(Tally const &) = delete;
+
+		Counts const & getCounts() const { return counts; }
+
+	private:
+		friend void report(size_t bytes, bool nacked);
+
+		Counts counts{};
+		Tally * const outer;
+	};
+
+	/**
+	 * Called by the I2C layer after every transfer.
+	 * @param bytes Bytes moved before the transfer ended
+	 * @param nacked Whether the address or a written byte wasn't acknowledged, or the transfer failed otherwise
+	 */
+	void report(size_t bytes, bool nacked);
+}
+
+#endif //BQ34Z100G1_UTILS_I2CTRANSFERS_H
@@ -0,0 +1,299 @@
+//
+// State logic of an unattended Impedance Track learning cycle.
+//
+
+#include "LearningCycle.h"
+
+#include <cstdlib>
+
+LearningCycle::LearningCycle(Config const & config):
+config(config)
+{
+}
+
+char const * LearningCycle::phaseName(Phase phase)
+{
+	switch(phase)
+	{
+		case Phase::START: return "Start";
+		case Phase::DISCHARGE_EMPTY: return "Discharge to empty";
+		case Phase::RELAX_EMPTY: return "Relax at empty";
+		case Phase::ENABLE_IT: return "Enable Impedance Track";
+		case Phase::CHARGE: return "Charge";
+		case Phase::RELAX_FULL: return "Relax at full";
+		case Phase::DISCHARGE_LEARN: return "Discharge to learn Ra";
+		case Phase::RELAX_LEARN: return "Relax after learning discharge";
+		case Phase::DONE: return "Done";
+		case Phase::FAILED: return "Failed";
+	}
+	return "Unknown";
+}
+
+char const * LearningCycle::eventName(Event event)
+{
+	switch(event)
+	{
+		case Event::NONE: return "";
+		case Event::ALREADY_LEARNED: return "Update Status already shows Qmax and Ra learned";
+		case Event::IT_ENABLE_SENT: return "IT_ENABLE sent";
+		case Event::IT_ENABLED: return "Impedance Track enabled (QEN set, Update Status 0x04)";
+		case Event::QMAX_UPDATED: return "Qmax updated (Update Status 0x05)";
+		case Event::LEARNED: return "Ra learned (Update Status 0x06), learning cycle complete";
+		case Event::DISCHARGED: return "Discharge cutoff reached, remove the load";
+		case Event::LOAD_MISSING: return "No discharge current, connect the load";
+		case Event::CHARGER_NOT_STARTED: return "Charger did not start, retrying";
+		case Event::CHARGE_TIMEOUT: return "Charge did not finish in time";
+		case Event::OCV_NOT_TAKEN: return "No OCV reading yet (OCVTAKEN clear or VOK set), extending the relax";
+		case Event::IT_NOT_ENABLED: return "QEN still clear, sending IT_ENABLE again";
+		case Event::QMAX_NOT_UPDATED: return "Qmax was not updated, repeating the cycle";
+		case Event::RA_NOT_UPDATED: return "Ra was not learned, repeating the charge and discharge";
+	}
+	return "Unknown";
+}
+
+void LearningCycle::setPhase(Phase newPhase, std::chrono::milliseconds now)
+{
+	phase = newPhase;
+	phaseStart = now;
+	retries = 0;
+
+	switch(phase)
+	{
+		case Phase::DISCHARGE_EMPTY:
+		case Phase::DISCHARGE_LEARN:
+			loadSeen = false;
+			lastLoad = now;
+			ocvCleared = false;
+			break;
+
+		case Phase::CHARGE:
+			chargingSeen = false;
+			chargerOnTime = now;
+			ocvCleared = false;
+			break;
+
+		case Phase::ENABLE_IT:
+			itEnableSent = false;
+			break;
+
+		default:
+			break;
+	}
+}
+
+bool LearningCycle::retry(Event event, std::chrono::milliseconds now, Output & output)
+{
+	output.event = event;
+	if(retries >= config.maxRetries)
+	{
+		setPhase(Phase::FAILED, now);
+		return false;
+	}
+	++retries;
+	return true;
+}
+
+void LearningCycle::nextCycle(Phase from, Event event, std::chrono::milliseconds now, Output & output)
+{
+	output.event = event;
+	if(cycle >= config.maxCycles)
+	{
+		setPhase(Phase::FAILED, now);
+		return;
+	}
+	++cycle;
+	setPhase(from, now);
+}
+
+LearningCycle::Output LearningCycle::update(Input const & input)
+{
+	Output output{Event::NONE, false, false};
+	if(finished())
+	{
+		return output;
+	}
+
+	// The progress bits only count while IT is enabled: 0x02 alone is a golden image with IT off
+	uint8_t const progress = (input.updateStatus & UPDATE_STATUS_IT_ENABLED) ? input.updateStatus & UPDATE_STATUS_PROGRESS_MASK : 0;
+	if(progress >= UPDATE_STATUS_RA_UPDATED)
+	{
+		output.event = phase == Phase::START ? Event::ALREADY_LEARNED : Event::LEARNED;
+		setPhase(Phase::DONE, input.elapsed);
+		return output;
+	}
+	if(phase != Phase::START && progress >= UPDATE_STATUS_QMAX_UPDATED && lastProgress < UPDATE_STATUS_QMAX_UPDATED)
+	{
+		output.event = Event::QMAX_UPDATED;
+	}
+	lastProgress = progress;
+
+	if(!(input.flags & FLAG_OCVTAKEN))
+	{
+		ocvCleared = true;
+	}
+
+	switch(phase)
+	{
+		case Phase::START:
+			setPhase(Phase::DISCHARGE_EMPTY, input.elapsed);
+			updateDischarge(input, Phase::RELAX_EMPTY, output);
+			break;
+
+		case Phase::DISCHARGE_EMPTY:
+			updateDischarge(input, Phase::RELAX_EMPTY, output);
+			break;
+
+		case Phase::RELAX_EMPTY:
+			updateRelax(input, config.relaxEmptyTime, output);
+			break;
+
+		case Phase::ENABLE_IT:
+			updateEnableIT(input, output);
+			break;
+
+		case Phase::CHARGE:
+			updateCharge(input, output);
+			break;
+
+		case Phase::RELAX_FULL:
+			updateRelax(input, config.relaxFullTime, output);
+			break;
+
+		case Phase::DISCHARGE_LEARN:
+			updateDischarge(input, Phase::RELAX_LEARN, output);
+			break;
+
+		case Phase::RELAX_LEARN:
+			updateRelax(input, config.relaxEmptyTime, output);
+			break;
+
+		case Phase::DONE:
+		case Phase::FAILED:
+			break;
+	}
+
+	output.chargerOn = phase == Phase::CHARGE && input.elapsed >= chargerOnTime;
+	return output;
+}
+
+void LearningCycle::updateDischarge(Input const & input, Phase next, Output & output)
+{
+	if(!input.charging && std::abs(input.current_mA) >= config.minLoadCurrent_mA)
+	{
+		loadSeen = true;
+		lastLoad = input.elapsed;
+	}
+
+	if(input.voltage_mV <= config.dischargeCutoff_mV)
+	{
+		if(loadSeen)
+		{
+			output.event = Event::DISCHARGED;
+		}
+		else
+		{
+			// Already empty when the phase started, so an OCV reading the gauge took at rest is good
+			ocvCleared = true;
+		}
+		setPhase(next, input.elapsed);
+		return;
+	}
+
+	if(input.elapsed - lastLoad >= config.loadWaitTime && retry(Event::LOAD_MISSING, input.elapsed, output))
+	{
+		lastLoad = input.elapsed;
+	}
+}
+
+void LearningCycle::updateRelax(Input const & input, std::chrono::milliseconds maxTime, Output & output)
+{
+	bool const resting = !input.charging && std::abs(input.current_mA) < config.minLoadCurrent_mA;
+	bool const ocvTaken = ocvCleared && (input.flags & FLAG_OCVTAKEN) && !(input.controlStatus & STATUS_VOK);
+	if(!resting || !ocvTaken)
+	{
+		if(input.elapsed - phaseStart >= maxTime && retry(Event::OCV_NOT_TAKEN, input.elapsed, output))
+		{
+			phaseStart = input.elapsed;
+		}
+		return;
+	}
+
+	switch(phase)
+	{
+		case Phase::RELAX_EMPTY:
+			setPhase(Phase::ENABLE_IT, input.elapsed);
+			break;
+
+		case Phase::RELAX_FULL:
+			if(lastProgress >= UPDATE_STATUS_QMAX_UPDATED)
+			{
+				setPhase(Phase::DISCHARGE_LEARN, input.elapsed);
+			}
+			else
+			{
+				// The pack is full and has an OCV reading, so the next pass starts with the discharge
+				nextCycle(Phase::DISCHARGE_EMPTY, Event::QMAX_NOT_UPDATED, input.elapsed, output);
+			}
+			break;
+
+		case Phase::RELAX_LEARN:
+			nextCycle(Phase::ENABLE_IT, Event::RA_NOT_UPDATED, input.elapsed, output);
+			break;
+
+		default:
+			break;
+	}
+}
+
+void LearningCycle::updateCharge(Input const & input, Output & output)
+{
+	if(input.charging)
+	{
+		chargingSeen = true;
+	}
+	else if(chargingSeen)
+	{
+		// The charger has terminated
+		setPhase(Phase::RELAX_FULL, input.elapsed);
+		return;
+	}
+
+	if(input.elapsed - phaseStart >= config.maxChargeTime)
+	{
+		output.event = Event::CHARGE_TIMEOUT;
+		setPhase(Phase::FAILED, input.elapsed);
+		return;
+	}
+
+	if(!chargingSeen && input.elapsed >= chargerOnTime + config.chargerStartTime
+		&& retry(Event::CHARGER_NOT_STARTED, input.elapsed, output))
+	{
+		// Turn the charger off for a while before the next attempt
+		chargerOnTime = input.elapsed + config.chargerRetryDelay;
+	}
+}
+
+void LearningCycle::updateEnableIT(Input const & input, Output & output)
+{
+	if((input.controlStatus & STATUS_QEN) && (input.updateStatus & UPDATE_STATUS_IT_ENABLED))
+	{
+		if(itEnableSent)
+		{
+			output.event = Event::IT_ENABLED;
+		}
+		setPhase(Phase::CHARGE, input.elapsed);
+		return;
+	}
+
+	if(!itEnableSent)
+	{
+		output.event = Event::IT_ENABLE_SENT;
+	}
+	else if(input.elapsed - itEnableSentTime < config.itEnableTime || !retry(Event::IT_NOT_ENABLED, input.elapsed, output))
+	{
+		return;
+	}
+	output.sendITEnable = true;
+	itEnableSent = true;
+	itEnableSentTime = input.elapsed;
+}
@@ -0,0 +1,173 @@
+//
+// State logic of an unattended Impedance Track learning cycle, separated from the gauge and charger I/O.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_LEARNINGCYCLE_H
+#define BQ34Z100G1_UTILS_LEARNINGCYCLE_H
+
+#include <chrono>
+#include <cstdint>
+
+/**
+ * Runs TI's learning cycle: discharge to empty, relax until the gauge takes an OCV reading, enable
+ * Impedance Track, charge, relax for another OCV reading (which updates Qmax, Update Status 0x04 -> 0x05),
+ * then discharge again while the gauge learns the cell resistances (0x05 -> 0x06).
+ *
+ * The relax phases end on the gauge's own word: once OCVTAKEN is set and VOK has cleared, rather than after
+ * a fixed time.  The cycle ends as soon as Update Status shows Ra learned, whichever phase it is in.
+ * A step that doesn't happen in time (no load, a charger that doesn't start, no OCV reading, IT not enabling)
+ * is retried, and if a whole pass leaves Update Status where it was, the cycle is repeated from there.
+ */
+class LearningCycle
+{
+public:
+	// Update Status (data flash 82): bit 2 is set once IT is enabled, the low bits count the learning progress
+	static constexpr uint8_t UPDATE_STATUS_IT_ENABLED = 0x04;
+	static constexpr uint8_t UPDATE_STATUS_PROGRESS_MASK = 0x03;
+	static constexpr uint8_t UPDATE_STATUS_QMAX_UPDATED = 0x01;
+	static constexpr uint8_t UPDATE_STATUS_RA_UPDATED = 0x02;
+
+	// CONTROL_STATUS and Flags() bits that the cycle waits on
+	static constexpr uint16_t STATUS_RUP_DIS = 1 << 2;
+	static constexpr uint16_t STATUS_VOK = 1 << 1;
+	static constexpr uint16_t STATUS_QEN = 1 << 0;
+	static constexpr uint16_t FLAG_OCVTAKEN = 1 << 7;
+
+	enum class Phase : uint8_t
+	{
+		START,
+		DISCHARGE_EMPTY, // discharge to the zero charge voltage
+		RELAX_EMPTY, // rest until the gauge has taken an OCV reading
+		ENABLE_IT, // send IT_ENABLE, unless it already is
+		CHARGE,
+		RELAX_FULL, // rest until the next OCV reading, which should update Qmax
+		DISCHARGE_LEARN, // discharge again, over which the gauge learns Ra
+		RELAX_LEARN, // rest at empty if Ra wasn't learned by the end of the discharge
+		DONE, // Ra learned
+		FAILED // a step still failed after its retries, or the cycles ran out
+	};
+
+	// Something worth telling the operator about, at most one per sample
+	enum class Event : uint8_t
+	{
+		NONE,
+		ALREADY_LEARNED, // Update Status showed Ra learned at the start
+		IT_ENABLE_SENT,
+		IT_ENABLED, // QEN set and Update Status 0x04
+		QMAX_UPDATED, // Update Status 0x05
+		LEARNED, // Update Status 0x06
+		DISCHARGED, // reached the cutoff, the load should be removed
+		LOAD_MISSING, // no discharge current for loadWaitTime
+		CHARGER_NOT_STARTED, // the charger didn't report charging within chargerStartTime
+		CHARGE_TIMEOUT,
+		OCV_NOT_TAKEN, // the gauge took no OCV reading within the relax time
+		IT_NOT_ENABLED, // QEN still clear itEnableTime after IT_ENABLE
+		QMAX_NOT_UPDATED, // the full charge relax ended without a Qmax update
+		RA_NOT_UPDATED // the second discharge and its relax ended without Ra learned
+	};
+
+	struct Config
+	{
+		uint16_t dischargeCutoff_mV; // discharges end once the voltage drops to this
+		int32_t minLoadCurrent_mA; // less than this counts as no load, and as rest
+
+		std::chrono::milliseconds loadWaitTime = std::chrono::hours(3);
+		std::chrono::milliseconds chargerStartTime = std::chrono::seconds(30);
+		std::chrono::milliseconds chargerRetryDelay = std::chrono::minutes(1); // charger off before trying again
+		std::chrono::milliseconds maxChargeTime = std::chrono::hours(12);
+
+		// Rest allowed for an OCV reading, per attempt.  TI recommends 5 hours at empty and 2 at full.
+		std::chrono::milliseconds relaxEmptyTime = std::chrono::hours(5);
+		std::chrono::milliseconds relaxFullTime = std::chrono::hours(2);
+
+		std::chrono::milliseconds itEnableTime = std::chrono::seconds(10);
+
+		uint8_t maxRetries = 2; // per step, on top of the first attempt
+		uint8_t maxCycles = 3; // passes through the charge and discharge before giving up
+	};
+
+	// One reading of the gauge and charger, timestamped from the start of the cycle
+	struct Input
+	{
+		std::chrono::milliseconds elapsed;
+		uint16_t voltage_mV;
+		int32_t current_mA; // as reported by the gauge, either sign
+		uint16_t controlStatus;
+		uint16_t flags;
+		uint8_t updateStatus;
+		bool charging; // charger status pin
+	};
+
+	struct Output
+	{
+		Event event;
+
+		// What the charger should be doing from now on
+		bool chargerOn;
+
+		// IT_ENABLE should be sent to the gauge now
+		bool sendITEnable;
+	};
+
+	explicit LearningCycle(Config const & config);
+
+	/**
+	 * Feed the next reading and run any step it triggers.
+	 */
+	Output update(Input const & input);
+
+	Phase getPhase() const { return phase; }
+
+	// Time the current phase was entered
+	std::chrono::milliseconds getPhaseStartTime() const { return phaseStart; }
+
+	// Passes through the charge so far, counting the current one
+	uint8_t getCycle() const { return cycle; }
+
+	bool finished() const { return phase == Phase::DONE || phase == Phase::FAILED; }
+
+	static char const * phaseName(Phase phase);
+	static char const * eventName(Event event);
+
+private:
+	Config config;
+
+	Phase phase = Phase::START;
+	std::chrono::milliseconds phaseStart{0};
+	uint8_t cycle = 1;
+	uint8_t retries = 0; // of the current step
+
+	// Progress bits of Update Status at the last reading
+	uint8_t lastProgress = 0;
+
+	// Each relax phase waits for a fresh OCV reading, i.e. OCVTAKEN set after having been clear
+	bool ocvCleared = false;
+
+	// Discharge: whether a load has been seen, and when it last was, or the phase started
+	bool loadSeen = false;
+	std::chrono::milliseconds lastLoad{0};
+
+	// Charge: whether the charger has reported charging, and when it was (re)started
+	bool chargingSeen = false;
+	std::chrono::milliseconds chargerOnTime{0};
+
+	// Enable IT: whether IT_ENABLE has been sent, and when it last was
+	bool itEnableSent = false;
+	std::chrono::milliseconds itEnableSentTime{0};
+
+	void setPhase(Phase newPhase, std::chrono::milliseconds now);
+
+	// Count a failed attempt at the current step.  Returns false, and fails the cycle, once out of retries.
+	bool retry(Event event, std::chrono::milliseconds now, Output & output);
+
+	// Start the next pass, or give up if that was the last
+	void nextCycle(Phase from, Event event, std::chrono::milliseconds now, Output & output);
+
+	void updateDischarge(Input const & input, Phase next, Output & output);
+	void updateRelax(Input const & input, std::chrono::milliseconds maxTime, Output & output);
+	void updateCharge(Input const & input, Output & output);
+	void updateEnableIT(Input const & input, Output & output);
+};
+
+#endif //BQ34Z100G1_UTILS_LEARNINGCYCLE_H
@@ -0,0 +1,349 @@
+//
+// Framed command/response protocol for driving soc-test from fixture software.
+//
+
+#include "MachineProtocol.h"
+#include "Crc16.h"
+
+#include <cstring>
+
+namespace MachineProtocol
+{
+	char const * commandName(Command command)
+	{
+		switch(command)
+		{
+			case Command::PING: return "PING";
+			case Command::RESET: return "RESET";
+			case Command::READ_STATUS: return "READ_STATUS";
+			case Command::READ_TELEMETRY: return "READ_TELEMETRY";
+			case Command::READ_IDENTITY: return "READ_IDENTITY";
+			case Command::WRITE_SETTINGS: return "WRITE_SETTINGS";
+			case Command::CALIBRATE_VOLTAGE: return "CALIBRATE_VOLTAGE";
+			case Command::CALIBRATE_CURRENT: return "CALIBRATE_CURRENT";
+			case Command::ENABLE_CALIBRATION: return "ENABLE_CALIBRATION";
+			case Command::DISABLE_CALIBRATION: return "DISABLE_CALIBRATION";
+			case Command::ENABLE_IT: return "ENABLE_IT";
+			case Command::RESET_VOLTAGE_DIVIDER: return "RESET_VOLTAGE_DIVIDER";
+			case Command::AUTO_CALIBRATE_VOLTAGE: return "AUTO_CALIBRATE_VOLTAGE";
+			case Command::AUTO_CALIBRATE_CURRENT: return "AUTO_CALIBRATE_CURRENT";
+			case Command::DISCHARGE: return "DISCHARGE";
+			case Command::CHARGE: return "CHARGE";
+			case Command::RELAX: return "RELAX";
+			case Command::READ_FLASH_BLOCK: return "READ_FLASH_BLOCK";
+			case Command::WRITE_FLASH_BLOCK: return "WRITE_FLASH_BLOCK";
+			case Command::EXIT: return "EXIT";
+		}
+		return nullptr;
+	}
+
+	char const * statusName(Status status)
+	{
+		switch(status)
+		{
+			case Status::OK: return "OK";
+			case Status::UNKNOWN_COMMAND: return "UNKNOWN_COMMAND";
+			case Status::BAD_ARGUMENTS: return "BAD_ARGUMENTS";
+			case Status::INVALID_ARGUMENT: return "INVALID_ARGUMENT";
+			case Status::GAUGE_ERROR: return "GAUGE_ERROR";
+			case Status::CHARGER_NOT_STARTED: return "CHARGER_NOT_STARTED";
+			case Status::FLASH_WRITE_FAILED: return "FLASH_WRITE_FAILED";
+			case Status::METER_ERROR: return "METER_ERROR";
+			case Status::NO_CURRENT: return "NO_CURRENT";
+			case Status::CURRENT_REVERSED: return "CURRENT_REVERSED";
+		}
+		return "UNKNOWN_STATUS";
+	}
+
+	PayloadWriter::PayloadWriter(uint8_t * buffer, size_t capacity):
+	buffer(buffer),
+	capacity(capacity)
+	{
+	}
+
+	PayloadWriter & PayloadWriter::u8(uint8_t value)
+	{
+		return bytes(&value, 1);
+	}
+
+	PayloadWriter & PayloadWriter::u16(uint16_t value)
+	{
+		uint8_t const encoded[2] = {static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>(value >> 8)};
+		return bytes(encoded, sizeof(encoded));
+	}
+
+	PayloadWriter & PayloadWriter::u32(uint32_t value)
+	{
+		uint8_t const encoded[4] = {static_cast<uint8_t>(value & 0xFF), static_cast<uint8_t>((value >> 8) & 0xFF),
+			static_cast<uint8_t>((value >> 16) & 0xFF), static_cast<uint8_t>(value >> 24)};
+		return bytes(encoded, sizeof(encoded));
+	}
+
+	PayloadWriter & PayloadWriter::bytes(uint8_t const * data, size_t length)
+	{
+		if(length > capacity - used)
+		{
+			overflow = true;
+			return *this;
+		}
+		if(length == 0)
+		{
+			return *this;
+		}
+		memcpy(buffer + used, data, length);
+		used += length;
+		return *this;
+	}
+
+	PayloadReader::PayloadReader(uint8_t const * data, size_t length):
+	data(data),
+	length(length)
+	{
+	}
+
+	uint8_t PayloadReader::u8()
+	{
+		uint8_t value = 0;
+		bytes(&value, 1);
+		return value;
+	}
+
+	uint16_t PayloadReader::u16()
+	{
+		uint8_t encoded[2] = {};
+		bytes(encoded, sizeof(encoded));
+		return static_cast<uint16_t>(encoded[0] | (encoded[1] << 8));
+	}
+
+	uint32_t PayloadReader::u32()
+	{
+		uint8_t encoded[4] = {};
+		bytes(encoded, sizeof(encoded));
+		return static_cast<uint32_t>(encoded[0]) | (static_cast<uint32_t>(encoded[1]) << 8)
+			| (static_cast<uint32_t>(encoded[2]) << 16) | (static_cast<uint32_t>(encoded[3]) << 24);
+	}
+
+	void PayloadReader::bytes(uint8_t * out, size_t count)
+	{
+		if(count > length - position)
+		{
+			failed = true;
+			memset(out, 0, count);
+			return;
+		}
+		memcpy(out, data + position, count);
+		position += count;
+	}
+
+	void encode(PayloadWriter & writer, DeviceInfo const & value)
+	{
+		writer.u16(value.deviceType).u16(value.firmwareVersion).u16(value.hardwareVersion);
+	}
+
+	void encode(PayloadWriter & writer, StatusRegisters const & value)
+	{
+		writer.u16(value.controlStatus).u16(value.flags).u16(value.flagsB).u8(value.updateStatus);
+	}
+
+	void encode(PayloadWriter & writer, Telemetry const & value)
+	{
+		writer.u8(value.soc_percent).u8(value.maxError_percent).u16(value.remaining_mAh).u16(value.fullCharge_mAh)
+			.u16(value.voltage_mV).i16(value.averageCurrent_mA).u16(value.temperature_dK).u16(value.flags)
+			.i16(value.current_mA).u16(value.flagsB);
+	}
+
+	void encode(PayloadWriter & writer, Identity const & value)
+	{
+		encode(writer, value.device);
+		writer.i32(value.serialNumber).u16(value.chemID);
+	}
+
+	void encode(PayloadWriter & writer, SettingsResult const & value)
+	{
+		writer.u8(value.blocksWritten).u8(value.blocksUnchanged).u8(value.blocksFailed).u8(value.updateStatus);
+	}
+
+	void encode(PayloadWriter & writer, CycleResult const & value)
+	{
+		writer.u32(value.sampleCount).u32(value.droppedCount).u32(value.duration_s)
+			.u16(value.finalVoltage_mV).i16(value.finalCurrent_mA);
+	}
+
+	void encode(PayloadWriter & writer, RelaxResult const & value)
+	{
+		writer.u32(value.duration_s).u8(value.settledEarly);
+	}
+
+	void encode(PayloadWriter & writer, CalibrationResult const & value)
+	{
+		writer.u8(value.converged).u8(value.corrections).i32(value.reference).i32(value.gauge)
+			.u8(value.rejected).u32(value.setting);
+	}
+
+	void encode(PayloadWriter & writer, Progress const & value)
+	{
+		writer.u32(value.elapsed_ms).u16(value.voltage_mV).i16(value.current_mA);
+	}
+
+	void decode(PayloadReader & reader, DeviceInfo & value)
+	{
+		value.deviceType = reader.u16();
+		value.firmwareVersion = reader.u16();
+		value.hardwareVersion = reader.u16();
+	}
+
+	void decode(PayloadReader & reader, StatusRegisters & value)
+	{
+		value.controlStatus = reader.u16();
+		value.flags = reader.u16();
+		value.flagsB = reader.u16();
+		value.updateStatus = reader.u8();
+	}
+
+	void decode(PayloadReader & reader, Telemetry & value)
+	{
+		value.soc_percent = reader.u8();
+		value.maxError_percent = reader.u8();
+		value.remaining_mAh = reader.u16();
+		value.fullCharge_mAh = reader.u16();
+		value.voltage_mV = reader.u16();
+		value.averageCurrent_mA = reader.i16();
+		value.temperature_dK = reader.u16();
+		value.flags = reader.u16();
+		value.current_mA = reader.i16();
+		value.flagsB = reader.u16();
+	}
+
+	void decode(PayloadReader & reader, Identity & value)
+	{
+		decode(reader, value.device);
+		value.serialNumber = reader.i32();
+		value.chemID = reader.u16();
+	}
+
+	void decode(PayloadReader & reader, SettingsResult & value)
+	{
+		value.blocksWritten = reader.u8();
+		value.blocksUnchanged = reader.u8();
+		value.blocksFailed = reader.u8();
+		value.updateStatus = reader.u8();
+	}
+
+	void decode(PayloadReader & reader, CycleResult & value)
+	{
+		value.sampleCount = reader.u32();
+		value.droppedCount = reader.u32();
+		value.duration_s = reader.u32();
+		value.finalVoltage_mV = reader.u16();
+		value.finalCurrent_mA = reader.i16();
+	}
+
+	void decode(PayloadReader & reader, RelaxResult & value)
+	{
+		value.duration_s = reader.u32();
+		value.settledEarly = reader.u8();
+	}
+
+	void decode(PayloadReader & reader, CalibrationResult & value)
+	{
+		value.converged = reader.u8();
+		value.corrections = reader.u8();
+		value.reference = reader.i32();
+		value.gauge = reader.i32();
+		value.rejected = reader.u8();
+		value.setting = reader.u32();
+	}
+
+	void decode(PayloadReader & reader, Progress & value)
+	{
+		value.elapsed_ms = reader.u32();
+		value.voltage_mV = reader.u16();
+		value.current_mA = reader.i16();
+	}
+
+	void sendFrame(ByteSink & sink, uint8_t code, uint8_t requestID, uint8_t const * payload, size_t length)
+	{
+		if(length > MAX_PAYLOAD_SIZE)
+		{
+			return;
+		}
+
+		uint8_t frame[MAX_FRAME_SIZE];
+		frame[0] = SYNC;
+		frame[1] = code;
+		frame[2] = requestID;
+		frame[3] = static_cast<uint8_t>(length);
+		if(length > 0)
+		{
+			memcpy(frame + 4, payload, length);
+		}
+		uint16_t const crc = crc16(frame + 1, length + 3);
+		frame[4 + length] = crc & 0xFF;
+		frame[5 + length] = crc >> 8;
+		sink.write(frame, length + FRAME_OVERHEAD);
+	}
+
+	bool Parser::feed(uint8_t byte)
+	{
+		switch(parseState)
+		{
+			case ParseState::SYNC:
+				if(byte == SYNC)
+				{
+					parseState = ParseState::CODE;
+				}
+				break;
+
+			case ParseState::CODE:
+				frame.code = byte;
+				parseState = ParseState::REQUEST_ID;
+				break;
+
+			case ParseState::REQUEST_ID:
+				frame.requestID = byte;
+				parseState = ParseState::LENGTH;
+				break;
+
+			case ParseState::LENGTH:
+				if(byte > MAX_PAYLOAD_SIZE)
+				{
+					++errorCount;
+					parseState = ParseState::SYNC;
+					break;
+				}
+				frame.length = byte;
+				received = 0;
+				parseState = byte > 0 ? ParseState::PAYLOAD : ParseState::CRC_LOW;
+				break;
+
+			case ParseState::PAYLOAD:
+				frame.payload[received++] = byte;
+				if(received == frame.length)
+				{
+					parseState = ParseState::CRC_LOW;
+				}
+				break;
+
+			case ParseState::CRC_LOW:
+				receivedCRC = byte;
+				parseState = ParseState::CRC_HIGH;
+				break;
+
+			case ParseState::CRC_HIGH:
+			{
+				receivedCRC |= static_cast<uint16_t>(byte) << 8;
+				parseState = ParseState::SYNC;
+
+				uint8_t const header[3] = {frame.code, frame.requestID, frame.length};
+				uint16_t const crc = crc16(frame.payload, frame.length, crc16(header, sizeof(header)));
+				if(crc != receivedCRC)
+				{
+					++errorCount;
+					break;
+				}
+				return true;
+			}
+		}
+		return false;
+	}
+}
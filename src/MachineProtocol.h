@@ -0,0 +1,324 @@
+//
+// Framed command/response protocol for driving soc-test from fixture software instead of the text menu.
+// This file has no Mbed dependencies so that the host-side client can share it.
+//
+// Each frame on the wire looks like:
+//   SYNC (0xC5) | code (1 byte) | request ID (1 byte) | payload length (1 byte) | payload | CRC-16/CCITT (2 bytes, little endian)
+// The CRC covers the code, request ID, length and payload bytes.  Anything between frames, such as the menu or text
+// printed by the driver, is skipped by the parser.  That text is ASCII, so it can't be mistaken for SYNC.
+// Multi-byte payload fields are little endian.
+//
+// The host sends requests, whose code is a Command.  Every request gets exactly one response, with code
+// RESPONSE_FLAG | command and the same request ID.  Its payload is a Status byte, followed by the command's result
+// if the status is OK.  Requests are handled strictly in order, so a client may send several before reading the
+// responses, as long as they fit in the target's receive buffer.
+// Long-running commands also send PROGRESS_FLAG | command frames, carrying a Progress, while they run.
+// The target sends a READY frame with request ID 0 when it enters machine mode.
+//
+// Commands, with their arguments -> results:
+//   PING                                             -> protocol version (1)
+//   RESET                                            -> DeviceInfo               (menu 1)
+//   READ_STATUS                                      -> StatusRegisters          (menu 13 and 15)
+//   READ_TELEMETRY                                   -> Telemetry                (menu 14, standard commands)
+//   READ_IDENTITY                                    -> Identity                 (menu 14, serial and chem ID)
+//   WRITE_SETTINGS                                   -> SettingsResult           (menu 3)
+//   CALIBRATE_VOLTAGE  pack voltage in mV (2)        -> new voltage divider (2)  (menu 4)
+//   CALIBRATE_CURRENT  sense current in mA (2, signed)                           (menu 5)
+//   ENABLE_CALIBRATION                                                           (menu 6)
+//   DISABLE_CALIBRATION                                                          (menu 7)
+//   ENABLE_IT                                                                    (menu 8)
+//   RESET_VOLTAGE_DIVIDER                                                        (menu 16)
+//   AUTO_CALIBRATE_VOLTAGE                           -> CalibrationResult        (menu 27, voltage part)
+//   AUTO_CALIBRATE_CURRENT                           -> CalibrationResult        (menu 27, current part)
+//   DISCHARGE          end voltage in mV (2, 0 for the default), sample period in s (2, 0 for 10)
+//                                                    -> CycleResult              (menu 9)
+//   CHARGE             sample period in s (2, 0 for 10)
+//                                                    -> CycleResult              (menu 11)
+//   RELAX              longest rest in s (4)         -> RelaxResult              (menu 10 and 12)
+//   READ_FLASH_BLOCK   subclass (1), block index (1) -> block data (32)          (menu 21, one block at a time)
+//   WRITE_FLASH_BLOCK  subclass (1), block index (1), block data (32)
+//                                                    -> 1 if the block was written, 0 if it was unchanged (1)
+//                                                                                (menu 22, one block at a time)
+//   EXIT                                                                         (back to the text menu)
+//
+
+#ifndef BQ34Z100G1_UTILS_MACHINEPROTOCOL_H
+#define BQ34Z100G1_UTILS_MACHINEPROTOCOL_H
+
+#include "ByteSink.h"
+
+#include <cstddef>
+#include <cstdint>
+
+namespace MachineProtocol
+{
+	constexpr uint8_t SYNC = 0xC5;
+	constexpr uint8_t PROTOCOL_VERSION = 1;
+
+	constexpr size_t MAX_PAYLOAD_SIZE = 64;
+	constexpr size_t FRAME_OVERHEAD = 6; // sync, code, request ID, length and CRC
+	constexpr size_t MAX_FRAME_SIZE = MAX_PAYLOAD_SIZE + FRAME_OVERHEAD;
+
+	constexpr size_t FLASH_BLOCK_SIZE = 32;
+
+	enum class Command : uint8_t
+	{
+		PING = 0x01,
+		RESET = 0x02,
+		READ_STATUS = 0x03,
+		READ_TELEMETRY = 0x04,
+		READ_IDENTITY = 0x05,
+
+		WRITE_SETTINGS = 0x10,
+		CALIBRATE_VOLTAGE = 0x11,
+		CALIBRATE_CURRENT = 0x12,
+		ENABLE_CALIBRATION = 0x13,
+		DISABLE_CALIBRATION = 0x14,
+		ENABLE_IT = 0x15,
+		RESET_VOLTAGE_DIVIDER = 0x16,
+		AUTO_CALIBRATE_VOLTAGE = 0x17,
+		AUTO_CALIBRATE_CURRENT = 0x18,
+
+		DISCHARGE = 0x20,
+		CHARGE = 0x21,
+		RELAX = 0x22,
+
+		READ_FLASH_BLOCK = 0x30,
+		WRITE_FLASH_BLOCK = 0x31,
+
+		EXIT = 0x3F
+	};
+
+	// Frame codes other than requests
+	constexpr uint8_t PROGRESS_FLAG = 0x40;
+	constexpr uint8_t RESPONSE_FLAG = 0x80;
+	constexpr uint8_t READY = 0x7F;
+
+	enum class Status : uint8_t
+	{
+		OK = 0,
+		UNKNOWN_COMMAND = 1,
+		BAD_ARGUMENTS = 2, // payload has the wrong length
+		INVALID_ARGUMENT = 3, // payload is well formed, but a value is out of range
+		GAUGE_ERROR = 4, // the gauge didn't answer, or isn't a BQ34Z100
+		CHARGER_NOT_STARTED = 5,
+		FLASH_WRITE_FAILED = 6, // writing or verifying data flash failed
+		METER_ERROR = 7, // the reference meter didn't answer or gave an invalid reading
+		NO_CURRENT = 8, // too little current for current calibration
+		CURRENT_REVERSED = 9 // the reference meter and the gauge disagree on the direction of the current
+	};
+
+	/**
+	 * Get the name of a command, e.g. "READ_STATUS", or nullptr for unknown codes.
+	 */
+	char const * commandName(Command command);
+
+	/**
+	 * Get the name of a status, e.g. "GAUGE_ERROR".
+	 */
+	char const * statusName(Status status);
+
+	// Results
+
+	struct DeviceInfo
+	{
+		uint16_t deviceType;
+		uint16_t firmwareVersion;
+		uint16_t hardwareVersion;
+	};
+
+	struct StatusRegisters
+	{
+		uint16_t controlStatus;
+		uint16_t flags;
+		uint16_t flagsB;
+		uint8_t updateStatus;
+	};
+
+	// Standard commands, all read in one burst
+	struct Telemetry
+	{
+		uint8_t soc_percent;
+		uint8_t maxError_percent;
+		uint16_t remaining_mAh;
+		uint16_t fullCharge_mAh;
+		uint16_t voltage_mV;
+		int16_t averageCurrent_mA;
+		uint16_t temperature_dK; // 0.1 K
+		uint16_t flags;
+		int16_t current_mA;
+		uint16_t flagsB;
+	};
+
+	struct Identity
+	{
+		DeviceInfo device;
+		int32_t serialNumber;
+		uint16_t chemID;
+	};
+
+	struct SettingsResult
+	{
+		uint8_t blocksWritten;
+		uint8_t blocksUnchanged;
+		uint8_t blocksFailed;
+		uint8_t updateStatus;
+	};
+
+	struct CycleResult
+	{
+		uint32_t sampleCount;
+		uint32_t droppedCount; // samples the sampler had to discard
+		uint32_t duration_s;
+		uint16_t finalVoltage_mV;
+		int16_t finalCurrent_mA;
+	};
+
+	struct RelaxResult
+	{
+		uint32_t duration_s;
+		uint8_t settledEarly; // 1 if the pack was detected as settled before the longest rest was up
+	};
+
+	// Last measurement of an automatic calibration, taken with the final calibration constants
+	struct CalibrationResult
+	{
+		uint8_t converged; // 1 if the error is within the tolerance
+		uint8_t corrections; // times the calibration constant was changed
+		int32_t reference; // mV or mA, averaged over the measurement
+		int32_t gauge;
+		uint8_t rejected; // outlier readings left out of the averages
+		uint32_t setting; // voltage divider, or CC Gain in Xemics format
+	};
+
+	// Sent by DISCHARGE and CHARGE for every sample, by RELAX every tenth of the longest rest,
+	// and by the automatic calibrations after every measurement
+	struct Progress
+	{
+		uint32_t elapsed_ms;
+		uint16_t voltage_mV;
+		int16_t current_mA;
+	};
+
+	/**
+	 * Builds a payload field by field.  If the fields don't fit, overflowed() is set and the extra bytes are dropped.
+	 */
+	class PayloadWriter
+	{
+	public:
+		PayloadWriter(uint8_t * buffer, size_t capacity);
+
+		PayloadWriter & u8(uint8_t value);
+		PayloadWriter & u16(uint16_t value);
+		PayloadWriter & i16(int16_t value) { return u16(static_cast<uint16_t>(value)); }
+		PayloadWriter & u32(uint32_t value);
+		PayloadWriter & i32(int32_t value) { return u32(static_cast<uint32_t>(value)); }
+		PayloadWriter & bytes(uint8_t const * data, size_t length);
+
+		size_t length() const { return used; }
+		bool overflowed() const { return overflow; }
+
+	private:
+		uint8_t * buffer;
+		size_t capacity;
+		size_t used = 0;
+		bool overflow = false;
+	};
+
+	/**
+	 * Takes a payload apart field by field.  Reading past the end returns zeros, and complete() is then false.
+	 */
+	class PayloadReader
+	{
+	public:
+		PayloadReader(uint8_t const * data, size_t length);
+
+		uint8_t u8();
+		uint16_t u16();
+		int16_t i16() { return static_cast<int16_t>(u16()); }
+		uint32_t u32();
+		int32_t i32() { return static_cast<int32_t>(u32()); }
+		void bytes(uint8_t * out, size_t length);
+
+		// True if every field was there and nothing is left over
+		bool complete() const { return !failed && position == length; }
+
+	private:
+		uint8_t const * data;
+		size_t length;
+		size_t position = 0;
+		bool failed = false;
+	};
+
+	// Encoding and decoding of the result structures
+	void encode(PayloadWriter & writer, DeviceInfo const & value);
+	void encode(PayloadWriter & writer, StatusRegisters const & value);
+	void encode(PayloadWriter & writer, Telemetry const & value);
+	void encode(PayloadWriter & writer, Identity const & value);
+	void encode(PayloadWriter & writer, SettingsResult const & value);
+	void encode(PayloadWriter & writer, CycleResult const & value);
+	void encode(PayloadWriter & writer, RelaxResult const & value);
+	void encode(PayloadWriter & writer, CalibrationResult const & value);
+	void encode(PayloadWriter & writer, Progress const & value);
+
+	void decode(PayloadReader & reader, DeviceInfo & value);
+	void decode(PayloadReader & reader, StatusRegisters & value);
+	void decode(PayloadReader & reader, Telemetry & value);
+	void decode(PayloadReader & reader, Identity & value);
+	void decode(PayloadReader & reader, SettingsResult & value);
+	void decode(PayloadReader & reader, CycleResult & value);
+	void decode(PayloadReader & reader, RelaxResult & value);
+	void decode(PayloadReader & reader, CalibrationResult & value);
+	void decode(PayloadReader & reader, Progress & value);
+
+	struct Frame
+	{
+		uint8_t code;
+		uint8_t requestID;
+		uint8_t length;
+		uint8_t payload[MAX_PAYLOAD_SIZE];
+	};
+
+	/**
+	 * Send one frame as a single write.
+	 */
+	void sendFrame(ByteSink & sink, uint8_t code, uint8_t requestID, uint8_t const * payload, size_t length);
+
+	/**
+	 * Finds frames in a byte stream.  Bytes outside of frames and frames with bad CRCs are skipped.
+	 */
+	class Parser
+	{
+	public:
+		/**
+		 * Feed in one byte.
+		 * @return true if it completed a valid frame, which is then in frame until the next call.
+		 */
+		bool feed(uint8_t byte);
+
+		Frame const & getFrame() const { return frame; }
+
+		// Number of frames dropped because of a bad CRC or length
+		uint32_t getErrorCount() const { return errorCount; }
+
+	private:
+		enum class ParseState
+		{
+			SYNC,
+			CODE,
+			REQUEST_ID,
+			LENGTH,
+			PAYLOAD,
+			CRC_LOW,
+			CRC_HIGH
+		};
+		ParseState parseState = ParseState::SYNC;
+
+		Frame frame{};
+		size_t received = 0;
+		uint16_t receivedCRC = 0;
+		uint32_t errorCount = 0;
+	};
+}
+
+#endif //BQ34Z100G1_UTILS_MACHINEPROTOCOL_H
@@ -0,0 +1,144 @@
+//
+// Streaming statistics over one phase of a charge/discharge cycle.
+//
+
+#include "PhaseStatistics.h"
+#include "FixedFormat.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdlib>
+
+namespace
+{
+	int32_t roundToInt(double value)
+	{
+		return static_cast<int32_t>(std::lround(value));
+	}
+
+	PhaseStatistics::Quantity summarizeQuantity(RunningStatistics const & statistics)
+	{
+		return {roundToInt(statistics.getMin()), roundToInt(statistics.getMax()), roundToInt(statistics.getMean() * 10),
+			static_cast<uint32_t>(roundToInt(statistics.getStdDev() * 10))};
+	}
+
+	// Below this, e.g. over a relax phase, the error relative to the counted charge means nothing
+	constexpr int32_t MIN_CHARGE_FOR_PERCENT_uAh = 10000;
+
+	// Integer division rounded half away from zero
+	int64_t divideRounded(int64_t numerator, int64_t denominator)
+	{
+		int64_t const half = denominator / 2;
+		return (numerator >= 0 ? numerator + half : numerator - half) / denominator;
+	}
+
+	// e.g. "V mean 14850.2 sd 12.0 min 12100 max 16700 mV"
+	FixedFormatter & formatQuantity(FixedFormatter & formatter, char const * name, PhaseStatistics::Quantity const & quantity,
+		char const * unit)
+	{
+		return formatter.text(name).text(" mean ").fixed(quantity.mean_x10, 1)
+			.text(" sd ").fixed(static_cast<int32_t>(quantity.stdDev_x10), 1)
+			.text(" min ").signedInt(quantity.min)
+			.text(" max ").signedInt(quantity.max).character(' ').text(unit);
+	}
+}
+
+void RunningStatistics::reset()
+{
+	*this = RunningStatistics();
+}
+
+void RunningStatistics::add(double value)
+{
+	++count;
+	double const delta = value - mean;
+	mean += delta / count;
+	sumSquaredDeviations += delta * (value - mean);
+
+	min = count == 1 ? value : std::min(min, value);
+	max = count == 1 ? value : std::max(max, value);
+}
+
+double RunningStatistics::getVariance() const
+{
+	return count < 2 ? 0 : sumSquaredDeviations / (count - 1);
+}
+
+double RunningStatistics::getStdDev() const
+{
+	return std::sqrt(getVariance());
+}
+
+void PhaseStatistics::reset()
+{
+	*this = PhaseStatistics();
+}
+
+void PhaseStatistics::add(Reading const & reading)
+{
+	if(getSampleCount() == 0)
+	{
+		firstTime = reading.time;
+		remainingStart_mAh = reading.remaining_mAh;
+	}
+	else
+	{
+		// Trapezoidal rule between this sample and the last one
+		double const dt_s = std::chrono::duration<double>(reading.time - lastReading.time).count();
+		double const power_mW = static_cast<double>(reading.voltage_mV) * reading.current_mA / 1000;
+		double const lastPower_mW = static_cast<double>(lastReading.voltage_mV) * lastReading.current_mA / 1000;
+		charge_mAs += (reading.current_mA + lastReading.current_mA) / 2.0 * dt_s;
+		energy_mWs += (power_mW + lastPower_mW) / 2 * dt_s;
+	}
+
+	voltage.add(reading.voltage_mV);
+	current.add(reading.current_mA);
+	temperature.add(reading.temperature_dK);
+	lastReading = reading;
+}
+
+PhaseStatistics::Summary PhaseStatistics::summarize() const
+{
+	Summary summary;
+	summary.duration_s = static_cast<uint32_t>(std::chrono::duration_cast<std::chrono::seconds>(getDuration()).count());
+	summary.sampleCount = getSampleCount();
+	summary.charge_uAh = roundToInt(getCharge_mAh() * 1000);
+	summary.energy_uWh = roundToInt(getEnergy_mWh() * 1000);
+	summary.remainingStart_mAh = remainingStart_mAh;
+	summary.remainingEnd_mAh = lastReading.remaining_mAh;
+	summary.voltage_mV = summarizeQuantity(voltage);
+	summary.current_mA = summarizeQuantity(current);
+	summary.temperature_dK = summarizeQuantity(temperature);
+	return summary;
+}
+
+int PhaseStatistics::formatSummary(char * buffer, size_t size, Summary const & summary)
+{
+	int32_t const remainingChange_mAh = static_cast<int32_t>(summary.remainingEnd_mAh) - summary.remainingStart_mAh;
+	int64_t const gaugeError_uAh = static_cast<int64_t>(remainingChange_mAh) * 1000 - summary.charge_uAh;
+
+	FixedFormatter formatter(buffer, size);
+	formatter.character('[')
+		.fixed(static_cast<int32_t>(divideRounded(summary.charge_uAh, 100)), 1).text(" mAh ")
+		.fixed(static_cast<int32_t>(divideRounded(summary.energy_uWh, 100)), 1).text(" mWh in ")
+		.unsignedInt(summary.duration_s).text(" s (").unsignedInt(summary.sampleCount).text(" samples); ")
+		.text("RemainingCapacity ").unsignedInt(summary.remainingStart_mAh).text(" -> ").unsignedInt(summary.remainingEnd_mAh)
+		.text(" mAh, ").fixed(static_cast<int32_t>(divideRounded(gaugeError_uAh, 100)), 1).text(" mAh");
+	if(std::abs(summary.charge_uAh) >= MIN_CHARGE_FOR_PERCENT_uAh)
+	{
+		formatter.text(" (").fixed(static_cast<int32_t>(divideRounded(gaugeError_uAh * 1000, std::abs(summary.charge_uAh))), 1)
+			.text("%)");
+	}
+	formatter.text(" off the count; ");
+
+	formatQuantity(formatter, "V", summary.voltage_mV, "mV").text("; ");
+	formatQuantity(formatter, "I", summary.current_mA, "mA").text("; ");
+
+	// in degrees Celsius, with the extra digit from the tenths of 0.1 K
+	PhaseStatistics::Quantity const & temperature = summary.temperature_dK;
+	formatter.text("T mean ").fixed(temperature.mean_x10 - 27315, 2)
+		.text(" sd ").fixed(static_cast<int32_t>(temperature.stdDev_x10), 2)
+		.text(" min ").fixed(temperature.min * 10 - 27315, 2)
+		.text(" max ").fixed(temperature.max * 10 - 27315, 2).text(" C]");
+	return static_cast<int>(formatter.length());
+}
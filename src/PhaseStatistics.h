@@ -0,0 +1,133 @@
+//
+// Streaming statistics over one phase of a charge/discharge cycle: the mean, spread and range of the readings,
+// and the charge and energy that went through the pack, counted from the samples themselves.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_PHASESTATISTICS_H
+#define BQ34Z100G1_UTILS_PHASESTATISTICS_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Running mean, variance, minimum and maximum of a stream of values in constant memory.
+ * The variance uses Welford's update, which stays accurate over long runs of nearly equal values
+ * where summing squares would cancel out.
+ */
+class RunningStatistics
+{
+public:
+	void reset();
+	void add(double value);
+
+	uint32_t getCount() const { return count; }
+	double getMean() const { return mean; }
+
+	// Sample variance and standard deviation.  0 with fewer than two values.
+	double getVariance() const;
+	double getStdDev() const;
+
+	// 0 before any value is added
+	double getMin() const { return min; }
+	double getMax() const { return max; }
+
+private:
+	uint32_t count = 0;
+	double mean = 0;
+	double sumSquaredDeviations = 0; // M2 in Welford's algorithm
+	double min = 0;
+	double max = 0;
+};
+
+/**
+ * Statistics for one phase (charge, relax or discharge), fed one sample at a time.
+ *
+ * Charge and energy are integrated with the trapezoidal rule over the samples' own timestamps, so uneven
+ * spacing, e.g. from samples in step with the gauge's updates, doesn't bias them.  The gauge's
+ * RemainingCapacity at the first and last sample is kept as well, so that its change over the phase can
+ * be compared against the charge counted here.  The sign of the charge follows the current that is fed in.
+ */
+class PhaseStatistics
+{
+public:
+	struct Reading
+	{
+		std::chrono::milliseconds time;
+		uint16_t voltage_mV;
+		int32_t current_mA;
+		uint16_t temperature_dK; // 0.1 K, as reported by the gauge
+		uint16_t remaining_mAh; // RemainingCapacity
+	};
+
+	// Statistics of one quantity in integers, in the quantity's own unit
+	struct Quantity
+	{
+		int32_t min;
+		int32_t max;
+		int32_t mean_x10; // tenths of the unit
+		uint32_t stdDev_x10;
+	};
+
+	// Everything that is reported at the end of a phase
+	struct Summary
+	{
+		uint32_t duration_s;
+		uint32_t sampleCount;
+		int32_t charge_uAh;
+		int32_t energy_uWh;
+		uint16_t remainingStart_mAh;
+		uint16_t remainingEnd_mAh;
+		Quantity voltage_mV;
+		Quantity current_mA;
+		Quantity temperature_dK;
+	};
+
+	// Start a new phase
+	void reset();
+
+	void add(Reading const & reading);
+
+	uint32_t getSampleCount() const { return voltage.getCount(); }
+
+	// Time from the first sample to the last
+	std::chrono::milliseconds getDuration() const { return lastReading.time - firstTime; }
+
+	// Integrated so far
+	double getCharge_mAh() const { return charge_mAs / 3600; }
+	double getEnergy_mWh() const { return energy_mWs / 3600; }
+
+	// Change of RemainingCapacity from the first sample to the last
+	int32_t getRemainingChange_mAh() const
+	{
+		return static_cast<int32_t>(lastReading.remaining_mAh) - remainingStart_mAh;
+	}
+
+	RunningStatistics const & getVoltage() const { return voltage; }
+	RunningStatistics const & getCurrent() const { return current; }
+	RunningStatistics const & getTemperature() const { return temperature; }
+
+	Summary summarize() const;
+
+	/**
+	 * Describe a summary on one line without commas, so that it fits in a CSV comment.
+	 * Formatted with integer arithmetic only.
+	 * @return Number of characters written.
+	 */
+	static int formatSummary(char * buffer, size_t size, Summary const & summary);
+
+private:
+	RunningStatistics voltage;
+	RunningStatistics current;
+	RunningStatistics temperature;
+
+	std::chrono::milliseconds firstTime{0};
+	uint16_t remainingStart_mAh = 0;
+	Reading lastReading{};
+
+	double charge_mAs = 0;
+	double energy_mWs = 0;
+};
+
+#endif //BQ34Z100G1_UTILS_PHASESTATISTICS_H
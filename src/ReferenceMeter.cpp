@@ -0,0 +1,104 @@
+//
+// Client for a bench multimeter with a SCPI serial interface.
+//
+
+#include "ReferenceMeter.h"
+
+#include <cerrno>
+#include <cmath>
+#include <cstdlib>
+#include <cstring>
+
+namespace
+{
+	// Meters report overload as +9.9E37.  Anything this big (in V or A) isn't a real reading.
+	constexpr double OVERLOAD_THRESHOLD = 1e6;
+}
+
+ReferenceMeter::ReferenceMeter(FileHandle & serial, std::chrono::milliseconds timeout):
+serial(serial),
+timeout(timeout)
+{
+}
+
+bool ReferenceMeter::identify(char * buffer, size_t size)
+{
+	return query("*IDN?", buffer, size) && buffer[0] != '\0';
+}
+
+bool ReferenceMeter::measureVoltage(int32_t & voltage_mV)
+{
+	return measure("MEAS:VOLT:DC?", voltage_mV);
+}
+
+bool ReferenceMeter::measureCurrent(int32_t & current_mA)
+{
+	return measure("MEAS:CURR:DC?", current_mA);
+}
+
+bool ReferenceMeter::query(char const * command, char * reply, size_t size)
+{
+	serial.set_blocking(false);
+
+	// Drop anything left over from an earlier query that timed out
+	char discard[16];
+	while(serial.read(discard, sizeof(discard)) > 0)
+	{
+	}
+
+	serial.write(command, strlen(command));
+	serial.write("\n", 1);
+
+	size_t length = 0;
+	Kernel::Clock::time_point const deadline = Kernel::Clock::now() + timeout;
+	while(Kernel::Clock::now() < deadline)
+	{
+		char c;
+		ssize_t const bytesRead = serial.read(&c, 1);
+		if(bytesRead == -EAGAIN)
+		{
+			ThisThread::sleep_for(1ms);
+			continue;
+		}
+		if(bytesRead != 1)
+		{
+			break;
+		}
+
+		if(c == '\n')
+		{
+			// Strip the CR of a CR LF terminator
+			if(length > 0 && reply[length - 1] == '\r')
+			{
+				--length;
+			}
+			reply[length] = '\0';
+			return true;
+		}
+		if(length + 1 < size)
+		{
+			reply[length++] = c;
+		}
+	}
+
+	reply[0] = '\0';
+	return false;
+}
+
+bool ReferenceMeter::measure(char const * command, int32_t & value_milli)
+{
+	char reply[MAX_REPLY_LENGTH];
+	if(!query(command, reply, sizeof(reply)))
+	{
+		return false;
+	}
+
+	char * end;
+	double const value = strtod(reply, &end);
+	if(end == reply || std::fabs(value) >= OVERLOAD_THRESHOLD)
+	{
+		return false;
+	}
+	value_milli = static_cast<int32_t>(std::lround(value * 1000));
+	return true;
+}
@@ -0,0 +1,59 @@
+//
+// Client for a bench multimeter with a SCPI serial interface, used as the reference for automatic calibration.
+//
+
+#ifndef BQ34Z100G1_UTILS_REFERENCEMETER_H
+#define BQ34Z100G1_UTILS_REFERENCEMETER_H
+
+#include "mbed.h"
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Sends SCPI queries over a serial link and parses the replies.  The link is switched to non-blocking
+ * mode so that a meter that doesn't answer (unplugged, wrong baud rate) ends in a timeout instead of a hang.
+ * Commands are terminated with a newline, and replies are expected to be terminated with one (CR LF is fine).
+ */
+class ReferenceMeter
+{
+public:
+	// Longest reply this reads, e.g. an *IDN? string
+	static constexpr size_t MAX_REPLY_LENGTH = 80;
+
+	/**
+	 * @param serial UART connected to the meter
+	 * @param timeout How long to wait for each reply.  Must cover the meter's integration time.
+	 */
+	explicit ReferenceMeter(FileHandle & serial, std::chrono::milliseconds timeout = std::chrono::seconds(2));
+
+	/**
+	 * Ask the meter to identify itself (*IDN?).
+	 * @return false if it didn't answer
+	 */
+	bool identify(char * buffer, size_t size);
+
+	/**
+	 * Take one DC voltage reading, rounded to the nearest mV.
+	 * @return false if the meter didn't answer, or the reading was invalid or overloaded
+	 */
+	bool measureVoltage(int32_t & voltage_mV);
+
+	/**
+	 * Take one DC current reading, rounded to the nearest mA.
+	 * @return false if the meter didn't answer, or the reading was invalid or overloaded
+	 */
+	bool measureCurrent(int32_t & current_mA);
+
+private:
+	FileHandle & serial;
+	std::chrono::milliseconds timeout;
+
+	bool query(char const * command, char * reply, size_t size);
+
+	// Query a reading in base units and convert it to thousandths
+	bool measure(char const * command, int32_t & value_milli);
+};
+
+#endif //BQ34Z100G1_UTILS_REFERENCEMETER_H
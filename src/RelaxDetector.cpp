@@ -0,0 +1,123 @@
+//
+// Decides when a pack at rest has settled to its open circuit voltage.
+//
+
+#include "RelaxDetector.h"
+
+#include <cinttypes>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+RelaxDetector::RelaxDetector(Config const & config):
+config(config)
+{
+}
+
+void RelaxDetector::reset(std::chrono::milliseconds now)
+{
+	phaseStart = now;
+	lastFlags = -1;
+	restartFit(now);
+}
+
+void RelaxDetector::restartFit(std::chrono::milliseconds now)
+{
+	restStart = now;
+	lastTime = now;
+	hasSamples = false;
+	weightSum = 0;
+	timeSum = 0;
+	voltageSum = 0;
+	timeSquaredSum = 0;
+	timeVoltageSum = 0;
+	underLimitSince = std::chrono::milliseconds(-1);
+}
+
+bool RelaxDetector::update(std::chrono::milliseconds now, uint16_t voltage_mV, int32_t current_mA, int32_t flags)
+{
+	float const cellVoltage_mV = static_cast<float>(voltage_mV) / config.cellCount;
+	lastFlags = flags;
+
+	if(!hasSamples)
+	{
+		firstVoltage_mV = cellVoltage_mV;
+		hasSamples = true;
+	}
+	else
+	{
+		// Move the time origin to this sample, then decay the old samples' weights
+		double const dt_s = std::chrono::duration<double>(now - lastTime).count();
+		double const decay = std::exp(-dt_s / std::chrono::duration<double>(config.filterTimeConstant).count());
+		timeSquaredSum = decay * (timeSquaredSum - 2 * dt_s * timeSum + dt_s * dt_s * weightSum);
+		timeVoltageSum = decay * (timeVoltageSum - dt_s * voltageSum);
+		timeSum = decay * (timeSum - dt_s * weightSum);
+		voltageSum = decay * voltageSum;
+		weightSum = decay * weightSum;
+	}
+	lastTime = now;
+
+	// The new sample is at time 0, so it adds nothing to the time sums
+	weightSum += 1;
+	voltageSum += cellVoltage_mV - firstVoltage_mV;
+
+	bool const atRest = std::abs(current_mA) <= config.maxCurrent_mA;
+	if(!atRest)
+	{
+		// the voltage is still being pulled around, so start over once the current stops
+		restartFit(now);
+		return false;
+	}
+
+	std::chrono::milliseconds const relaxTime = now - restStart;
+	bool const fitReady = relaxTime >= config.filterTimeConstant;
+	if(fitReady && std::fabs(getSlope_uVps()) <= config.slopeLimit_uVps)
+	{
+		if(underLimitSince.count() < 0)
+		{
+			underLimitSince = now;
+		}
+	}
+	else
+	{
+		underLimitSince = std::chrono::milliseconds(-1);
+	}
+
+	bool const slopeSettled = underLimitSince.count() >= 0 && now - underLimitSince >= config.holdTime;
+	bool const ocvTaken = !config.requireOCVTaken || flags < 0 || (flags & FLAG_OCVTAKEN);
+	return relaxTime >= config.minRelaxTime && slopeSettled && ocvTaken;
+}
+
+float RelaxDetector::getSlope_uVps() const
+{
+	double const denominator = weightSum * timeSquaredSum - timeSum * timeSum;
+	if(denominator <= 0)
+	{
+		return 0;
+	}
+
+	// mV/s -> uV/s
+	return static_cast<float>((weightSum * timeVoltageSum - timeSum * voltageSum) / denominator * 1000);
+}
+
+RelaxDetector::Evidence RelaxDetector::getEvidence(bool settled) const
+{
+	Evidence evidence;
+	evidence.settled = settled;
+	evidence.relaxTime_s = std::chrono::duration_cast<std::chrono::seconds>(lastTime - phaseStart).count();
+	evidence.slope_nVps = static_cast<int32_t>(std::lround(getSlope_uVps() * 1000));
+	evidence.slopeLimit_nVps = static_cast<uint32_t>(std::lround(config.slopeLimit_uVps * 1000));
+	evidence.underLimitTime_s = underLimitSince.count() < 0 ? 0 :
+		std::chrono::duration_cast<std::chrono::seconds>(lastTime - underLimitSince).count();
+	evidence.ocvTakenKnown = lastFlags >= 0;
+	evidence.ocvTaken = lastFlags >= 0 && (lastFlags & FLAG_OCVTAKEN);
+	return evidence;
+}
+
+int RelaxDetector::formatEvidence(char * buffer, size_t size, Evidence const & evidence)
+{
+	return snprintf(buffer, size, "[%s after %" PRIu32 " s: dV/dt %+.2f uV/s per cell, under %.2f uV/s for %" PRIu32 " s, OCVTAKEN %s]",
+		evidence.settled ? "settled" : "not settled", evidence.relaxTime_s, evidence.slope_nVps / 1000.0,
+		evidence.slopeLimit_nVps / 1000.0, evidence.underLimitTime_s,
+		!evidence.ocvTakenKnown ? "unknown" : (evidence.ocvTaken ? "set" : "clear"));
+}
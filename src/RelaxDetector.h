@@ -0,0 +1,111 @@
+//
+// Decides when a pack at rest has settled to its open circuit voltage.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_RELAXDETECTOR_H
+#define BQ34Z100G1_UTILS_RELAXDETECTOR_H
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Tracks dV/dt of a resting pack with an exponentially weighted least squares fit, which is updated
+ * in constant time per sample and averages out the gauge's 1 mV resolution.  The pack counts as settled
+ * once it has rested for a minimum time, the slope has stayed under a limit for a hold time, no current
+ * is flowing, and the gauge has taken its own OCV reading (OCVTAKEN in Flags()).
+ */
+class RelaxDetector
+{
+public:
+	// OCVTAKEN bit of the gauge's Flags() register
+	static constexpr uint16_t FLAG_OCVTAKEN = 1 << 7;
+
+	struct Config
+	{
+		uint8_t cellCount = 1; // slopes are judged per cell
+
+		// Largest |dV/dt| per cell that counts as settled.  The gauge itself takes an OCV reading below 4 uV/s.
+		float slopeLimit_uVps = 2.0f;
+
+		// Time constant of the slope fit.  Longer is less noisy but reacts more slowly.
+		std::chrono::milliseconds filterTimeConstant = std::chrono::minutes(10);
+
+		// How long the slope must stay under the limit
+		std::chrono::milliseconds holdTime = std::chrono::minutes(15);
+
+		// Never end a relax phase sooner than this after the current stops
+		std::chrono::milliseconds minRelaxTime = std::chrono::minutes(30);
+
+		// Anything more than this is not at rest, e.g. the load hasn't been removed yet
+		int32_t maxCurrent_mA = 10;
+
+		// Also wait for OCVTAKEN, when the flags are known
+		bool requireOCVTaken = true;
+	};
+
+	// Why a relax phase ended, for the log
+	struct Evidence
+	{
+		bool settled; // true if the detector ended the phase, false if it ran to its fixed length
+		uint32_t relaxTime_s; // time since the relax phase started
+		int32_t slope_nVps; // filtered dV/dt per cell at the end
+		uint32_t slopeLimit_nVps;
+		uint32_t underLimitTime_s; // how long |dV/dt| had been under the limit
+		bool ocvTakenKnown; // false if the flags were not available, e.g. replaying a log
+		bool ocvTaken;
+	};
+
+	explicit RelaxDetector(Config const & config);
+
+	// Start tracking a new relax phase
+	void reset(std::chrono::milliseconds now);
+
+	/**
+	 * Feed the next sample.
+	 * @param flags Gauge Flags(), or -1 if not known
+	 * @return true once the pack has settled
+	 */
+	bool update(std::chrono::milliseconds now, uint16_t voltage_mV, int32_t current_mA, int32_t flags);
+
+	// Filtered dV/dt per cell
+	float getSlope_uVps() const;
+
+	Evidence getEvidence(bool settled) const;
+
+	Config const & getConfig() const { return config; }
+
+	/**
+	 * Describe evidence in one line, e.g. for a log comment.
+	 * @return Number of characters written, as snprintf().
+	 */
+	static int formatEvidence(char * buffer, size_t size, Evidence const & evidence);
+
+private:
+	Config config;
+
+	std::chrono::milliseconds phaseStart{0};
+	std::chrono::milliseconds restStart{0}; // when the current last stopped
+	std::chrono::milliseconds lastTime{0};
+	bool hasSamples = false;
+
+	// Weighted sums for the slope fit, with times in seconds relative to the latest sample,
+	// and voltages in mV per cell relative to the first sample
+	double weightSum = 0;
+	double timeSum = 0;
+	double voltageSum = 0;
+	double timeSquaredSum = 0;
+	double timeVoltageSum = 0;
+	float firstVoltage_mV = 0;
+
+	// When |dV/dt| last went under the limit, or -1 if it is over it now
+	std::chrono::milliseconds underLimitSince{-1};
+
+	int32_t lastFlags = -1;
+
+	// Forget the slope fit, e.g. because current is flowing
+	void restartFit(std::chrono::milliseconds now);
+};
+
+#endif //BQ34Z100G1_UTILS_RELAXDETECTOR_H
@@ -0,0 +1,51 @@
+//
+// Averaging of repeated readings with outlier rejection.
+//
+
+#include "RobustMean.h"
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace
+{
+	// Median of values, which get sorted.  For an even count, the lower middle value.
+	int32_t median(int32_t * values, size_t count)
+	{
+		std::sort(values, values + count);
+		return values[(count - 1) / 2];
+	}
+}
+
+RobustMean robustMean(int32_t * values, size_t count, int32_t minSpread)
+{
+	int32_t const center = median(values, count);
+
+	int32_t deviations[UINT8_MAX];
+	for(size_t index = 0; index < count; index++)
+	{
+		deviations[index] = std::abs(values[index] - center);
+	}
+
+	// 1.4826 * MAD estimates the standard deviation of normally distributed readings
+	int64_t const spread = std::max<int64_t>(minSpread, (static_cast<int64_t>(median(deviations, count)) * 14826 + 5000) / 10000);
+	int64_t const limit = 3 * spread;
+
+	RobustMean result{0, 0, 0};
+	int64_t sum = 0;
+	for(size_t index = 0; index < count; index++)
+	{
+		if(std::abs(static_cast<int64_t>(values[index]) - center) > limit)
+		{
+			++result.rejected;
+			continue;
+		}
+		sum += values[index];
+		++result.used;
+	}
+
+	// the median is always within the limit, so something is used.  Round half away from zero.
+	int64_t const halfUsed = result.used / 2;
+	result.mean = static_cast<int32_t>((sum >= 0 ? sum + halfUsed : sum - halfUsed) / result.used);
+	return result;
+}
@@ -0,0 +1,27 @@
+//
+// Averaging of repeated readings with outlier rejection.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_ROBUSTMEAN_H
+#define BQ34Z100G1_UTILS_ROBUSTMEAN_H
+
+#include <cstddef>
+#include <cstdint>
+
+struct RobustMean
+{
+	int32_t mean; // rounded to the nearest unit
+	uint8_t used; // readings that went into the mean
+	uint8_t rejected; // readings left out as outliers
+};
+
+/**
+ * Average readings after leaving out outliers: readings further from the median than 3 times the
+ * median absolute deviation (scaled to match a standard deviation) are rejected.  The deviation
+ * is taken as at least minSpread, so that a few readings one count apart don't reject the rest.
+ * values is reordered.  count must be at least 1 and at most 255.
+ */
+RobustMean robustMean(int32_t * values, size_t count, int32_t minSpread);
+
+#endif //BQ34Z100G1_UTILS_ROBUSTMEAN_H
@@ -3,119 +3,331 @@
     Contributors: Arpad Kovesdy
 */
 #include "SOCTestSuite.h"
-
+#include "AutoCalibration.h"
+#include "ChangeFilter.h"
+#include "ChemIDLog.h"
+#include "ConsoleIO.h"
+#include "DataFlashCache.h"
+#include "FaultTolerantI2C.h"
+#include "FixedFormat.h"
+#include "FlashImage.h"
+#include "GaugeBits.h"
+#include "GaugeTelemetry.h"
+#include "I2CProfiler.h"
+#include "LearningCycle.h"
+#include "MachineProtocol.h"
+#include "PhaseStatistics.h"
+#include "ReferenceMeter.h"
+#include "RelaxDetector.h"
+#include "TelemetryRecorder.h"
+#include "TelemetrySampler.h"
+#include "Xemics.h"
+
+#include <algorithm>
 #include <cinttypes>
+#include <cmath>
+#include <type_traits>
 
 I2C i2c(BQ34_I2C_SDA, BQ34_I2C_SCL);
 BQ34Z100 soc(i2c, 100000);
+// The sampling loops' reads are retried, and recover the bus, so that a misbehaving gauge can't stall them
+FaultTolerantI2C gaugeBus(i2c, BQ34_I2C_SDA, BQ34_I2C_SCL);
+GaugeTelemetry telemetry(gaugeBus);
+TelemetrySampler sampler(telemetry, GAUGE_UPDATE_PIN);
+
+// How the discharge, charge and relax tests time their samples
+constexpr TelemetrySampler::Timing CYCLE_SAMPLE_TIMING = MBED_CONF_APP_GAUGE_SYNCHRONIZED_SAMPLING ?
+	TelemetrySampler::Timing::GAUGE_UPDATES : TelemetrySampler::Timing::FIXED;
 
 DigitalIn chgPin(CHARGE_STATUS_PIN);
 DigitalOut shdnPin(ACTIVATE_CHARGER_PIN);
 
-// helper function to print a bitfield prettily.
-void printBitfield(uint16_t value, const char* name, const char** bitDescriptions)
+// Pack voltage at which the discharge tests stop: every cell down to the gauge's zero charge voltage
+constexpr uint16_t DISCHARGE_END_VOLTAGE_MV = ZEROCHARGEVOLT * CELLCOUNT;
+
+// The sampling loops print through this so that a slow console never holds them up
+ConsoleQueue consoleQueue;
+
+// The discharge and charge tests also keep their samples on the board, as chem ID log frames
+TelemetryRecorder telemetryLog;
+ChemIDLog::Encoder telemetryEncoder(telemetryLog.getLog());
+
+// Driver accesses, as seen by the I2C profiler
+namespace DriverCommand
 {
-	printf("\n");
-	printf("%s: 0x%" PRIx16 " (0b", name, value);
-	for (int i = 15; i >= 0; i--)
+	using I2CProfiler::Kind;
+	constexpr I2CProfiler::CommandID STATUS{Kind::CONTROL, 0x0000};
+	constexpr I2CProfiler::CommandID DEVICE_TYPE{Kind::CONTROL, 0x0001};
+	constexpr I2CProfiler::CommandID FW_VERSION{Kind::CONTROL, 0x0002};
+	constexpr I2CProfiler::CommandID HW_VERSION{Kind::CONTROL, 0x0003};
+	constexpr I2CProfiler::CommandID STATE_OF_CHARGE{Kind::STANDARD, 0x02};
+	constexpr I2CProfiler::CommandID VOLTAGE{Kind::STANDARD, 0x08};
+	constexpr I2CProfiler::CommandID TEMPERATURE{Kind::STANDARD, 0x0C};
+	constexpr I2CProfiler::CommandID FLAGS{Kind::STANDARD, 0x0E}; // reads Flags and FlagsB
+	constexpr I2CProfiler::CommandID CURRENT{Kind::STANDARD, 0x10};
+	constexpr I2CProfiler::CommandID UPDATE_STATUS{Kind::DATA_FLASH_READ, 82};
+}
+
+// helper function for driver calls in the polling loops and status reads: runs one as a transaction on the gauge's
+// bus, like the sampler's reads, so that a NACK is retried and a stuck bus recovered instead of the loop going on
+// with garbage, and the call can't overlap a recovery on the sampler thread.  Returns false if every attempt failed.
+template<typename Call>
+bool callGauge(Call && call)
+{
+	auto attempt = [&call](I2C &) {
+		call();
+		return true; // the NACKs are seen by FaultTolerantI2C
+	};
+	return gaugeBus.transact(attempt).ok();
+}
+
+// helper function like callGauge() for a read, which the I2C profiler records as the given access.
+// Leaves value untouched if every attempt failed.
+template<typename Value, typename Read>
+bool readGauge(I2CProfiler::CommandID id, Value & value, Read && read)
+{
+	Value result{};
+	auto attempt = [&](I2C &) {
+		result = read();
+		return true;
+	};
+	FaultTolerantI2C::Result outcome;
 	{
-		printf("%i", (value >> i) & 1);
+		I2CProfiler::Access access(id);
+		outcome = gaugeBus.transact(attempt);
+		access.setRetries(outcome.retries);
 	}
-	printf(")\n");
+	if (!outcome.ok()) {
+		return false;
+	}
+	value = result;
+	return true;
+}
 
-	const size_t maxBit = sizeof(value) * 8 - 1;
-	for (int i = maxBit; i>=0; i--)
-	{
-		// Description array is in reverse order numerically
-		char const * description = bitDescriptions[maxBit - i];
+// helper function to print times in seconds with 2 decimals, rounded like %.02f
+int32_t centiseconds(std::chrono::milliseconds time)
+{
+	return static_cast<int32_t>((time.count() + 5) / 10);
+}
 
-		uint8_t bitValue = (value >> i) & 1;
-		if(description != nullptr)
+// helper function for the sampling loops: queues one "time, voltage, current" row
+void printSample(TelemetrySampler::Sample const & sample)
+{
+	char row[48];
+	FixedFormatter formatter(row, sizeof(row));
+	formatter.fixed(centiseconds(sample.timestamp), 2).text(",\t")
+		.unsignedInt(sample.telemetry.voltage_mV).text(",\t")
+		.signedInt(sample.telemetry.current_mA).text("\r\n");
+	consoleQueue.write(formatter.c_str(), formatter.length());
+}
+
+// helper function for the sampling loops: queues a note in place of a sample the gauge couldn't be read for
+void printReadFailure(TelemetrySampler::Sample const & sample)
+{
+	char note[48];
+	FixedFormatter formatter(note, sizeof(note));
+	formatter.text("# ").fixed(centiseconds(sample.timestamp), 2).text(" s: gauge read failed\r\n");
+	consoleQueue.write(formatter.c_str(), formatter.length());
+}
+
+// helper function to end a sampling loop's queued output so that printf() can be used again
+void stopQueuedOutput()
+{
+	consoleQueue.stop();
+	if (consoleQueue.getDroppedCount() > 0) {
+		printf("Rows dropped because the console fell behind: %" PRIu32 "\r\n", consoleQueue.getDroppedCount());
+	}
+}
+
+// helper function to print the sampler's counters once it has stopped
+void printSamplerStats()
+{
+	printf("Samples: %" PRIu32 ", dropped: %" PRIu32 " (in %" PRIu32 " overflows), read errors: %" PRIu32 ", gauge reads: %" PRIu32 "\r\n",
+		sampler.getSampleCount(), sampler.getDroppedCount(), sampler.getOverflowCount(), sampler.getReadErrorCount(),
+		sampler.getReadCount());
+
+	FaultTolerantI2C::Counters const & bus = gaugeBus.getCounters();
+	if (bus.retries > 0 || bus.recoveries > 0) {
+		printf("I2C retries: %" PRIu32 " (%" PRIu32 " timed out), bus recoveries: %" PRIu32 " (%" PRIu32 " failed)\r\n",
+			bus.retries, bus.timeouts, bus.recoveries, bus.failedRecoveries);
+	}
+}
+
+// helper function for the charge and discharge loops: adds a sample to the statistics of the phase.
+// The gauge reports the current as positive either way, so the discharge loop passes -1 to count it as negative.
+void addToPhase(PhaseStatistics & phase, TelemetrySampler::Sample const & sample, int32_t currentSign)
+{
+	TelemetrySnapshot const & telemetry = sample.telemetry;
+	phase.add({sample.timestamp, telemetry.voltage_mV, currentSign * telemetry.current_mA, telemetry.temperature_dK,
+		telemetry.remaining_mAh});
+}
+
+// helper function for the charge and discharge loops: keeps a sample in the telemetry log.  The sample that ends
+// the phase comes with its event and the statistics of the phase, and everything is programmed straight away.
+void logSample(TelemetrySampler::Sample const & sample, int32_t currentSign, ChemIDLog::Event event = ChemIDLog::Event::NONE,
+	PhaseStatistics const * phase = nullptr)
+{
+	if (!telemetryLog.isReady()) {
+		return;
+	}
+
+	TelemetrySnapshot const & telemetry = sample.telemetry;
+	ChemIDLog::Sample logged;
+	logged.elapsed_s = std::chrono::duration_cast<std::chrono::seconds>(sample.timestamp).count();
+	logged.voltage_mV = telemetry.voltage_mV;
+	logged.current_mA = currentSign * telemetry.current_mA;
+	logged.temperature_dK = telemetry.temperature_dK;
+	logged.soc_percent = telemetry.soc_percent;
+
+	if (event != ChemIDLog::Event::NONE) {
+		PhaseStatistics::Summary summary;
+		bool const hasSummary = phase != nullptr && phase->getSampleCount() > 1;
+		if (hasSummary) {
+			summary = phase->summarize();
+		}
+		telemetryEncoder.addEvent(event, nullptr, hasSummary ? &summary : nullptr);
+	}
+	telemetryEncoder.addSample(logged);
+
+	if (event != ChemIDLog::Event::NONE) {
+		telemetryEncoder.flush();
+		telemetryLog.getLog().flush();
+	}
+}
+
+// helper function to print the statistics of a phase once its loop has ended
+void printPhaseSummary(PhaseStatistics const & phase)
+{
+	if (phase.getSampleCount() < 2) {
+		return;
+	}
+	char summary[320];
+	PhaseStatistics::formatSummary(summary, sizeof(summary), phase.summarize());
+	printf("Counted: %s\r\n", summary);
+}
+
+// helper function to turn the charger on and wait for it to start.  If it doesn't, it is turned off again.
+bool startCharger()
+{
+	shdnPin.write(CHARGER_PIN_ACTIVATE);
+	ThisThread::sleep_for(10s);
+	if (chgPin.read() != CHARGE_STATUS_CHARGING) {
+		shdnPin.write(CHARGER_PIN_DEACTIVATE);
+		return false;
+	}
+	return true;
+}
+
+// How a rest went
+struct RestResult
+{
+	std::chrono::milliseconds duration;
+	bool settled; // ended early because the pack had settled
+	bool hasEvidence; // only with relax-early-exit
+	RelaxDetector::Evidence evidence;
+};
+
+// helper function for the relax tests: rests the pack for maxTime, calling onTenth every tenth of it.
+// With relax-early-exit, it samples the gauge and stops as soon as the pack has settled.
+RestResult restPack(std::chrono::seconds maxTime, Callback<void(std::chrono::milliseconds)> onTenth)
+{
+	RestResult result{};
+#if MBED_CONF_APP_RELAX_EARLY_EXIT
+	RelaxDetector::Config config;
+	config.cellCount = CELLCOUNT;
+	RelaxDetector detector(config);
+	detector.reset(0ms);
+
+	std::chrono::milliseconds const progressInterval = maxTime / 10;
+	std::chrono::milliseconds nextProgress = progressInterval;
+
+	sampler.start(10s, CYCLE_SAMPLE_TIMING);
+	while(true)
+	{
+		TelemetrySampler::Sample sample;
+		sampler.waitForSample(sample);
+		result.duration = sample.timestamp;
+		if(sample.valid)
 		{
-			printf("- %s: %" PRIu8 "\n", description, bitValue);
+			result.settled = detector.update(sample.timestamp, sample.telemetry.voltage_mV, sample.telemetry.current_mA, sample.telemetry.flags);
 		}
+		if(result.settled || sample.timestamp >= maxTime)
+		{
+			break;
+		}
+		if(sample.timestamp >= nextProgress)
+		{
+			onTenth(sample.timestamp);
+			nextProgress += progressInterval;
+		}
+	}
+	sampler.stop();
+
+	result.hasEvidence = true;
+	result.evidence = detector.getEvidence(result.settled);
+#else
+	for(int i = 0; i < 10; i++)
+	{
+		ThisThread::sleep_for(maxTime / 10);
+		result.duration += maxTime / 10;
+		onTenth(result.duration);
+	}
+#endif
+	return result;
+}
+
+// helper function for the relax tests: rests the pack, printing a # every tenth of maxTime
+void relax(std::chrono::seconds maxTime)
+{
+	RestResult const result = restPack(maxTime, [](std::chrono::milliseconds) { printf("#"); });
+	if(result.hasEvidence)
+	{
+		char evidence[128];
+		RelaxDetector::formatEvidence(evidence, sizeof(evidence), result.evidence);
+		printf("\r\n%s", evidence);
 	}
 }
 
+// helper function to print a bitfield prettily.
+void printBitfield(uint16_t value, const char* name, GaugeBits::Descriptions const & bitDescriptions)
+{
+	char report[GaugeBits::BITFIELD_REPORT_SIZE];
+	GaugeBits::formatBitfield(report, sizeof(report), name, bitDescriptions, value);
+	printf("%s", report);
+}
+
 void SOCTestSuite::outputStatus()
 {
-    uint16_t status_code = soc.getStatus();
-
-    // Descriptions for each bit of the status bytes
-    const char* statusBitDescs[] = {
-    		nullptr,
-    		"Full Access Sealed (FAS)",
-    		"Sealed (SS)",
-    		"Calibration Enabled (CALEN)",
-    		"Coulomb Counter Calibrating (CCA)",
-    		"Board Calibration Active (BCA)",
-    		"Valid Data Flash Checksum (CSV)",
-    		nullptr,
-    		nullptr,
-    		nullptr,
-    		"Full Sleep Mode (FULLSLEEP)",
-    		"Sleep Mode (SLEEP)",
-    		"Impedance Track using Constant Power (LDMD)",
-    		"Ra Updates Disabled (RUP_DIS)",
-    		"Voltage OK for Qmax Updates (VOK)",
-    		"Qmax Updates Enabled (QEN)"
-    };
+    uint16_t status_code;
+	std::pair<uint16_t, uint16_t> flags;
+    uint8_t updateStatus;
+	if (!readGauge(DriverCommand::STATUS, status_code, [] { return soc.getStatus(); })
+		|| !readGauge(DriverCommand::FLAGS, flags, [] { return soc.getFlags(); })
+		|| !readGauge(DriverCommand::UPDATE_STATUS, updateStatus, [] { return soc.getUpdateStatus(); })) {
+		printf("Error communicating with BQ34Z100.\r\n");
+		return;
+	}
 
-    printBitfield(status_code, "Control Status", statusBitDescs);
-
-	// Descriptions for each bit of the flags bytes
-	const char* flagsBitDescs[] = {
-			"Overtemperature in Charge (OTC)",
-			"Overtemperature in Discharge (OTD)",
-			"High Battery Voltage (BATHI)",
-			"Low Battery Voltage (BATLOW)",
-			"Charge Inhibited (CHG_INH)",
-			"Charging Not Allowed (XCHG)",
-			"Full Charge (FC)",
-			"Charge Allowed (CHG)",
-			"Open Circuit Voltage Measurement Performed (OCVTAKEN)",
-			nullptr,
-			nullptr,
-			"Update Cycle Needed (CF)",
-			nullptr,
-			"SoC Threshold 1 Reached (SOC1)",
-			"SoC Threshold Final Reached (SOCF)",
-			"Discharge Detected (DSG)"
-	};
-	const char* flagsBBitDescs[] = {
-			"State of Health Calc Active (SOH)",
-			"LiFePO4 Relax Enabled (LIFE)",
-			"Waiting for Depth of Discharge Measurement (FIRSTDOD)",
-			nullptr,
-			nullptr,
-			"Depth of Discharge at End of Charge Updated (DODEOC)",
-			"Remaining Capacity Changed (DTRC)",
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr,
-			nullptr
-	};
+    printBitfield(status_code, "Control Status", GaugeBits::STATUS_BIT_DESCS);
 
-	std::pair<uint16_t, uint16_t> flags = soc.getFlags();
-	printBitfield(flags.first, "Flags", flagsBitDescs);
-	printBitfield(flags.second, "FlagsB", flagsBBitDescs);
+	printBitfield(flags.first, "Flags", GaugeBits::FLAGS_BIT_DESCS);
+	printBitfield(flags.second, "FlagsB", GaugeBits::FLAGSB_BIT_DESCS);
 
 
-    uint8_t updateStatus = soc.getUpdateStatus();
     printf("Update status: 0x%" PRIx8 "\n", updateStatus);
 }
 
 void SOCTestSuite::sensorReset()
 {
     printf("Resetting BQ34Z100 Sensor.\r\n");
+
+    // A gauge that was reset halfway through sending a byte can be left holding SDA low
+    if (!gaugeBus.recoverBus()) {
+        printf("Warning: the I2C bus is still held low after clocking it out\r\n");
+    }
     soc.reset();
 
-    uint16_t deviceType = soc.readDeviceType();
+    uint16_t deviceType = I2CProfiler::profile(DriverCommand::DEVICE_TYPE, [] { return soc.readDeviceType(); });
     if(deviceType == 0x100)
     {
         printf("BQ34Z100 detected\r\n");
@@ -132,12 +344,21 @@ void SOCTestSuite::sensorReset()
 void SOCTestSuite::displayData()
 {
     ThisThread::sleep_for(10ms); //Let the device catch up
-    printf("SOC: %d%%\r\n", soc.getSOC());
-    printf("Voltage: %d mV\r\n", soc.getVoltage());
-    printf("Current: %d mA\r\n", soc.getCurrent());
-    printf("Remaining: %d mAh\r\n", soc.getRemaining());
-    printf("Temperature: %.1f C\r\n", soc.getTemperature());
-    printf("Max Error: %d%%\r\n", soc.getError());
+
+    // Read all the standard command values in one burst
+    TelemetrySnapshot snapshot;
+    if(!telemetry.read(snapshot))
+    {
+        printf("Error communicating with BQ34Z100.\r\n");
+        return;
+    }
+
+    printf("SOC: %d%%\r\n", snapshot.soc_percent);
+    printf("Voltage: %d mV\r\n", snapshot.voltage_mV);
+    printf("Current: %d mA\r\n", snapshot.current_mA);
+    printf("Remaining: %d mAh\r\n", snapshot.remaining_mAh);
+    printf("Temperature: %.1f C\r\n", snapshot.temperatureC());
+    printf("Max Error: %d%%\r\n", snapshot.maxError_percent);
     printf("Serial No: %d\r\n", soc.getSerial());
     printf("CHEM ID: %" PRIx16 "\r\n", soc.getChemID());
 }
@@ -168,18 +389,75 @@ void SOCTestSuite::startIt()
     soc.ITEnable();
 }
 
-//Outputs an integer of the length provided starting from the given index in flashBytes
-//Provide pointer to first element (array pointer to flashbytes)
-void SOCTestSuite::outputFlashInt(uint8_t* flash, int index, int len)
+// Res Current that BQ34Z100::changePage80() writes
+constexpr int16_t DRIVER_RES_CURRENT_MA = 10;
+
+// helper function to make the data flash edits of writeSettings() in the cache, ready to commit.  These are exactly
+// the edits of the driver's changePage48(), changePage64(), changePage80() and changePage82(), from the driver's
+// pack configuration macros; the cache only batches them and skips the blocks they leave unchanged.
+// Returns false if a block couldn't be read from the gauge.
+bool stageSettings(DataFlashCache & flash)
 {
-    if (index > 31) index = index % 32;
-    unsigned int result = 0;
-    for (int i = 0; i<len; i++)
-    {
-        //result = result | ((uint32_t)flash[index+i] << 8*len);
-        result |= ((uint32_t)flash[index+i] << 8*(len-i-1));
-    }
-    printf("%d", result);
+	using namespace DataFlash;
+
+	// changePage48()
+	bool ok = flash.set<int16_t>(DESIGN_CAPACITY, DESIGNCAP);
+	ok &= flash.set<int16_t>(DESIGN_ENERGY, DESIGNENERGY);
+
+	// changePage64()
+	ok &= flash.set<uint8_t>(LED_CONFIG, LEDCONFIG);
+	ok &= flash.set<uint8_t>(CELL_COUNT, CELLCOUNT);
+
+	// changePage80()
+	ok &= flash.set<uint8_t>(LOAD_SELECT, LOADSELECT);
+	ok &= flash.set<uint8_t>(LOAD_MODE, LOADMODE);
+	ok &= flash.set<int16_t>(RES_CURRENT, DRIVER_RES_CURRENT_MA);
+	ok &= flash.set<int16_t>(CELL_TERMINATE_VOLTAGE, ZEROCHARGEVOLT);
+
+	// changePage82()
+	ok &= flash.set<int16_t>(QMAX0, DESIGNCAP);
+	return ok;
+}
+
+namespace
+{
+	// Print one integer field of the data flash schema as "<prefix> <name>: <value>"
+	template<typename T>
+	bool printSetting(DataFlashCache & flash, char const * prefix, DataFlash::Field<T> const & field)
+	{
+		T value{};
+		if (!flash.get(field, value)) {
+			printf("Error reading data flash subclass %" PRIu8 ": %s\r\n", field.subclass,
+				DataFlashCache::errorText(flash.getLastError()));
+			return false;
+		}
+		if (std::is_signed<T>::value) {
+			printf("%s %s: %" PRIi32 "\r\n", prefix, field.name, static_cast<int32_t>(value));
+		} else {
+			printf("%s %s: %" PRIu32 "\r\n", prefix, field.name, static_cast<uint32_t>(value));
+		}
+		return true;
+	}
+
+	// Print every data flash field that writeSettings() touches.  Returns false at the first one that can't be read.
+	bool printSettings(DataFlashCache & flash, char const * prefix)
+	{
+		using namespace DataFlash;
+
+		// Fetch all the blocks first, so that fields sharing a block cost a single read
+		flash.load(DESIGN_CAPACITY, PACK_CONFIGURATION, LOAD_SELECT, CELL_TERMINATE_VOLTAGE, QMAX0);
+
+		return printSetting(flash, prefix, DESIGN_CAPACITY)
+			&& printSetting(flash, prefix, DESIGN_ENERGY)
+			&& printSetting(flash, prefix, PACK_CONFIGURATION)
+			&& printSetting(flash, prefix, LED_CONFIG)
+			&& printSetting(flash, prefix, CELL_COUNT)
+			&& printSetting(flash, prefix, LOAD_SELECT)
+			&& printSetting(flash, prefix, LOAD_MODE)
+			&& printSetting(flash, prefix, RES_CURRENT)
+			&& printSetting(flash, prefix, CELL_TERMINATE_VOLTAGE)
+			&& printSetting(flash, prefix, QMAX0);
+	}
 }
 
 void SOCTestSuite::writeSettings()
@@ -191,107 +469,28 @@ void SOCTestSuite::writeSettings()
 
     soc.unseal();
     printf("Starting overwrite of sensor settings\r\n");
-    uint8_t* flashStore = soc.getFlashBytes(); //Get address of array for later
-
-    //Page 48
-    soc.changePage(48, 0); //calls ChangePage from BQ34Z100 editing page 48 from datasheet
-    soc.readFlash();
-
-    //declares old subclass properties as per BQ34Z100 function commands
-    printf("Old design capacity:");
-    outputFlashInt(flashStore, 11, 2);
-    printf("\r\n");
-    printf("Old design energy:");
-    outputFlashInt(flashStore, 13, 2);
-    printf("\r\n");
-
-    //replaces the old subclass properties with new ones as per BQ34Z100 function commands
-    soc.changePage48();
-    printf("New design capacity:");
-    outputFlashInt(flashStore, 11, 2);
-    printf("\r\n");
-    printf("New design energy:");
-    outputFlashInt(flashStore, 13, 2);
-    printf("\r\n");
-
-    //Page 64
-    soc.changePage(64, 0); //calls ChangePage from BQ34Z100 editing page 48 from datasheet
-    soc.readFlash();
-
-    //declares old subclass properties as per BQ34Z100 function commands
-    printf("Old Pack Configuration:");
-    outputFlashInt(flashStore, 0, 2);
-    printf("\r\n");
-    printf("Old LED Config:");
-    outputFlashInt(flashStore, 4, 1);
-    printf("\r\n");
-    printf("Old Cell Count:");
-    outputFlashInt(flashStore, 7, 1);
-    printf("\r\n");
-
-    //replaces the old subclass properties with new ones as per BQ34Z100 function commands
-    soc.changePage64();
-    printf("New Pack Configuration:");
-    outputFlashInt(flashStore, 0, 2);
-    printf("\r\n");
-    printf("New LED Config:");
-    outputFlashInt(flashStore, 4, 1);
-    printf("\r\n");
-    printf("New Cell Count:");
-    outputFlashInt(flashStore, 7, 1);
-    printf("\r\n");
-
-    //Page 80
-
-    soc.changePage(80, 0); //calls ChangePage from BQ34Z100 editing page 48 from datasheet
-    soc.readFlash();
-    //declares old subclass properties as per BQ34Z100 function commands
-    printf("Old Load Select:");
-    outputFlashInt(flashStore, 0, 1);
-    printf("\r\n");
-    printf("Old Load Mode:");
-    outputFlashInt(flashStore, 1, 1);
-    printf("\r\n");
-
-    soc.changePage(80, 53);
-    soc.readFlash();
-    printf("Old Cell Terminate Voltage:");
-    outputFlashInt(flashStore, 53, 2);
-    printf("\r\n");
-
-    //replaces the old subclass properties with new ones as per BQ34Z100 function commands
-    soc.changePage80();
-    soc.changePage(80, 0);
-    soc.readFlash();
-    printf("New Load Select:");
-    outputFlashInt(flashStore, 0, 1);
-    printf("\r\n");
-    printf("New Load Mode:");
-    outputFlashInt(flashStore, 1, 1);
-    printf("\r\n");
-    printf("Res Current:");
-    outputFlashInt(flashStore, 10, 2);
-    printf("\r\n");
-    soc.changePage(80, 53);
-    soc.readFlash();
-    printf("New Cell Terminate Voltage:");
-    outputFlashInt(flashStore, 53, 2);
-    printf("\r\n");
-
-    //Page 82
-    soc.changePage(82, 0); //calls ChangePage from BQ34Z100 editing page 48 from datasheet
-    soc.readFlash();
-
-    //declares old subclass properties as per BQ34Z100 function commands
-    printf("Old QMax0:");
-    outputFlashInt(flashStore, 0, 2);
-    printf("\r\n");
-
-    //replaces the old subclass properties with new ones as per BQ34Z100 function commands
-    soc.changePage82();
-    printf("New QMax0:");
-    outputFlashInt(flashStore, 0, 2);
-    printf("\r\n");
+
+    // Each block is read from the gauge once, then all edits are made in memory
+    DataFlashCache flash(i2c);
+
+    if(!printSettings(flash, "Old"))
+    {
+        return;
+    }
+
+    // Nothing is committed if any block couldn't be staged, so the settings are never left half written
+    if(!stageSettings(flash))
+    {
+        printf("Error staging sensor settings: %s\r\n", DataFlashCache::errorText(flash.getLastError()));
+        return;
+    }
+
+    // Only blocks that actually changed get written (and then verified)
+    DataFlashCache::CommitResult result = flash.commit();
+    printf("Data flash blocks written: %" PRIu8 ", unchanged: %" PRIu8 ", failed: %" PRIu8 "\r\n",
+        result.blocksWritten, result.blocksUnchanged, result.blocksFailed);
+
+    printSettings(flash, "New");
 
     //Print the updatestatus
     //0x02 = Qmax and Ra data are learned, but Impedance Track is not enabled.
@@ -300,9 +499,215 @@ void SOCTestSuite::writeSettings()
     //0x05 = Impedance Track is enabled and only Qmax has been updated during a learning cycle.
     //0x06 = Impedance Track is enabled. Qmax and Ra data are learned after a successful learning
     //cycle. This should be the operation setting for end equipment.
-    printf("UPDATE STATUS:");
-    outputFlashInt(flashStore, 4, 1);
-    printf("\r\n");
+    uint8_t updateStatus = 0;
+    flash.get(DataFlash::UPDATE_STATUS, updateStatus);
+    printf("UPDATE STATUS: 0x%" PRIx8 "\r\n", updateStatus);
+    printf("(%" PRIu32 " I2C transactions)\r\n", flash.getTransactionCount());
+}
+
+namespace
+{
+    /**
+     * Programs each block of an incoming image as soon as its record checks out, through the driver's data flash
+     * page access.  The sender waits for an ACK after the header and after every block, so the console receive
+     * buffer can't overflow during the flash programming waits and nothing needs to be buffered.
+     */
+    class ImageProgrammer : public FlashImage::Listener
+    {
+    public:
+        ImageProgrammer(BQ34Z100 & soc, bool includeCalibration):
+        soc(soc),
+        includeCalibration(includeCalibration)
+        {
+        }
+
+        bool complete = false;
+        unsigned int blocksWritten = 0;
+        unsigned int blocksUnchanged = 0;
+        unsigned int blocksSkipped = 0;
+        unsigned int blocksFailed = 0;
+
+        bool onHeader(FlashImage::Header const & header) override
+        {
+            uint16_t const deviceType = soc.readDeviceType();
+            if(header.deviceType != deviceType)
+            {
+                reject();
+                printf("\r\nImage is for device type 0x%" PRIx16 " but this gauge is 0x%" PRIx16 "\r\n", header.deviceType, deviceType);
+                return false;
+            }
+            uint16_t const firmwareVersion = soc.readFWVersion();
+            if(header.firmwareVersion != firmwareVersion)
+            {
+                printf("WARNING: Image was taken from firmware version 0x%" PRIx16 ", this gauge runs 0x%" PRIx16 "\r\n",
+                    header.firmwareVersion, firmwareVersion);
+            }
+
+            soc.unseal();
+            acknowledge();
+            return true;
+        }
+
+        bool onBlock(FlashImage::Block const & block) override
+        {
+            if(block.index >= DataFlash::blockCount(block.subclass))
+            {
+                reject();
+                printf("\r\nImage has subclass %" PRIu8 " block %" PRIu8 ", which is not in the data flash schema\r\n",
+                    block.subclass, block.index);
+                return false;
+            }
+
+            if(FlashImage::isCalibration(block.subclass) && !includeCalibration)
+            {
+                ++blocksSkipped;
+            }
+            else
+            {
+                program(block);
+            }
+            acknowledge();
+            return true;
+        }
+
+        void onEnd() override
+        {
+            complete = true;
+        }
+
+        void onError(char const * message) override
+        {
+            reject();
+            printf("\r\nImage error: %s\r\n", message);
+        }
+
+    private:
+        BQ34Z100 & soc;
+        bool const includeCalibration;
+        ConsoleSink console;
+
+        void acknowledge()
+        {
+            console.write(&FlashImage::ACK, 1);
+        }
+
+        void reject()
+        {
+            console.write(&FlashImage::NAK, 1);
+        }
+
+        // Write the bytes that differ from the gauge's block, then read the block back to check it
+        void program(FlashImage::Block const & block)
+        {
+            uint16_t const offset = block.index * FlashImage::BLOCK_SIZE;
+            soc.changePage(block.subclass, offset);
+            soc.readFlash();
+            uint8_t const * current = soc.getFlashBytes();
+            if(memcmp(current, block.data, FlashImage::BLOCK_SIZE) == 0)
+            {
+                ++blocksUnchanged;
+                return;
+            }
+
+            for(size_t byteIndex = 0; byteIndex < FlashImage::BLOCK_SIZE; byteIndex++)
+            {
+                if(current[byteIndex] != block.data[byteIndex])
+                {
+                    soc.writeFlash(byteIndex, block.data[byteIndex], 1);
+                }
+            }
+            soc.updateChecksum();
+
+            soc.changePage(block.subclass, offset);
+            soc.readFlash();
+            if(memcmp(soc.getFlashBytes(), block.data, FlashImage::BLOCK_SIZE) == 0)
+            {
+                ++blocksWritten;
+            }
+            else
+            {
+                ++blocksFailed;
+            }
+        }
+    };
+}
+
+void SOCTestSuite::exportFlashImage()
+{
+    soc.unseal();
+
+    FlashImage::Header header;
+    header.deviceType = soc.readDeviceType();
+    header.firmwareVersion = soc.readFWVersion();
+    header.blockCount = FlashImage::totalBlockCount();
+
+    printf("Data flash image follows (%" PRIu16 " blocks):\r\n", header.blockCount);
+
+    // Each block is sent as soon as it has been read through the driver's data flash page access
+    ConsoleSink console;
+    FlashImage::Writer writer(console);
+    writer.writeHeader(header);
+    for(size_t subclassIndex = 0; subclassIndex < FlashImage::SUBCLASS_COUNT; subclassIndex++)
+    {
+        FlashImage::SubclassInfo const & subclass = FlashImage::SUBCLASSES[subclassIndex];
+        for(uint8_t index = 0; index < subclass.blockCount; index++)
+        {
+            FlashImage::Block block;
+            block.subclass = subclass.subclass;
+            block.index = index;
+            soc.changePage(subclass.subclass, index * FlashImage::BLOCK_SIZE);
+            soc.readFlash();
+            memcpy(block.data, soc.getFlashBytes(), FlashImage::BLOCK_SIZE);
+            writer.writeBlock(block);
+        }
+    }
+    writer.writeEnd();
+
+    printf("\r\nEnd of data flash image\r\n");
+}
+
+void SOCTestSuite::importFlashImage()
+{
+    if(soc.getVoltage() <= FLASH_UPDATE_OK_VOLT * CELLCOUNT)
+    {
+        printf("WARNING: Measured voltage is below FLASH_UPDATE_OK_VOLT, flash memory writes may not go through.\r\n");
+    }
+
+    // The calibration belongs to this gauge's own sense resistor and voltage divider, not to the golden pack
+    printf("Also write the calibration subclasses 104 and 107 (1 = yes, 0 = no): ");
+    int includeCalibration = 0;
+    scanf("%d", &includeCalibration);
+    printf("%d\r\n", includeCalibration);
+
+    printf("Send the data flash image now, one record per ACK.\r\n");
+
+    ImageProgrammer programmer(soc, includeCalibration != 0);
+    FlashImage::Parser parser(programmer);
+    while(!parser.isFinished())
+    {
+        uint8_t buffer[64];
+        ssize_t const bytesRead = consoleRead(buffer, sizeof(buffer));
+        if(bytesRead < 0)
+        {
+            printf("Error reading console\r\n");
+            break;
+        }
+        if(bytesRead == 0)
+        {
+            printf("\r\nImage ended early\r\n");
+            break;
+        }
+        parser.feed(buffer, bytesRead);
+    }
+
+    printf("\r\nData flash blocks written: %u, unchanged: %u, calibration skipped: %u, failed: %u\r\n",
+        programmer.blocksWritten, programmer.blocksUnchanged, programmer.blocksSkipped, programmer.blocksFailed);
+    if(!programmer.complete)
+    {
+        printf("Image was not imported completely.  The blocks written so far stay written, import it again.\r\n");
+        return;
+    }
+    printf("Reset the gauge for the new settings to take effect.\r\n");
 }
 
 void SOCTestSuite::calibrateVoltage ()
@@ -338,30 +743,211 @@ void SOCTestSuite::calibrateCurrent()
 	 soc.calibrateShunt(current_int);
 }
 
+// helper function for autoCalibrate(): prints one measurement row
+void printCalibrationMeasurement(uint8_t corrections, AutoCalibrator::Measurement const & measurement)
+{
+	printf("%" PRIu8 ",\t%" PRIi32 ",\t%" PRIi32 ",\t%+" PRIi32 ",\t%" PRIu8 "\r\n",
+		corrections, measurement.reference, measurement.gauge, measurement.error(), measurement.rejected);
+}
+
+void SOCTestSuite::autoCalibrate()
+{
+	// The meter's UART is only claimed while calibrating, so its pins are free the rest of the time
+	BufferedSerial meterSerial(REFERENCE_METER_TX, REFERENCE_METER_RX, REFERENCE_METER_BAUD);
+	ReferenceMeter referenceMeter(meterSerial);
+
+	char identity[ReferenceMeter::MAX_REPLY_LENGTH];
+	if (!referenceMeter.identify(identity, sizeof(identity))) {
+		printf("The reference meter did not answer.  Check its connection and REFERENCE_METER_TX/RX/BAUD in pins.h.\r\n");
+		return;
+	}
+	printf("Reference meter: %s\r\n", identity);
+
+	soc.unseal();
+	AutoCalibrator calibrator(i2c, soc, referenceMeter, AutoCalibrator::Config());
+
+	printf("\r\nCalibrating voltage.  The pack should be at rest, with the meter across it.\r\n");
+	printf("Corrections,\tMeter (mV),\tGauge (mV),\tError (mV),\tOutliers\r\n");
+	AutoCalibrator::Result const voltage = calibrator.calibrateVoltage(printCalibrationMeasurement);
+
+	printf("\r\nCalibrating current.  The meter should be in series with the pack, which the charger will now charge.\r\n");
+	bool const charging = startCharger();
+	AutoCalibrator::Result current{};
+	if (charging) {
+		printf("Corrections,\tMeter (mA),\tGauge (mA),\tError (mA),\tOutliers\r\n");
+		current = calibrator.calibrateCurrent(printCalibrationMeasurement);
+		shdnPin.write(CHARGER_PIN_DEACTIVATE);
+	} else {
+		printf("Charging did not start, so current was not calibrated.\r\n");
+	}
+
+	printf("\r\nVoltage: %s, corrections: %" PRIu8 ", residual %+" PRIi32 " mV, voltage divider %" PRIu32 "\r\n",
+		AutoCalibrator::outcomeName(voltage.outcome), voltage.corrections, voltage.last.error(), voltage.setting);
+	if (charging) {
+		printf("Current: %s, corrections: %" PRIu8 ", residual %+" PRIi32 " mA, CC Gain %f (0x%08" PRIx32 ")\r\n",
+			AutoCalibrator::outcomeName(current.outcome), current.corrections, current.last.error(),
+			Xemics::toFloat(current.setting), current.setting);
+	}
+}
+
+// helper function for learningCycle(): prints a line with the time since the start in seconds
+void printCycleLine(std::chrono::milliseconds elapsed, char const * text)
+{
+	char line[176];
+	FixedFormatter formatter(line, sizeof(line));
+	formatter.fixed(centiseconds(elapsed), 2).character(' ').text(text).text("\r\n");
+	printf("%s", formatter.c_str());
+}
+
+void SOCTestSuite::learningCycle()
+{
+	printf("Running the Impedance Track learning cycle unattended: discharge, relax, enable IT, charge, relax, discharge.\r\n");
+	printf("Keep a load of about C/10 on hand.  Discharging to %" PRIu16 " mV.\r\n", DISCHARGE_END_VOLTAGE_MV);
+
+	// Update Status is in data flash
+	soc.unseal();
+
+	LearningCycle::Config config;
+	config.dischargeCutoff_mV = DISCHARGE_END_VOLTAGE_MV;
+	config.minLoadCurrent_mA = DESIGNCAP / 100;
+	LearningCycle cycle(config);
+
+	// Only the bits the cycle waits on are reported as they change
+	constexpr uint16_t WATCHED_STATUS = LearningCycle::STATUS_RUP_DIS | LearningCycle::STATUS_VOK | LearningCycle::STATUS_QEN;
+	constexpr uint16_t WATCHED_FLAGS = LearningCycle::FLAG_OCVTAKEN;
+	constexpr std::chrono::milliseconds POLL_PERIOD = 10s;
+	constexpr std::chrono::milliseconds PROGRESS_PERIOD = 10min;
+
+	Kernel::Clock::time_point const start = Kernel::Clock::now();
+	Kernel::Clock::time_point nextPoll = start;
+	std::chrono::milliseconds nextProgress{0};
+	bool first = true;
+	uint16_t status = 0;
+	uint16_t flags = 0;
+	uint8_t updateStatus = 0;
+	PhaseStatistics phase;
+
+	while (!cycle.finished()) {
+		TelemetrySnapshot snapshot;
+		uint16_t newStatus = 0;
+		uint8_t newUpdateStatus = 0;
+		bool const readOK = telemetry.read(snapshot)
+			&& readGauge(DriverCommand::STATUS, newStatus, [] { return soc.getStatus(); })
+			&& readGauge(DriverCommand::UPDATE_STATUS, newUpdateStatus, [] { return soc.getUpdateStatus(); });
+		std::chrono::milliseconds const elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(Kernel::Clock::now() - start);
+		if (!readOK) {
+			printCycleLine(elapsed, "Gauge read failed, skipping this sample");
+			nextPoll += POLL_PERIOD;
+			ThisThread::sleep_until(nextPoll);
+			continue;
+		}
+		newStatus &= WATCHED_STATUS;
+		uint16_t const newFlags = snapshot.flags & WATCHED_FLAGS;
+
+		char record[160];
+		int const statusLength = first ? GaugeBits::formatSetBits(record, sizeof(record), "STATUS", GaugeBits::STATUS_NAMES, newStatus)
+			: GaugeBits::formatTransitions(record, sizeof(record), "STATUS", GaugeBits::STATUS_NAMES, status, newStatus);
+		if (statusLength > 0) {
+			printCycleLine(elapsed, record);
+		}
+		int const flagsLength = first ? GaugeBits::formatSetBits(record, sizeof(record), "FLAGS", GaugeBits::FLAGS_NAMES, newFlags)
+			: GaugeBits::formatTransitions(record, sizeof(record), "FLAGS", GaugeBits::FLAGS_NAMES, flags, newFlags);
+		if (flagsLength > 0) {
+			printCycleLine(elapsed, record);
+		}
+		if (first || newUpdateStatus != updateStatus) {
+			FixedFormatter formatter(record, sizeof(record));
+			formatter.text("UPDATE = ").hex(newUpdateStatus, 2);
+			printCycleLine(elapsed, formatter.c_str());
+		}
+		first = false;
+		status = newStatus;
+		flags = newFlags;
+		updateStatus = newUpdateStatus;
+
+		bool const charging = chgPin.read() == CHARGE_STATUS_CHARGING;
+		LearningCycle::Phase const previousPhase = cycle.getPhase();
+		LearningCycle::Output const output = cycle.update({elapsed, snapshot.voltage_mV, snapshot.current_mA,
+			newStatus, newFlags, newUpdateStatus, charging});
+
+		shdnPin.write(output.chargerOn ? CHARGER_PIN_ACTIVATE : CHARGER_PIN_DEACTIVATE);
+		if (output.sendITEnable && !callGauge([] { soc.ITEnable(); })) {
+			printCycleLine(elapsed, "Sending IT_ENABLE failed");
+		}
+		if (output.event != LearningCycle::Event::NONE) {
+			printCycleLine(elapsed, LearningCycle::eventName(output.event));
+		}
+
+		// The gauge reports the current as positive either way
+		TelemetrySampler::Sample const sample{elapsed, snapshot, 0, true};
+		if (cycle.getPhase() != previousPhase) {
+			addToPhase(phase, sample, charging ? 1 : -1);
+			printPhaseSummary(phase);
+			phase.reset();
+
+			FixedFormatter formatter(record, sizeof(record));
+			formatter.text("Cycle ").unsignedInt(cycle.getCycle()).text(": ").text(LearningCycle::phaseName(cycle.getPhase()));
+			printCycleLine(elapsed, formatter.c_str());
+		}
+		addToPhase(phase, sample, charging ? 1 : -1);
+
+		if (!cycle.finished() && elapsed >= nextProgress) {
+			FixedFormatter formatter(record, sizeof(record));
+			formatter.text(LearningCycle::phaseName(cycle.getPhase())).text(": ")
+				.unsignedInt(snapshot.voltage_mV).text(" mV, ")
+				.signedInt(snapshot.current_mA).text(" mA, ")
+				.unsignedInt(snapshot.remaining_mAh).text(" mAh remaining");
+			printCycleLine(elapsed, formatter.c_str());
+			nextProgress = elapsed + PROGRESS_PERIOD;
+		}
+
+		nextPoll += POLL_PERIOD;
+		ThisThread::sleep_until(nextPoll);
+	}
+
+	shdnPin.write(CHARGER_PIN_DEACTIVATE);
+	if (cycle.getPhase() == LearningCycle::Phase::DONE) {
+		printf("\r\nLearning cycle complete after %" PRIu8 " pass(es).  Update Status: 0x%02" PRIx8 "\r\n", cycle.getCycle(), updateStatus);
+	} else {
+		printf("\r\nLearning cycle failed.  Update Status: 0x%02" PRIx8 "\r\n", updateStatus);
+	}
+}
+
 void SOCTestSuite::discharge() {
     printf("Discharging Battery, have a small load attached \r\n");
-    int voltage = soc.getVoltage();
-    //2750 is the termination voltage
-    int seconds = 0;
-    int current = soc.getCurrent();
     printf("Time,\tVoltage,\tCurrent\r\n");
-    while (voltage > 2750) {
-        printf("%d,\t%d,\t%d\r\n", seconds, voltage, current);
-        voltage = soc.getVoltage();
-        current = soc.getCurrent();
-        ThisThread::sleep_for(10s);
+
+    // Samples are taken on the sampler thread, so console delays don't shift their timing
+    consoleQueue.start();
+    sampler.start(10s, CYCLE_SAMPLE_TIMING);
+    if (telemetryLog.isReady()) {
+        telemetryEncoder.start();
     }
+    PhaseStatistics phase;
+    bool done = false;
+    do {
+        TelemetrySampler::Sample sample;
+        sampler.waitForSample(sample);
+        if (!sample.valid) {
+            printReadFailure(sample);
+            continue;
+        }
+        printSample(sample);
+        addToPhase(phase, sample, -1);
+        done = sample.telemetry.voltage_mV <= DISCHARGE_END_VOLTAGE_MV;
+        logSample(sample, -1, done ? ChemIDLog::Event::DISCHARGE_DONE : ChemIDLog::Event::NONE, &phase);
+    } while (!done);
+    sampler.stop();
+    stopQueuedOutput();
 
     printf("\r\nDischarge Complete!\r\n");
-
+    printSamplerStats();
+    printPhaseSummary(phase);
 }
 
 void SOCTestSuite::relaxEmpty() {
     printf("Relaxing the battery after a discharge (5 hours) \r\n");
-    for (int i = 0; i < 10; i++) {
-        ThisThread::sleep_for(1800s);
-        printf("#");
-    }
+    relax(5h);
 
     printf("\r\n\nDischarge relax complete!\r\n");
 }
@@ -378,46 +964,744 @@ void SOCTestSuite::charge() {
         return;
     }
 
-    int voltage = soc.getVoltage();
-    Timer chargeTimer;
-    chargeTimer.start();
-    int current = soc.getCurrent();
     printf("Time,\tVoltage,\tCurrent\r\n");
 
     //Could use the CHG_I_OUT pin to read charging current, but we can also
     //just measure it with the gauge
-    while (chgPin.read() == CHARGE_STATUS_CHARGING) {
-        printf("%.02f,\t%d,\t%d\r\n",
-        		std::chrono::duration_cast<std::chrono::duration<float>>(chargeTimer.elapsed_time()).count(),
-        		voltage, current);
-        voltage = soc.getVoltage();
-        current = soc.getCurrent();
-        ThisThread::sleep_for(10s);
+    consoleQueue.start();
+    sampler.start(10s, CYCLE_SAMPLE_TIMING);
+    if (telemetryLog.isReady()) {
+        telemetryEncoder.start();
     }
+    PhaseStatistics phase;
+    bool charging = true;
+    bool first = true;
+    do {
+        TelemetrySampler::Sample sample;
+        sampler.waitForSample(sample);
+        if (!sample.valid) {
+            printReadFailure(sample);
+            continue;
+        }
+        printSample(sample);
+        addToPhase(phase, sample, 1);
+
+        // The pin is read once per sample, so that the sample it ends on is known
+        charging = chgPin.read() == CHARGE_STATUS_CHARGING;
+        ChemIDLog::Event const event = !charging ? ChemIDLog::Event::CHARGE_DONE
+            : first ? ChemIDLog::Event::CHARGE_STARTED : ChemIDLog::Event::NONE;
+        logSample(sample, 1, event, &phase);
+        first = false;
+    } while (charging);
+    sampler.stop();
+    stopQueuedOutput();
 
     printf("\r\nCharge Complete!\r\n");
 	shdnPin.write(CHARGER_PIN_DEACTIVATE);
+    printSamplerStats();
+    printPhaseSummary(phase);
+
+}
 
+void SOCTestSuite::dumpTelemetryLog()
+{
+	telemetryLog.printStatus();
+	if (!telemetryLog.isReady()) {
+		return;
+	}
+
+	printf("First record to send (0 for all, or one past the last record of an earlier dump): ");
+	uint32_t firstSequence = 0;
+	scanf("%" SCNu32, &firstSequence);
+	printf("\r\nTelemetry log dump follows:\r\n");
+
+	uint32_t const recordCount = telemetryLog.dumpToConsole(firstSequence);
+	printf("\r\nEnd of telemetry log dump (%" PRIu32 " records)\r\n", recordCount);
 }
 
 void SOCTestSuite::readVoltageCurrent()
 {
-	printf("Voltage,\tCurrent\r\n");
+	printf("Time,\tVoltage,\tCurrent\r\n");
 
+	consoleQueue.start();
+	sampler.start(100ms);
+	uint32_t reportedDrops = 0;
+	uint32_t reportedConsoleDrops = consoleQueue.getDroppedCount();
 	while (true) {
-		int voltage = soc.getVoltage();
-		int current = soc.getCurrent();
-		printf("%d,\t%d\r\n", voltage, current);
-		ThisThread::sleep_for(100ms);
+		TelemetrySampler::Sample sample;
+		sampler.waitForSample(sample);
+		if (sample.valid) {
+			printSample(sample);
+		} else {
+			printReadFailure(sample);
+		}
+
+		// the console can't always keep up at this rate
+		if (sampler.getDroppedCount() != reportedDrops || consoleQueue.getDroppedCount() != reportedConsoleDrops) {
+			reportedDrops = sampler.getDroppedCount();
+			reportedConsoleDrops = consoleQueue.getDroppedCount();
+			char note[96];
+			FixedFormatter formatter(note, sizeof(note));
+			formatter.text("# ").unsignedInt(reportedDrops).text(" samples dropped in ").unsignedInt(sampler.getOverflowCount())
+				.text(" overflows, ").unsignedInt(reportedConsoleDrops).text(" rows dropped by the console\r\n");
+			consoleQueue.write(formatter.c_str(), formatter.length());
+		}
+	}
+}
+
+void SOCTestSuite::readVoltageCurrentOnChange()
+{
+	ChangeFilter::Config config;
+	int voltageDeadband = 0;
+	int currentDeadband = 0;
+	int heartbeatSeconds = 60;
+
+	printf("Enter voltage deadband in mV (0 to print every new value): ");
+	scanf("%d", &voltageDeadband);
+	printf("Enter current deadband in mA (0 to print every new value): ");
+	scanf("%d", &currentDeadband);
+	printf("Enter heartbeat interval in seconds (0 for none): ");
+	scanf("%d", &heartbeatSeconds);
+	config.voltageDeadband_mV = voltageDeadband;
+	config.currentDeadband_mA = currentDeadband;
+	config.heartbeatInterval = std::chrono::seconds(heartbeatSeconds);
+	printf("\r\nDeadbands: %d mV, %d mA.  Heartbeat every %d s.\r\n", voltageDeadband, currentDeadband, heartbeatSeconds);
+
+	ChangeFilter filter(config);
+	printf("Time,\tVoltage,\tCurrent\r\n");
+
+	// Poll well above the gauge's refresh rate so new values are seen promptly, but only print what changed
+	consoleQueue.start();
+	sampler.start(100ms);
+	while (true) {
+		TelemetrySampler::Sample sample;
+		sampler.waitForSample(sample);
+		if (!sample.valid) {
+			printReadFailure(sample);
+			continue;
+		}
+
+		uint32_t const suppressed = filter.getSuppressedCount();
+		ChangeFilter::Decision decision = filter.update(sample.timestamp, sample.telemetry.voltage_mV, sample.telemetry.current_mA);
+		if (decision == ChangeFilter::Decision::REPORT) {
+			printSample(sample);
+		}
+		else if (decision == ChangeFilter::Decision::HEARTBEAT) {
+			char note[160];
+			FixedFormatter formatter(note, sizeof(note));
+			formatter.text("# ").fixed(centiseconds(sample.timestamp), 2)
+				.text(" s: still ").unsignedInt(sample.telemetry.voltage_mV)
+				.text(" mV, ").signedInt(sample.telemetry.current_mA)
+				.text(" mA (").unsignedInt(suppressed)
+				.text(" repeats suppressed, ").unsignedInt(sampler.getDroppedCount()).text(" samples dropped");
+			if (filter.getUpdateInterval().count() > 0) {
+				formatter.text(", gauge updates every ").unsignedInt(filter.getUpdateInterval().count()).text(" ms");
+			}
+			formatter.text(")\r\n");
+			consoleQueue.write(formatter.c_str(), formatter.length());
+		}
+	}
+}
+
+void SOCTestSuite::watchStatus()
+{
+	int periodMs = 1000;
+	printf("Enter poll period in ms: ");
+	scanf("%d", &periodMs);
+	periodMs = std::max(periodMs, 10);
+	printf("\r\nPolling every %d ms.  Only bit changes are printed, as <time (s)> <register> +<bit set> -<bit cleared>\r\n", periodMs);
+
+	Kernel::Clock::time_point const start = Kernel::Clock::now();
+	Kernel::Clock::time_point nextPoll = start;
+	bool first = true;
+	uint16_t status = 0;
+	std::pair<uint16_t, uint16_t> flags;
+	uint8_t updateStatus = 0;
+
+	consoleQueue.start();
+	while (true) {
+		uint16_t newStatus;
+		std::pair<uint16_t, uint16_t> newFlags;
+		uint8_t newUpdateStatus;
+		bool const readOK = readGauge(DriverCommand::STATUS, newStatus, [] { return soc.getStatus(); })
+			&& readGauge(DriverCommand::FLAGS, newFlags, [] { return soc.getFlags(); })
+			&& readGauge(DriverCommand::UPDATE_STATUS, newUpdateStatus, [] { return soc.getUpdateStatus(); });
+		int32_t const time_cs = centiseconds(std::chrono::duration_cast<std::chrono::milliseconds>(Kernel::Clock::now() - start));
+		auto const printRecord = [&](char const * record) {
+			char line[176];
+			FixedFormatter formatter(line, sizeof(line));
+			formatter.fixed(time_cs, 2).character(' ').text(record).text("\r\n");
+			consoleQueue.write(formatter.c_str(), formatter.length());
+		};
+		if (!readOK) {
+			printRecord("gauge read failed");
+			nextPoll += std::chrono::milliseconds(periodMs);
+			ThisThread::sleep_until(nextPoll);
+			continue;
+		}
+
+		// The first poll lists every bit that is set, after that only the changes
+		auto const report = [&](char const * name, GaugeBits::NameTable const & names, uint16_t previous, uint16_t current) {
+			char record[160];
+			int const length = first ? GaugeBits::formatSetBits(record, sizeof(record), name, names, current)
+				: GaugeBits::formatTransitions(record, sizeof(record), name, names, previous, current);
+			if (length > 0) {
+				printRecord(record);
+			}
+		};
+		report("STATUS", GaugeBits::STATUS_NAMES, status, newStatus);
+		report("FLAGS", GaugeBits::FLAGS_NAMES, flags.first, newFlags.first);
+		report("FLAGSB", GaugeBits::FLAGSB_NAMES, flags.second, newFlags.second);
+		if (first || newUpdateStatus != updateStatus) {
+			char record[32];
+			FixedFormatter formatter(record, sizeof(record));
+			formatter.text("UPDATE ");
+			if (first) {
+				formatter.text("= ");
+			}
+			else {
+				formatter.hex(updateStatus, 2).text(" -> ");
+			}
+			formatter.hex(newUpdateStatus, 2);
+			printRecord(record);
+		}
+
+		first = false;
+		status = newStatus;
+		flags = newFlags;
+		updateStatus = newUpdateStatus;
+
+		nextPoll += std::chrono::milliseconds(periodMs);
+		ThisThread::sleep_until(nextPoll);
 	}
 }
 
+namespace
+{
+	using MachineProtocol::Command;
+	using MachineProtocol::Status;
+
+	// Handles machine protocol requests from the console, one at a time, until EXIT
+	class MachineServer
+	{
+	public:
+		void run()
+		{
+			MachineProtocol::sendFrame(console, MachineProtocol::READY, 0, nullptr, 0);
+
+			MachineProtocol::Parser parser;
+			while (true) {
+				uint8_t buffer[64];
+				ssize_t const bytesRead = consoleRead(buffer, sizeof(buffer));
+				if (bytesRead <= 0) {
+					return;
+				}
+				for (ssize_t index = 0; index < bytesRead; index++) {
+					// Requests that arrive while one is running wait in the serial driver's receive buffer
+					if (parser.feed(buffer[index]) && !handle(parser.getFrame())) {
+						return;
+					}
+				}
+			}
+		}
+
+	private:
+		ConsoleSink console;
+
+		// Request being handled
+		uint8_t command = 0;
+		uint8_t requestID = 0;
+
+		void respond(Status status, uint8_t const * result = nullptr, size_t length = 0)
+		{
+			uint8_t payload[MachineProtocol::MAX_PAYLOAD_SIZE];
+			MachineProtocol::PayloadWriter writer(payload, sizeof(payload));
+			writer.u8(static_cast<uint8_t>(status)).bytes(result, length);
+			MachineProtocol::sendFrame(console, MachineProtocol::RESPONSE_FLAG | command, requestID, payload, writer.length());
+		}
+
+		template<typename Result>
+		void respond(Result const & result)
+		{
+			uint8_t payload[MachineProtocol::MAX_PAYLOAD_SIZE];
+			MachineProtocol::PayloadWriter writer(payload, sizeof(payload));
+			encode(writer, result);
+			respond(Status::OK, payload, writer.length());
+		}
+
+		void sendProgress(std::chrono::milliseconds elapsed, uint16_t voltage_mV, int16_t current_mA)
+		{
+			MachineProtocol::Progress const progress{static_cast<uint32_t>(elapsed.count()), voltage_mV, current_mA};
+			uint8_t payload[MachineProtocol::MAX_PAYLOAD_SIZE];
+			MachineProtocol::PayloadWriter writer(payload, sizeof(payload));
+			encode(writer, progress);
+			MachineProtocol::sendFrame(console, MachineProtocol::PROGRESS_FLAG | command, requestID, payload, writer.length());
+		}
+
+		// Returns false once the host has asked to leave machine mode
+		bool handle(MachineProtocol::Frame const & frame)
+		{
+			command = frame.code;
+			requestID = frame.requestID;
+			MachineProtocol::PayloadReader arguments(frame.payload, frame.length);
+
+			switch (static_cast<Command>(frame.code)) {
+				case Command::PING:                  ping(arguments);                break;
+				case Command::RESET:                 reset(arguments);               break;
+				case Command::READ_STATUS:           readStatus(arguments);          break;
+				case Command::READ_TELEMETRY:        readTelemetry(arguments);       break;
+				case Command::READ_IDENTITY:         readIdentity(arguments);        break;
+				case Command::WRITE_SETTINGS:        writeSettings(arguments);       break;
+				case Command::CALIBRATE_VOLTAGE:     calibrateVoltage(arguments);    break;
+				case Command::CALIBRATE_CURRENT:     calibrateCurrent(arguments);    break;
+				case Command::ENABLE_CALIBRATION:    simple(arguments, [] { soc.enableCal(); soc.enterCal(); }); break;
+				case Command::DISABLE_CALIBRATION:   simple(arguments, [] { soc.exitCal(); });                 break;
+				case Command::ENABLE_IT:             simple(arguments, [] { soc.ITEnable(); });                break;
+				case Command::RESET_VOLTAGE_DIVIDER: simple(arguments, [] { soc.resetVoltageDivider(); });     break;
+				case Command::AUTO_CALIBRATE_VOLTAGE: autoCalibrate(arguments, false); break;
+				case Command::AUTO_CALIBRATE_CURRENT: autoCalibrate(arguments, true);  break;
+				case Command::DISCHARGE:             discharge(arguments);           break;
+				case Command::CHARGE:                charge(arguments);              break;
+				case Command::RELAX:                 relax(arguments);               break;
+				case Command::READ_FLASH_BLOCK:      readFlashBlock(arguments);      break;
+				case Command::WRITE_FLASH_BLOCK:     writeFlashBlock(arguments);     break;
+				case Command::EXIT:
+					if (!arguments.complete()) {
+						respond(Status::BAD_ARGUMENTS);
+						return true;
+					}
+					respond(Status::OK);
+					return false;
+				default:                             respond(Status::UNKNOWN_COMMAND); break;
+			}
+			return true;
+		}
+
+		// Commands that take no arguments and have no result
+		template<typename Action>
+		void simple(MachineProtocol::PayloadReader const & arguments, Action action)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			action();
+			respond(Status::OK);
+		}
+
+		void ping(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			uint8_t const version = MachineProtocol::PROTOCOL_VERSION;
+			respond(Status::OK, &version, 1);
+		}
+
+		void reset(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			soc.reset();
+
+			MachineProtocol::DeviceInfo info;
+			info.deviceType = I2CProfiler::profile(DriverCommand::DEVICE_TYPE, [] { return soc.readDeviceType(); });
+			if (info.deviceType != 0x100) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			info.firmwareVersion = soc.readFWVersion();
+			info.hardwareVersion = soc.readHWVersion();
+			respond(info);
+		}
+
+		void readStatus(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			MachineProtocol::StatusRegisters registers;
+			std::pair<uint16_t, uint16_t> flags;
+			if (!readGauge(DriverCommand::STATUS, registers.controlStatus, [] { return soc.getStatus(); })
+				|| !readGauge(DriverCommand::FLAGS, flags, [] { return soc.getFlags(); })
+				|| !readGauge(DriverCommand::UPDATE_STATUS, registers.updateStatus, [] { return soc.getUpdateStatus(); })) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			registers.flags = flags.first;
+			registers.flagsB = flags.second;
+			respond(registers);
+		}
+
+		void readTelemetry(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			TelemetrySnapshot snapshot;
+			if (!telemetry.read(snapshot)) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			MachineProtocol::Telemetry result;
+			result.soc_percent = snapshot.soc_percent;
+			result.maxError_percent = snapshot.maxError_percent;
+			result.remaining_mAh = snapshot.remaining_mAh;
+			result.fullCharge_mAh = snapshot.fullCharge_mAh;
+			result.voltage_mV = snapshot.voltage_mV;
+			result.averageCurrent_mA = snapshot.averageCurrent_mA;
+			result.temperature_dK = snapshot.temperature_dK;
+			result.flags = snapshot.flags;
+			result.current_mA = snapshot.current_mA;
+			result.flagsB = snapshot.flagsB;
+			respond(result);
+		}
+
+		void readIdentity(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			MachineProtocol::Identity identity;
+			identity.device.deviceType = soc.readDeviceType();
+			identity.device.firmwareVersion = soc.readFWVersion();
+			identity.device.hardwareVersion = soc.readHWVersion();
+			identity.serialNumber = soc.getSerial();
+			identity.chemID = soc.getChemID();
+			respond(identity);
+		}
+
+		void writeSettings(MachineProtocol::PayloadReader const & arguments)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			soc.unseal();
+
+			DataFlashCache flash(i2c);
+			if (!stageSettings(flash)) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			DataFlashCache::CommitResult const commit = flash.commit();
+			if (commit.blocksFailed > 0) {
+				respond(Status::FLASH_WRITE_FAILED);
+				return;
+			}
+
+			MachineProtocol::SettingsResult result;
+			result.blocksWritten = commit.blocksWritten;
+			result.blocksUnchanged = commit.blocksUnchanged;
+			result.blocksFailed = commit.blocksFailed;
+			result.updateStatus = 0;
+			flash.get(DataFlash::UPDATE_STATUS, result.updateStatus);
+			respond(result);
+		}
+
+		void calibrateVoltage(MachineProtocol::PayloadReader arguments)
+		{
+			uint16_t const packVoltage_mV = arguments.u16();
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (packVoltage_mV == 0) {
+				respond(Status::INVALID_ARGUMENT);
+				return;
+			}
+			uint8_t result[2];
+			MachineProtocol::PayloadWriter(result, sizeof(result)).u16(soc.calibrateVoltage(packVoltage_mV));
+			respond(Status::OK, result, sizeof(result));
+		}
+
+		void calibrateCurrent(MachineProtocol::PayloadReader arguments)
+		{
+			int16_t const current_mA = arguments.i16();
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (current_mA == 0) {
+				respond(Status::INVALID_ARGUMENT);
+				return;
+			}
+			// same sequence as the menu
+			soc.setSenseResistor();
+			soc.reset();
+			ThisThread::sleep_for(200ms);
+			soc.calibrateShunt(current_mA);
+			respond(Status::OK);
+		}
+
+		void autoCalibrate(MachineProtocol::PayloadReader const & arguments, bool current)
+		{
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (current && !startCharger()) {
+				respond(Status::CHARGER_NOT_STARTED);
+				return;
+			}
+
+			BufferedSerial meterSerial(REFERENCE_METER_TX, REFERENCE_METER_RX, REFERENCE_METER_BAUD);
+			ReferenceMeter referenceMeter(meterSerial);
+
+			soc.unseal();
+			AutoCalibrator calibrator(i2c, soc, referenceMeter, AutoCalibrator::Config());
+			Timer timer;
+			timer.start();
+			auto const onMeasurement = [this, &timer](uint8_t, AutoCalibrator::Measurement const &) {
+				TelemetrySnapshot snapshot;
+				telemetry.read(snapshot);
+				sendProgress(std::chrono::duration_cast<std::chrono::milliseconds>(timer.elapsed_time()),
+					snapshot.voltage_mV, snapshot.current_mA);
+			};
+			AutoCalibrator::Result const result = current ? calibrator.calibrateCurrent(onMeasurement) : calibrator.calibrateVoltage(onMeasurement);
+			if (current) {
+				shdnPin.write(CHARGER_PIN_DEACTIVATE);
+			}
+
+			switch (result.outcome) {
+				case AutoCalibrator::Outcome::CONVERGED:
+				case AutoCalibrator::Outcome::NOT_CONVERGED:
+					break;
+				case AutoCalibrator::Outcome::METER_ERROR:        respond(Status::METER_ERROR);        return;
+				case AutoCalibrator::Outcome::GAUGE_ERROR:        respond(Status::GAUGE_ERROR);        return;
+				case AutoCalibrator::Outcome::NO_CURRENT:         respond(Status::NO_CURRENT);         return;
+				case AutoCalibrator::Outcome::CURRENT_REVERSED:   respond(Status::CURRENT_REVERSED);   return;
+				case AutoCalibrator::Outcome::FLASH_WRITE_FAILED: respond(Status::FLASH_WRITE_FAILED); return;
+			}
+
+			MachineProtocol::CalibrationResult response;
+			response.converged = result.outcome == AutoCalibrator::Outcome::CONVERGED;
+			response.corrections = result.corrections;
+			response.reference = result.last.reference;
+			response.gauge = result.last.gauge;
+			response.rejected = result.last.rejected;
+			response.setting = result.setting;
+			respond(response);
+		}
+
+		// Sample period argument of DISCHARGE and CHARGE
+		static std::chrono::seconds samplePeriod(uint16_t period_s)
+		{
+			return period_s == 0 ? 10s : std::chrono::seconds(period_s);
+		}
+
+		MachineProtocol::CycleResult cycleResult(TelemetrySampler::Sample const & last) const
+		{
+			MachineProtocol::CycleResult result;
+			result.sampleCount = sampler.getSampleCount();
+			result.droppedCount = sampler.getDroppedCount();
+			result.duration_s = std::chrono::duration_cast<std::chrono::seconds>(last.timestamp).count();
+			result.finalVoltage_mV = last.telemetry.voltage_mV;
+			result.finalCurrent_mA = last.telemetry.current_mA;
+			return result;
+		}
+
+		void discharge(MachineProtocol::PayloadReader arguments)
+		{
+			uint16_t endVoltage_mV = arguments.u16();
+			std::chrono::seconds const period = samplePeriod(arguments.u16());
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (endVoltage_mV == 0) {
+				endVoltage_mV = DISCHARGE_END_VOLTAGE_MV;
+			}
+
+			sampler.start(period, CYCLE_SAMPLE_TIMING);
+			TelemetrySampler::Sample sample;
+			do {
+				sampler.waitForSample(sample);
+				if (sample.valid) {
+					sendProgress(sample.timestamp, sample.telemetry.voltage_mV, sample.telemetry.current_mA);
+				}
+			} while (!sample.valid || sample.telemetry.voltage_mV > endVoltage_mV);
+			sampler.stop();
+
+			respond(cycleResult(sample));
+		}
+
+		void charge(MachineProtocol::PayloadReader arguments)
+		{
+			std::chrono::seconds const period = samplePeriod(arguments.u16());
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+
+			if (!startCharger()) {
+				respond(Status::CHARGER_NOT_STARTED);
+				return;
+			}
+
+			sampler.start(period, CYCLE_SAMPLE_TIMING);
+			TelemetrySampler::Sample sample{};
+			while (chgPin.read() == CHARGE_STATUS_CHARGING) {
+				sampler.waitForSample(sample);
+				if (sample.valid) {
+					sendProgress(sample.timestamp, sample.telemetry.voltage_mV, sample.telemetry.current_mA);
+				}
+			}
+			sampler.stop();
+			shdnPin.write(CHARGER_PIN_DEACTIVATE);
+
+			respond(cycleResult(sample));
+		}
+
+		void relax(MachineProtocol::PayloadReader arguments)
+		{
+			uint32_t const maxTime_s = arguments.u32();
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (maxTime_s == 0) {
+				respond(Status::INVALID_ARGUMENT);
+				return;
+			}
+
+			RestResult const rest = restPack(std::chrono::seconds(maxTime_s), [this](std::chrono::milliseconds elapsed) {
+				TelemetrySnapshot snapshot;
+				telemetry.read(snapshot);
+				sendProgress(elapsed, snapshot.voltage_mV, snapshot.current_mA);
+			});
+
+			MachineProtocol::RelaxResult result;
+			result.duration_s = std::chrono::duration_cast<std::chrono::seconds>(rest.duration).count();
+			result.settledEarly = rest.settled;
+			respond(result);
+		}
+
+		// Subclass and block index arguments of the data flash commands.  Only blocks in FlashImage's table are allowed.
+		bool readBlockAddress(MachineProtocol::PayloadReader & arguments, uint8_t & subclass, uint8_t & index)
+		{
+			subclass = arguments.u8();
+			index = arguments.u8();
+			for (size_t subclassIndex = 0; subclassIndex < FlashImage::SUBCLASS_COUNT; subclassIndex++) {
+				if (FlashImage::SUBCLASSES[subclassIndex].subclass == subclass) {
+					return index < FlashImage::SUBCLASSES[subclassIndex].blockCount;
+				}
+			}
+			return false;
+		}
+
+		void readFlashBlock(MachineProtocol::PayloadReader arguments)
+		{
+			uint8_t subclass;
+			uint8_t index;
+			bool const validAddress = readBlockAddress(arguments, subclass, index);
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (!validAddress) {
+				respond(Status::INVALID_ARGUMENT);
+				return;
+			}
+
+			soc.unseal();
+			DataFlashCache flash(i2c);
+			uint8_t data[MachineProtocol::FLASH_BLOCK_SIZE];
+			if (!flash.readBlockData(subclass, index, data)) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			respond(Status::OK, data, sizeof(data));
+		}
+
+		void writeFlashBlock(MachineProtocol::PayloadReader arguments)
+		{
+			uint8_t subclass;
+			uint8_t index;
+			bool const validAddress = readBlockAddress(arguments, subclass, index);
+			uint8_t data[MachineProtocol::FLASH_BLOCK_SIZE];
+			arguments.bytes(data, sizeof(data));
+			if (!arguments.complete()) {
+				respond(Status::BAD_ARGUMENTS);
+				return;
+			}
+			if (!validAddress) {
+				respond(Status::INVALID_ARGUMENT);
+				return;
+			}
+
+			soc.unseal();
+			DataFlashCache flash(i2c);
+			if (!flash.writeBlockData(subclass, index, data)) {
+				respond(Status::GAUGE_ERROR);
+				return;
+			}
+			DataFlashCache::CommitResult const commit = flash.commit();
+			if (commit.blocksFailed > 0) {
+				respond(Status::FLASH_WRITE_FAILED);
+				return;
+			}
+			uint8_t const written = commit.blocksWritten;
+			respond(Status::OK, &written, 1);
+		}
+	};
+}
+
+void SOCTestSuite::machineMode()
+{
+	MachineServer server;
+	server.run();
+}
+
+void SOCTestSuite::printI2CLatency()
+{
+	I2CProfiler::printReport();
+}
+
+void SOCTestSuite::benchmarkI2C()
+{
+	if (!I2CProfiler::ENABLED) {
+		I2CProfiler::printReport();
+		return;
+	}
+
+	constexpr int iterations = 50;
+	printf("Timing %d rounds of gauge accesses at the current bus speed\r\n\n", iterations);
+	I2CProfiler::reset();
+
+	using namespace DriverCommand;
+	DataFlashCache flash(i2c);
+	for (int i = 0; i < iterations; i++) {
+		I2CProfiler::profile(STATE_OF_CHARGE, [] { return soc.getSOC(); });
+		I2CProfiler::profile(VOLTAGE, [] { return soc.getVoltage(); });
+		I2CProfiler::profile(CURRENT, [] { return soc.getCurrent(); });
+		I2CProfiler::profile(TEMPERATURE, [] { return soc.getTemperature(); });
+		I2CProfiler::profile(FLAGS, [] { return soc.getFlags(); });
+		I2CProfiler::profile(STATUS, [] { return soc.getStatus(); });
+		I2CProfiler::profile(DEVICE_TYPE, [] { return soc.readDeviceType(); });
+		I2CProfiler::profile(FW_VERSION, [] { return soc.readFWVersion(); });
+		I2CProfiler::profile(HW_VERSION, [] { return soc.readHWVersion(); });
+
+		// these record themselves
+		TelemetrySnapshot snapshot;
+		telemetry.read(snapshot);
+		int16_t designCapacity;
+		flash.get(DataFlash::DESIGN_CAPACITY, designCapacity);
+		flash.clear();
+	}
+
+	I2CProfiler::printReport();
+}
+
 void SOCTestSuite::relaxFull() {
     printf("Relaxing the battery after a charge (2 hours) \r\n");
-    for (int i = 0; i < 10; i++) {
-        ThisThread::sleep_for(720s);
-        printf("#");
-    }
+    relax(2h);
 
     printf("\r\n\nCharge relax complete!\r\n");
 }
@@ -428,23 +1712,53 @@ void SOCTestSuite::resetVoltageCalibration()
     printf("\r\n\nVoltage divider calibration reset.\r\n");
 }
 
+namespace
+{
+	// Whether two conversions differ by at most one unit in the last place of the 24 bit Xemics mantissa
+	bool withinOneLSB(float a, float b)
+	{
+		return std::fabs(a - b) <= std::ldexp(std::max(std::fabs(a), std::fabs(b)), -23);
+	}
+}
+
 void SOCTestSuite::testFloatConversion()
 {
 	// test data from https://e2e.ti.com/support/power-management/f/196/p/551252/2020286?tisearch=e2e-quicksearch&keymatch=xemics#2020286
+	// (TI's value is rounded, so it only matches to about 4 digits)
 	float valueFloat = .8335f;
 	uint32_t valueXemics = 0x80555E9E;
 
 	// try converting float to xemics
 	uint32_t convertedValue = BQ34Z100::floatToXemics(valueFloat);
-	printf("Converted value: 0x%" PRIx32 "\n", convertedValue);
+	printf("Converted value: 0x%" PRIx32 " (Xemics.h: 0x%" PRIx32 ")\n", convertedValue, Xemics::fromFloat(valueFloat));
 
 	// try converting xemics to float
 	float convertedFloat = BQ34Z100::xemicsToFloat(valueXemics);
-	printf("Converted float: %f\n", convertedFloat);
-
-	printf("Expected default CC Gain: 0x%" PRIx32 "\n", BQ34Z100::floatToXemics(0.4768));
-	printf("Expected default CC Delta: 0x%" PRIx32 "\n", BQ34Z100::floatToXemics(567744.56));
+	printf("Converted float: %f (Xemics.h: %f)\n", convertedFloat, Xemics::toFloat(valueXemics));
+
+	// These are computed at compile time
+	printf("Expected default CC Gain: 0x%" PRIx32 "\n", Xemics::DEFAULT_CC_GAIN);
+	printf("Expected default CC Delta: 0x%" PRIx32 "\n", Xemics::DEFAULT_CC_DELTA);
+
+	// Spot check the driver against Xemics.h, which is verified exhaustively by the host xemics-verify tool.
+	// The driver's conversions are a port of TI's code, which truncates where Xemics.h rounds, so the two may
+	// differ in the last bit of the mantissa; that counts as agreeing.
+	const float checkValues[] = {0.4768f, 567744.56f, valueFloat, 1.0f, -1.0f, 1e-6f, -12345.678f, 3.0e9f};
+	int mismatches = 0;
+	for (float value : checkValues) {
+		uint32_t driverXemics = BQ34Z100::floatToXemics(value);
+		if (!withinOneLSB(Xemics::toFloat(driverXemics), Xemics::toFloat(Xemics::fromFloat(value)))
+			|| !withinOneLSB(BQ34Z100::xemicsToFloat(driverXemics), Xemics::toFloat(driverXemics))) {
+			printf("Mismatch for %g: driver 0x%" PRIx32 ", Xemics.h 0x%" PRIx32 "\n", value, driverXemics, Xemics::fromFloat(value));
+			++mismatches;
+		}
+	}
+	printf("Driver and Xemics.h %s to within 1 LSB on %d values\n", mismatches == 0 ? "agree" : "DISAGREE",
+		static_cast<int>(sizeof(checkValues) / sizeof(checkValues[0])));
 
+	// TI's code can't encode 0 and uses 0.00001 instead, where Xemics.h encodes 0 exactly, so that is only shown
+	uint32_t driverZero = BQ34Z100::floatToXemics(0.0f);
+	printf("Driver encodes 0 as 0x%" PRIx32 " (%g), Xemics.h as 0x%" PRIx32 "\n", driverZero, Xemics::toFloat(driverZero), Xemics::fromFloat(0.0f));
 }
 
 
@@ -457,6 +1771,8 @@ int main()
     shdnPin.write(CHARGER_PIN_DEACTIVATE);
 	chgPin.mode(PinMode::PullNone);
 
+	telemetryLog.start();
+
     while(1){
         int test=-1;
         printf("\r\n\nBattery State of Charge Sensor Test Suite:\r\n");
@@ -480,7 +1796,17 @@ int main()
         printf("16.  Reset Voltage Divider Calibration\r\n");
 	    printf("17.  Test Float Conversion\r\n");
 	    printf("18.  Read Voltage and Current Forever\r\n");
+	    printf("19.  Read Voltage and Current Forever, Changes Only\r\n");
 	    printf("20.  Exit Test Suite\r\n");
+	    printf("21.  Export Data Flash Image\r\n");
+	    printf("22.  Import Data Flash Image\r\n");
+	    printf("23.  Print I2C Latency Report\r\n");
+	    printf("24.  Benchmark I2C Latency\r\n");
+	    printf("25.  Watch Status Bits, Changes Only\r\n");
+	    printf("26.  Machine Protocol Mode (for fixture software)\r\n");
+	    printf("27.  Automatic Voltage and Current Calibration (reference meter)\r\n");
+	    printf("28.  Impedance Track Learning Cycle, Unattended\r\n");
+	    printf("29.  Dump Telemetry Log (binary)\r\n");
 
         scanf("%d", &test);
         printf("Running test %d:\r\n\n", test);
@@ -504,7 +1830,17 @@ int main()
             case 16:        harness.resetVoltageCalibration();               break;
 	        case 17:        harness.testFloatConversion();                   break;
 	        case 18:        harness.readVoltageCurrent();                    break;
+	        case 19:        harness.readVoltageCurrentOnChange();            break;
 	        case 20:        printf("Exiting test suite.\r\n");               return 0;
+	        case 21:        harness.exportFlashImage();                      break;
+	        case 22:        harness.importFlashImage();                      break;
+	        case 23:        harness.printI2CLatency();                       break;
+	        case 24:        harness.benchmarkI2C();                          break;
+	        case 25:        harness.watchStatus();                           break;
+	        case 26:        harness.machineMode();                           break;
+	        case 27:        harness.autoCalibrate();                         break;
+	        case 28:        harness.learningCycle();                         break;
+	        case 29:        harness.dumpTelemetryLog();                      break;
             default:        printf("Invalid test number. Please run again.\r\n"); return 1;
         }
 
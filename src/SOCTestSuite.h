@@ -28,7 +28,14 @@ public:
    void resetVoltageCalibration();
    void testFloatConversion();
    void readVoltageCurrent();
-
-private:
-	void outputFlashInt(uint8_t* flash, int index, int len);
+   void readVoltageCurrentOnChange();
+   void exportFlashImage();
+   void importFlashImage();
+   void printI2CLatency();
+   void benchmarkI2C();
+   void watchStatus();
+   void machineMode();
+   void autoCalibrate();
+   void learningCycle();
+   void dumpTelemetryLog();
 };
@@ -0,0 +1,81 @@
+//
+// Lock-free ring buffer for passing items from exactly one producer thread (or ISR)
+// to exactly one consumer thread.
+// This file has no Mbed dependencies.
+//
+
+#ifndef BQ34Z100G1_UTILS_SPSCRINGBUFFER_H
+#define BQ34Z100G1_UTILS_SPSCRINGBUFFER_H
+
+#include <atomic>
+#include <cstddef>
+
+/**
+ * Single-producer/single-consumer FIFO of fixed capacity.
+ * push() may only be called from the producer and pop() only from the consumer; neither ever blocks.
+ * Capacity must be a power of two.
+ */
+template<typename T, size_t Capacity>
+class SpscRingBuffer
+{
+	static_assert(Capacity >= 2 && (Capacity & (Capacity - 1)) == 0, "Capacity must be a power of two");
+
+public:
+	/**
+	 * Add an item.  Producer only.
+	 * @return false if the buffer is full, in which case the item is not added.
+	 */
+	bool push(T const & item)
+	{
+		// head and tail run freely and wrap; only their difference matters
+		size_t const currentHead = head.load(std::memory_order_relaxed);
+		if(currentHead - tail.load(std::memory_order_acquire) == Capacity)
+		{
+			return false;
+		}
+
+		items[currentHead & MASK] = item;
+		head.store(currentHead + 1, std::memory_order_release);
+		return true;
+	}
+
+	/**
+	 * Remove the oldest item.  Consumer only.
+	 * @return false if the buffer is empty.
+	 */
+	bool pop(T & item)
+	{
+		size_t const currentTail = tail.load(std::memory_order_relaxed);
+		if(head.load(std::memory_order_acquire) == currentTail)
+		{
+			return false;
+		}
+
+		item = items[currentTail & MASK];
+		tail.store(currentTail + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Number of items waiting.  Exact only when called from the producer or consumer.
+	size_t size() const
+	{
+		return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+	}
+
+	bool empty() const { return size() == 0; }
+
+	static constexpr size_t capacity() { return Capacity; }
+
+private:
+	static constexpr size_t MASK = Capacity - 1;
+
+	T items[Capacity];
+
+	// next slot the producer writes to
+	std::atomic<size_t> head{0};
+
+	// next slot the consumer reads from
+	std::atomic<size_t> tail{0};
+};
+
+#endif //BQ34Z100G1_UTILS_SPSCRINGBUFFER_H
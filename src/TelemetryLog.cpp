@@ -0,0 +1,495 @@
+//
+// Append-only circular log of small records on a BlockDevice.
+//
+
+#include "TelemetryLog.h"
+#include "Crc16.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace
+{
+	void putLE32(uint8_t * out, uint32_t value)
+	{
+		for(size_t i = 0; i < 4; i++)
+		{
+			out[i] = (value >> (8 * i)) & 0xFF;
+		}
+	}
+
+	uint32_t getLE32(uint8_t const * in)
+	{
+		return in[0] | (in[1] << 8) | (in[2] << 16) | (static_cast<uint32_t>(in[3]) << 24);
+	}
+
+	bd_size_t roundUp(bd_size_t value, bd_size_t multiple)
+	{
+		return (value + multiple - 1) / multiple * multiple;
+	}
+
+	// Offset of the sequence number within a record
+	constexpr size_t SEQUENCE_OFFSET = 2;
+	constexpr size_t HEADER_SIZE = 6;
+}
+
+TelemetryLog::TelemetryLog(BlockDevice & device):
+TelemetryLog(device, Config())
+{
+}
+
+TelemetryLog::TelemetryLog(BlockDevice & device, Config const & config):
+device(device),
+config(config)
+{
+}
+
+int TelemetryLog::init()
+{
+	ready = false;
+	eraseCount = 0;
+	programCount = 0;
+	batchFill = 0;
+	if(device.init() != 0)
+	{
+		return ERROR_DEVICE;
+	}
+
+	bd_size_t const deviceSize = device.size();
+	if(config.start >= deviceSize)
+	{
+		return ERROR_DEVICE;
+	}
+	bd_size_t const regionSize = config.size != 0 ? config.size : deviceSize - config.start;
+	if(regionSize > deviceSize - config.start)
+	{
+		return ERROR_DEVICE;
+	}
+	regionStart = config.start;
+	sectorSize = device.get_erase_size(regionStart);
+	if(sectorSize == 0 || regionStart % sectorSize != 0)
+	{
+		return ERROR_DEVICE;
+	}
+
+	// Batches have to start on program and read boundaries, fit a record, and tile a sector
+	bd_size_t const unit = std::max(device.get_program_size(), device.get_read_size());
+	bd_size_t const batch = roundUp(std::min<bd_size_t>(config.batchSize, sectorSize), unit);
+	if(batch > MAX_BATCH_SIZE || batch < MAX_RECORD_SIZE || sectorSize % batch != 0)
+	{
+		return ERROR_DEVICE;
+	}
+	batchSize = batch;
+	batchesPerSector = sectorSize / batchSize;
+	sectorCount = regionSize / sectorSize;
+	if(sectorCount < 2)
+	{
+		return ERROR_DEVICE;
+	}
+
+	// The first records of the sectors tell which is the newest, and which the oldest
+	bool found = false;
+	uint32_t newestSector = 0;
+	uint32_t newestSequence = 0;
+	firstSector = 0;
+	firstSequence = 1;
+	for(uint32_t sector = 0; sector < sectorCount; sector++)
+	{
+		uint32_t sequence;
+		if(!readFirstSequence(sector, sequence))
+		{
+			continue;
+		}
+		if(!found || sequence > newestSequence)
+		{
+			newestSector = sector;
+			newestSequence = sequence;
+		}
+		if(!found || sequence < firstSequence)
+		{
+			firstSector = sector;
+			firstSequence = sequence;
+		}
+		found = true;
+	}
+
+	if(!found)
+	{
+		headSector = 0;
+		headBatch = 0;
+		firstSector = 0;
+		firstSequence = 1;
+		storedEnd = 1;
+		nextSequence = 1;
+		ready = true;
+		return OK;
+	}
+
+	// The log ends in the newest sector, at the first batch that doesn't carry on from the one before
+	uint32_t expected = newestSequence;
+	headSector = newestSector;
+	headBatch = batchesPerSector;
+	for(uint32_t batch = 0; batch < batchesPerSector; batch++)
+	{
+		if(device.read(readBuffer, batchAddress(newestSector, batch), batchSize) != 0)
+		{
+			return ERROR_DEVICE;
+		}
+		uint32_t const before = expected;
+		size_t fromOffset;
+		uint32_t count = 0;
+		scanBatch(readBuffer, batchSize, expected, UINT32_MAX, 0, fromOffset, count);
+		if(expected == before)
+		{
+			headBatch = batch;
+			break;
+		}
+	}
+	storedEnd = expected;
+	nextSequence = expected;
+
+	// A batch cut off while being programmed can't be programmed again without an erase, so skip past anything
+	// that isn't blank.  Devices without an erase value can be programmed over anyway.
+	int const eraseValue = device.get_erase_value();
+	if(eraseValue >= 0)
+	{
+		for(; headBatch < batchesPerSector; headBatch++)
+		{
+			if(device.read(readBuffer, batchAddress(headSector, headBatch), batchSize) != 0)
+			{
+				return ERROR_DEVICE;
+			}
+			if(std::all_of(readBuffer, readBuffer + batchSize, [eraseValue](uint8_t byte) { return byte == eraseValue; }))
+			{
+				break;
+			}
+		}
+	}
+	if(headBatch == batchesPerSector)
+	{
+		headSector = nextSector(headSector);
+		headBatch = 0;
+	}
+
+	ready = true;
+	return OK;
+}
+
+int TelemetryLog::append(uint8_t const * payload, size_t size)
+{
+	if(!ready)
+	{
+		++writeErrorCount;
+		return ERROR_NOT_READY;
+	}
+	if(size > MAX_PAYLOAD_SIZE || (payload == nullptr && size > 0))
+	{
+		++writeErrorCount;
+		return ERROR_INVALID_ARGUMENT;
+	}
+
+	// The record goes into the next batch even if programming this one failed, as a later retry may work
+	size_t const recordSize = size + RECORD_OVERHEAD;
+	int result = OK;
+	if(batchFill + recordSize > batchSize)
+	{
+		result = programBatch();
+	}
+
+	uint8_t * const record = batchBuffer + batchFill;
+	record[0] = RECORD_MARKER;
+	record[1] = static_cast<uint8_t>(size);
+	putLE32(record + SEQUENCE_OFFSET, nextSequence);
+	if(size > 0)
+	{
+		memcpy(record + HEADER_SIZE, payload, size);
+	}
+	uint16_t const crc = crc16(record + 1, HEADER_SIZE - 1 + size);
+	record[HEADER_SIZE + size] = crc & 0xFF;
+	record[HEADER_SIZE + size + 1] = crc >> 8;
+
+	batchFill += recordSize;
+	++nextSequence;
+	return result;
+}
+
+void TelemetryLog::write(uint8_t const * data, size_t length)
+{
+	append(data, length);
+}
+
+int TelemetryLog::flush()
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+	int result = programBatch();
+	if(device.sync() != 0 && result == OK)
+	{
+		result = ERROR_DEVICE;
+	}
+	return result;
+}
+
+int TelemetryLog::dump(uint32_t fromSequence, ByteSink & sink, uint32_t * recordCount)
+{
+	if(recordCount != nullptr)
+	{
+		*recordCount = 0;
+	}
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+
+	// Records still in RAM would be lost by a reset, and their sequence numbers given to new ones, so a reader
+	// resuming from the last record it got would miss those.  Everything sent is on the device.
+	int result = flush();
+	fromSequence = std::max(fromSequence, firstSequence);
+	uint32_t count = 0;
+
+	uint32_t sector = firstSector;
+	uint32_t expected = firstSequence;
+	for(uint32_t sectorsLeft = sectorCount; sectorsLeft > 0 && expected < storedEnd && fromSequence < storedEnd; sectorsLeft--)
+	{
+		// Skip the whole sector if the next one still starts at or before the first record wanted
+		uint32_t const next = nextSector(sector);
+		uint32_t nextFirst;
+		if(sectorsLeft > 1 && readFirstSequence(next, nextFirst) && nextFirst > expected && nextFirst <= fromSequence
+			&& nextFirst < storedEnd)
+		{
+			sector = next;
+			expected = nextFirst;
+			continue;
+		}
+
+		// Every batch, as a lost or cut off batch can have good ones after it
+		for(uint32_t batch = 0; batch < batchesPerSector && expected < storedEnd; batch++)
+		{
+			if(device.read(readBuffer, batchAddress(sector, batch), batchSize) != 0)
+			{
+				result = ERROR_DEVICE;
+				continue;
+			}
+			size_t fromOffset;
+			size_t const end = scanBatch(readBuffer, batchSize, expected, storedEnd, fromSequence, fromOffset, count);
+			if(end > fromOffset)
+			{
+				sink.write(readBuffer + fromOffset, end - fromOffset);
+			}
+		}
+		sector = next;
+	}
+
+	if(recordCount != nullptr)
+	{
+		*recordCount = count;
+	}
+	return result;
+}
+
+int TelemetryLog::reset()
+{
+	if(!ready)
+	{
+		return ERROR_NOT_READY;
+	}
+
+	int result = OK;
+	for(uint32_t sector = 0; sector < sectorCount; sector++)
+	{
+		if(clearSector(sector) != OK)
+		{
+			result = ERROR_DEVICE;
+		}
+	}
+
+	headSector = 0;
+	headBatch = 0;
+	firstSector = 0;
+	firstSequence = 1;
+	storedEnd = 1;
+	nextSequence = 1;
+	batchFill = 0;
+	return result;
+}
+
+bool TelemetryLog::parseRecord(uint8_t const * data, size_t length, uint32_t & sequence, size_t & recordSize)
+{
+	if(length < RECORD_OVERHEAD || data[0] != RECORD_MARKER || data[1] > MAX_PAYLOAD_SIZE)
+	{
+		return false;
+	}
+	size_t const size = data[1] + RECORD_OVERHEAD;
+	if(length < size)
+	{
+		return false;
+	}
+	uint16_t const crc = data[size - 2] | (data[size - 1] << 8);
+	if(crc16(data + 1, size - 3) != crc)
+	{
+		return false;
+	}
+	sequence = getLE32(data + SEQUENCE_OFFSET);
+	recordSize = size;
+	return true;
+}
+
+size_t TelemetryLog::scanBatch(uint8_t const * batch, size_t size, uint32_t & expectedSequence, uint32_t limit,
+	uint32_t fromSequence, size_t & fromOffset, uint32_t & count)
+{
+	size_t offset = 0;
+	fromOffset = SIZE_MAX;
+	uint32_t sequence;
+	size_t recordSize;
+	while(parseRecord(batch + offset, size - offset, sequence, recordSize) && sequence >= expectedSequence
+		&& sequence < limit)
+	{
+		// Stale records from before the last erase have lower numbers, so a jump forward can only be a loss
+		if(offset > 0 && sequence != expectedSequence)
+		{
+			break;
+		}
+		if(sequence >= fromSequence)
+		{
+			fromOffset = std::min(fromOffset, offset);
+			++count;
+		}
+		offset += recordSize;
+		expectedSequence = sequence + 1;
+	}
+	fromOffset = std::min(fromOffset, offset);
+	return offset;
+}
+
+bool TelemetryLog::readFirstSequence(uint32_t sector, uint32_t & sequence)
+{
+	size_t recordSize;
+	return device.read(readBuffer, batchAddress(sector, 0), batchSize) == 0
+		&& parseRecord(readBuffer, batchSize, sequence, recordSize);
+}
+
+int TelemetryLog::programBatch()
+{
+	if(batchFill == 0)
+	{
+		return OK;
+	}
+
+	int const eraseValue = device.get_erase_value();
+	memset(batchBuffer + batchFill, eraseValue >= 0 ? eraseValue : 0xFF, batchSize - batchFill);
+
+	int result = OK;
+	if(headBatch == 0)
+	{
+		// Once the ring is full, the oldest sector is the one about to be erased
+		if(headSector == firstSector && storedEnd != firstSequence)
+		{
+			firstSector = nextSector(firstSector);
+			if(!readFirstSequence(firstSector, firstSequence))
+			{
+				firstSector = headSector;
+				firstSequence = storedEnd;
+			}
+		}
+
+		++eraseCount;
+		if(device.erase(batchAddress(headSector, 0), sectorSize) != 0)
+		{
+			result = ERROR_DEVICE;
+		}
+	}
+	if(result == OK)
+	{
+		++programCount;
+		if(device.program(batchBuffer, batchAddress(headSector, headBatch), batchSize) != 0)
+		{
+			result = ERROR_DEVICE;
+		}
+	}
+	if(result != OK)
+	{
+		writeErrorCount += nextSequence - storedEnd;
+	}
+
+	// Move on even after an error, rather than getting stuck on a bad spot
+	storedEnd = nextSequence;
+	batchFill = 0;
+	if(++headBatch == batchesPerSector)
+	{
+		headSector = nextSector(headSector);
+		headBatch = 0;
+	}
+	return result;
+}
+
+int TelemetryLog::clearSector(uint32_t sector)
+{
+	++eraseCount;
+	if(device.erase(batchAddress(sector, 0), sectorSize) != 0)
+	{
+		return ERROR_DEVICE;
+	}
+	if(device.get_erase_value() >= 0)
+	{
+		return OK;
+	}
+
+	// Erasing may have left the old contents, so overwrite them
+	memset(batchBuffer, 0, batchSize);
+	for(uint32_t batch = 0; batch < batchesPerSector; batch++)
+	{
+		++programCount;
+		if(device.program(batchBuffer, batchAddress(sector, batch), batchSize) != 0)
+		{
+			return ERROR_DEVICE;
+		}
+	}
+	return OK;
+}
+
+TelemetryLog::Parser::Parser(Listener & listener):
+listener(listener)
+{
+}
+
+void TelemetryLog::Parser::feed(uint8_t const * data, size_t length)
+{
+	for(size_t i = 0; i < length; i++)
+	{
+		if(bufferLength == 0 && data[i] != RECORD_MARKER)
+		{
+			listener.onSkippedByte();
+			continue;
+		}
+		buffer[bufferLength++] = data[i];
+		if(bufferLength < 2)
+		{
+			continue;
+		}
+
+		bool const sizeValid = buffer[1] <= MAX_PAYLOAD_SIZE;
+		if(sizeValid && bufferLength < buffer[1] + RECORD_OVERHEAD)
+		{
+			continue;
+		}
+
+		uint32_t sequence;
+		size_t recordSize;
+		if(sizeValid && parseRecord(buffer, bufferLength, sequence, recordSize))
+		{
+			listener.onRecord(sequence, buffer + HEADER_SIZE, buffer[1]);
+			bufferLength = 0;
+			continue;
+		}
+
+		// Not a record after all: drop the marker and look for the next one in what was buffered
+		uint8_t rest[MAX_RECORD_SIZE];
+		size_t const restLength = bufferLength - 1;
+		memcpy(rest, buffer + 1, restLength);
+		bufferLength = 0;
+		listener.onSkippedByte();
+		feed(rest, restLength);
+	}
+}
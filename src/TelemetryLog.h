@@ -0,0 +1,213 @@
+//
+// Append-only circular log of small records on a BlockDevice, e.g. on-chip flash or an SD card, so that
+// measurements are kept on the board even while nothing is listening on the console.
+// This file has no Mbed dependencies beyond the BlockDevice interface, so that host tools can share it.
+//
+// Each record, on the device and in a dump, looks like:
+//   MARKER (0x7E) | payload length (1 byte) | sequence number (4 bytes, little endian) | payload | CRC-16/CCITT (2 bytes, little endian)
+// The CRC covers the length, sequence number and payload bytes.
+// Sequence numbers count up by one per record from 1, and carry on across resets and wrap-arounds, so a
+// reader can ask for everything after the last record it received.  Records lost to a device error leave a gap.
+//
+
+#ifndef BQ34Z100G1_UTILS_TELEMETRYLOG_H
+#define BQ34Z100G1_UTILS_TELEMETRYLOG_H
+
+#include "ByteSink.h"
+#include "blockdevice/BlockDevice.h"
+
+#include <cstddef>
+#include <cstdint>
+
+/**
+ * Records are collected in RAM and programmed a whole batch (512 bytes by default, rounded to the program size)
+ * at a time, at batch-aligned addresses.  Records never straddle a batch, and the rest of a batch that is
+ * programmed early by flush() is left as padding.
+ *
+ * The device region is used as a ring of erase units (sectors).  Writing goes through them in order, and a
+ * sector is erased just before its first batch is programmed, which drops the oldest records once the log has
+ * wrapped around.  So every sector is erased exactly once per trip around the ring: the wear is spread evenly
+ * over the whole region without any mapping tables.
+ *
+ * Nothing but the records themselves is stored.  init() finds the newest sector from the sequence number of the
+ * first record in each, and the end of the log from where the run of consecutive sequence numbers stops, so
+ * stale records left behind on devices whose erase doesn't clear anything (SD cards, HeapBlockDevice) are
+ * never mistaken for new ones.  A batch cut off by a reset fails its CRC and ends the log there.  Records that
+ * were still in RAM are lost, and as no reader can have seen them, their sequence numbers are given out again.
+ */
+class TelemetryLog : public ByteSink
+{
+public:
+	// Return codes, as for CheckpointStore
+	static constexpr int OK = 0;
+	static constexpr int ERROR_INVALID_ARGUMENT = -2;
+	static constexpr int ERROR_DEVICE = -3;
+	static constexpr int ERROR_NOT_READY = -5; // init() not called or failed
+
+	static constexpr uint8_t RECORD_MARKER = 0x7E;
+
+	// marker, length, sequence number and CRC
+	static constexpr size_t RECORD_OVERHEAD = 8;
+	static constexpr size_t MAX_PAYLOAD_SIZE = 128;
+	static constexpr size_t MAX_RECORD_SIZE = RECORD_OVERHEAD + MAX_PAYLOAD_SIZE;
+
+	// Largest batch, which is also the RAM buffer size
+	static constexpr size_t MAX_BATCH_SIZE = 1024;
+
+	struct Config
+	{
+		// Part of the device to use, in whole erase units.  A size of 0 means up to the end of the device.
+		bd_addr_t start = 0;
+		bd_size_t size = 0;
+
+		size_t batchSize = 512;
+	};
+
+	explicit TelemetryLog(BlockDevice & device);
+	TelemetryLog(BlockDevice & device, Config const & config);
+
+	/**
+	 * Initialize the device and find the end of the log, so that appending carries on after the newest record.
+	 */
+	int init();
+
+	/**
+	 * Add a record.  It is programmed once its batch fills up, or by flush().
+	 */
+	int append(uint8_t const * payload, size_t size);
+
+	// ByteSink: every write is one record.  Errors are counted, see getWriteErrorCount().
+	void write(uint8_t const * data, size_t length) override;
+
+	/**
+	 * Program the records still in RAM, even though their batch isn't full, and sync the device.
+	 */
+	int flush();
+
+	/**
+	 * Send every record from firstSequence on (or from the oldest one, if that is gone), oldest first and without
+	 * padding.  The records still in RAM are programmed first, as by flush(), so that nothing sent can be lost
+	 * to a reset.  The device is read a batch at a time and each batch's records go to the sink in one write.
+	 * @param recordCount if not null, set to the number of records sent
+	 */
+	int dump(uint32_t firstSequence, ByteSink & sink, uint32_t * recordCount = nullptr);
+
+	// Remove every record.  Sequence numbers start over from 1.
+	int reset();
+
+	bool isReady() const { return ready; }
+
+	// Oldest record still in the log, and the one the next append() gets.  Equal if the log is empty.
+	uint32_t getFirstSequence() const { return firstSequence; }
+	uint32_t getNextSequence() const { return nextSequence; }
+	uint32_t getRecordCount() const { return nextSequence - firstSequence; }
+
+	// Size of the ring, and the size it was divided into
+	bd_size_t getCapacity() const { return static_cast<bd_size_t>(sectorCount) * sectorSize; }
+	bd_size_t getSectorSize() const { return sectorSize; }
+	size_t getBatchSize() const { return batchSize; }
+
+	// Device operations since init(), for checking wear and batching
+	uint32_t getEraseCount() const { return eraseCount; }
+	uint32_t getProgramCount() const { return programCount; }
+
+	// Records that couldn't be stored: write() while not ready, oversized, or lost to a device error
+	uint32_t getWriteErrorCount() const { return writeErrorCount; }
+
+	/**
+	 * Check for a record at the start of data.
+	 * @param recordSize set to the size of the record if one is found
+	 * @return true if a complete record with a good CRC is there
+	 */
+	static bool parseRecord(uint8_t const * data, size_t length, uint32_t & sequence, size_t & recordSize);
+
+	// Receives the records found by a Parser
+	class Listener
+	{
+	public:
+		virtual void onRecord(uint32_t sequence, uint8_t const * payload, size_t size) = 0;
+
+		// Called for every byte skipped while looking for a record, e.g. console text around a dump
+		virtual void onSkippedByte() {}
+
+	protected:
+		~Listener() = default;
+	};
+
+	/**
+	 * Finds the records in a dump, fed in pieces of any size.
+	 */
+	class Parser
+	{
+	public:
+		explicit Parser(Listener & listener);
+
+		void feed(uint8_t const * data, size_t length);
+
+	private:
+		Listener & listener;
+		uint8_t buffer[MAX_RECORD_SIZE];
+		size_t bufferLength = 0;
+	};
+
+private:
+	BlockDevice & device;
+	Config config;
+	bool ready = false;
+
+	bd_addr_t regionStart = 0;
+	bd_size_t sectorSize = 0;
+	uint32_t sectorCount = 0;
+	size_t batchSize = 0;
+	uint32_t batchesPerSector = 0;
+
+	// Where the next batch is programmed
+	uint32_t headSector = 0;
+	uint32_t headBatch = 0;
+
+	// Records from firstSequence up to storedEnd are on the device, the rest up to nextSequence are in batchBuffer
+	uint32_t firstSector = 0;
+	uint32_t firstSequence = 1;
+	uint32_t storedEnd = 1;
+	uint32_t nextSequence = 1;
+
+	uint8_t batchBuffer[MAX_BATCH_SIZE];
+	size_t batchFill = 0;
+
+	// For reading back, so that dump() leaves the records in RAM alone
+	uint8_t readBuffer[MAX_BATCH_SIZE];
+
+	uint32_t eraseCount = 0;
+	uint32_t programCount = 0;
+	uint32_t writeErrorCount = 0;
+
+	bd_addr_t batchAddress(uint32_t sector, uint32_t batch) const
+	{
+		return regionStart + static_cast<bd_addr_t>(sector) * sectorSize + static_cast<bd_addr_t>(batch) * batchSize;
+	}
+
+	uint32_t nextSector(uint32_t sector) const { return sector + 1 < sectorCount ? sector + 1 : 0; }
+
+	/**
+	 * Go through the records of a batch that continue the log: those with sequence numbers from expectedSequence
+	 * up to limit, in order.  A jump forward is allowed, as records can be lost to a device error.
+	 * @param expectedSequence advanced past the last record found
+	 * @param fromSequence records before this are skipped over
+	 * @param fromOffset set to the offset of the first record that isn't skipped, or the end of the run
+	 * @param count incremented for every record that isn't skipped
+	 * @return Offset of the end of the run
+	 */
+	static size_t scanBatch(uint8_t const * batch, size_t size, uint32_t & expectedSequence, uint32_t limit,
+		uint32_t fromSequence, size_t & fromOffset, uint32_t & count);
+
+	// Sequence number of the first record of a sector, if it has one
+	bool readFirstSequence(uint32_t sector, uint32_t & sequence);
+
+	// Program batchBuffer at the head, erasing the sector first if the batch is its first
+	int programBatch();
+
+	// Erase a sector so that none of its old records can be read back, whatever the device's erase does
+	int clearSector(uint32_t sector);
+};
+
+#endif //BQ34Z100G1_UTILS_TELEMETRYLOG_H
@@ -0,0 +1,145 @@
+//
+// The telemetry log, on the storage picked in mbed_app.json5, for soc-test and chem-id-measurer.
+//
+
+#include "TelemetryRecorder.h"
+#include "ConsoleIO.h"
+
+#include <cinttypes>
+
+#if !MBED_CONF_APP_TELEMETRY_LOG_IN_RAM && !defined(MBED_CONF_APP_TELEMETRY_LOG_ADDRESS)
+#error "Set telemetry-log-address in mbed_app.json5 to keep the telemetry log in on-chip flash"
+#endif
+
+namespace
+{
+#if MBED_CONF_APP_TELEMETRY_LOG_IN_RAM
+	// Same geometry as STM32L4 flash pages, so that the batching and wear leveling behave as they would there
+	constexpr bd_size_t RAM_ERASE_SIZE = 2048;
+#else
+	// The first sector boundary at or after address (or the end of the flash).  Sectors differ in size on some
+	// parts, e.g. 16, 64 and 128 kiB on the STM32F4, so they are walked from the start of the flash.
+	uint32_t sectorBoundaryAtOrAfter(FlashIAP & flash, uint32_t address)
+	{
+		uint32_t const flashEnd = flash.get_flash_start() + flash.get_flash_size();
+		uint32_t boundary = flash.get_flash_start();
+		while(boundary < address && boundary < flashEnd)
+		{
+			boundary += flash.get_sector_size(boundary);
+		}
+		return boundary;
+	}
+
+	/**
+	 * Check that the log's flash can be erased without touching anything else: it has to lie within the flash,
+	 * start and end on sector boundaries, and be clear of the program and of the default FlashIAPBlockDevice's
+	 * region, which holds chem-id-measurer's checkpoints.  Like FlashIAPBlockDevice, that region is
+	 * flashiap-block-device.base-address and size, or the sectors from the end of the program to the end of the
+	 * flash if they are left at their defaults.
+	 * @return nullptr if the region can be used, otherwise what is wrong with it
+	 */
+	char const * checkFlashRegion(uint32_t start, uint32_t size)
+	{
+		FlashIAP flash;
+		if(flash.init() != 0)
+		{
+			return "the flash can't be accessed";
+		}
+
+		uint32_t const end = start + size;
+		uint32_t const flashEnd = flash.get_flash_start() + flash.get_flash_size();
+		uint32_t const programEnd = sectorBoundaryAtOrAfter(flash, FLASHIAP_APP_ROM_END_ADDR);
+
+		uint32_t checkpointStart = MBED_CONF_FLASHIAP_BLOCK_DEVICE_BASE_ADDRESS;
+		if(checkpointStart == 0xFFFFFFFF)
+		{
+			checkpointStart = programEnd;
+		}
+		uint32_t const checkpointEnd = MBED_CONF_FLASHIAP_BLOCK_DEVICE_SIZE == 0 ? flashEnd
+			: checkpointStart + MBED_CONF_FLASHIAP_BLOCK_DEVICE_SIZE;
+
+		char const * problem = nullptr;
+		if(start < flash.get_flash_start() || end > flashEnd || end < start)
+		{
+			problem = "it is not within the flash";
+		}
+		else if(sectorBoundaryAtOrAfter(flash, start) != start || sectorBoundaryAtOrAfter(flash, end) != end)
+		{
+			problem = "it does not start and end on flash sector boundaries";
+		}
+		else if(start < programEnd)
+		{
+			problem = "it overlaps the program";
+		}
+		else if(start < checkpointEnd && checkpointStart < end)
+		{
+			problem = "it overlaps the checkpoint flash (flashiap-block-device.base-address and size)";
+		}
+
+		flash.deinit();
+		return problem;
+	}
+#endif
+}
+
+TelemetryRecorder::TelemetryRecorder():
+#if MBED_CONF_APP_TELEMETRY_LOG_IN_RAM
+device(MBED_CONF_APP_TELEMETRY_LOG_SIZE, 1, 1, RAM_ERASE_SIZE),
+#else
+device(MBED_CONF_APP_TELEMETRY_LOG_ADDRESS, MBED_CONF_APP_TELEMETRY_LOG_SIZE),
+#endif
+log(device)
+{
+}
+
+bool TelemetryRecorder::start()
+{
+	if(MBED_CONF_APP_TELEMETRY_LOG_SIZE == 0)
+	{
+		return false;
+	}
+
+#if !MBED_CONF_APP_TELEMETRY_LOG_IN_RAM
+	char const * const problem = checkFlashRegion(MBED_CONF_APP_TELEMETRY_LOG_ADDRESS, MBED_CONF_APP_TELEMETRY_LOG_SIZE);
+	if(problem != nullptr)
+	{
+		printf("Warning: telemetry-log-address 0x%08" PRIx32 " and telemetry-log-size can't be used, as %s.  Samples will not be kept on the board\r\n",
+			static_cast<uint32_t>(MBED_CONF_APP_TELEMETRY_LOG_ADDRESS), problem);
+		return false;
+	}
+#endif
+
+	int const result = log.init();
+	if(result != TelemetryLog::OK)
+	{
+		printf("Warning: telemetry log storage not available (error %d), samples will not be kept on the board\r\n", result);
+		return false;
+	}
+	return true;
+}
+
+void TelemetryRecorder::printStatus()
+{
+	if(!log.isReady())
+	{
+		printf("Telemetry log is off\r\n");
+		return;
+	}
+	printf("Telemetry log: records %" PRIu32 " to %" PRIu32 " (%" PRIu32 " records) in %" PRIu32 " bytes of %s, %" PRIu32
+		" byte batches.  Since start: %" PRIu32 " erases, %" PRIu32 " programs, %" PRIu32 " records lost\r\n",
+		log.getFirstSequence(), log.getNextSequence() - 1, log.getRecordCount(), static_cast<uint32_t>(log.getCapacity()),
+		device.get_type(), static_cast<uint32_t>(log.getBatchSize()), log.getEraseCount(), log.getProgramCount(),
+		log.getWriteErrorCount());
+}
+
+uint32_t TelemetryRecorder::dumpToConsole(uint32_t firstSequence)
+{
+	ConsoleSink sink;
+	uint32_t recordCount = 0;
+	int const result = log.dump(firstSequence, sink, &recordCount);
+	if(result != TelemetryLog::OK)
+	{
+		printf("\r\nWarning: reading the telemetry log failed (error %d), the dump is incomplete\r\n", result);
+	}
+	return recordCount;
+}
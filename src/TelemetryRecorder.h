@@ -0,0 +1,60 @@
+//
+// The telemetry log, on the storage picked in mbed_app.json5, for soc-test and chem-id-measurer.
+//
+
+#ifndef BQ34Z100G1_UTILS_TELEMETRYRECORDER_H
+#define BQ34Z100G1_UTILS_TELEMETRYRECORDER_H
+
+#include "TelemetryLog.h"
+
+#include <mbed.h>
+
+#if MBED_CONF_APP_TELEMETRY_LOG_IN_RAM
+#include "blockdevice/HeapBlockDevice.h"
+#else
+#include "FlashIAPBlockDevice.h"
+#endif
+
+/**
+ * Owns the block device behind the log.  By default (telemetry-log-in-ram) that is a HeapBlockDevice, which is lost
+ * at every reset but needs no free flash.  Otherwise it is telemetry-log-size bytes of on-chip flash at
+ * telemetry-log-address, which start() checks for sector alignment and overlap with the program and the
+ * checkpoint flash.
+ */
+class TelemetryRecorder
+{
+public:
+	TelemetryRecorder();
+
+	/**
+	 * Open the log.  If telemetry-log-size is 0 or the storage can't be used (including flash that fails the
+	 * checks above), the log stays off (with a warning for the latter), and appending to it only counts write
+	 * errors.
+	 * @return true if the log is ready
+	 */
+	bool start();
+
+	bool isReady() const { return log.isReady(); }
+
+	TelemetryLog & getLog() { return log; }
+
+	// Print the range of sequence numbers held, and the capacity and wear counters
+	void printStatus();
+
+	/**
+	 * Send the records from firstSequence on to the console as raw binary, at the full console speed.
+	 * Use the host telemetry-log-extract tool to take them apart again.
+	 * @return Number of records sent
+	 */
+	uint32_t dumpToConsole(uint32_t firstSequence);
+
+private:
+#if MBED_CONF_APP_TELEMETRY_LOG_IN_RAM
+	HeapBlockDevice device;
+#else
+	FlashIAPBlockDevice device;
+#endif
+	TelemetryLog log;
+};
+
+#endif //BQ34Z100G1_UTILS_TELEMETRYRECORDER_H
@@ -0,0 +1,333 @@
+//
+// Periodic gauge sampling on a dedicated high priority thread.
+//
+
+#include "TelemetrySampler.h"
+
+#include <algorithm>
+
+namespace
+{
+	constexpr std::chrono::milliseconds GAUGE_UPDATE_PERIOD = GaugeUpdateTracker::NOMINAL_UPDATE_PERIOD;
+
+	// In update pin mode, a sample is read anyway if the pin has been quiet for this many update periods
+	// past when the sample was due, e.g. because it isn't wired up
+	constexpr int MISSING_SIGNAL_UPDATES = 2;
+}
+
+TelemetrySampler::TelemetrySampler(GaugeTelemetry & telemetry, PinName updatePinName):
+sourceCount(1),
+thread(osPriorityHigh, OS_STACK_SIZE, nullptr, "TelemetrySampler"),
+queue(4 * EVENTS_EVENT_SIZE)
+{
+	sources[0].telemetry = &telemetry;
+	if(updatePinName != NC)
+	{
+		updatePin = std::make_unique<InterruptIn>(updatePinName);
+	}
+}
+
+TelemetrySampler::TelemetrySampler(GaugeTelemetry * const * newSources, size_t newSourceCount):
+sourceCount(std::min(newSourceCount, MAX_SOURCES)),
+thread(osPriorityHigh, OS_STACK_SIZE, nullptr, "TelemetrySampler"),
+queue((4 + sourceCount) * EVENTS_EVENT_SIZE)
+{
+	for(size_t sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+	{
+		sources[sourceIndex].telemetry = newSources[sourceIndex];
+	}
+}
+
+void TelemetrySampler::start(std::chrono::milliseconds newPeriod, Timing newTiming)
+{
+	if(!threadStarted)
+	{
+		thread.start(callback(&queue, &EventQueue::dispatch_forever));
+		threadStarted = true;
+	}
+
+	stop();
+
+	// stop() has waited out any read under way, so nothing is producing now and the buffer can be emptied
+	// from this thread
+	Sample staleSample;
+	while(buffer.pop(staleSample))
+	{
+	}
+
+	sampleCount = 0;
+	droppedCount = 0;
+	overflowCount = 0;
+	readErrorCount = 0;
+	readCount = 0;
+	overflowing = false;
+
+	period = newPeriod;
+	timing = newTiming;
+	startTime = Kernel::Clock::now();
+	nextRead_ms = 0;
+
+	// Set up everything the events use before the first one can run, as the sampler thread has higher priority
+	uint32_t const run = currentRun;
+	running = true;
+	if(timing != Timing::FIXED && updatePin)
+	{
+		updatesPerSample = std::max<uint32_t>(1, (period + GAUGE_UPDATE_PERIOD / 2) / GAUGE_UPDATE_PERIOD);
+		updatesSinceSample = 0;
+		updatePin->rise(callback(this, &TelemetrySampler::onUpdateEdge));
+		updatePin->fall(callback(this, &TelemetrySampler::onUpdateEdge));
+	}
+	post([this, run] { beginRun(run); });
+}
+
+void TelemetrySampler::beginRun(uint32_t run)
+{
+	if(run != currentRun)
+	{
+		return;
+	}
+
+	if(timing == Timing::FIXED)
+	{
+		// Periodic events are scheduled from their previous deadline, so the period doesn't drift.
+		// call_every() waits one period before the first call, so the first sample is taken now.
+		periodicEventID = queue.call_every(period, [this, run] { takeSample(run); });
+		takeSample(run);
+	}
+	else if(updatePin)
+	{
+		takeSignalledSample(run);
+	}
+	else
+	{
+		for(size_t sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+		{
+			Source & source = sources[sourceIndex];
+			source.tracker.start(period);
+			source.haveReading = false;
+		}
+		for(size_t sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+		{
+			pollSource(sourceIndex, run);
+		}
+	}
+}
+
+void TelemetrySampler::stop()
+{
+	// From here on, every event of the run that is ending returns without reading or rescheduling
+	++currentRun;
+	if(!running)
+	{
+		return;
+	}
+	running = false;
+
+	if(updatePin)
+	{
+		updatePin->rise(nullptr);
+		updatePin->fall(nullptr);
+	}
+
+	// The event IDs are only touched on the sampler thread, which reschedules as it goes, so the run's events are
+	// cancelled from there.  Events run one at a time, so once this one has run, a read that was under way has
+	// been queued too.
+	stopped = false;
+	post([this] { cancelEvents(); stopped = true; });
+	while(!stopped)
+	{
+		ThisThread::sleep_for(1ms);
+	}
+}
+
+void TelemetrySampler::post(Callback<void()> event)
+{
+	while(queue.call(event) == 0)
+	{
+		// Out of event memory.  The events of a run that has ended free theirs as they run and return without
+		// rescheduling, so there will be room shortly.
+		ThisThread::sleep_for(1ms);
+	}
+}
+
+void TelemetrySampler::cancelEvents()
+{
+	cancel(periodicEventID);
+	cancel(fallbackEventID);
+	for(size_t sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+	{
+		cancel(sources[sourceIndex].eventID);
+	}
+}
+
+void TelemetrySampler::cancel(int & eventID)
+{
+	if(eventID != 0)
+	{
+		queue.cancel(eventID);
+		eventID = 0;
+	}
+}
+
+bool TelemetrySampler::pop(Sample & sample)
+{
+	return buffer.pop(sample);
+}
+
+void TelemetrySampler::waitForSample(Sample & sample)
+{
+	// If a read is already overdue, e.g. a sample in update pin mode waiting for its edge, check back
+	// after a fraction of the period
+	std::chrono::milliseconds const recheck = std::max<std::chrono::milliseconds>(period / 16, 1ms);
+
+	while(!buffer.pop(sample))
+	{
+		Kernel::Clock::time_point const nextRead = startTime + std::chrono::milliseconds(nextRead_ms.load());
+		ThisThread::sleep_until(std::max(nextRead, Kernel::Clock::now() + recheck));
+	}
+}
+
+bool TelemetrySampler::readSource(size_t sourceIndex, Sample & sample)
+{
+	Source & source = sources[sourceIndex];
+	sample.source = static_cast<uint8_t>(sourceIndex);
+	sample.timestamp = Kernel::Clock::now() - startTime;
+	++readCount;
+	sample.valid = source.telemetry->read(sample.telemetry);
+	if(!sample.valid)
+	{
+		++readErrorCount;
+		sample.telemetry = source.haveReading ? source.lastReading : TelemetrySnapshot();
+		return false;
+	}
+	return true;
+}
+
+void TelemetrySampler::pushSample(Sample const & sample)
+{
+	if(buffer.push(sample))
+	{
+		++sampleCount;
+		overflowing = false;
+	}
+	else
+	{
+		++droppedCount;
+		if(!overflowing)
+		{
+			++overflowCount;
+			overflowing = true;
+		}
+	}
+}
+
+void TelemetrySampler::takeSample(uint32_t run)
+{
+	if(run != currentRun)
+	{
+		return;
+	}
+
+	nextRead_ms = (Kernel::Clock::now() - startTime + period).count();
+	for(size_t sourceIndex = 0; sourceIndex < sourceCount; sourceIndex++)
+	{
+		Sample sample;
+		if(readSource(sourceIndex, sample))
+		{
+			sources[sourceIndex].lastReading = sample.telemetry;
+			sources[sourceIndex].haveReading = true;
+		}
+		pushSample(sample);
+	}
+}
+
+void TelemetrySampler::pollSource(size_t sourceIndex, uint32_t run)
+{
+	if(run != currentRun)
+	{
+		return;
+	}
+
+	Source & source = sources[sourceIndex];
+	source.eventID = 0;
+
+	Sample sample;
+	bool const readOK = readSource(sourceIndex, sample);
+	bool const changed = readOK && source.haveReading && !sample.telemetry.sameReadings(source.lastReading);
+	if(readOK)
+	{
+		source.lastReading = sample.telemetry;
+		source.haveReading = true;
+	}
+
+	// A failed read is passed on straight away, rather than held up until the gauge is seen to update
+	GaugeUpdateTracker::Step const step = source.tracker.observe(sample.timestamp, changed);
+	if(step.sample || !readOK)
+	{
+		pushSample(sample);
+	}
+	scheduleRead(step.nextRead, source.eventID, [this, sourceIndex, run] { pollSource(sourceIndex, run); });
+}
+
+void TelemetrySampler::scheduleRead(std::chrono::milliseconds time, int & eventID, Callback<void()> read)
+{
+	std::chrono::milliseconds const now = Kernel::Clock::now() - startTime;
+
+	// with several sources, wake up for whichever reads next
+	uint32_t const time_ms = std::max(time, now).count();
+	uint32_t const otherRead_ms = nextRead_ms.load();
+	nextRead_ms = otherRead_ms > now.count() ? std::min(otherRead_ms, time_ms) : time_ms;
+
+	eventID = queue.call_in(std::max(time - now, 0ms), read);
+}
+
+void TelemetrySampler::onUpdateEdge()
+{
+	// an edge queued just before stop() must not restart sampling
+	uint32_t const run = currentRun;
+	queue.call([this, run] { updateSignalled(run); });
+}
+
+void TelemetrySampler::updateSignalled(uint32_t run)
+{
+	if(run == currentRun && ++updatesSinceSample >= updatesPerSample)
+	{
+		takeSignalledSample(run);
+	}
+}
+
+void TelemetrySampler::takeSignalledSample(uint32_t run)
+{
+	if(run != currentRun)
+	{
+		return;
+	}
+
+	updatesSinceSample = 0;
+
+	Sample sample;
+	if(readSource(0, sample))
+	{
+		sources[0].lastReading = sample.telemetry;
+		sources[0].haveReading = true;
+	}
+	pushSample(sample);
+
+	// Expect the next edge around a period from now
+	cancel(fallbackEventID);
+	std::chrono::milliseconds const due = sample.timestamp + updatesPerSample * GAUGE_UPDATE_PERIOD;
+	scheduleRead(due + MISSING_SIGNAL_UPDATES * GAUGE_UPDATE_PERIOD, fallbackEventID,
+		[this, run] { sampleWithoutSignal(run); });
+	nextRead_ms = due.count();
+}
+
+void TelemetrySampler::sampleWithoutSignal(uint32_t run)
+{
+	if(run != currentRun)
+	{
+		return;
+	}
+
+	fallbackEventID = 0;
+	takeSignalledSample(run);
+}
@@ -0,0 +1,214 @@
+//
+// Periodic gauge sampling on a dedicated high priority thread.
+//
+
+#ifndef BQ34Z100G1_UTILS_TELEMETRYSAMPLER_H
+#define BQ34Z100G1_UTILS_TELEMETRYSAMPLER_H
+
+#include <mbed.h>
+
+#include <atomic>
+#include <chrono>
+#include <memory>
+
+#include "GaugeTelemetry.h"
+#include "GaugeUpdateTracker.h"
+#include "SpscRingBuffer.h"
+
+/**
+ * Reads a TelemetrySnapshot at a fixed period from its own thread and queues it, with its timestamp,
+ * in a lock-free ring buffer.  The application thread drains the buffer at its own pace, so a slow
+ * console can delay output but never the samples themselves.  If the buffer fills up, new samples
+ * are dropped and counted rather than blocking the sampler.
+ *
+ * A sampler can also read several gauges.  Every period it reads them back to back, in source order,
+ * and queues one sample per gauge tagged with its source index.  Since the sampler thread is the only
+ * one talking to the gauges while it runs, it also serves as the arbiter for buses and muxes shared
+ * between them.
+ *
+ * With Timing::GAUGE_UPDATES, samples are locked onto the gauge's own measurement updates instead of the MCU's
+ * clock, so that every sample is a fresh measurement and none are repeated or skipped.  Each gauge gets a
+ * GaugeUpdateTracker that finds its updates from changing readings.  For a single gauge, a pin that toggles on
+ * every update can be given instead, and then each sample is read when the pin's edge arrives.  Either way
+ * nothing runs between reads, so the MCU can go to deep sleep (if nothing else holds a deep sleep lock).
+ *
+ * A read that fails, after the retries and bus recovery of the gauge's FaultTolerantI2C, still gives a sample,
+ * marked as not valid.  So the consumer keeps getting a sample per source every period through bus faults,
+ * rather than waiting on one that never comes, and nothing takes longer than the period plus the sources'
+ * worst case read latency.
+ */
+class TelemetrySampler
+{
+public:
+	// Samples that can be queued before the consumer has to catch up
+	static constexpr size_t BUFFER_SIZE = 32;
+
+	// Most gauges that one sampler can read
+	static constexpr size_t MAX_SOURCES = 8;
+
+	enum class Timing : uint8_t
+	{
+		FIXED, // every period on the MCU's clock
+		GAUGE_UPDATES // just after a gauge update, one per period
+	};
+
+	struct Sample
+	{
+		// Time since start() when the gauge was read
+		std::chrono::milliseconds timestamp;
+
+		// If the read failed, the source's last good reading (zeros if there is none yet)
+		TelemetrySnapshot telemetry;
+
+		// Index of the gauge this sample came from
+		uint8_t source;
+
+		// false if the gauge couldn't be read.  Such a sample only marks the time.
+		bool valid;
+	};
+
+	/**
+	 * @param updatePin Input that toggles on every gauge measurement update, or NC to find the updates
+	 *     from the readings.  Only used with Timing::GAUGE_UPDATES.
+	 */
+	explicit TelemetrySampler(GaugeTelemetry & telemetry, PinName updatePin = NC);
+
+	/**
+	 * Sampler for several gauges.  The array is copied, but the readers it points to must outlive the sampler.
+	 */
+	TelemetrySampler(GaugeTelemetry * const * sources, size_t sourceCount);
+
+	/**
+	 * Start sampling at the given period, restarting the timestamps at 0.
+	 * The first sample is taken immediately.  Anything left in the buffer from an earlier run is discarded.
+	 * With Timing::GAUGE_UPDATES, the period is rounded to a whole number of gauge updates.
+	 */
+	void start(std::chrono::milliseconds period, Timing timing = Timing::FIXED);
+
+	/**
+	 * Stop sampling.  Samples still in the buffer can be read afterwards.
+	 * Once this returns, nothing more is queued: a read that was under way has finished, and events of this run
+	 * that were already due, or were being rescheduled as stop() ran, do nothing when they fire.
+	 */
+	void stop();
+
+	/**
+	 * Get the oldest queued sample.  Never blocks.
+	 * May only be called from one thread at a time.
+	 * @return false if no sample is waiting
+	 */
+	bool pop(Sample & sample);
+
+	/**
+	 * Wait until a sample is available and get it.
+	 * Sleeps until the sampler's next read, so the calling thread doesn't wake up in between.
+	 */
+	void waitForSample(Sample & sample);
+
+	// Samples taken and queued since start()
+	uint32_t getSampleCount() const { return sampleCount; }
+
+	// Samples discarded because the buffer was full
+	uint32_t getDroppedCount() const { return droppedCount; }
+
+	// Number of times the buffer became full, i.e. distinct bursts of dropped samples
+	uint32_t getOverflowCount() const { return overflowCount; }
+
+	// Gauge reads that failed, summed over all sources
+	uint32_t getReadErrorCount() const { return readErrorCount; }
+
+	// Gauge reads since start(), summed over all sources.  With Timing::GAUGE_UPDATES this includes
+	// the reads that only looked for an update.
+	uint32_t getReadCount() const { return readCount; }
+
+	// With Timing::GAUGE_UPDATES, how the first source's tracker is doing
+	GaugeUpdateTracker const & getTracker() const { return sources[0].tracker; }
+
+private:
+	struct Source
+	{
+		GaugeTelemetry * telemetry = nullptr;
+
+		// Last good reading, which failed reads are filled in with
+		TelemetrySnapshot lastReading;
+		bool haveReading = false;
+
+		// Timing::GAUGE_UPDATES only
+		GaugeUpdateTracker tracker;
+		int eventID = 0;
+	};
+
+	Source sources[MAX_SOURCES];
+	size_t sourceCount;
+
+	// Runs the event queue.  Higher priority than the application so that sample timing
+	// doesn't depend on what the application is doing.
+	Thread thread;
+	EventQueue queue;
+	bool threadStarted = false;
+
+	// The IDs of scheduled events are only used on the sampler thread, which reschedules as it goes
+	int periodicEventID = 0;
+
+	// Every event is tagged with the run that scheduled it and does nothing once stop() has moved on to the
+	// next run.
+	std::atomic<uint32_t> currentRun{0};
+	bool running = false; // application thread only
+
+	// Set by the event that stop() queues behind any read under way
+	std::atomic<bool> stopped{false};
+
+	std::chrono::milliseconds period{0};
+	Timing timing = Timing::FIXED;
+	Kernel::Clock::time_point startTime;
+
+	// Time of the next scheduled read, in ms since startTime.  Tells waitForSample() how long to sleep.
+	std::atomic<uint32_t> nextRead_ms{0};
+
+	// Update pin mode
+	std::unique_ptr<InterruptIn> updatePin;
+	uint32_t updatesPerSample = 1;
+	uint32_t updatesSinceSample = 0;
+	int fallbackEventID = 0;
+
+	SpscRingBuffer<Sample, BUFFER_SIZE> buffer;
+
+	std::atomic<uint32_t> sampleCount{0};
+	std::atomic<uint32_t> droppedCount{0};
+	std::atomic<uint32_t> overflowCount{0};
+	std::atomic<uint32_t> readErrorCount{0};
+	std::atomic<uint32_t> readCount{0};
+
+	// true while samples are being dropped, so each overflow is counted once
+	bool overflowing = false;
+
+	// Queue an event from the application thread, waiting for room if the queue is full
+	void post(Callback<void()> event);
+
+	// Runs on the sampler thread: schedule the first reads of a run
+	void beginRun(uint32_t run);
+
+	// Runs on the sampler thread
+	void takeSample(uint32_t run);
+
+	// Read one source, stamping the sample with the time and marking it valid or not.  Counts failures.
+	bool readSource(size_t sourceIndex, Sample & sample);
+
+	void pushSample(Sample const & sample);
+
+	// Timing::GAUGE_UPDATES: read a source and let its tracker decide whether that is a sample, and when to read next
+	void pollSource(size_t sourceIndex, uint32_t run);
+	void scheduleRead(std::chrono::milliseconds time, int & eventID, Callback<void()> read);
+
+	// Update pin mode
+	void onUpdateEdge(); // interrupt context
+	void updateSignalled(uint32_t run);
+	void sampleWithoutSignal(uint32_t run);
+	void takeSignalledSample(uint32_t run);
+
+	// Runs on the sampler thread
+	void cancelEvents();
+	void cancel(int & eventID);
+};
+
+#endif //BQ34Z100G1_UTILS_TELEMETRYSAMPLER_H
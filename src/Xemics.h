@@ -0,0 +1,208 @@
+//
+// Conversions between float and the Xemics floating point format that the BQ34Z100 uses for
+// calibration constants such as CC Gain and CC Delta.
+// Everything here is constexpr, so constants fold at compile time.  This file has no Mbed dependencies.
+//
+// Xemics format, as a big endian uint32_t:
+//   bits 31-24: exponent + 128
+//   bit 23:     sign
+//   bits 22-0:  mantissa without its leading 1 (value = 0.1mmm... binary * 2^exponent)
+// That is an IEEE single precision float with the exponent moved and biased by 2 more, so for all
+// normal floats the conversion is a pure rearrangement of bits.  Edge cases, handled the same way
+// by both implementations below:
+//   - 0 is encoded as 0x00000000, and 0x00000000 decodes to 0
+//   - magnitudes below 2^-129 encode as 0, NaN encodes as 0
+//   - magnitudes of 2^127 or more, including infinity, saturate to the largest encoding
+//   - encodings below 2^-126 decode to the nearest (denormal) float
+//
+
+#ifndef BQ34Z100G1_UTILS_XEMICS_H
+#define BQ34Z100G1_UTILS_XEMICS_H
+
+#include <cstdint>
+
+#if defined(__has_builtin)
+#if __has_builtin(__builtin_bit_cast)
+#define XEMICS_HAS_BIT_CAST 1
+#endif
+#endif
+
+namespace Xemics
+{
+	constexpr uint32_t SIGN_BIT = 0x800000;
+	constexpr uint32_t MANTISSA_MASK = 0x7FFFFF;
+
+	// Largest magnitude that can be encoded, without the sign
+	constexpr uint32_t MAX_MAGNITUDE = 0xFF7FFFFF;
+
+	namespace detail
+	{
+		// 2^exponent, exact for |exponent| < 1023
+		constexpr double pow2(int exponent)
+		{
+			double result = 1;
+			double base = exponent < 0 ? 0.5 : 2;
+			for(unsigned int remaining = exponent < 0 ? -exponent : exponent; remaining > 0; remaining >>= 1)
+			{
+				if(remaining & 1)
+				{
+					result *= base;
+				}
+				base *= base;
+			}
+			return result;
+		}
+
+		// Portable versions using only arithmetic, for compilers without a constexpr bit cast
+		constexpr uint32_t fromFloatArithmetic(float value)
+		{
+			if(value != value)
+			{
+				return 0;
+			}
+
+			uint32_t const sign = value < 0 ? SIGN_BIT : 0;
+			double magnitude = value < 0 ? -static_cast<double>(value) : static_cast<double>(value);
+			if(magnitude < pow2(-129))
+			{
+				return 0;
+			}
+			if(magnitude >= pow2(127))
+			{
+				return MAX_MAGNITUDE | sign;
+			}
+
+			// Normalize to [1, 2) with a fixed sequence of power of two steps
+			int exponent = 0;
+			for(int step = 64; step > 0; step >>= 1)
+			{
+				if(magnitude >= pow2(step))
+				{
+					magnitude *= pow2(-step);
+					exponent += step;
+				}
+			}
+			for(int step = 128; step > 0; step >>= 1)
+			{
+				if(magnitude < pow2(1 - step))
+				{
+					magnitude *= pow2(step);
+					exponent -= step;
+				}
+			}
+
+			// A float has 24 significant bits, so this is exact
+			uint32_t const mantissa = static_cast<uint32_t>(magnitude * pow2(23));
+			return (static_cast<uint32_t>(exponent + 129) << 24) | sign | (mantissa & MANTISSA_MASK);
+		}
+
+		constexpr float toFloatArithmetic(uint32_t xemics)
+		{
+			if(xemics == 0)
+			{
+				return 0;
+			}
+
+			int const exponent = static_cast<int>(xemics >> 24) - 128;
+			uint32_t const mantissa = (xemics & MANTISSA_MASK) | SIGN_BIT;
+
+			// exact in double, and converting to float rounds the denormal cases to nearest
+			double const magnitude = static_cast<double>(mantissa) * pow2(exponent - 24);
+			return static_cast<float>((xemics & SIGN_BIT) ? -magnitude : magnitude);
+		}
+
+#if XEMICS_HAS_BIT_CAST
+		// Bit manipulation versions.  The common case is a single well predicted branch.
+		constexpr uint32_t fromFloatBits(float value)
+		{
+			uint32_t const bits = __builtin_bit_cast(uint32_t, value);
+			uint32_t const sign = (bits >> 8) & SIGN_BIT;
+			uint32_t const biasedExponent = (bits >> 23) & 0xFF;
+			uint32_t const fraction = bits & MANTISSA_MASK;
+
+			// normal floats below 2^127
+			if(biasedExponent - 1 < 253)
+			{
+				return ((biasedExponent + 2) << 24) | sign | fraction;
+			}
+
+			if(biasedExponent != 0)
+			{
+				// too large, infinity or NaN
+				return fraction != 0 && biasedExponent == 0xFF ? 0 : MAX_MAGNITUDE | sign;
+			}
+
+			// Denormal floats: representable if their leading 1 is one of the top 3 fraction bits
+			if(fraction < (1u << 20))
+			{
+				return 0;
+			}
+			uint32_t const shift = fraction >= (1u << 22) ? 1 : fraction >= (1u << 21) ? 2 : 3;
+			return ((3 - shift) << 24) | sign | ((fraction << shift) & MANTISSA_MASK);
+		}
+
+		constexpr float toFloatBits(uint32_t xemics)
+		{
+			uint32_t const exponentByte = xemics >> 24;
+			uint32_t const sign = (xemics & SIGN_BIT) << 8;
+			uint32_t const fraction = xemics & MANTISSA_MASK;
+
+			if(exponentByte >= 3)
+			{
+				return __builtin_bit_cast(float, sign | ((exponentByte - 2) << 23) | fraction);
+			}
+			if(xemics == 0)
+			{
+				return 0;
+			}
+
+			// Below the normal float range: shift into a denormal, rounding to nearest even.
+			// Rounding up out of the top denormal gives the smallest normal float, which is also right.
+			uint32_t const shift = 3 - exponentByte;
+			uint32_t const mantissa = fraction | SIGN_BIT;
+			uint32_t const half = 1u << (shift - 1);
+			uint32_t const remainder = mantissa & ((1u << shift) - 1);
+			uint32_t rounded = mantissa >> shift;
+			if(remainder > half || (remainder == half && (rounded & 1)))
+			{
+				++rounded;
+			}
+			return __builtin_bit_cast(float, sign | rounded);
+		}
+#endif
+	}
+
+	/**
+	 * Convert a float to Xemics format.
+	 */
+	constexpr uint32_t fromFloat(float value)
+	{
+#if XEMICS_HAS_BIT_CAST
+		return detail::fromFloatBits(value);
+#else
+		return detail::fromFloatArithmetic(value);
+#endif
+	}
+
+	/**
+	 * Convert a Xemics value to a float.
+	 */
+	constexpr float toFloat(uint32_t xemics)
+	{
+#if XEMICS_HAS_BIT_CAST
+		return detail::toFloatBits(xemics);
+#else
+		return detail::toFloatArithmetic(xemics);
+#endif
+	}
+
+	// Data flash defaults from the bq34z100-G1 technical reference manual
+	constexpr uint32_t DEFAULT_CC_GAIN = fromFloat(0.4768f);
+	constexpr uint32_t DEFAULT_CC_DELTA = fromFloat(567744.56f);
+
+	static_assert(fromFloat(1.0f) == 0x81000000 && fromFloat(-0.5f) == 0x80800000, "Xemics conversion is broken");
+	static_assert(detail::fromFloatArithmetic(1.0f) == 0x81000000 && detail::fromFloatArithmetic(-0.5f) == 0x80800000,
+		"Xemics conversion is broken");
+}
+
+#endif //BQ34Z100G1_UTILS_XEMICS_H
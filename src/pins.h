@@ -18,4 +18,30 @@
 #define CHARGE_STATUS_CHARGING 0 // Level present on CHARGE_STATUS_PIN when charging
 #define CHARGE_STATUS_NOT_CHARGING 1 // Level present on CHARGE_STATUS_PIN when not charging
 
+// Input that toggles on every gauge measurement update, for sampling in step with the gauge.  The BQ34Z100's own
+// ALERT pin can't signal updates, so this needs extra hardware; leave it NC and the updates are found from the readings.
+#ifndef GAUGE_UPDATE_PIN
+#define GAUGE_UPDATE_PIN NC
+#endif
+
+// UART connected to the reference meter used by the automatic calibration: a bench multimeter that takes SCPI
+// commands (MEAS:VOLT:DC?, MEAS:CURR:DC?) over RS-232, through a level shifter.  It must not be the console UART.
+#define REFERENCE_METER_TX PC_6
+#define REFERENCE_METER_RX PC_7
+#define REFERENCE_METER_BAUD 9600
+
+// Packs that the Chem ID Measurer runs at the same time, up to 8.  Each entry is
+//   {SDA pin, SCL pin, mux channel, charger activate pin, charge status pin}
+// Gauges all have the same I2C address, so packs on the same SDA/SCL pins have to sit behind
+// separate channels of a TCA9548A I2C mux at I2C_MUX_ADDRESS.  Use CHEMID_NO_MUX for a gauge wired
+// straight to its bus.  For example, two packs behind one mux:
+//   #define CHEMID_CHANNELS {PB_9, PB_8, 0, PF_1, PF_2}, {PB_9, PB_8, 1, PF_3, PF_4}
+#define CHEMID_NO_MUX -1
+#ifndef CHEMID_CHANNELS
+#define CHEMID_CHANNELS {BQ34_I2C_SDA, BQ34_I2C_SCL, CHEMID_NO_MUX, ACTIVATE_CHARGER_PIN, CHARGE_STATUS_PIN}
+#endif
+
+// 8-bit I2C address of the mux (A2..A0 tied low)
+#define I2C_MUX_ADDRESS 0xE0
+
 #endif //BQ34Z100G1_UTILS_PINS_H